@@ -29,7 +29,8 @@
 #define S25FL064L_CMD_RDCR1			0x35
 #define S25FL064L_CMD_RDCR3			0x33
 #define S25FL064L_CMD_CLSR			0x30
-#define S25FL064L_CMD_SE			0x21
+#define S25FL064L_CMD_4SE			0x21
+#define S25FL064L_CMD_SE			0x20
 #define S25FL064L_CMD_RDCR2			0x15
 #define S25FL064L_CMD_4READ			0x13
 #define S25FL064L_CMD_4PP			0x12
@@ -44,168 +45,340 @@
 #define S25FL064L_BIT_BUSY			0x00
 #define S25FL064L_BIT_WEL			0x01
 
+/** @brief Address phase of a command.
+ */
+typedef enum
+{
+    S25FL064L_ADDR_NONE		= 0x00,			    /**< No address. */
+    S25FL064L_ADDR_3		= 0x03,			    /**< Always a 3-byte address. */
+    S25FL064L_ADDR_DEVICE	= 0xFF,			    /**< 3- or 4-byte address, depending on the address mode of the
+								 device. */
+} s25fl064_addr_t;
+
+/** @brief Commands of the command table.
+ */
+typedef enum
+{
+    S25FL064L_OP_RSFDP,
+    S25FL064L_OP_DPD,
+    S25FL064L_OP_RES,
+    S25FL064L_OP_RDID,
+    S25FL064L_OP_CE,
+    S25FL064L_OP_RUID,
+    S25FL064L_OP_CLSR,
+    S25FL064L_OP_SE,
+    S25FL064L_OP_RDCR2,
+    S25FL064L_OP_READ,
+    S25FL064L_OP_PP,
+    S25FL064L_OP_WREN,
+    S25FL064L_OP_RDSR2,
+    S25FL064L_OP_RDSR1,
+} s25fl064_op_t;
+
+/** @brief Command table entry.
+ */
+typedef struct
+{
+    uint8_t Code;					    /**< Command code. Used with 3-byte addresses. */
+    uint8_t Code4;					    /**< Command code with 4-byte addresses. */
+    s25fl064_addr_t Address;				    /**< Address phase. */
+    uint8_t Dummy;					    /**< Number of dummy bytes. */
+} s25fl064_command_t;
+
+/** @brief Command table of the driver.
+ */
+static const s25fl064_command_t Commands[] =
+{
+    [S25FL064L_OP_RSFDP]    = {S25FL064L_CMD_RSFDP,	    0,				S25FL064L_ADDR_3,	1},
+    [S25FL064L_OP_DPD]	    = {S25FL064L_CMD_DPD,	    0,				S25FL064L_ADDR_NONE,	0},
+    [S25FL064L_OP_RES]	    = {S25FL064L_CMD_RES,	    0,				S25FL064L_ADDR_NONE,	0},
+    [S25FL064L_OP_RDID]	    = {S25FL064L_CMD_RDID,	    0,				S25FL064L_ADDR_NONE,	0},
+    [S25FL064L_OP_CE]	    = {S25FL064L_CMD_CE,	    0,				S25FL064L_ADDR_NONE,	0},
+    [S25FL064L_OP_RUID]	    = {S25FL064L_CMD_RUID,	    0,				S25FL064L_ADDR_NONE,	4},
+    [S25FL064L_OP_CLSR]	    = {S25FL064L_CMD_CLSR,	    0,				S25FL064L_ADDR_NONE,	0},
+    [S25FL064L_OP_SE]	    = {S25FL064L_CMD_SE,	    S25FL064L_CMD_4SE,		S25FL064L_ADDR_DEVICE,	0},
+    [S25FL064L_OP_RDCR2]    = {S25FL064L_CMD_RDCR2,	    0,				S25FL064L_ADDR_NONE,	0},
+    [S25FL064L_OP_READ]	    = {S25FL064L_CMD_READ,	    S25FL064L_CMD_4READ,	S25FL064L_ADDR_DEVICE,	0},
+    [S25FL064L_OP_PP]	    = {S25FL064L_CMD_PAGE_PROGRAM,  S25FL064L_CMD_4PP,		S25FL064L_ADDR_DEVICE,	0},
+    [S25FL064L_OP_WREN]	    = {S25FL064L_CMD_WREN,	    0,				S25FL064L_ADDR_NONE,	0},
+    [S25FL064L_OP_RDSR2]    = {S25FL064L_CMD_RDSR2,	    0,				S25FL064L_ADDR_NONE,	0},
+    [S25FL064L_OP_RDSR1]    = {S25FL064L_CMD_RDSR1,	    0,				S25FL064L_ADDR_NONE,	0},
+};
+
 /** @brief JEDEC flash parameters.
  */
 static flash_params_t Params;
 
-/** @brief		    Send a command code to the Flash memory.
- *  @param p_Device	    Pointer to S25FL064 device structure
- *  @param p_Command	    Pointer to command data
- *  @param CommandLength    Command length
- *  @param p_Data	    Pointer to return data from command
- *  @param Length	    Length of return data
- *  @return		    Error code
+/** @brief		Build the header of a command.
+ *  @param p_Device	Pointer to S25FL064 device structure
+ *  @param Op		Command
+ *  @param Address	Command address. Ignored for commands without an address
+ *  @param p_Header	Pointer to header buffer with at least \ref S25FL064L_HEADER_SIZE bytes
+ *  @return		Header length
  */
-static s25fl064_error_t S25FL064L_Command(s25fl064_t* p_Device, uint8_t* p_Command, uint8_t CommandLength, uint8_t* p_Data, uint8_t Length)
+static uint8_t S25FL064L_Header(s25fl064_t* p_Device, s25fl064_op_t Op, uint32_t Address, uint8_t* p_Header)
 {
-    s25fl064_error_t Error = S25FL064_NO_ERROR;
+    const s25fl064_command_t* p_Command = &Commands[Op];
+    uint8_t Length = 0;
+    uint8_t AddressLength = p_Command->Address;
 
-    if((p_Device == NULL) || (p_Device->p_RW == NULL) || (p_Device->p_CS == NULL) || ((p_Data == NULL) && (Length > 0)))
+    // The short address mode saves one byte for each command with an address
+    if(AddressLength == S25FL064L_ADDR_DEVICE)
     {
-	return S25FL064_INVALID_PARAM;
+	AddressLength = p_Device->isShortAddress ? 3 : 4;
     }
 
-    p_Device->p_CS(true);
-    Error = p_Device->p_RW(p_Command, CommandLength, p_Data, Length);
-    if(Error != S25FL064_NO_ERROR)
+    p_Header[Length++] = ((AddressLength == 4) ? p_Command->Code4 : p_Command->Code);
+
+    for(uint8_t i = AddressLength; i > 0; i--)
     {
-	p_Device->p_CS(false);
-	return Error;
+	p_Header[Length++] = (Address >> ((i - 1) * 0x08)) & 0xFF;
     }
-    p_Device->p_CS(false);
 
-    return Error;
+    for(uint8_t i = 0; i < p_Command->Dummy; i++)
+    {
+	p_Header[Length++] = 0x00;
+    }
+
+    return Length;
 }
 
-/** @brief	    Read the manufacturer and the device ID.
- *  @param p_Device Pointer to S25FL064 device structure
- *  @return	    Error code
+/** @brief		Initialize a command frame.
+ *  @param p_Device	Pointer to S25FL064 device structure
+ *  @param p_Frame	Pointer to command frame
+ *  @param Op		Command
+ *  @param Address	Command address. Ignored for commands without an address
  */
-static s25fl064_error_t S25FL064L_ReadID(s25fl064_t* p_Device)
+static void S25FL064L_Frame(s25fl064_t* p_Device, s25fl064_frame_t* p_Frame, s25fl064_op_t Op, uint32_t Address)
+{
+    *p_Frame = (s25fl064_frame_t){0};
+    p_Frame->HeaderLength = S25FL064L_Header(p_Device, Op, Address, p_Frame->Header);
+}
+
+/** @brief		Initialize a command frame which reads the status register 1 and checks it.
+ *  @param p_Device	Pointer to S25FL064 device structure
+ *  @param p_Frame	Pointer to command frame
+ *  @param Condition	Condition for the status
+ *  @param Mask		Status mask
+ *  @param Value	Expected status value
+ */
+static void S25FL064L_StatusFrame(s25fl064_t* p_Device, s25fl064_frame_t* p_Frame, s25fl064_cond_t Condition, uint8_t Mask, uint8_t Value)
+{
+    S25FL064L_Frame(p_Device, p_Frame, S25FL064L_OP_RDSR1, 0);
+    p_Frame->Condition = Condition;
+    p_Frame->Mask = Mask;
+    p_Frame->Value = Value;
+    p_Frame->p_Rx = &p_Frame->Status;
+    p_Frame->Rx_Length = sizeof(p_Frame->Status);
+}
+
+/** @brief		Transmit or receive data while the device is selected.
+ *  @param p_Device	Pointer to S25FL064 device structure
+ *  @param p_Tx		Pointer to transmit data. NULL when receiving
+ *  @param p_Rx		Pointer to receive data. NULL when transmitting
+ *  @param Length	Data length
+ *  @return		Error code
+ */
+static s25fl064_error_t S25FL064L_Clock(s25fl064_t* p_Device, const uint8_t* p_Tx, uint8_t* p_Rx, uint32_t Length)
 {
-    uint8_t Rx_Buffer[4];
-    uint8_t Tx_Buffer = S25FL064L_CMD_RDID;
     s25fl064_error_t Error = S25FL064_NO_ERROR;
 
-    Error = S25FL064L_Command(p_Device, &Tx_Buffer, sizeof(Tx_Buffer), Rx_Buffer, sizeof(Rx_Buffer));
-    if(Error != S25FL064_NO_ERROR)
+    while((Length > 0) && (Error == S25FL064_NO_ERROR))
     {
-	return Error;
-    }
+	// NOTE: nRF52832 specific
+	// The SPI master can transmit up to 255 bytes in a single transaction. So the last byte needs a seperate transaction.
+	// Not an ideal solution, because there is some delay between both transactions (around 32 s) and it doesnt make sense
+	// to add the last byte to the next block of 255 bytes, because the flash memory only supports the writing of one page (256 bytes).
+	uint8_t TransmissionLength = (Length > 255) ? 255 : Length;
 
-    p_Device->MID = Rx_Buffer[1];
-    p_Device->DID = (((uint16_t)Rx_Buffer[2]) << 0x08) | Rx_Buffer[3];
+	if(p_Tx != NULL)
+	{
+	    Error = p_Device->p_RW(p_Tx, TransmissionLength, NULL, 0);
+	    p_Tx += TransmissionLength;
+	}
+	else
+	{
+	    Error = p_Device->p_RW(NULL, 0, p_Rx, TransmissionLength);
+	    p_Rx += TransmissionLength;
+	}
+
+	Length -= TransmissionLength;
+    }
 
     return Error;
 }
 
-/** @brief	    Read the unique device ID.
- *  @param p_Device Pointer to S25FL064 device structure
- *  @return	    Error code
+/** @brief		Execute a batch of command frames.
+ *			The batch is handed to the batch transport of the device when available. Otherwise the frames are
+ *			executed one after the other with the read/write function.
+ *  @param p_Device	Pointer to S25FL064 device structure
+ *  @param p_Frames	Pointer to command frames
+ *  @param Count	Number of command frames
+ *  @return		Error code
  */
-static s25fl064_error_t S25FL064L_ReadUID(s25fl064_t* p_Device)
+static s25fl064_error_t S25FL064L_Execute(s25fl064_t* p_Device, s25fl064_frame_t* p_Frames, uint32_t Count)
 {
-    uint8_t Rx_Buffer[5];
     s25fl064_error_t Error = S25FL064_NO_ERROR;
-    uint8_t Command = S25FL064L_CMD_RUID;
 
     if((p_Device == NULL) || (p_Device->p_RW == NULL) || (p_Device->p_CS == NULL))
     {
 	return S25FL064_INVALID_PARAM;
     }
 
-    p_Device->p_CS(true);
+    // Wait for an erase which runs in the background before the next command is sent
+    if(p_Device->isBusy)
+    {
+	s25fl064_frame_t Frame;
 
-    // Transmit the command and receive the four dummy bytes
-    Error = p_Device->p_RW(&Command, sizeof(Command), Rx_Buffer, sizeof(Rx_Buffer));
-    if(Error != S25FL064_NO_ERROR)
+	p_Device->isBusy = false;
+
+	S25FL064L_StatusFrame(p_Device, &Frame, S25FL064_COND_POLL, 0x01 << S25FL064L_BIT_BUSY, 0);
+
+	Error = S25FL064L_Execute(p_Device, &Frame, 1);
+	if(Error != S25FL064_NO_ERROR)
+	{
+	    p_Device->isBusy = true;
+
+	    return Error;
+	}
+    }
+
+    if(p_Device->p_Batch && (Count > 0))
     {
-	p_Device->p_CS(false);
-	return Error;
+	return p_Device->p_Batch(p_Frames, Count);
     }
 
-    // Receive the UID
-    Error = p_Device->p_RW(NULL, 0, p_Device->UID, 8);
-    if(Error != S25FL064_NO_ERROR)
+    for(uint32_t i = 0; i < Count; i++)
     {
-	p_Device->p_CS(false);
-	return Error;
+	s25fl064_frame_t* p_Frame = &p_Frames[i];
+
+	while(true)
+	{
+	    p_Device->p_CS(true);
+
+	    Error = p_Device->p_RW(p_Frame->Header, p_Frame->HeaderLength, NULL, 0);
+	    if((Error == S25FL064_NO_ERROR) && (p_Frame->Tx_Length > 0))
+	    {
+		Error = S25FL064L_Clock(p_Device, p_Frame->p_Tx, NULL, p_Frame->Tx_Length);
+	    }
+
+	    if((Error == S25FL064_NO_ERROR) && (p_Frame->Rx_Length > 0))
+	    {
+		Error = S25FL064L_Clock(p_Device, NULL, p_Frame->p_Rx, p_Frame->Rx_Length);
+	    }
+
+	    p_Device->p_CS(false);
+
+	    if(Error != S25FL064_NO_ERROR)
+	    {
+		return Error;
+	    }
+
+	    if((p_Frame->Condition == S25FL064_COND_NONE) ||
+	       ((p_Frame->p_Rx[p_Frame->Rx_Length - 1] & p_Frame->Mask) == p_Frame->Value))
+	    {
+		break;
+	    }
+	    else if(p_Frame->Condition == S25FL064_COND_EXPECT)
+	    {
+		return S25FL064_WRITE_PROTECTED;
+	    }
+
+	    if(p_Device->p_Busy)
+	    {
+		p_Device->p_Busy();
+	    }
+	}
     }
-    p_Device->p_CS(false);
 
     return Error;
 }
 
-/** @brief	    Wait until a pending write process has finished.
+/** @brief		Send a command without data to the Flash memory.
+ *  @param p_Device	Pointer to S25FL064 device structure
+ *  @param Op		Command
+ *  @param p_Data	Pointer to return data from command
+ *  @param Length	Length of return data
+ *  @return		Error code
+ */
+static s25fl064_error_t S25FL064L_Command(s25fl064_t* p_Device, s25fl064_op_t Op, uint8_t* p_Data, uint32_t Length)
+{
+    s25fl064_frame_t Frame;
+
+    if((p_Device == NULL) || ((p_Data == NULL) && (Length > 0)))
+    {
+	return S25FL064_INVALID_PARAM;
+    }
+
+    S25FL064L_Frame(p_Device, &Frame, Op, 0);
+    Frame.p_Rx = p_Data;
+    Frame.Rx_Length = Length;
+
+    return S25FL064L_Execute(p_Device, &Frame, 1);
+}
+
+/** @brief	    Read the manufacturer and the device ID.
  *  @param p_Device Pointer to S25FL064 device structure
  *  @return	    Error code
  */
-static s25fl064_error_t S25FL064L_WaitBusy(s25fl064_t* p_Device)
+static s25fl064_error_t S25FL064L_ReadID(s25fl064_t* p_Device)
 {
-    uint8_t Rx_Buffer[2];
-    uint8_t Tx_Buffer = S25FL064L_CMD_RDSR1;
+    uint8_t Rx_Buffer[3];
     s25fl064_error_t Error = S25FL064_NO_ERROR;
 
-    do
+    Error = S25FL064L_Command(p_Device, S25FL064L_OP_RDID, Rx_Buffer, sizeof(Rx_Buffer));
+    if(Error != S25FL064_NO_ERROR)
     {
-	Error = S25FL064L_Command(p_Device, &Tx_Buffer, sizeof(Tx_Buffer), Rx_Buffer, sizeof(Rx_Buffer));
-	if(Error != S25FL064_NO_ERROR)
-	{
-	    return Error;
-	}
+	return Error;
+    }
 
-	if(p_Device->p_Busy)
-	{
-	    p_Device->p_Busy();
-	}
-    }while(Rx_Buffer[1] & (0x01 << S25FL064L_BIT_BUSY));
+    p_Device->MID = Rx_Buffer[0];
+    p_Device->DID = (((uint16_t)Rx_Buffer[1]) << 0x08) | Rx_Buffer[2];
 
     return Error;
 }
 
-/** @brief Read the JEDEC parameter from the flash memory.
+/** @brief	    Read the unique device ID.
+ *  @param p_Device Pointer to S25FL064 device structure
+ *  @return	    Error code
  */
-static s25fl064_error_t S25FL064L_ReadJEDEC(s25fl064_t* p_Device)
+static s25fl064_error_t S25FL064L_ReadUID(s25fl064_t* p_Device)
 {
-    uint8_t Rx_Buffer[5];
-    uint8_t Tx_Buffer[] = {S25FL064L_CMD_RSFDP, 0x00, 0x00, 0x00, 0x00};
-    s25fl064_error_t Error = S25FL064_NO_ERROR;
-
-    if((p_Device == NULL) || (p_Device->p_RW == NULL) || (p_Device->p_CS == NULL))
+    if(p_Device == NULL)
     {
 	return S25FL064_INVALID_PARAM;
     }
 
-    p_Device->p_CS(true);
+    // The command is followed by four dummy bytes
+    return S25FL064L_Command(p_Device, S25FL064L_OP_RUID, p_Device->UID, sizeof(p_Device->UID));
+}
 
-    // Transmit the command
-    Error = p_Device->p_RW(Tx_Buffer, sizeof(Tx_Buffer), Rx_Buffer, sizeof(Rx_Buffer));
-    if(Error != S25FL064_NO_ERROR)
-    {
-	p_Device->p_CS(false);
-	return Error;
-    }
+/** @brief Read the JEDEC parameter from the flash memory.
+ */
+static s25fl064_error_t S25FL064L_ReadJEDEC(s25fl064_t* p_Device)
+{
+    s25fl064_frame_t Frame;
 
-    // Receive the data
-    Error = p_Device->p_RW(NULL, 0, (uint8_t*)&Params, sizeof(Params));
-    if(Error != S25FL064_NO_ERROR)
+    if(p_Device == NULL)
     {
-	p_Device->p_CS(false);
-	return Error;
+	return S25FL064_INVALID_PARAM;
     }
 
-    p_Device->p_CS(false);
+    // The command uses a 3-byte address and a dummy byte in both address modes
+    S25FL064L_Frame(p_Device, &Frame, S25FL064L_OP_RSFDP, 0);
+    Frame.p_Rx = (uint8_t*)&Params;
+    Frame.Rx_Length = sizeof(Params);
 
-    return Error;
+    return S25FL064L_Execute(p_Device, &Frame, 1);
 }
 
 s25fl064_error_t S25FL064L_Init(s25fl064_t* p_Device)
 {
-    uint8_t Rx_Buffer[2];
-    uint8_t Tx_Buffer;
+    uint8_t CR2;
     s25fl064_error_t Error = S25FL064_NO_ERROR;
 
     p_Device->isInitialized = false;
+    p_Device->isBusy = false;
 
     Error = S25FL064L_LeavePowerDown(p_Device);
     if(Error != S25FL064_NO_ERROR)
@@ -227,26 +400,25 @@ s25fl064_error_t S25FL064L_Init(s25fl064_t* p_Device)
 	return Error;
     }
 
-    Tx_Buffer = S25FL064L_CMD_RDCR2;
-    Error = S25FL064L_Command(p_Device, &Tx_Buffer, sizeof(Tx_Buffer), Rx_Buffer, sizeof(Rx_Buffer));
+    Error = S25FL064L_Command(p_Device, S25FL064L_OP_RDCR2, &CR2, sizeof(CR2));
     if(Error != S25FL064_NO_ERROR)
     {
 	return Error;
     }
 
     // Address length status is set. The device will use 4-byte addresses
-    if(Rx_Buffer[1] & (0x01 << S25FL064L_BIT_ADDR_LENGTH))
+    if(CR2 & (0x01 << S25FL064L_BIT_ADDR_LENGTH))
     {
 	p_Device->isShortAddress = false;
     }
     // Address length status is not set. The device will use 3-byte addresses
     else
     {
-	p_Device->isShortAddress = false;
+	p_Device->isShortAddress = true;
     }
 
-    p_Device->Impedance = (Rx_Buffer[1] >> 0x05) & 0x03;
-    p_Device->isQPI = (Rx_Buffer[1] >> 0x03) & 0x01;
+    p_Device->Impedance = (CR2 >> 0x05) & 0x03;
+    p_Device->isQPI = (CR2 >> 0x03) & 0x01;
     p_Device->BlockSize = S25FL064L_SECTOR_SIZE;
     p_Device->Blocks = S25FL064L_SECTOR_COUNT;
 
@@ -259,20 +431,30 @@ s25fl064_error_t S25FL064L_Init(s25fl064_t* p_Device)
 
 s25fl064_error_t S25FL064L_GetError(s25fl064_t* p_Device, uint8_t* p_Error)
 {
-    uint8_t Rx_Buffer[2];
-    uint8_t Tx_Buffer = S25FL064L_CMD_RDSR2;
+    uint8_t SR2;
+    s25fl064_frame_t Frames[2];
     s25fl064_error_t Error = S25FL064_NO_ERROR;
 
-    Error = S25FL064L_Command(p_Device, &Tx_Buffer, sizeof(Tx_Buffer), Rx_Buffer, sizeof(Rx_Buffer));
+    if((p_Device == NULL) || (p_Error == NULL))
+    {
+	return S25FL064_INVALID_PARAM;
+    }
+
+    // Read the error flags and clear them
+    S25FL064L_Frame(p_Device, &Frames[0], S25FL064L_OP_RDSR2, 0);
+    Frames[0].p_Rx = &SR2;
+    Frames[0].Rx_Length = sizeof(SR2);
+    S25FL064L_Frame(p_Device, &Frames[1], S25FL064L_OP_CLSR, 0);
+
+    Error = S25FL064L_Execute(p_Device, Frames, 2);
     if(Error != S25FL064_NO_ERROR)
     {
 	return Error;
     }
 
-    *p_Error = (Rx_Buffer[1] & 0x60) >> 0x05;
+    *p_Error = (SR2 & 0x60) >> 0x05;
 
-    Tx_Buffer = S25FL064L_CMD_CLSR;
-    return S25FL064L_Command(p_Device, &Tx_Buffer, sizeof(Tx_Buffer), NULL, 0);
+    return Error;
 }
 
 s25fl064_error_t S25FL064L_Reset(s25fl064_t* p_Device)
@@ -285,16 +467,16 @@ s25fl064_error_t S25FL064L_Reset(s25fl064_t* p_Device)
     p_Device->p_Reset();
 
     p_Device->isInitialized = false;
+    p_Device->isBusy = false;
 
     return S25FL064_NO_ERROR;
 }
 
 s25fl064_error_t S25FL064L_EnterPowerDown(s25fl064_t* p_Device)
 {
-    uint8_t Tx_Buffer = S25FL064L_CMD_DPD;
     s25fl064_error_t Error = S25FL064_NO_ERROR;
 
-    Error = S25FL064L_Command(p_Device, &Tx_Buffer, sizeof(Tx_Buffer), NULL, 0);
+    Error = S25FL064L_Command(p_Device, S25FL064L_OP_DPD, NULL, 0);
     if(Error != S25FL064_NO_ERROR)
     {
 	return Error;
@@ -307,16 +489,18 @@ s25fl064_error_t S25FL064L_EnterPowerDown(s25fl064_t* p_Device)
 
 s25fl064_error_t S25FL064L_LeavePowerDown(s25fl064_t* p_Device)
 {
-    uint8_t Tx_Buffer = S25FL064L_CMD_RES;
+    s25fl064_frame_t Frames[2];
     s25fl064_error_t Error = S25FL064_NO_ERROR;
 
-    Error = S25FL064L_Command(p_Device, &Tx_Buffer, sizeof(Tx_Buffer), NULL, 0);
-    if(Error != S25FL064_NO_ERROR)
+    if(p_Device == NULL)
     {
-	return Error;
+	return S25FL064_INVALID_PARAM;
     }
 
-    Error = S25FL064L_WaitBusy(p_Device);
+    S25FL064L_Frame(p_Device, &Frames[0], S25FL064L_OP_RES, 0);
+    S25FL064L_StatusFrame(p_Device, &Frames[1], S25FL064_COND_POLL, 0x01 << S25FL064L_BIT_BUSY, 0);
+
+    Error = S25FL064L_Execute(p_Device, Frames, 2);
     if(Error != S25FL064_NO_ERROR)
     {
 	return Error;
@@ -329,63 +513,100 @@ s25fl064_error_t S25FL064L_LeavePowerDown(s25fl064_t* p_Device)
 
 s25fl064_error_t S25FL064L_EraseSector(s25fl064_t* p_Device, uint32_t Address)
 {
-    uint8_t Tx_Buffer[5] = {S25FL064L_CMD_WREN};
-    s25fl064_error_t Error = S25FL064_NO_ERROR;
+    s25fl064_frame_t Frames[3];
 
-    // Enable write to nonvolatile memory
-    Error = S25FL064L_Command(p_Device, &Tx_Buffer[0], sizeof(Tx_Buffer[0]), NULL, 0);
-    if(Error != S25FL064_NO_ERROR)
+    if(p_Device == NULL)
     {
-	return Error;
+	return S25FL064_INVALID_PARAM;
     }
 
-    p_Device->p_CS(true);
+    // Enable write to nonvolatile memory, erase the sector and wait until the device is ready
+    S25FL064L_Frame(p_Device, &Frames[0], S25FL064L_OP_WREN, 0);
+    S25FL064L_Frame(p_Device, &Frames[1], S25FL064L_OP_SE, Address);
+    S25FL064L_StatusFrame(p_Device, &Frames[2], S25FL064_COND_POLL, 0x01 << S25FL064L_BIT_BUSY, 0);
 
-    Tx_Buffer[0] = S25FL064L_CMD_SE;
-    Tx_Buffer[1] = (Address & 0xFF000000) >> 0x18;
-    Tx_Buffer[2] = (Address & 0x00FF0000) >> 0x10;
-    Tx_Buffer[3] = (Address & 0x0000FF00) >> 0x08;
-    Tx_Buffer[4] = (Address & 0x000000FF) >> 0x00;
+    return S25FL064L_Execute(p_Device, Frames, 3);
+}
 
-    // Transmit the set pointer region command and the address
-    Error = p_Device->p_RW(Tx_Buffer, sizeof(Tx_Buffer), NULL, 0);
-    if(Error != S25FL064_NO_ERROR)
+s25fl064_error_t S25FL064L_EraseSectorStart(s25fl064_t* p_Device, uint32_t Address)
+{
+    s25fl064_frame_t Frames[2];
+    s25fl064_error_t Error = S25FL064_NO_ERROR;
+
+    if(p_Device == NULL)
     {
-	p_Device->p_CS(false);
+	return S25FL064_INVALID_PARAM;
+    }
+
+    // Enable write to nonvolatile memory and erase the sector. The next command waits until the device is ready
+    S25FL064L_Frame(p_Device, &Frames[0], S25FL064L_OP_WREN, 0);
+    S25FL064L_Frame(p_Device, &Frames[1], S25FL064L_OP_SE, Address);
 
+    Error = S25FL064L_Execute(p_Device, Frames, 2);
+    if(Error != S25FL064_NO_ERROR)
+    {
 	return Error;
     }
 
-    p_Device->p_CS(false);
+    p_Device->isBusy = true;
 
-    return S25FL064L_WaitBusy(p_Device);
+    return Error;
 }
 
-s25fl064_error_t S25FL064L_EraseChip(s25fl064_t* p_Device)
+s25fl064_error_t S25FL064L_Poll(s25fl064_t* p_Device, bool* p_Busy)
 {
-    uint8_t Tx_Buffer = S25FL064L_CMD_WREN;
+    uint8_t SR1;
     s25fl064_error_t Error = S25FL064_NO_ERROR;
 
-    Error = S25FL064L_Command(p_Device, &Tx_Buffer, sizeof(Tx_Buffer), NULL, 0);
-    if(Error != S25FL064_NO_ERROR)
+    if((p_Device == NULL) || (p_Busy == NULL))
     {
-	return Error;
+	return S25FL064_INVALID_PARAM;
     }
 
-    Tx_Buffer = S25FL064L_CMD_CE;
-    Error = S25FL064L_Command(p_Device, &Tx_Buffer, sizeof(Tx_Buffer), NULL, 0);
-    if(Error != S25FL064_NO_ERROR)
+    // Read the status only once. The flag is cleared, because the command would wait for the erase otherwise
+    if(p_Device->isBusy)
     {
-	return Error;
+	p_Device->isBusy = false;
+
+	Error = S25FL064L_Command(p_Device, S25FL064L_OP_RDSR1, &SR1, sizeof(SR1));
+
+	p_Device->isBusy = (Error != S25FL064_NO_ERROR) || (SR1 & (0x01 << S25FL064L_BIT_BUSY));
     }
 
-    return S25FL064L_WaitBusy(p_Device);
+    *p_Busy = p_Device->isBusy;
+
+    return Error;
+}
+
+s25fl064_error_t S25FL064L_Wait(s25fl064_t* p_Device)
+{
+    if(p_Device == NULL)
+    {
+	return S25FL064_INVALID_PARAM;
+    }
+
+    return S25FL064L_Execute(p_Device, NULL, 0);
+}
+
+s25fl064_error_t S25FL064L_EraseChip(s25fl064_t* p_Device)
+{
+    s25fl064_frame_t Frames[3];
+
+    if(p_Device == NULL)
+    {
+	return S25FL064_INVALID_PARAM;
+    }
+
+    S25FL064L_Frame(p_Device, &Frames[0], S25FL064L_OP_WREN, 0);
+    S25FL064L_Frame(p_Device, &Frames[1], S25FL064L_OP_CE, 0);
+    S25FL064L_StatusFrame(p_Device, &Frames[2], S25FL064_COND_POLL, 0x01 << S25FL064L_BIT_BUSY, 0);
+
+    return S25FL064L_Execute(p_Device, Frames, 3);
 }
 
 s25fl064_error_t S25FL064L_Write(s25fl064_t* p_Device, uint32_t Address, const uint8_t* p_Buffer, uint32_t Length)
 {
-    uint8_t Tx_Buffer[5];
-    uint8_t Rx_Buffer[2];
+    s25fl064_frame_t Frames[S25FL064L_BATCH_PAGES * 4];
     uint32_t RemainingBytes = Length;
     uint32_t MemoryAddress = Address;
     const uint8_t* p_Buffer_Temp = p_Buffer;
@@ -396,166 +617,165 @@ s25fl064_error_t S25FL064L_Write(s25fl064_t* p_Device, uint32_t Address, const u
 	return S25FL064_INVALID_PARAM;
     }
 
-    do
+    while((RemainingBytes > 0) && (Error == S25FL064_NO_ERROR))
     {
-	// Enable write to nonvolatile memory
-	Tx_Buffer[0] = S25FL064L_CMD_WREN;
-	Error = S25FL064L_Command(p_Device, &Tx_Buffer[0], sizeof(uint8_t), NULL, 0);
-	if(Error != S25FL064_NO_ERROR)
+	uint32_t Count = 0;
+
+	// Queue the write enable, the write enable check, the page program and the busy poll of each page
+	for(uint32_t Page = 0; (Page < S25FL064L_BATCH_PAGES) && (RemainingBytes > 0); Page++)
 	{
-	    return Error;
-	}
+	    // NOTE: A page program wraps around at the end of the page.
+	    uint32_t PageLength = S25FL064L_PAGE_SIZE - (MemoryAddress % S25FL064L_PAGE_SIZE);
+
+	    if(PageLength > RemainingBytes)
+	    {
+		PageLength = RemainingBytes;
+	    }
 
-	Tx_Buffer[0] = S25FL064L_CMD_RDSR1;
-    	Error = S25FL064L_Command(p_Device, &Tx_Buffer[0], sizeof(Tx_Buffer), Rx_Buffer, sizeof(Rx_Buffer));
-    	if(Error != S25FL064_NO_ERROR)
-    	{
-    	    return Error;
-    	}
+	    S25FL064L_Frame(p_Device, &Frames[Count++], S25FL064L_OP_WREN, 0);
+	    S25FL064L_StatusFrame(p_Device, &Frames[Count++], S25FL064_COND_EXPECT, 0x01 << S25FL064L_BIT_WEL, 0x01 << S25FL064L_BIT_WEL);
+	    S25FL064L_Frame(p_Device, &Frames[Count], S25FL064L_OP_PP, MemoryAddress);
+	    Frames[Count].p_Tx = p_Buffer_Temp;
+	    Frames[Count++].Tx_Length = PageLength;
+	    S25FL064L_StatusFrame(p_Device, &Frames[Count++], S25FL064_COND_POLL, 0x01 << S25FL064L_BIT_BUSY, 0);
 
-	// Check if the memory is writeable
-	if(!(Rx_Buffer[1] & (0x01 << S25FL064L_BIT_WEL)))
-	{
-	    return S25FL064_WRITE_PROTECTED;
+	    RemainingBytes -= PageLength;
+	    p_Buffer_Temp += PageLength;
+	    MemoryAddress += PageLength;
 	}
 
-	Tx_Buffer[0] = S25FL064L_CMD_4PP;
-	Tx_Buffer[1] = (MemoryAddress & 0xFF000000) >> 0x18;
-	Tx_Buffer[2] = (MemoryAddress & 0x00FF0000) >> 0x10;
-	Tx_Buffer[3] = (MemoryAddress & 0x0000FF00) >> 0x08;
-	Tx_Buffer[4] = (MemoryAddress & 0x000000FF) >> 0x00;
+	Error = S25FL064L_Execute(p_Device, Frames, Count);
+    }
 
-	p_Device->p_CS(true);
+    return Error;
+}
 
-	// Transmit the write command and the address
-	Error = p_Device->p_RW(Tx_Buffer, sizeof(Tx_Buffer), NULL, 0);
-	if(Error != S25FL064_NO_ERROR)
-	{
-	    p_Device->p_CS(false);
+s25fl064_error_t S25FL064L_Read(s25fl064_t* p_Device, uint32_t Start, uint8_t* p_Buffer, uint32_t Length)
+{
+    s25fl064_frame_t Frame;
 
-	    return Error;
-	}
+    if((p_Device == NULL) || (p_Buffer == NULL))
+    {
+	return S25FL064_INVALID_PARAM;
+    }
+
+    S25FL064L_Frame(p_Device, &Frame, S25FL064L_OP_READ, Start);
+    Frame.p_Rx = p_Buffer;
+    Frame.Rx_Length = Length;
 
-	// At least one page to transmit
-	if(RemainingBytes >= S25FL064L_PAGE_SIZE)
+    return S25FL064L_Execute(p_Device, &Frame, 1);
+}
+
+/** @brief		Send a read command for the given start address.
+ *  @param p_Device	Pointer to S25FL064 device structure
+ *  @param Start	Start address
+ *  @return		Error code
+ */
+static s25fl064_error_t S25FL064L_ReadCommand(s25fl064_t* p_Device, uint32_t Start)
+{
+    uint8_t Tx_Buffer[S25FL064L_HEADER_SIZE];
+
+    return p_Device->p_RW(Tx_Buffer, S25FL064L_Header(p_Device, S25FL064L_OP_READ, Start, Tx_Buffer), NULL, 0);
+}
+
+s25fl064_error_t S25FL064L_ReadSegments(s25fl064_t* p_Device, const s25fl064_segment_t* p_Segments, uint32_t Count)
+{
+    uint8_t Scratch[32];
+    uint32_t Next = 0;
+    s25fl064_error_t Error = S25FL064_NO_ERROR;
+
+    if((p_Device == NULL) || ((p_Segments == NULL) && (Count > 0)))
+    {
+	return S25FL064_INVALID_PARAM;
+    }
+
+    for(uint32_t i = 0; i < Count; i++)
+    {
+	if(p_Segments[i].p_Buffer == NULL)
 	{
-	    // NOTE: nRF52832 specific
-	    // The SPI master can transmit up to 255 bytes in a single transaction. So the last byte needs a seperate transaction.
-	    // Not an ideal solution, because there is some delay between both transactions (around 32 s) and it doesnt make sense 
-	    // to add the last byte to the next block of 255 bytes, because the flash memory only supports the writing of one page (256 bytes).
-	    Error = p_Device->p_RW(p_Buffer_Temp, 255, NULL, 0) || p_Device->p_RW(p_Buffer_Temp + 255, 1, NULL, 0);
-	    if(Error != S25FL064_NO_ERROR)
-	    {
-		p_Device->p_CS(false);
+	    return S25FL064_INVALID_PARAM;
+	}
+    }
 
-		return Error;
-	    }
+    Error = S25FL064L_Wait(p_Device);
 
-	    // Unselect the device and write the page
-	    p_Device->p_CS(false);
+    for(uint32_t i = 0; (i < Count) && (Error == S25FL064_NO_ERROR); i++)
+    {
+	const s25fl064_segment_t* p_Segment = &p_Segments[i];
 
-	    // Wait until the device is ready
-	    Error = S25FL064L_WaitBusy(p_Device);
-	    if(Error != S25FL064_NO_ERROR)
+	// Continue the running read command when the segment follows closely, otherwise start a new one
+	if((i > 0) && (p_Segment->Address >= Next) && ((p_Segment->Address - Next) <= S25FL064L_READ_MERGE_GAP))
+	{
+	    uint32_t Gap = p_Segment->Address - Next;
+
+	    while((Gap > 0) && (Error == S25FL064_NO_ERROR))
 	    {
-		p_Device->p_CS(false);
+		uint32_t Length = (Gap > sizeof(Scratch)) ? sizeof(Scratch) : Gap;
 
-		return Error;
+		Error = S25FL064L_Clock(p_Device, NULL, Scratch, Length);
+		Gap -= Length;
 	    }
-
-	    RemainingBytes -= S25FL064L_PAGE_SIZE;
-	    p_Buffer_Temp += S25FL064L_PAGE_SIZE;
-	    MemoryAddress += S25FL064L_PAGE_SIZE;
 	}
-	// Only one page to transmit
 	else
 	{
-	    Error = p_Device->p_RW(p_Buffer, RemainingBytes, NULL, 0);
-	    if(Error != S25FL064_NO_ERROR)
+	    if(i > 0)
 	    {
 		p_Device->p_CS(false);
-
-		return Error;
 	    }
 
-	    // Unselect the device and write the page
-	    p_Device->p_CS(false);
+	    p_Device->p_CS(true);
 
-	    // Wait until the device is ready
-	    Error = S25FL064L_WaitBusy(p_Device);
-	    if(Error != S25FL064_NO_ERROR)
-	    {
-		p_Device->p_CS(false);
-
-		return Error;
-	    }
+	    Error = S25FL064L_ReadCommand(p_Device, p_Segment->Address);
+	}
 
-	    RemainingBytes -= RemainingBytes;
+	if(Error == S25FL064_NO_ERROR)
+	{
+	    Error = S25FL064L_Clock(p_Device, NULL, p_Segment->p_Buffer, p_Segment->Length);
 	}
 
+	Next = p_Segment->Address + p_Segment->Length;
+    }
+
+    if(Count > 0)
+    {
 	p_Device->p_CS(false);
-    } while(RemainingBytes > 0);
+    }
 
-    return S25FL064L_WaitBusy(p_Device);
+    return Error;
 }
 
-s25fl064_error_t S25FL064L_Read(s25fl064_t* p_Device, uint32_t Start, uint8_t* p_Buffer, uint32_t Length)
+s25fl064_error_t S25FL064L_ReadStream(s25fl064_t* p_Device, uint32_t Address, uint32_t Length, s25fl06_stream_fptr_t Consumer, void* p_Context)
 {
-    uint8_t Tx_Buffer[5];
-    uint32_t RemainingBytes = Length;
-    uint8_t* p_Buffer_Temp = p_Buffer;
-    s25fl064_error_t Error = S25FL064_NO_ERROR;
+    uint8_t Rx_Buffer[S25FL064L_STREAM_SIZE];
+    s25fl064_error_t Error;
 
-    if((p_Device == NULL) || (p_Buffer == NULL))
+    if((p_Device == NULL) || (Consumer == NULL))
     {
 	return S25FL064_INVALID_PARAM;
     }
 
-    // Begin the read command by sending the command code and the start address
-    Tx_Buffer[0] = S25FL064L_CMD_4READ;
-    Tx_Buffer[1] = (Start & 0xFF000000) >> 0x18;
-    Tx_Buffer[2] = (Start & 0x00FF0000) >> 0x10;
-    Tx_Buffer[3] = (Start & 0x0000FF00) >> 0x08;
-    Tx_Buffer[4] = (Start & 0x000000FF) >> 0x00;
-
-    p_Device->p_CS(true);
-
-    Error = p_Device->p_RW(Tx_Buffer, sizeof(Tx_Buffer), NULL, 0);
+    Error = S25FL064L_Wait(p_Device);
     if(Error != S25FL064_NO_ERROR)
     {
-	p_Device->p_CS(false);
-
 	return Error;
     }
 
-    do
-    {
-	uint8_t TransmissionLength;
+    p_Device->p_CS(true);
 
-	// NOTE: nRF52832 specific
-	// The SPI master can transmit up to 255 bytes in a single transaction. So the last byte needs a seperate transaction.
-	// Not an ideal solution, because there is some delay between both transactions (around 32 s) and it doesnt make sense 
-	// to add the last byte to the next block of 255 bytes, because the flash memory only supports the writing of one page (256 bytes).
-	if(RemainingBytes > 255)
-	{
-	    TransmissionLength = 255;
-	}
-	else
-	{
-	    TransmissionLength = RemainingBytes;
-	}
+    Error = S25FL064L_ReadCommand(p_Device, Address);
 
-	Error = p_Device->p_RW(NULL, 0, p_Buffer_Temp, TransmissionLength);
-	if(Error != S25FL064_NO_ERROR)
-	{
-	    p_Device->p_CS(false);
+    while((Length > 0) && (Error == S25FL064_NO_ERROR))
+    {
+	uint32_t ChunkLength = (Length > sizeof(Rx_Buffer)) ? sizeof(Rx_Buffer) : Length;
 
-	    return Error;
+	Error = S25FL064L_Clock(p_Device, NULL, Rx_Buffer, ChunkLength);
+	if((Error == S25FL064_NO_ERROR) && !Consumer(p_Context, Rx_Buffer, ChunkLength))
+	{
+	    Error = S25FL064_ABORTED;
 	}
 
-	RemainingBytes -= TransmissionLength;
-	p_Buffer_Temp += TransmissionLength;
-    } while(RemainingBytes > 0);
+	Length -= ChunkLength;
+    }
 
     p_Device->p_CS(false);
 
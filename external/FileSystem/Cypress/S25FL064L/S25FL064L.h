@@ -58,6 +58,27 @@
   */
  s25fl064_error_t S25FL064L_EraseSector(s25fl064_t* p_Device, uint32_t Address);
 
+ /** @brief		Start a single sector erase without waiting for it.
+  *			The erase runs in the background until the next command of the driver, which waits for it first.
+  *  @param p_Device	Pointer to S25FL064 device structure
+  *  @param Address	Sector address
+  *  @return		Error code
+  */
+ s25fl064_error_t S25FL064L_EraseSectorStart(s25fl064_t* p_Device, uint32_t Address);
+
+ /** @brief		Check once if an erase started with #S25FL064L_EraseSectorStart is still running.
+  *  @param p_Device	Pointer to S25FL064 device structure
+  *  @param p_Busy	Pointer to busy flag
+  *  @return		Error code
+  */
+ s25fl064_error_t S25FL064L_Poll(s25fl064_t* p_Device, bool* p_Busy);
+
+ /** @brief		Wait until an erase started with #S25FL064L_EraseSectorStart has finished.
+  *  @param p_Device	Pointer to S25FL064 device structure
+  *  @return		Error code
+  */
+ s25fl064_error_t S25FL064L_Wait(s25fl064_t* p_Device);
+
  /** @brief		Perform a complete chip erase.
   *  @param p_Device	Pointer to S25FL064 device structure
   *  @return		Error code
@@ -82,4 +103,24 @@
   */
  s25fl064_error_t S25FL064L_Read(s25fl064_t* p_Device, uint32_t Address, uint8_t* p_Buffer, uint32_t Length);
 
+ /** @brief		Read several segments from the flash memory.
+  *			Segments with ascending addresses and gaps up to \ref S25FL064L_READ_MERGE_GAP bytes share a single read command.
+  *  @param p_Device	Pointer to S25FL064 device structure
+  *  @param p_Segments	Pointer to segment list
+  *  @param Count	Number of segments
+  *  @return		Error code
+  */
+ s25fl064_error_t S25FL064L_ReadSegments(s25fl064_t* p_Device, const s25fl064_segment_t* p_Segments, uint32_t Count);
+
+ /** @brief		Read data from the flash memory with a single read command and pass it to a consumer in chunks of up to
+  *			\ref S25FL064L_STREAM_SIZE bytes, straight from the SPI receive buffer.
+  *  @param p_Device	Pointer to S25FL064 device structure
+  *  @param Address	Start address
+  *  @param Length	Data length
+  *  @param Consumer	Consumer function
+  *  @param p_Context	Pointer to user context for the consumer
+  *  @return		Error code. #S25FL064_ABORTED when the consumer stopped the read
+  */
+ s25fl064_error_t S25FL064L_ReadStream(s25fl064_t* p_Device, uint32_t Address, uint32_t Length, s25fl06_stream_fptr_t Consumer, void* p_Context);
+
 #endif /* S25FL064L_H_ */
\ No newline at end of file
@@ -46,6 +46,40 @@
   */
  #define S25FL064L_DEVICE_ID			0x6017
 
+ /** @brief Largest gap in bytes between two read segments which are merged into a single read command.
+  *	    The gap is clocked out and discarded, which is cheaper than a new command for gaps of this size.
+  */
+ #define S25FL064L_READ_MERGE_GAP		128
+
+ /** @brief Maximum number of pages which are queued in a single command batch by \ref S25FL064L_Write.
+  */
+ #define S25FL064L_BATCH_PAGES			2
+
+ /** @brief Maximum number of header bytes of a command frame (command code, address and dummy bytes).
+  */
+ #define S25FL064L_HEADER_SIZE			6
+
+ /** @brief Size of the receive chunks in bytes which are passed to the consumer by \ref S25FL064L_ReadStream.
+  *	    The chunk buffer is placed on the stack. 255 bytes is the largest single transaction of the nRF52 SPI master.
+  */
+ #ifndef S25FL064L_STREAM_SIZE
+    #define S25FL064L_STREAM_SIZE		255
+ #endif
+
+ /** @brief Timing and power model of the device with approximate typical values of the datasheet. The values are only
+  *	    used to estimate the time and the energy of flash operations.
+  */
+ #define S25FL064L_SUPPLY_MV			3000		    /**< Supply voltage in mV. */
+ #define S25FL064L_TIME_PU_US			300		    /**< Power up time until the first command in us. */
+ #define S25FL064L_TIME_RES_US			30		    /**< Release from deep power down in us. */
+ #define S25FL064L_TIME_PP_US			450		    /**< Page program time in us. */
+ #define S25FL064L_TIME_SE_US			50000		    /**< Sector erase time in us. */
+ #define S25FL064L_CURRENT_READ_UA		10000		    /**< Active current while reading or clocking commands in uA. */
+ #define S25FL064L_CURRENT_PROG_UA		20000		    /**< Active current while programming in uA. */
+ #define S25FL064L_CURRENT_ERASE_UA		20000		    /**< Active current while erasing in uA. */
+ #define S25FL064L_CURRENT_STANDBY_UA		20		    /**< Standby current in uA. */
+ #define S25FL064L_CURRENT_DPD_UA		2		    /**< Deep power down current in uA. */
+
  /** @brief Error codes for the S25FL064 driver.
   */
  typedef enum
@@ -55,8 +89,19 @@
     S25FL064_NOT_INITIALIZED	= 0x03,			    /**< Device is not initialized. Please call the
 								 \ref S25FL064_Init function. */
     S25FL064_WRITE_PROTECTED	= 0x04,			    /**< Can not write to flash memory. */
+    S25FL064_ABORTED		= 0x05,			    /**< Operation was stopped by the consumer. */
  } s25fl064_error_t;
 
+ /** @brief Conditions for the last received byte of a command frame.
+  */
+ typedef enum
+ {
+    S25FL064_COND_NONE		= 0x00,			    /**< No condition. */
+    S25FL064_COND_POLL		= 0x01,			    /**< Repeat the frame until the masked byte matches the value. */
+    S25FL064_COND_EXPECT	= 0x02,			    /**< Stop the batch with #S25FL064_WRITE_PROTECTED when the masked
+								 byte doesn't match the value. */
+ } s25fl064_cond_t;
+
  /** @brief Impedance values used by the S25FL064 driver.
   */
  typedef enum
@@ -113,6 +158,49 @@
     uint8_t PS:1;					     /**< Program Suspend. */
  } __attribute__((packed)) s25fl064_sr2_t;
 
+ /** @brief S25FL064 read segment object structure.
+  */
+ typedef struct
+ {
+    uint32_t		    Address;			    /**< Start address of the segment. */
+    uint8_t*		    p_Buffer;			    /**< Pointer to data buffer. */
+    uint32_t		    Length;			    /**< Data length. */
+ } s25fl064_segment_t;
+
+ /** @brief S25FL064 command frame object structure. A frame is a single transaction with the chip select asserted.
+  *	    The header is transmitted first, followed by the transmit data and the receive data.
+  */
+ typedef struct
+ {
+    uint8_t		    Header[S25FL064L_HEADER_SIZE];  /**< Command code, address and dummy bytes. */
+    uint8_t		    HeaderLength;		    /**< Number of header bytes. */
+    s25fl064_cond_t	    Condition;			    /**< Condition for the last received byte. */
+    uint8_t		    Mask;			    /**< Mask for the condition. */
+    uint8_t		    Value;			    /**< Expected value of the masked byte. */
+    uint8_t		    Status;			    /**< Receive buffer for status frames. */
+    const uint8_t*	    p_Tx;			    /**< Pointer to transmit data. */
+    uint32_t		    Tx_Length;			    /**< Transmit data length. */
+    uint8_t*		    p_Rx;			    /**< Pointer to receive data. */
+    uint32_t		    Rx_Length;			    /**< Receive data length. */
+ } s25fl064_frame_t;
+
+ /** @brief		Batch transport function pointer which executes a list of command frames back-to-back, e.g. with a
+  *			DMA transfer list. The transport has to handle the chip select and the frame conditions.
+  *  @param p_Frames	Pointer to command frames
+  *  @param Count	Number of command frames
+  *  @return		Communication error code
+  */
+ typedef s25fl064_error_t (*s25fl06_batch_fptr_t)(s25fl064_frame_t* p_Frames, uint32_t Count);
+
+ /** @brief		Stream consumer function pointer which receives the data of \ref S25FL064L_ReadStream.
+  *			The chip select is still asserted during the call, so the consumer must not access the flash memory.
+  *  @param p_Context	Pointer to user context
+  *  @param p_Data	Pointer to received data. Only valid during the call
+  *  @param Length	Data length
+  *  @return		#true to continue the read
+  */
+ typedef bool (*s25fl06_stream_fptr_t)(void* p_Context, const uint8_t* p_Data, uint32_t Length);
+
  /** @brief S25FL064 device object structure.
   */
  typedef struct
@@ -122,9 +210,13 @@
     s25fl06_rw_fptr_t	    p_RW;			    /**< Pointer to S25FL064 read/write function. */
     s25fl06_busy_fptr_t	    p_Busy;			    /**< Pointer to S25FL064 busy function. 
 								 NOTE: This function can be NULL. */
+    s25fl06_batch_fptr_t    p_Batch;			    /**< Pointer to S25FL064 batch transport function. The driver
+								 executes the frames with the read/write function when
+								 this function is NULL. */
 
     bool		    isInitialized;		    /**< Boolean flag to indicate a successful initialization. */
     bool		    isPowerDown;		    /**< Boolean flag to indicate active power down mode. */
+    bool		    isBusy;			    /**< Boolean flag to indicate an erase which runs in the background. */
     bool		    isWriteProtect;		    /**< Boolean flag to indicate active write protection. */
     bool		    isShortAddress;		    /**< Boolean flag to indicate the 3-byte address mode. */
     bool		    isQPI;			    /**< Boolean flag to indicate QPI mode instead of SPI. */
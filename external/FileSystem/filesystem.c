@@ -38,6 +38,98 @@
  */
 #define LFS_BUFFER_SIZE				128
 
+/** @brief Cache size used by the cold data partition to speed up large reads.
+ */
+#define LFS_DATA_CACHE_SIZE			512
+
+/** @brief Number of flash sectors used by the hot log partition. The remaining sectors are used by the data partition.
+ */
+#define FILESYSTEM_LOG_SECTORS			256
+
+/** @brief User attribute which holds the checkpoint of a staged image.
+ */
+#define FILESYSTEM_STAGE_ATTRIBUTE		0x44
+
+/** @brief Number of full file blocks between two checkpoints of a staged image. A dropped transfer loses at most
+ *         this many blocks.
+ */
+#define FILESYSTEM_STAGE_CHECKPOINT_BLOCKS	4
+
+/** @brief Number of free blocks kept for metadata updates while an image is staged.
+ */
+#define FILESYSTEM_STAGE_SPARE_BLOCKS		4
+
+/** @brief Size of the RAM journal which collects small writes to the log partition while the flash memory is powered
+ *         down.
+ */
+#define FILESYSTEM_JOURNAL_SIZE			1024
+
+/** @brief Fill level of the journal in bytes which triggers a flush.
+ */
+#define FILESYSTEM_JOURNAL_FLUSH_SIZE		768
+
+/** @brief Age of the oldest journal record in ms which triggers a flush. Bounds the data loss window together with
+ *         the size of the journal.
+ */
+#define FILESYSTEM_JOURNAL_MAX_AGE		10000
+
+/** @brief SPI clock in kHz used for the energy estimate.
+ */
+#define FILESYSTEM_SPI_FREQ_KHZ			8000
+
+/** @brief Set to 1 to let the sector erases of LittleFS run in the background. The erase overlaps with the work of
+ *         LittleFS and of the application until the next flash operation, which waits for it.
+ */
+#define FILESYSTEM_BACKGROUND_ERASE		1
+
+/* The project fixes the geometry shared by both partitions at compile time. The cache, lookahead and block count
+   differ between the partitions and stay in the configuration. */
+#if(defined(LFS_STATIC_READ_SIZE) && (LFS_STATIC_READ_SIZE != LFS_BUFFER_SIZE))
+    #error "LFS_STATIC_READ_SIZE does not match the read size of the partitions!"
+#endif
+#if(defined(LFS_STATIC_PROG_SIZE) && (LFS_STATIC_PROG_SIZE != LFS_BUFFER_SIZE))
+    #error "LFS_STATIC_PROG_SIZE does not match the program size of the partitions!"
+#endif
+#if(defined(LFS_STATIC_BLOCK_SIZE) && (LFS_STATIC_BLOCK_SIZE != S25FL064L_SECTOR_SIZE))
+    #error "LFS_STATIC_BLOCK_SIZE does not match the sector size of the flash memory!"
+#endif
+#if(defined(LFS_STATIC_BLOCK_COUNT) || defined(LFS_STATIC_CACHE_SIZE) || defined(LFS_STATIC_LOOKAHEAD_SIZE))
+    #error "The partitions use different block counts, caches and lookahead sizes!"
+#endif
+#if(FILESYSTEM_STAGE_CACHE_SIZE != LFS_DATA_CACHE_SIZE)
+    #error "FILESYSTEM_STAGE_CACHE_SIZE does not match the cache size of the data partition!"
+#endif
+
+/** @brief Partition descriptor. Each partition is an offset/size bounded block device on the shared flash memory
+ *         with its own LittleFS instance and geometry.
+ */
+typedef struct
+{
+    uint32_t FirstSector;				/**< First flash sector used by the partition. */
+    uint32_t SectorCount;				/**< Number of flash sectors used by the partition. */
+    struct lfs_config Config;				/**< LittleFS configuration object of the partition. */
+    lfs_t FileSystem;					/**< LittleFS instance of the partition. */
+    bool isMounted;					/**< Partition is mounted. */
+} filesystem_partition_t;
+
+/** @brief Header of a journal record. The record data follows the header.
+ */
+typedef struct
+{
+    const char* p_Path;					/**< Path of the log file. */
+    uint16_t Length;					/**< Length of the record data. */
+} filesystem_journal_record_t;
+
+/** @brief Counters of flash memory operations used for the energy estimate.
+ */
+typedef struct
+{
+    uint32_t Read;					/**< Number of bytes read. */
+    uint32_t Programmed;				/**< Number of bytes programmed. */
+    uint32_t Pages;					/**< Number of page program operations. */
+    uint32_t Erases;					/**< Number of sector erase operations. */
+} filesystem_flash_counter_t;
+
 NRF_LOG_MODULE_REGISTER();
 
 /** @brief          Flash block read function.
@@ -51,6 +143,16 @@ NRF_LOG_MODULE_REGISTER();
  */
 static int Flash_Read(const struct lfs_config* p_Config, lfs_block_t Block, lfs_off_t Offset, void* p_Buffer, lfs_size_t Size);
 
+/** @brief          Flash vectored read function.
+ *                  Regions of blocks which follow each other on the flash memory are read with a single read command.
+ *  @param p_Config Pointer to LittleFS configuration object
+ *  @param p_IOV    Pointer to region list
+ *  @param Count    Number of regions
+ *  @return         0 when successful
+ *                  -1 when an error occurs
+ */
+static int Flash_ReadV(const struct lfs_config* p_Config, const struct lfs_iovec* p_IOV, lfs_size_t Count);
+
 /** @brief          Flash block write function.
  *  @param p_Config Pointer to LittleFS configuration object
  *  @param Block    Block number
@@ -69,6 +171,14 @@ static int Flash_Write(const struct lfs_config* p_Config, lfs_block_t Block, lfs
  */
 static int Flash_Erase(const struct lfs_config* p_Config, lfs_block_t Block);
 
+/** @brief          Flash block discard function.
+ *                  The sectors of the block are queued for an erase in the idle time.
+ *  @param p_Config Pointer to LittleFS configuration object
+ *  @param Block    Block number
+ *  @return         0 when successful
+ */
+static int Flash_Discard(const struct lfs_config* p_Config, lfs_block_t Block);
+
 /** @brief          Flash sync function.
  *  @param p_Config Pointer to LittleFS configuration object
  *  @return         0 when successful
@@ -89,30 +199,103 @@ static s25fl064_t Flash;
  */
 static nrf_drv_wdt_channel_id WDT_Channel_ID;
 
-/** @brief LittleFS file system configuration object.
+/** @brief Partition table of the flash memory.
+ *         The hot log partition uses an aggressive block cycle count to spread the wear caused by frequent metadata updates.
+ *         The cold data partition uses larger caches for large reads and allocates its blocks as one sequential log
+ *         across reboots. Compaction and allocator traversals of one partition never touch the blocks of the other
+ *         partition.
  */
-static struct lfs_config FileSystemConfig =
+static filesystem_partition_t Partitions[FILESYSTEM_PARTITION_COUNT] =
 {
-    .context = NULL,
+    [FILESYSTEM_PARTITION_LOG] =
+    {
+	.FirstSector = 0,
+	.SectorCount = FILESYSTEM_LOG_SECTORS,
+	.Config =
+	{
+	    .context = &Partitions[FILESYSTEM_PARTITION_LOG],
+
+	    .read = Flash_Read,
+	    .readv = Flash_ReadV,
+	    .prog = Flash_Write,
+	    .erase = Flash_Erase,
+	    .sync = Flash_Sync,
+	    .discard = Flash_Discard,
+
+	    .read_size = LFS_BUFFER_SIZE,
+	    .prog_size = LFS_BUFFER_SIZE,
+	    .cache_size = LFS_BUFFER_SIZE,
+	    .lookahead_size = LFS_BUFFER_SIZE,
+
+	    .block_size = S25FL064L_SECTOR_SIZE,
+	    .block_count = FILESYSTEM_LOG_SECTORS,
+	    .block_cycles = 100,
+	},
+    },
+    [FILESYSTEM_PARTITION_DATA] =
+    {
+	.FirstSector = FILESYSTEM_LOG_SECTORS,
+	.SectorCount = S25FL064L_SECTOR_COUNT - FILESYSTEM_LOG_SECTORS,
+	.Config =
+	{
+	    .context = &Partitions[FILESYSTEM_PARTITION_DATA],
+
+	    .read = Flash_Read,
+	    .readv = Flash_ReadV,
+	    .prog = Flash_Write,
+	    .erase = Flash_Erase,
+	    .sync = Flash_Sync,
+	    .discard = Flash_Discard,
+
+	    .read_size = LFS_BUFFER_SIZE,
+	    .prog_size = LFS_BUFFER_SIZE,
+	    .cache_size = LFS_DATA_CACHE_SIZE,
+	    .lookahead_size = (S25FL064L_SECTOR_COUNT - FILESYSTEM_LOG_SECTORS) / 8,
+
+	    .block_size = S25FL064L_SECTOR_SIZE,
+	    .block_count = S25FL064L_SECTOR_COUNT - FILESYSTEM_LOG_SECTORS,
+	    .block_cycles = 1000,
+
+	    .alloc_policy = LFS_ALLOC_SEQUENTIAL,
+	},
+    },
+};
 
-    .read = Flash_Read,
-    .prog = Flash_Write,
-    .erase = Flash_Erase,
-    .sync = Flash_Sync,
+/** @brief Power supply of the flash memory is enabled.
+ */
+static bool isFlashEnabled;
 
-    .read_size = LFS_BUFFER_SIZE,
-    .prog_size = LFS_BUFFER_SIZE,
-    .cache_size = LFS_BUFFER_SIZE,
-    .lookahead_size = LFS_BUFFER_SIZE,
+/** @brief Flash memory operations since the initialization.
+ */
+static filesystem_flash_counter_t Flash_Counter;
 
-    .block_size = S25FL064L_SECTOR_SIZE,
-    .block_count = S25FL064L_SECTOR_COUNT,
-    .block_cycles = 500,
-};
+/** @brief RAM journal for small writes to the log partition.
+ */
+static uint8_t Journal[FILESYSTEM_JOURNAL_SIZE];
 
-/** @brief
+/** @brief Number of used bytes in the journal.
+ */
+static uint32_t Journal_Used;
+
+/** @brief Time of the oldest record in the journal in ms.
+ */
+static uint32_t Journal_Time;
+
+/** @brief Journal statistics.
+ */
+static filesystem_journal_stats_t Journal_Stats;
+
+/** @brief Sectors which are erased and not programmed since, one bit per sector.
  */
-static lfs_t FileSystem;
+static uint32_t Sector_Erased[S25FL064L_SECTOR_COUNT / 32];
+
+/** @brief Sectors which are unused by LittleFS and wait for an erase in the idle time, one bit per sector.
+ */
+static uint32_t Sector_Discarded[S25FL064L_SECTOR_COUNT / 32];
+
+/** @brief Pre-erase statistics.
+ */
+static filesystem_discard_stats_t Discard_Stats;
 
 /** @brief
  */
@@ -190,9 +373,85 @@ static void Init_SPI(void)
     APP_ERROR_CHECK(nrf_drv_spi_init(&SPI_Master, &SPI_Config, NULL, NULL));
 }
 
+/** @brief          Get the flash address of a partition block.
+ *  @param p_Config Pointer to LittleFS configuration object of the partition
+ *  @param Block    Block number inside the partition
+ *  @return         Flash address of the block
+ */
+static uint32_t Partition_GetAddress(const struct lfs_config* p_Config, lfs_block_t Block)
+{
+    const filesystem_partition_t* p_Partition = (const filesystem_partition_t*)p_Config->context;
+
+    return (p_Partition->FirstSector * S25FL064L_SECTOR_SIZE) + (Block * p_Config->block_size);
+}
+
+/** @brief          Get the first flash sector of a partition block.
+ *  @param p_Config Pointer to LittleFS configuration object of the partition
+ *  @param Block    Block number inside the partition
+ *  @return         Flash sector
+ */
+static uint32_t Partition_GetSector(const struct lfs_config* p_Config, lfs_block_t Block)
+{
+    return Partition_GetAddress(p_Config, Block) / S25FL064L_SECTOR_SIZE;
+}
+
+/** @brief          Get the bit of a sector from a sector map.
+ *  @param p_Map    Pointer to sector map
+ *  @param Sector   Flash sector
+ *  @return         #true when the bit is set
+ */
+static inline bool Sector_Get(const uint32_t* p_Map, uint32_t Sector)
+{
+    return (p_Map[Sector / 32] & (0x01UL << (Sector % 32))) != 0;
+}
+
+/** @brief          Set or clear the bit of a sector in a sector map.
+ *  @param p_Map    Pointer to sector map
+ *  @param Sector   Flash sector
+ *  @param Value    New value of the bit
+ */
+static inline void Sector_Set(uint32_t* p_Map, uint32_t Sector, bool Value)
+{
+    if(Value)
+    {
+	p_Map[Sector / 32] |= (0x01UL << (Sector % 32));
+    }
+    else
+    {
+	p_Map[Sector / 32] &= ~(0x01UL << (Sector % 32));
+    }
+}
+
 int Flash_Read(const struct lfs_config* p_Config, lfs_block_t Block, lfs_off_t Offset, void* p_Buffer, lfs_size_t Size)
 {
-    if(S25FL064L_Read(&Flash, (Block * p_Config->block_size) + Offset, p_Buffer, Size) != S25FL064_NO_ERROR)
+    Flash_Counter.Read += Size;
+
+    if(S25FL064L_Read(&Flash, Partition_GetAddress(p_Config, Block) + Offset, p_Buffer, Size) != S25FL064_NO_ERROR)
+    {
+	return -1;
+    }
+
+    return 0;
+}
+
+int Flash_ReadV(const struct lfs_config* p_Config, const struct lfs_iovec* p_IOV, lfs_size_t Count)
+{
+    s25fl064_segment_t Segments[LFS_READV_MAX];
+
+    if(Count > LFS_READV_MAX)
+    {
+	return -1;
+    }
+
+    for(lfs_size_t i = 0; i < Count; i++)
+    {
+	Segments[i].Address = Partition_GetAddress(p_Config, p_IOV[i].block) + p_IOV[i].off;
+	Segments[i].p_Buffer = p_IOV[i].buffer;
+	Segments[i].Length = p_IOV[i].size;
+	Flash_Counter.Read += p_IOV[i].size;
+    }
+
+    if(S25FL064L_ReadSegments(&Flash, Segments, Count) != S25FL064_NO_ERROR)
     {
 	return -1;
     }
@@ -202,7 +461,20 @@ int Flash_Read(const struct lfs_config* p_Config, lfs_block_t Block, lfs_off_t O
 
 int Flash_Write(const struct lfs_config* p_Config, lfs_block_t Block, lfs_off_t Offset, const void* p_Buffer, lfs_size_t Size)
 {
-    if(S25FL064L_Write(&Flash, (Block * p_Config->block_size) + Offset, p_Buffer, Size) != S25FL064_NO_ERROR)
+    uint32_t Address = Partition_GetAddress(p_Config, Block) + Offset;
+
+    // NOTE: The driver programs each page of the flash memory with a single command.
+    Flash_Counter.Programmed += Size;
+    Flash_Counter.Pages += ((Address + Size - 1) / S25FL064L_PAGE_SIZE) - (Address / S25FL064L_PAGE_SIZE) + 1;
+
+    // The sectors are in use again and must not be erased by the idle pre-erase
+    for(uint32_t Sector = Address / S25FL064L_SECTOR_SIZE; Sector <= ((Address + Size - 1) / S25FL064L_SECTOR_SIZE); Sector++)
+    {
+	Sector_Set(Sector_Erased, Sector, false);
+	Sector_Set(Sector_Discarded, Sector, false);
+    }
+
+    if(S25FL064L_Write(&Flash, Address, p_Buffer, Size) != S25FL064_NO_ERROR)
     {
 	return -1;
     }
@@ -212,9 +484,46 @@ int Flash_Write(const struct lfs_config* p_Config, lfs_block_t Block, lfs_off_t
 
 int Flash_Erase(const struct lfs_config* p_Config, lfs_block_t Block)
 {
-    if(S25FL064L_EraseSector(&Flash, Block * p_Config->block_size) != S25FL064_NO_ERROR)
+    // NOTE: A partition block can span several flash sectors.
+    for(uint32_t Sector = Partition_GetSector(p_Config, Block); Sector < Partition_GetSector(p_Config, Block + 1); Sector++)
     {
-	return -1;
+	Sector_Set(Sector_Discarded, Sector, false);
+
+	// Sectors erased in the idle time are still erased when nothing was programmed since
+	if(Sector_Get(Sector_Erased, Sector))
+	{
+	    Discard_Stats.Skipped++;
+
+	    continue;
+	}
+
+	Flash_Counter.Erases++;
+
+#if(FILESYSTEM_BACKGROUND_ERASE == 1)
+	if(S25FL064L_EraseSectorStart(&Flash, Sector * S25FL064L_SECTOR_SIZE) != S25FL064_NO_ERROR)
+#else
+	if(S25FL064L_EraseSector(&Flash, Sector * S25FL064L_SECTOR_SIZE) != S25FL064_NO_ERROR)
+#endif
+	{
+	    return -1;
+	}
+
+	Sector_Set(Sector_Erased, Sector, true);
+    }
+
+    return 0;
+}
+
+int Flash_Discard(const struct lfs_config* p_Config, lfs_block_t Block)
+{
+    // NOTE: LittleFS reports a free block again on every scan until the block is allocated.
+    for(uint32_t Sector = Partition_GetSector(p_Config, Block); Sector < Partition_GetSector(p_Config, Block + 1); Sector++)
+    {
+	if((Sector_Get(Sector_Erased, Sector) == false) && (Sector_Get(Sector_Discarded, Sector) == false))
+	{
+	    Sector_Set(Sector_Discarded, Sector, true);
+	    Discard_Stats.Discarded++;
+	}
     }
 
     return 0;
@@ -262,21 +571,109 @@ ret_code_t FileSystem_Init(bool EraseChip, nrf_drv_wdt_channel_id Watchdog)
     NRF_LOG_DEBUG("	MID: 0x%x", Flash.MID);
     NRF_LOG_DEBUG("	DID: 0x%x", Flash.DID);
 
+    // Check the partition table
+    for(uint32_t i = 0; i < FILESYSTEM_PARTITION_COUNT; i++)
+    {
+	const filesystem_partition_t* p_Partition = &Partitions[i];
+
+	if(((p_Partition->Config.block_size % S25FL064L_SECTOR_SIZE) != 0) ||
+	   ((p_Partition->Config.block_count * p_Partition->Config.block_size) != (p_Partition->SectorCount * S25FL064L_SECTOR_SIZE)) ||
+	   ((p_Partition->FirstSector + p_Partition->SectorCount) > S25FL064L_SECTOR_COUNT) ||
+	   ((i > 0) && (p_Partition->FirstSector < (Partitions[i - 1].FirstSector + Partitions[i - 1].SectorCount))))
+	{
+	    NRF_LOG_ERROR("	Invalid partition %u!", i);
+
+	    return NRF_ERROR_INVALID_PARAM;
+	}
+
+	NRF_LOG_DEBUG("	Partition %u: Sector %u - %u", i, p_Partition->FirstSector, p_Partition->FirstSector + p_Partition->SectorCount - 1);
+    }
+
     return NRF_SUCCESS;
 }
 
-ret_code_t FileSystem_Deinit(void)
+ret_code_t FileSystem_Mount(filesystem_partition_id_t Partition, bool Format)
+{
+    filesystem_partition_t* p_Partition;
+
+    if(Partition >= FILESYSTEM_PARTITION_COUNT)
+    {
+	return NRF_ERROR_INVALID_PARAM;
+    }
+
+    p_Partition = &Partitions[Partition];
+    if(p_Partition->isMounted)
+    {
+	return NRF_SUCCESS;
+    }
+
+    if(lfs_mount(&p_Partition->FileSystem, &p_Partition->Config))
+    {
+	if((Format == false) || lfs_format(&p_Partition->FileSystem, &p_Partition->Config) ||
+	   lfs_mount(&p_Partition->FileSystem, &p_Partition->Config))
+	{
+	    NRF_LOG_ERROR("	Can not mount partition %u!", Partition);
+
+	    return NRF_ERROR_NO_MEM;
+	}
+    }
+
+    p_Partition->isMounted = true;
+
+    return NRF_SUCCESS;
+}
+
+ret_code_t FileSystem_Unmount(filesystem_partition_id_t Partition)
 {
-    if(lfs_file_close(&FileSystem, &File))
+    filesystem_partition_t* p_Partition;
+
+    if(Partition >= FILESYSTEM_PARTITION_COUNT)
+    {
+	return NRF_ERROR_INVALID_PARAM;
+    }
+
+    p_Partition = &Partitions[Partition];
+    if(p_Partition->isMounted == false)
+    {
+	return NRF_SUCCESS;
+    }
+
+    // Pending journal records belong to the log partition
+    if((Partition == FILESYSTEM_PARTITION_LOG) && FileSystem_JournalFlush())
     {
 	return NRF_ERROR_NO_MEM;
     }
 
-    if(lfs_unmount(&FileSystem))
+    if(lfs_unmount(&p_Partition->FileSystem))
     {
 	return NRF_ERROR_NO_MEM;
     }
 
+    p_Partition->isMounted = false;
+
+    return NRF_SUCCESS;
+}
+
+lfs_t* FileSystem_GetPartition(filesystem_partition_id_t Partition)
+{
+    if((Partition >= FILESYSTEM_PARTITION_COUNT) || (Partitions[Partition].isMounted == false))
+    {
+	return NULL;
+    }
+
+    return &Partitions[Partition].FileSystem;
+}
+
+ret_code_t FileSystem_Deinit(void)
+{
+    for(uint32_t i = 0; i < FILESYSTEM_PARTITION_COUNT; i++)
+    {
+	if(FileSystem_Unmount((filesystem_partition_id_t)i))
+	{
+	    return NRF_ERROR_NO_MEM;
+	}
+    }
+
     if(S25FL064L_EnterPowerDown(&Flash))
     {
 	return NRF_ERROR_NO_MEM;
@@ -289,6 +686,14 @@ ret_code_t FileSystem_Deinit(void)
 
 void FileSystem_EnableFlash(bool Enable)
 {
+    // Do not cut the supply during an erase in the background
+    if((Enable == false) && isFlashEnabled && Flash.isBusy)
+    {
+	S25FL064L_Wait(&Flash);
+    }
+
+    isFlashEnabled = Enable;
+
     if(Enable)
     {
         nrf_gpio_pin_clear(FLASH_ENABLE);
@@ -299,6 +704,576 @@ void FileSystem_EnableFlash(bool Enable)
     }
 }
 
+/** @brief          Get the number of data bytes a file block can hold.
+ *                  Each block of a file, except the first one, starts with the pointers of the file's skip-list.
+ *  @param p_Config Pointer to LittleFS configuration object of the partition
+ *  @param Block    Index of the block inside the file
+ *  @return         Number of data bytes
+ */
+static uint32_t Stage_GetBlockRoom(const struct lfs_config* p_Config, uint32_t Block)
+{
+    if(Block == 0)
+    {
+	return p_Config->block_size;
+    }
+
+    return p_Config->block_size - (4 * (lfs_ctz(Block) + 1));
+}
+
+/** @brief          Check that the rest of a staged image fits into the partition.
+ *  @param p_Stage  Pointer to writer object
+ *  @return         #NRF_SUCCESS when successful
+ */
+static ret_code_t Stage_Reserve(filesystem_stage_t* p_Stage)
+{
+    uint32_t Blocks = 0;
+    const struct lfs_config* p_Config = &Partitions[FILESYSTEM_PARTITION_DATA].Config;
+    lfs_ssize_t Used = lfs_fs_size(&Partitions[FILESYSTEM_PARTITION_DATA].FileSystem);
+    uint32_t Remaining = p_Stage->Current.Size - p_Stage->Current.Offset;
+
+    if(Used < 0)
+    {
+	return NRF_ERROR_NO_MEM;
+    }
+
+    // The current block is already allocated
+    if(Remaining > p_Stage->Current.Room)
+    {
+	Remaining -= p_Stage->Current.Room;
+
+	for(uint32_t Block = p_Stage->Current.Block + 1; Remaining > 0; Block++)
+	{
+	    Remaining -= MIN(Remaining, Stage_GetBlockRoom(p_Config, Block));
+	    Blocks++;
+	}
+    }
+
+    if((Blocks + FILESYSTEM_STAGE_SPARE_BLOCKS) > (p_Config->block_count - (uint32_t)Used))
+    {
+	NRF_LOG_ERROR("	Image needs %u blocks, %u blocks are free!", Blocks, p_Config->block_count - (uint32_t)Used);
+
+	return NRF_ERROR_NO_MEM;
+    }
+
+    return NRF_SUCCESS;
+}
+
+/** @brief          Store the state of a staged image as checkpoint.
+ *                  The checkpoint is committed together with the file contents.
+ *  @param p_Stage  Pointer to writer object
+ *  @return         #NRF_SUCCESS when successful
+ */
+static ret_code_t Stage_Checkpoint(filesystem_stage_t* p_Stage)
+{
+    p_Stage->Checkpoint = p_Stage->Current;
+
+    if(lfs_file_sync(&Partitions[FILESYSTEM_PARTITION_DATA].FileSystem, &p_Stage->File))
+    {
+	return NRF_ERROR_NO_MEM;
+    }
+
+    return NRF_SUCCESS;
+}
+
+ret_code_t FileSystem_StageOpen(filesystem_stage_t* p_Stage, const char* p_Path, uint32_t Size)
+{
+    lfs_soff_t FileSize;
+    ret_code_t Error;
+    lfs_t* p_FileSystem = FileSystem_GetPartition(FILESYSTEM_PARTITION_DATA);
+
+    if((p_Stage == NULL) || (p_Path == NULL) || (Size == 0))
+    {
+	return NRF_ERROR_INVALID_PARAM;
+    }
+    else if(p_FileSystem == NULL)
+    {
+	return NRF_ERROR_INVALID_STATE;
+    }
+
+    memset(&p_Stage->Checkpoint, 0, sizeof(p_Stage->Checkpoint));
+    p_Stage->Attribute.type = FILESYSTEM_STAGE_ATTRIBUTE;
+    p_Stage->Attribute.buffer = &p_Stage->Checkpoint;
+    p_Stage->Attribute.size = sizeof(p_Stage->Checkpoint);
+    p_Stage->Config.buffer = p_Stage->Cache;
+    p_Stage->Config.attrs = &p_Stage->Attribute;
+    p_Stage->Config.attr_count = 1;
+
+    // NOTE: The checkpoint is read from the flash memory when the file is opened.
+    if(lfs_file_opencfg(p_FileSystem, &p_Stage->File, p_Path, LFS_O_RDWR | LFS_O_CREAT, &p_Stage->Config))
+    {
+	return NRF_ERROR_NO_MEM;
+    }
+
+    // A checkpoint which belongs to the same image and matches the file contents is resumed without reading the image
+    FileSize = lfs_file_size(p_FileSystem, &p_Stage->File);
+    if((p_Stage->Checkpoint.Size != Size) || (p_Stage->Checkpoint.Offset > Size) || (FileSize < 0) ||
+       ((uint32_t)FileSize != p_Stage->Checkpoint.Offset))
+    {
+	NRF_LOG_INFO("Start staging of %u bytes...", Size);
+
+	p_Stage->Checkpoint.Size = Size;
+	p_Stage->Checkpoint.Offset = 0;
+	p_Stage->Checkpoint.CRC = 0xFFFFFFFF;
+	p_Stage->Checkpoint.Block = 0;
+	p_Stage->Checkpoint.Room = Stage_GetBlockRoom(&Partitions[FILESYSTEM_PARTITION_DATA].Config, 0);
+
+	if(lfs_file_truncate(p_FileSystem, &p_Stage->File, 0))
+	{
+	    lfs_file_close(p_FileSystem, &p_Stage->File);
+
+	    return NRF_ERROR_NO_MEM;
+	}
+    }
+    else
+    {
+	NRF_LOG_INFO("Resume staging at %u / %u bytes...", p_Stage->Checkpoint.Offset, Size);
+    }
+
+    p_Stage->Current = p_Stage->Checkpoint;
+
+    if(lfs_file_seek(p_FileSystem, &p_Stage->File, p_Stage->Current.Offset, LFS_SEEK_SET) < 0)
+    {
+	lfs_file_close(p_FileSystem, &p_Stage->File);
+
+	return NRF_ERROR_NO_MEM;
+    }
+
+    Error = Stage_Reserve(p_Stage);
+    if(Error)
+    {
+	lfs_file_close(p_FileSystem, &p_Stage->File);
+
+	return Error;
+    }
+
+    p_Stage->p_Path = p_Path;
+    p_Stage->isOpen = true;
+
+    return NRF_SUCCESS;
+}
+
+uint32_t FileSystem_StageGetOffset(const filesystem_stage_t* p_Stage)
+{
+    if((p_Stage == NULL) || (p_Stage->isOpen == false))
+    {
+	return 0;
+    }
+
+    return p_Stage->Current.Offset;
+}
+
+ret_code_t FileSystem_StageWrite(filesystem_stage_t* p_Stage, const void* p_Data, uint32_t Length)
+{
+    ret_code_t Error;
+    const uint8_t* p_Bytes = (const uint8_t*)p_Data;
+    const struct lfs_config* p_Config = &Partitions[FILESYSTEM_PARTITION_DATA].Config;
+    lfs_t* p_FileSystem = FileSystem_GetPartition(FILESYSTEM_PARTITION_DATA);
+
+    if((p_Stage == NULL) || ((p_Data == NULL) && (Length > 0)))
+    {
+	return NRF_ERROR_INVALID_PARAM;
+    }
+    else if((p_Stage->isOpen == false) || (p_FileSystem == NULL))
+    {
+	return NRF_ERROR_INVALID_STATE;
+    }
+    else if(Length > (p_Stage->Current.Size - p_Stage->Current.Offset))
+    {
+	return NRF_ERROR_INVALID_LENGTH;
+    }
+
+    while(Length > 0)
+    {
+	// NOTE: A write never crosses the end of a block, so a checkpoint can be placed right behind a full block. The
+	//       next write starts a new block instead of copying a partially written one.
+	uint32_t Chunk = MIN(Length, p_Stage->Current.Room);
+
+	if(lfs_file_write(p_FileSystem, &p_Stage->File, p_Bytes, Chunk) != (lfs_ssize_t)Chunk)
+	{
+	    return NRF_ERROR_NO_MEM;
+	}
+
+	p_Stage->Current.CRC = lfs_crc(p_Stage->Current.CRC, p_Bytes, Chunk);
+	p_Stage->Current.Offset += Chunk;
+	p_Stage->Current.Room -= Chunk;
+	p_Bytes += Chunk;
+	Length -= Chunk;
+
+	if(p_Stage->Current.Room == 0)
+	{
+	    p_Stage->Current.Block++;
+	    p_Stage->Current.Room = Stage_GetBlockRoom(p_Config, p_Stage->Current.Block);
+
+	    if((p_Stage->Current.Block - p_Stage->Checkpoint.Block) >= FILESYSTEM_STAGE_CHECKPOINT_BLOCKS)
+	    {
+		Error = Stage_Checkpoint(p_Stage);
+		if(Error)
+		{
+		    return Error;
+		}
+	    }
+	}
+    }
+
+    return NRF_SUCCESS;
+}
+
+ret_code_t FileSystem_StageFinish(filesystem_stage_t* p_Stage, uint32_t CRC)
+{
+    if(p_Stage == NULL)
+    {
+	return NRF_ERROR_INVALID_PARAM;
+    }
+    else if(p_Stage->isOpen == false)
+    {
+	return NRF_ERROR_INVALID_STATE;
+    }
+    else if(p_Stage->Current.Offset != p_Stage->Current.Size)
+    {
+	return NRF_ERROR_INVALID_LENGTH;
+    }
+
+    // The running CRC covers every staged byte, so the image is verified without reading it back
+    if((p_Stage->Current.CRC ^ 0xFFFFFFFF) != CRC)
+    {
+	NRF_LOG_ERROR("Invalid image! Expected CRC 0x%x - Staged 0x%x", CRC, p_Stage->Current.CRC ^ 0xFFFFFFFF);
+	FileSystem_StageClose(p_Stage, true);
+
+	return NRF_ERROR_INVALID_DATA;
+    }
+
+    return FileSystem_StageClose(p_Stage, false);
+}
+
+ret_code_t FileSystem_StageClose(filesystem_stage_t* p_Stage, bool Discard)
+{
+    lfs_t* p_FileSystem = FileSystem_GetPartition(FILESYSTEM_PARTITION_DATA);
+
+    if(p_Stage == NULL)
+    {
+	return NRF_ERROR_INVALID_PARAM;
+    }
+    else if((p_Stage->isOpen == false) || (p_FileSystem == NULL))
+    {
+	return NRF_ERROR_INVALID_STATE;
+    }
+
+    p_Stage->isOpen = false;
+
+    // Keep everything written so far for a later resume
+    p_Stage->Checkpoint = p_Stage->Current;
+    if(lfs_file_close(p_FileSystem, &p_Stage->File))
+    {
+	return NRF_ERROR_NO_MEM;
+    }
+
+    if(Discard && lfs_remove(p_FileSystem, p_Stage->p_Path))
+    {
+	return NRF_ERROR_NO_MEM;
+    }
+
+    return NRF_SUCCESS;
+}
+
+/** @brief		Estimate the energy the flash memory needs for a number of operations.
+ *  @param p_Counter	Pointer to operation counters
+ *  @param PowerUp	The flash memory was powered up for the operations
+ *  @return		Energy in nJ
+ */
+static uint64_t Journal_GetEnergy(const filesystem_flash_counter_t* p_Counter, bool PowerUp)
+{
+    uint64_t Charge;
+    uint32_t Active = (((p_Counter->Read + p_Counter->Programmed) * 8 * 1000) / FILESYSTEM_SPI_FREQ_KHZ) + S25FL064L_TIME_RES_US;
+
+    if(PowerUp)
+    {
+	Active += S25FL064L_TIME_PU_US;
+    }
+
+    // uA * us * mV = fJ
+    Charge = (uint64_t)S25FL064L_CURRENT_READ_UA * Active;
+    Charge += (uint64_t)S25FL064L_CURRENT_PROG_UA * S25FL064L_TIME_PP_US * p_Counter->Pages;
+    Charge += (uint64_t)S25FL064L_CURRENT_ERASE_UA * S25FL064L_TIME_SE_US * p_Counter->Erases;
+
+    return (Charge * S25FL064L_SUPPLY_MV) / 1000000;
+}
+
+/** @brief		Write all journal records of a log file, starting with a given record.
+ *  @param p_FileSystem	Pointer to LittleFS object of the log partition
+ *  @param Start	Offset of the first record of the log file in the journal
+ *  @return		#NRF_SUCCESS when successful
+ */
+static ret_code_t Journal_WriteFile(lfs_t* p_FileSystem, uint32_t Start)
+{
+    lfs_file_t LogFile;
+    filesystem_journal_record_t First;
+    filesystem_journal_record_t Record;
+    ret_code_t Error = NRF_SUCCESS;
+
+    memcpy(&First, &Journal[Start], sizeof(First));
+
+    if(lfs_file_open(p_FileSystem, &LogFile, First.p_Path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND))
+    {
+	return NRF_ERROR_NO_MEM;
+    }
+
+    // The records of a file keep their order, records of other files are skipped
+    for(uint32_t Offset = Start; Offset < Journal_Used; Offset += sizeof(Record) + Record.Length)
+    {
+	memcpy(&Record, &Journal[Offset], sizeof(Record));
+
+	if(strcmp(Record.p_Path, First.p_Path))
+	{
+	    continue;
+	}
+
+	if(lfs_file_write(p_FileSystem, &LogFile, &Journal[Offset + sizeof(Record)], Record.Length) != Record.Length)
+	{
+	    Error = NRF_ERROR_NO_MEM;
+	    break;
+	}
+    }
+
+    if(lfs_file_close(p_FileSystem, &LogFile))
+    {
+	Error = NRF_ERROR_NO_MEM;
+    }
+
+    return Error;
+}
+
+/** @brief		Check if a log file has a record in front of a given journal record.
+ *  @param Offset	Offset of the journal record
+ *  @return		true when the file was already written with an earlier record
+ */
+static bool Journal_IsWritten(uint32_t Offset)
+{
+    filesystem_journal_record_t Record;
+    filesystem_journal_record_t Current;
+
+    memcpy(&Current, &Journal[Offset], sizeof(Current));
+
+    for(uint32_t i = 0; i < Offset; i += sizeof(Record) + Record.Length)
+    {
+	memcpy(&Record, &Journal[i], sizeof(Record));
+
+	if(strcmp(Record.p_Path, Current.p_Path) == 0)
+	{
+	    return true;
+	}
+    }
+
+    return false;
+}
+
+ret_code_t FileSystem_JournalFlush(void)
+{
+    filesystem_journal_record_t Record;
+    filesystem_flash_counter_t Start = Flash_Counter;
+    filesystem_flash_counter_t Used;
+    ret_code_t Error = NRF_SUCCESS;
+    bool PowerUp = (isFlashEnabled == false);
+    bool PowerDown = Flash.isPowerDown;
+    lfs_t* p_FileSystem = FileSystem_GetPartition(FILESYSTEM_PARTITION_LOG);
+
+    if(Journal_Used == 0)
+    {
+	return NRF_SUCCESS;
+    }
+    else if(p_FileSystem == NULL)
+    {
+	return NRF_ERROR_INVALID_STATE;
+    }
+
+    // All records are written in a single burst of the flash memory
+    if(PowerUp)
+    {
+	FileSystem_EnableFlash(true);
+	nrf_delay_us(S25FL064L_TIME_PU_US);
+    }
+
+    if(PowerDown && S25FL064L_LeavePowerDown(&Flash))
+    {
+	Error = NRF_ERROR_NO_MEM;
+    }
+
+    // Each log file is opened only once per flush
+    for(uint32_t Offset = 0; (Error == NRF_SUCCESS) && (Offset < Journal_Used); Offset += sizeof(Record) + Record.Length)
+    {
+	memcpy(&Record, &Journal[Offset], sizeof(Record));
+
+	if(Journal_IsWritten(Offset) == false)
+	{
+	    Error = Journal_WriteFile(p_FileSystem, Offset);
+	}
+    }
+
+    // Restore the previous power state of the flash memory
+    if(PowerUp || PowerDown)
+    {
+	S25FL064L_EnterPowerDown(&Flash);
+    }
+
+    if(PowerUp)
+    {
+	FileSystem_EnableFlash(false);
+    }
+
+    Used.Read = Flash_Counter.Read - Start.Read;
+    Used.Programmed = Flash_Counter.Programmed - Start.Programmed;
+    Used.Pages = Flash_Counter.Pages - Start.Pages;
+    Used.Erases = Flash_Counter.Erases - Start.Erases;
+
+    Journal_Stats.Flushes++;
+    Journal_Stats.Programmed += Used.Programmed;
+    Journal_Stats.Erases += Used.Erases;
+    Journal_Stats.Energy += Journal_GetEnergy(&Used, PowerUp);
+
+    // NOTE: The records are dropped on an error, because a partially written journal can't be repeated without
+    //       duplicating records.
+    Journal_Used = 0;
+
+    if(Error)
+    {
+	NRF_LOG_ERROR("	Can not flush the journal!");
+    }
+
+    return Error;
+}
+
+ret_code_t FileSystem_JournalWrite(const char* p_Path, const void* p_Data, uint16_t Length, bool Urgent, uint32_t Time)
+{
+    ret_code_t Error;
+    filesystem_journal_record_t Record =
+    {
+	.p_Path = p_Path,
+	.Length = Length,
+    };
+
+    if((p_Path == NULL) || ((p_Data == NULL) && (Length > 0)))
+    {
+	return NRF_ERROR_INVALID_PARAM;
+    }
+    else if((sizeof(Record) + Length) > FILESYSTEM_JOURNAL_SIZE)
+    {
+	return NRF_ERROR_INVALID_LENGTH;
+    }
+    else if(FileSystem_GetPartition(FILESYSTEM_PARTITION_LOG) == NULL)
+    {
+	return NRF_ERROR_INVALID_STATE;
+    }
+
+    // Make room for the record
+    if((Journal_Used + sizeof(Record) + Length) > FILESYSTEM_JOURNAL_SIZE)
+    {
+	Error = FileSystem_JournalFlush();
+	if(Error)
+	{
+	    return Error;
+	}
+    }
+
+    if(Journal_Used == 0)
+    {
+	Journal_Time = Time;
+    }
+
+    memcpy(&Journal[Journal_Used], &Record, sizeof(Record));
+    memcpy(&Journal[Journal_Used + sizeof(Record)], p_Data, Length);
+    Journal_Used += sizeof(Record) + Length;
+    Journal_Stats.Bytes += Length;
+    Journal_Stats.Records++;
+
+    if(Urgent || (Journal_Used >= FILESYSTEM_JOURNAL_FLUSH_SIZE))
+    {
+	return FileSystem_JournalFlush();
+    }
+
+    return FileSystem_JournalPoll(Time);
+}
+
+ret_code_t FileSystem_JournalPoll(uint32_t Time)
+{
+    if((Journal_Used > 0) && ((Time - Journal_Time) >= FILESYSTEM_JOURNAL_MAX_AGE))
+    {
+	return FileSystem_JournalFlush();
+    }
+
+    return NRF_SUCCESS;
+}
+
+void FileSystem_JournalGetStats(filesystem_journal_stats_t* p_Stats)
+{
+    if(p_Stats == NULL)
+    {
+	return;
+    }
+
+    *p_Stats = Journal_Stats;
+}
+
+ret_code_t FileSystem_DiscardPoll(uint32_t Budget)
+{
+    bool Busy;
+
+    if((isFlashEnabled == false) || Flash.isPowerDown)
+    {
+	return NRF_SUCCESS;
+    }
+
+    // Come back later when the last erase still runs
+    if(S25FL064L_Poll(&Flash, &Busy) != S25FL064_NO_ERROR)
+    {
+	return NRF_ERROR_NO_MEM;
+    }
+    else if(Busy)
+    {
+	return NRF_SUCCESS;
+    }
+
+    // Let LittleFS look for unused blocks ahead of its allocator
+    for(uint32_t i = 0; i < FILESYSTEM_PARTITION_COUNT; i++)
+    {
+	if(Partitions[i].isMounted && lfs_fs_gc(&Partitions[i].FileSystem))
+	{
+	    return NRF_ERROR_NO_MEM;
+	}
+    }
+
+    for(uint32_t Word = 0; (Word < (S25FL064L_SECTOR_COUNT / 32)) && (Budget > 0); Word++)
+    {
+	while((Sector_Discarded[Word] != 0) && (Budget > 0))
+	{
+	    uint32_t Sector = (Word * 32) + lfs_ctz(Sector_Discarded[Word]);
+
+	    Flash_Counter.Erases++;
+
+	    // NOTE: The last erase is left running in the background.
+	    if(S25FL064L_EraseSectorStart(&Flash, Sector * S25FL064L_SECTOR_SIZE) != S25FL064_NO_ERROR)
+	    {
+		return NRF_ERROR_NO_MEM;
+	    }
+
+	    Sector_Set(Sector_Discarded, Sector, false);
+	    Sector_Set(Sector_Erased, Sector, true);
+	    Discard_Stats.Erased++;
+	    Budget--;
+	}
+    }
+
+    return NRF_SUCCESS;
+}
+
+void FileSystem_DiscardGetStats(filesystem_discard_stats_t* p_Stats)
+{
+    if(p_Stats == NULL)
+    {
+	return;
+    }
+
+    *p_Stats = Discard_Stats;
+}
+
 ret_code_t FileSystem_WriteTestFile(void)
 {
     int FileError;
@@ -306,13 +1281,19 @@ ret_code_t FileSystem_WriteTestFile(void)
     lfs_ssize_t BytesOut;
     char Test_Out[] = "Hello, World!";
     char Test_In[sizeof(Test_Out)];
+    lfs_t* p_FileSystem;
 
-    FileError = lfs_mount(&FileSystem, &FileSystemConfig);
-    FileError = lfs_file_open(&FileSystem, &File, "test.txt", LFS_O_RDWR | LFS_O_CREAT);
-    BytesIn = lfs_file_write(&FileSystem, &File, Test_Out, sizeof(Test_Out));
-    lfs_file_seek(&FileSystem, &File, 0, LFS_SEEK_SET);
-    BytesOut = lfs_file_read(&FileSystem, &File, Test_In, sizeof(Test_In));
-    FileError = lfs_file_close(&FileSystem, &File);
+    if(FileSystem_Mount(FILESYSTEM_PARTITION_DATA, false))
+    {
+	return NRF_ERROR_NO_MEM;
+    }
+
+    p_FileSystem = FileSystem_GetPartition(FILESYSTEM_PARTITION_DATA);
+    FileError = lfs_file_open(p_FileSystem, &File, "test.txt", LFS_O_RDWR | LFS_O_CREAT);
+    BytesIn = lfs_file_write(p_FileSystem, &File, Test_Out, sizeof(Test_Out));
+    lfs_file_seek(p_FileSystem, &File, 0, LFS_SEEK_SET);
+    BytesOut = lfs_file_read(p_FileSystem, &File, Test_In, sizeof(Test_In));
+    FileError = lfs_file_close(p_FileSystem, &File);
 
     if((FileError < 0) || (BytesIn != BytesOut))
     {
@@ -331,6 +1312,8 @@ ret_code_t FileSystem_MemTest(void)
     ret_code_t Error = NRF_SUCCESS;
     uint8_t Buffer_Out[Flash.BlockSize];
     uint8_t Buffer_In[Flash.BlockSize];
+    filesystem_partition_t* p_Partition = &Partitions[FILESYSTEM_PARTITION_DATA];
+    lfs_t* p_FileSystem = &p_Partition->FileSystem;
 
     if(nrf_drv_rng_init(NULL))
     {
@@ -338,15 +1321,16 @@ ret_code_t FileSystem_MemTest(void)
     }
 
     NRF_LOG_INFO("Format and mount file system...");
-    if(lfs_format(&FileSystem, &FileSystemConfig) || lfs_mount(&FileSystem, &FileSystemConfig))
+    if(FileSystem_Unmount(FILESYSTEM_PARTITION_DATA) || lfs_format(p_FileSystem, &p_Partition->Config) ||
+       FileSystem_Mount(FILESYSTEM_PARTITION_DATA, false))
     {
 	NRF_LOG_ERROR(" Can not mount flash memory. Abort!");
 
 	return NRF_ERROR_NO_MEM;
     }
-    NRF_LOG_INFO(" Size: %u blocks", lfs_fs_size(&FileSystem));
+    NRF_LOG_INFO(" Size: %u blocks", lfs_fs_size(p_FileSystem));
 
-    for(uint32_t Cycle = 0; Cycle < lfs_fs_size(&FileSystem); Cycle++)
+    for(uint32_t Cycle = 0; Cycle < lfs_fs_size(p_FileSystem); Cycle++)
     {
 	NRF_LOG_INFO("Cycle %u...", Cycle + 1);
 
@@ -354,31 +1338,31 @@ ret_code_t FileSystem_MemTest(void)
 	nrf_drv_rng_block_rand(Buffer_Out, sizeof(Buffer_Out));
 
 	NRF_LOG_INFO("Write %u bytes...", sizeof(Buffer_Out));
-	FileError = lfs_file_open(&FileSystem, &File, "memtest", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
-	BytesWritten = lfs_file_write(&FileSystem, &File, Buffer_Out, sizeof(Buffer_Out));
+	FileError = lfs_file_open(p_FileSystem, &File, "memtest", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+	BytesWritten = lfs_file_write(p_FileSystem, &File, Buffer_Out, sizeof(Buffer_Out));
 	if((FileError < 0) || (BytesWritten != sizeof(Buffer_Out)))
 	{
 	    NRF_LOG_ERROR(" Can not write buffer into file!");
-	    lfs_file_close(&FileSystem, &File);
+	    lfs_file_close(p_FileSystem, &File);
 	    Error = NRF_ERROR_NO_MEM;
 
 	    goto FileSystem_MemTest_Fail;
 	}
-	FileError = lfs_file_close(&FileSystem, &File);
+	FileError = lfs_file_close(p_FileSystem, &File);
 
 	NRF_LOG_INFO("Reading %u bytes...", sizeof(Buffer_In));
-	FileError = lfs_file_open(&FileSystem, &File, "memtest", LFS_O_RDONLY) ||
-                    lfs_file_seek(&FileSystem, &File, Cycle * sizeof(Buffer_In), LFS_SEEK_SET);
-        BytesRead = lfs_file_read(&FileSystem, &File, Buffer_In, sizeof(Buffer_In));
+	FileError = lfs_file_open(p_FileSystem, &File, "memtest", LFS_O_RDONLY) ||
+                    lfs_file_seek(p_FileSystem, &File, Cycle * sizeof(Buffer_In), LFS_SEEK_SET);
+        BytesRead = lfs_file_read(p_FileSystem, &File, Buffer_In, sizeof(Buffer_In));
 	if((FileError < 0) || (BytesRead != sizeof(Buffer_In)))
 	{
 	    NRF_LOG_ERROR(" Can not read bytes from file into buffer!");
-	    lfs_file_close(&FileSystem, &File);
+	    lfs_file_close(p_FileSystem, &File);
 	    Error = NRF_ERROR_NO_MEM;
 
 	    goto FileSystem_MemTest_Fail;
 	}
-	FileError = lfs_file_close(&FileSystem, &File);
+	FileError = lfs_file_close(p_FileSystem, &File);
 
 	for(uint32_t Byte = 0; Byte < sizeof(Buffer_In); Byte++)
 	{
@@ -397,15 +1381,15 @@ ret_code_t FileSystem_MemTest(void)
 FileSystem_MemTest_Fail:
 
     NRF_LOG_INFO("Getting file size...");
-    Size = lfs_file_size(&FileSystem, &File);
-    lfs_file_close(&FileSystem, &File);
+    Size = lfs_file_size(p_FileSystem, &File);
+    lfs_file_close(p_FileSystem, &File);
     NRF_LOG_INFO("  Size: %u bytes", Size);
 
     NRF_LOG_INFO("Remove test file...");
-    lfs_remove(&FileSystem, "memtest");
+    lfs_remove(p_FileSystem, "memtest");
 
     NRF_LOG_INFO("Unmount file system...");
-    lfs_unmount(&FileSystem);
+    FileSystem_Unmount(FILESYSTEM_PARTITION_DATA);
 
     NRF_LOG_FLUSH();
 
@@ -417,6 +1401,10 @@ ret_code_t FileSystem_RawMemTest(uint32_t* p_FaultSector, uint32_t* p_FaultPage,
     uint8_t Page_Out[S25FL064L_PAGE_SIZE];
     uint8_t Page_In[S25FL064L_PAGE_SIZE];
 
+    // The test bypasses the block functions, so the state of the sectors is unknown afterwards
+    memset(Sector_Erased, 0, sizeof(Sector_Erased));
+    memset(Sector_Discarded, 0, sizeof(Sector_Discarded));
+
     NRF_LOG_INFO("Erasinjg flash memory...");
     if(S25FL064L_EraseChip(&Flash))
     {
@@ -24,6 +24,68 @@
 
  #include <stdbool.h>
 
+ #include "lfs.h"
+
+ /** @brief Partitions of the flash memory. Each partition is an independent file system.
+  */
+ typedef enum
+ {
+    FILESYSTEM_PARTITION_LOG	= 0,				/**< Small partition for frequently written log data. */
+    FILESYSTEM_PARTITION_DATA	= 1,				/**< Large partition for rarely written assets. */
+    FILESYSTEM_PARTITION_COUNT,					/**< Number of partitions. */
+ } filesystem_partition_id_t;
+
+ /** @brief Size of the file cache used by an image staging writer. Must match the cache size of the data partition.
+  */
+ #define FILESYSTEM_STAGE_CACHE_SIZE		512
+
+ /** @brief Resume checkpoint of a staged image. The checkpoint is stored as a user attribute of the image file and
+  *         committed together with the file contents.
+  */
+ typedef struct
+ {
+    uint32_t Size;					/**< Size of the complete image in bytes. */
+    uint32_t Offset;					/**< Number of bytes staged. */
+    uint32_t CRC;					/**< Running CRC-32 of the staged bytes, without the final inversion. */
+    uint32_t Block;					/**< Index of the file block which receives the next byte. */
+    uint32_t Room;					/**< Number of bytes left in this block. */
+ } filesystem_stage_checkpoint_t;
+
+ /** @brief Writer object to stage a firmware image in the data partition.
+  */
+ typedef struct
+ {
+    lfs_file_t File;					/**< Image file. */
+    struct lfs_file_config Config;			/**< File configuration with the cache and the checkpoint attribute. */
+    struct lfs_attr Attribute;				/**< User attribute which holds the checkpoint. */
+    filesystem_stage_checkpoint_t Checkpoint;		/**< Checkpoint stored on the flash memory. */
+    filesystem_stage_checkpoint_t Current;		/**< State of the staged data. */
+    uint8_t Cache[FILESYSTEM_STAGE_CACHE_SIZE];		/**< File cache. */
+    const char* p_Path;					/**< Path of the image file. */
+    bool isOpen;					/**< Writer is open. */
+ } filesystem_stage_t;
+
+ /** @brief Statistics of the write journal with the estimated energy the flash memory needs for the flushes.
+  */
+ typedef struct
+ {
+    uint32_t Bytes;					/**< Number of logged bytes. */
+    uint32_t Records;					/**< Number of logged records. */
+    uint32_t Flushes;					/**< Number of flushes. */
+    uint32_t Programmed;				/**< Number of bytes programmed by the flushes. */
+    uint32_t Erases;					/**< Number of sectors erased by the flushes. */
+    uint64_t Energy;					/**< Estimated energy of the flushes in nJ. */
+ } filesystem_journal_stats_t;
+
+ /** @brief Statistics of the idle pre-erase of unused flash sectors.
+  */
+ typedef struct
+ {
+    uint32_t Discarded;					/**< Number of sectors reported as unused by LittleFS. */
+    uint32_t Erased;					/**< Number of sectors erased in the idle time. */
+    uint32_t Skipped;					/**< Number of LittleFS erases skipped, because the sector was erased. */
+ } filesystem_discard_stats_t;
+
  /** @brief		Initialize the file system.
   *  @param Watchdog	Channel ID of an active watchdog timer to reset the timer during the flash reset
   *  @return		#NRF_SUCCESS when successful
@@ -35,11 +97,116 @@
   */
  ret_code_t FileSystem_Deinit(void);
 
+ /** @brief		Mount the file system of a partition.
+  *  @param Partition	Partition ID
+  *  @param Format	Format the partition when it can not be mounted
+  *  @return		#NRF_SUCCESS when successful
+  */
+ ret_code_t FileSystem_Mount(filesystem_partition_id_t Partition, bool Format);
+
+ /** @brief		Unmount the file system of a partition.
+  *  @param Partition	Partition ID
+  *  @return		#NRF_SUCCESS when successful
+  */
+ ret_code_t FileSystem_Unmount(filesystem_partition_id_t Partition);
+
+ /** @brief		Get the LittleFS instance of a mounted partition.
+  *  @param Partition	Partition ID
+  *  @return		Pointer to the LittleFS instance
+  *			NULL when the partition is not mounted
+  */
+ lfs_t* FileSystem_GetPartition(filesystem_partition_id_t Partition);
+
  /** @brief         Enable / Disable the power supply of the flash memory.
   *  @param Enable  Enable / Disable the flash memory
   */
  void FileSystem_EnableFlash(bool Enable);
 
+ /** @brief		Open a writer to stage a firmware image in the data partition.
+  *			An interrupted transfer of the same image resumes at the last checkpoint. The free space for the rest
+  *			of the image is checked before any data is written.
+  *  @param p_Stage	Pointer to writer object
+  *  @param p_Path	Path of the image file. Must be valid until the writer is closed
+  *  @param Size	Size of the complete image in bytes
+  *  @return		#NRF_SUCCESS when successful
+  */
+ ret_code_t FileSystem_StageOpen(filesystem_stage_t* p_Stage, const char* p_Path, uint32_t Size);
+
+ /** @brief		Get the offset where the transfer of the image has to continue.
+  *  @param p_Stage	Pointer to writer object
+  *  @return		Number of bytes already staged
+  */
+ uint32_t FileSystem_StageGetOffset(const filesystem_stage_t* p_Stage);
+
+ /** @brief		Append data to a staged image.
+  *  @param p_Stage	Pointer to writer object
+  *  @param p_Data	Pointer to image data
+  *  @param Length	Length of image data
+  *  @return		#NRF_SUCCESS when successful
+  */
+ ret_code_t FileSystem_StageWrite(filesystem_stage_t* p_Stage, const void* p_Data, uint32_t Length);
+
+ /** @brief		Verify a completely staged image and close the writer.
+  *			The image is removed when the CRC doesn't match.
+  *  @param p_Stage	Pointer to writer object
+  *  @param CRC		Expected CRC-32 (IEEE 802.3) of the image
+  *  @return		#NRF_SUCCESS when successful
+  *			#NRF_ERROR_INVALID_DATA when the CRC doesn't match
+  */
+ ret_code_t FileSystem_StageFinish(filesystem_stage_t* p_Stage, uint32_t CRC);
+
+ /** @brief		Close a writer.
+  *  @param p_Stage	Pointer to writer object
+  *  @param Discard	Remove the image. Otherwise the staged data is kept for a later resume
+  *  @return		#NRF_SUCCESS when successful
+  */
+ ret_code_t FileSystem_StageClose(filesystem_stage_t* p_Stage, bool Discard);
+
+ /** @brief		Append a record to a file of the log partition through the RAM journal.
+  *			The journal collects small writes while the flash memory is powered down and writes them in a single
+  *			burst when it is full, when the oldest record gets too old or when an urgent record is logged. The
+  *			records of the journal are lost on a reset.
+  *  @param p_Path	Path of the log file. Must be valid until the record is flushed
+  *  @param p_Data	Pointer to record data
+  *  @param Length	Length of record data
+  *  @param Urgent	Flush the journal with this record
+  *  @param Time	Current time in ms
+  *  @return		#NRF_SUCCESS when successful
+  */
+ ret_code_t FileSystem_JournalWrite(const char* p_Path, const void* p_Data, uint16_t Length, bool Urgent, uint32_t Time);
+
+ /** @brief		Flush the journal when its oldest record is too old.
+  *			Call this function periodically to bound the age of the records in the journal.
+  *  @param Time	Current time in ms
+  *  @return		#NRF_SUCCESS when successful
+  */
+ ret_code_t FileSystem_JournalPoll(uint32_t Time);
+
+ /** @brief	Write all records of the journal to the flash memory.
+  *  @return	#NRF_SUCCESS when successful
+  */
+ ret_code_t FileSystem_JournalFlush(void);
+
+ /** @brief		Get the statistics of the journal.
+  *  @param p_Stats	Pointer to statistics object
+  */
+ void FileSystem_JournalGetStats(filesystem_journal_stats_t* p_Stats);
+
+ /** @brief		Erase unused sectors of the mounted partitions in the idle time.
+  *			LittleFS reports the unused blocks ahead of its allocator and they are erased here, so a later erase
+  *			of LittleFS is skipped. The function does nothing while the flash memory is switched off, in deep
+  *			power down or busy with an erase. The last erase is left running in the background, so a budget of
+  *			one never waits for the flash memory.
+  *  @param Budget	Maximum number of sectors to erase
+  *  @return		#NRF_SUCCESS when successful
+  */
+ ret_code_t FileSystem_DiscardPoll(uint32_t Budget);
+
+ /** @brief		Get the statistics of the idle pre-erase.
+  *  @param p_Stats	Pointer to statistics object
+  */
+ void FileSystem_DiscardGetStats(filesystem_discard_stats_t* p_Stats);
+
  /** @brief	Write and read a test file.
   *  @return	#NRF_SUCCESS when successful
   */
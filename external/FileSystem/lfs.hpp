@@ -0,0 +1,816 @@
+/*****************************************************************************/
+/**
+* @file lfs.hpp
+*
+* Header-only C++17 wrapper for the LittleFS.
+*
+* The file system, files and directories own all of their buffers. The buffer
+* sizes are given by a compile time geometry, so no heap allocation is done
+* by the LittleFS when using this wrapper. Every call maps 1:1 to the
+* corresponding LittleFS C call.
+*
+******************************************************************************/
+
+#ifndef LFS_HPP_
+#define LFS_HPP_
+
+ #include <array>
+ #include <cstddef>
+ #include <cstdint>
+ #include <new>
+ #include <type_traits>
+ #include <utility>
+
+ #if(__cplusplus >= 202002L)
+    #include <span>
+ #endif
+
+ extern "C"
+ {
+    #include "lfs.h"
+ }
+
+ namespace littlefs
+ {
+    /** @brief		Compile time geometry of a file system.
+     *  @tparam ReadSize	Minimum size of a block read
+     *  @tparam ProgSize	Minimum size of a block program
+     *  @tparam BlockSize	Size of an erasable block
+     *  @tparam BlockCount	Number of erasable blocks on the device
+     *  @tparam CacheSize	Size of the read, program and file caches
+     *  @tparam LookaheadSize	Size of the lookahead buffer
+     *  @tparam BlockCycles	Number of erase cycles before metadata is moved, -1 disables wear leveling
+     */
+    template<lfs_size_t ReadSize, lfs_size_t ProgSize, lfs_size_t BlockSize, lfs_size_t BlockCount,
+             lfs_size_t CacheSize, lfs_size_t LookaheadSize, int32_t BlockCycles = 500>
+    struct Geometry
+    {
+	static constexpr lfs_size_t Read_Size = ReadSize;
+	static constexpr lfs_size_t Prog_Size = ProgSize;
+	static constexpr lfs_size_t Block_Size = BlockSize;
+	static constexpr lfs_size_t Block_Count = BlockCount;
+	static constexpr lfs_size_t Cache_Size = CacheSize;
+	static constexpr lfs_size_t Lookahead_Size = LookaheadSize;
+	static constexpr int32_t Block_Cycles = BlockCycles;
+
+	static_assert((ReadSize > 0) && (ProgSize > 0) && (CacheSize > 0), "Sizes must not be zero!");
+	static_assert((CacheSize % ReadSize) == 0, "Cache size must be a multiple of the read size!");
+	static_assert((CacheSize % ProgSize) == 0, "Cache size must be a multiple of the program size!");
+	static_assert((BlockSize % CacheSize) == 0, "Block size must be a multiple of the cache size!");
+	static_assert(BlockSize >= 128, "Block size must be at least 128 bytes!");
+	static_assert((LookaheadSize > 0) && ((LookaheadSize % 8) == 0), "Lookahead size must be a multiple of 8!");
+	static_assert(BlockCycles != 0, "Block cycles must be -1 or greater than zero!");
+ #ifdef LFS_STATIC_READ_SIZE
+	static_assert(ReadSize == LFS_STATIC_READ_SIZE, "Read size does not match LFS_STATIC_READ_SIZE!");
+ #endif
+ #ifdef LFS_STATIC_PROG_SIZE
+	static_assert(ProgSize == LFS_STATIC_PROG_SIZE, "Program size does not match LFS_STATIC_PROG_SIZE!");
+ #endif
+ #ifdef LFS_STATIC_BLOCK_SIZE
+	static_assert(BlockSize == LFS_STATIC_BLOCK_SIZE, "Block size does not match LFS_STATIC_BLOCK_SIZE!");
+ #endif
+ #ifdef LFS_STATIC_BLOCK_COUNT
+	static_assert(BlockCount == LFS_STATIC_BLOCK_COUNT, "Block count does not match LFS_STATIC_BLOCK_COUNT!");
+ #endif
+ #ifdef LFS_STATIC_CACHE_SIZE
+	static_assert(CacheSize == LFS_STATIC_CACHE_SIZE, "Cache size does not match LFS_STATIC_CACHE_SIZE!");
+ #endif
+ #ifdef LFS_STATIC_LOOKAHEAD_SIZE
+	static_assert(LookaheadSize == LFS_STATIC_LOOKAHEAD_SIZE, "Lookahead size does not match LFS_STATIC_LOOKAHEAD_SIZE!");
+ #endif
+    };
+
+ #if(__cplusplus >= 202002L)
+    template<typename T>
+    using Span = std::span<T>;
+ #else
+    /** @brief	Minimal replacement for std::span in C++17.
+     *  @tparam T	Element type
+     */
+    template<typename T>
+    class Span
+    {
+	public:
+	    constexpr Span() noexcept : p_Data(nullptr), m_Size(0)
+	    {
+	    }
+
+	    constexpr Span(T* p_Data, std::size_t Size) noexcept : p_Data(p_Data), m_Size(Size)
+	    {
+	    }
+
+	    template<std::size_t N>
+	    constexpr Span(T (&Data)[N]) noexcept : p_Data(Data), m_Size(N)
+	    {
+	    }
+
+	    template<typename U, std::size_t N, typename = std::enable_if_t<std::is_convertible_v<U(*)[], T(*)[]>>>
+	    constexpr Span(std::array<U, N>& Data) noexcept : p_Data(Data.data()), m_Size(N)
+	    {
+	    }
+
+	    template<typename U, std::size_t N, typename = std::enable_if_t<std::is_convertible_v<const U(*)[], T(*)[]>>>
+	    constexpr Span(const std::array<U, N>& Data) noexcept : p_Data(Data.data()), m_Size(N)
+	    {
+	    }
+
+	    template<typename U, typename = std::enable_if_t<std::is_convertible_v<U(*)[], T(*)[]>>>
+	    constexpr Span(const Span<U>& Other) noexcept : p_Data(Other.data()), m_Size(Other.size())
+	    {
+	    }
+
+	    constexpr T* data() const noexcept
+	    {
+		return p_Data;
+	    }
+
+	    constexpr std::size_t size() const noexcept
+	    {
+		return m_Size;
+	    }
+
+	    constexpr std::size_t size_bytes() const noexcept
+	    {
+		return m_Size * sizeof(T);
+	    }
+
+	    constexpr bool empty() const noexcept
+	    {
+		return m_Size == 0;
+	    }
+
+	    constexpr T* begin() const noexcept
+	    {
+		return p_Data;
+	    }
+
+	    constexpr T* end() const noexcept
+	    {
+		return p_Data + m_Size;
+	    }
+
+	    constexpr T& operator[](std::size_t Index) const noexcept
+	    {
+		return p_Data[Index];
+	    }
+
+	private:
+	    T* p_Data;
+	    std::size_t m_Size;
+    };
+ #endif
+
+    /** @brief LittleFS error codes.
+     */
+    enum class Error : int
+    {
+	OK		= LFS_ERR_OK,
+	IO		= LFS_ERR_IO,
+	CORRUPT		= LFS_ERR_CORRUPT,
+	NOENT		= LFS_ERR_NOENT,
+	EXIST		= LFS_ERR_EXIST,
+	NOTDIR		= LFS_ERR_NOTDIR,
+	ISDIR		= LFS_ERR_ISDIR,
+	NOTEMPTY	= LFS_ERR_NOTEMPTY,
+	BADF		= LFS_ERR_BADF,
+	FBIG		= LFS_ERR_FBIG,
+	INVAL		= LFS_ERR_INVAL,
+	NOSPC		= LFS_ERR_NOSPC,
+	NOMEM		= LFS_ERR_NOMEM,
+	NOATTR		= LFS_ERR_NOATTR,
+	NAMETOOLONG	= LFS_ERR_NAMETOOLONG,
+	STALE		= LFS_ERR_STALE,
+    };
+
+    /** @brief	Result of an operation, holds either a value or an error (modeled after std::expected).
+     *  @tparam T	Value type
+     */
+    template<typename T>
+    class [[nodiscard]] Result
+    {
+	public:
+	    Result(const T& Value) noexcept(std::is_nothrow_copy_constructible_v<T>) : m_Error(Error::OK)
+	    {
+		new (&m_Storage) T(Value);
+	    }
+
+	    Result(T&& Value) noexcept(std::is_nothrow_move_constructible_v<T>) : m_Error(Error::OK)
+	    {
+		new (&m_Storage) T(std::move(Value));
+	    }
+
+	    Result(Error Error) noexcept : m_Error(Error)
+	    {
+	    }
+
+	    Result(Result&& Other) noexcept(std::is_nothrow_move_constructible_v<T>) : m_Error(Other.m_Error)
+	    {
+		if(Other.has_value())
+		{
+		    new (&m_Storage) T(std::move(*Other));
+		}
+	    }
+
+	    Result(const Result&) = delete;
+	    Result& operator=(const Result&) = delete;
+	    Result& operator=(Result&&) = delete;
+
+	    ~Result()
+	    {
+		if(has_value())
+		{
+		    (**this).~T();
+		}
+	    }
+
+	    bool has_value() const noexcept
+	    {
+		return m_Error == Error::OK;
+	    }
+
+	    explicit operator bool() const noexcept
+	    {
+		return has_value();
+	    }
+
+	    Error error() const noexcept
+	    {
+		return m_Error;
+	    }
+
+	    T& value() & noexcept
+	    {
+		return **this;
+	    }
+
+	    T&& value() && noexcept
+	    {
+		return std::move(**this);
+	    }
+
+	    T& operator*() noexcept
+	    {
+		return *std::launder(reinterpret_cast<T*>(&m_Storage));
+	    }
+
+	    const T& operator*() const noexcept
+	    {
+		return *std::launder(reinterpret_cast<const T*>(&m_Storage));
+	    }
+
+	    T* operator->() noexcept
+	    {
+		return &**this;
+	    }
+
+	    const T* operator->() const noexcept
+	    {
+		return &**this;
+	    }
+
+	private:
+	    Error m_Error;
+	    std::aligned_storage_t<sizeof(T), alignof(T)> m_Storage;
+    };
+
+    /** @brief Result of an operation without a value.
+     */
+    template<>
+    class [[nodiscard]] Result<void>
+    {
+	public:
+	    Result() noexcept : m_Error(Error::OK)
+	    {
+	    }
+
+	    Result(Error Error) noexcept : m_Error(Error)
+	    {
+	    }
+
+	    bool has_value() const noexcept
+	    {
+		return m_Error == Error::OK;
+	    }
+
+	    explicit operator bool() const noexcept
+	    {
+		return has_value();
+	    }
+
+	    Error error() const noexcept
+	    {
+		return m_Error;
+	    }
+
+	private:
+	    Error m_Error;
+    };
+
+    namespace detail
+    {
+	/** @brief		Convert a LittleFS return code into a result.
+	 *  @param ErrorCode	Return code of the LittleFS
+	 *  @return		Result holding the non-negative return code or the error
+	 */
+	template<typename T>
+	inline Result<T> ToResult(T ErrorCode) noexcept
+	{
+	    if(ErrorCode < 0)
+	    {
+		return static_cast<Error>(ErrorCode);
+	    }
+
+	    return ErrorCode;
+	}
+
+	inline Result<void> ToVoid(int ErrorCode) noexcept
+	{
+	    if(ErrorCode < 0)
+	    {
+		return static_cast<Error>(ErrorCode);
+	    }
+
+	    return {};
+	}
+
+	/** @brief		Replace an entry in the list of open handles of a file system after a handle was moved.
+	 *  @param p_FileSystem	Pointer to LittleFS object
+	 *  @param p_Old	Previous address of the handle
+	 *  @param p_New	New address of the handle
+	 */
+	inline void Relink(lfs_t* p_FileSystem, void* p_Old, void* p_New) noexcept
+	{
+	    // The moved handle is a copy and stays in the bucket of its metadata pair
+	    uint8_t Bucket = static_cast<struct lfs_t::lfs_mlist*>(p_New)->bucket;
+
+	    for(struct lfs_t::lfs_mlist** p = &p_FileSystem->mlist[Bucket]; *p != nullptr; p = &(*p)->next)
+	    {
+		if(*p == p_Old)
+		{
+		    *p = static_cast<struct lfs_t::lfs_mlist*>(p_New);
+
+		    return;
+		}
+	    }
+	}
+    }
+
+    template<typename Geometry>
+    class Filesystem;
+
+    /** @brief		Move-only file handle with embedded cache storage.
+     *  @tparam Geometry	Geometry of the file system
+     */
+    template<typename Geometry>
+    class File
+    {
+	public:
+	    File() noexcept : p_FileSystem(nullptr), m_File{}, m_Config{}
+	    {
+	    }
+
+	    File(File&& Other) noexcept : File()
+	    {
+		MoveFrom(Other);
+	    }
+
+	    File& operator=(File&& Other) noexcept
+	    {
+		if(this != &Other)
+		{
+		    (void)Close();
+		    MoveFrom(Other);
+		}
+
+		return *this;
+	    }
+
+	    File(const File&) = delete;
+	    File& operator=(const File&) = delete;
+
+	    ~File()
+	    {
+		(void)Close();
+	    }
+
+	    bool isOpen() const noexcept
+	    {
+		return p_FileSystem != nullptr;
+	    }
+
+	    Result<lfs_ssize_t> Read(Span<uint8_t> Buffer) noexcept
+	    {
+		return detail::ToResult(lfs_file_read(p_FileSystem, &m_File, Buffer.data(), Buffer.size()));
+	    }
+
+	    /** @brief		Stream file data straight out of the file cache.
+	     *  @param Size		Maximum number of bytes to read
+	     *  @param Consumer	Called with each chunk as a Span<const uint8_t>. Return
+	     *			false to stop early. The data is only valid during the call.
+	     *  @return		Number of bytes consumed
+	     */
+	    template<typename F>
+	    Result<lfs_ssize_t> ReadStream(lfs_size_t Size, F&& Consumer) noexcept
+	    {
+		auto Trampoline = [](void* p_Data, const void* p_Buffer, lfs_size_t Length) -> int
+		{
+		    auto& Function = *static_cast<std::remove_reference_t<F>*>(p_Data);
+
+		    return Function(Span<const uint8_t>(static_cast<const uint8_t*>(p_Buffer), Length)) ? 0 : 1;
+		};
+
+		return detail::ToResult(lfs_file_readcb(p_FileSystem, &m_File, Size, Trampoline, const_cast<void*>(static_cast<const void*>(&Consumer))));
+	    }
+
+	    Result<lfs_ssize_t> Write(Span<const uint8_t> Buffer) noexcept
+	    {
+		return detail::ToResult(lfs_file_write(p_FileSystem, &m_File, Buffer.data(), Buffer.size()));
+	    }
+
+	    Result<lfs_soff_t> Seek(lfs_soff_t Offset, int Whence = LFS_SEEK_SET) noexcept
+	    {
+		return detail::ToResult(lfs_file_seek(p_FileSystem, &m_File, Offset, Whence));
+	    }
+
+	    Result<lfs_soff_t> Tell() noexcept
+	    {
+		return detail::ToResult(lfs_file_tell(p_FileSystem, &m_File));
+	    }
+
+	    Result<lfs_soff_t> Size() noexcept
+	    {
+		return detail::ToResult(lfs_file_size(p_FileSystem, &m_File));
+	    }
+
+	    Result<void> Rewind() noexcept
+	    {
+		return detail::ToVoid(lfs_file_rewind(p_FileSystem, &m_File));
+	    }
+
+	    Result<void> Truncate(lfs_off_t Size) noexcept
+	    {
+		return detail::ToVoid(lfs_file_truncate(p_FileSystem, &m_File, Size));
+	    }
+
+	    Result<void> Sync() noexcept
+	    {
+		return detail::ToVoid(lfs_file_sync(p_FileSystem, &m_File));
+	    }
+
+	    /** @brief	Close the file. Closing a file that is not open does nothing.
+	     *  @return	Result of the final sync
+	     */
+	    Result<void> Close() noexcept
+	    {
+		if(p_FileSystem == nullptr)
+		{
+		    return {};
+		}
+
+		int Error = lfs_file_close(p_FileSystem, &m_File);
+		p_FileSystem = nullptr;
+
+		return detail::ToVoid(Error);
+	    }
+
+	private:
+	    friend class Filesystem<Geometry>;
+
+	    void MoveFrom(File& Other) noexcept
+	    {
+		p_FileSystem = Other.p_FileSystem;
+		m_File = Other.m_File;
+		m_Cache = Other.m_Cache;
+		m_Config = Other.m_Config;
+
+		if(p_FileSystem != nullptr)
+		{
+		    // The LittleFS keeps pointers to the handle, the configuration and the cache
+		    m_Config.buffer = m_Cache.data();
+		    m_File.cfg = &m_Config;
+		    m_File.cache.buffer = m_Cache.data();
+		    detail::Relink(p_FileSystem, &Other.m_File, &m_File);
+		}
+
+		Other.p_FileSystem = nullptr;
+	    }
+
+	    lfs_t* p_FileSystem;
+	    lfs_file_t m_File;
+	    struct lfs_file_config m_Config;
+	    std::array<uint8_t, Geometry::Cache_Size> m_Cache;
+    };
+
+    /** @brief		Move-only directory handle.
+     *  @tparam Geometry	Geometry of the file system
+     */
+    template<typename Geometry>
+    class Dir
+    {
+	public:
+	    Dir() noexcept : p_FileSystem(nullptr), m_Dir{}
+	    {
+	    }
+
+	    Dir(Dir&& Other) noexcept : Dir()
+	    {
+		MoveFrom(Other);
+	    }
+
+	    Dir& operator=(Dir&& Other) noexcept
+	    {
+		if(this != &Other)
+		{
+		    (void)Close();
+		    MoveFrom(Other);
+		}
+
+		return *this;
+	    }
+
+	    Dir(const Dir&) = delete;
+	    Dir& operator=(const Dir&) = delete;
+
+	    ~Dir()
+	    {
+		(void)Close();
+	    }
+
+	    bool isOpen() const noexcept
+	    {
+		return p_FileSystem != nullptr;
+	    }
+
+	    /** @brief		Read the next directory entry.
+	     *  @param Info	Output for the entry
+	     *  @return		true when an entry was read
+	     *			false at the end of the directory
+	     */
+	    Result<bool> Read(struct lfs_info& Info) noexcept
+	    {
+		int Error = lfs_dir_read(p_FileSystem, &m_Dir, &Info);
+		if(Error < 0)
+		{
+		    return static_cast<littlefs::Error>(Error);
+		}
+
+		return Error > 0;
+	    }
+
+	    Result<void> Seek(lfs_off_t Offset) noexcept
+	    {
+		return detail::ToVoid(lfs_dir_seek(p_FileSystem, &m_Dir, Offset));
+	    }
+
+	    Result<lfs_soff_t> Tell() noexcept
+	    {
+		return detail::ToResult(lfs_dir_tell(p_FileSystem, &m_Dir));
+	    }
+
+	    Result<void> Rewind() noexcept
+	    {
+		return detail::ToVoid(lfs_dir_rewind(p_FileSystem, &m_Dir));
+	    }
+
+	    /** @brief		Read a batch of directory entries.
+	     *  @param Entries	Output for the entries
+	     *  @param p_Batch	Optional name buffer and attributes to read
+	     *  @return		Number of entries read, 0 at the end of the directory
+	     */
+	    Result<lfs_ssize_t> ReadBatch(Span<struct lfs_dirent> Entries, const struct lfs_dir_batch* p_Batch = nullptr) noexcept
+	    {
+		return detail::ToResult(lfs_dir_readbatch(p_FileSystem, &m_Dir, Entries.data(), Entries.size(), p_Batch));
+	    }
+
+	    Result<lfs_dir_cursor_t> TellCursor() noexcept
+	    {
+		lfs_dir_cursor_t Cursor;
+		int Error = lfs_dir_tellcursor(p_FileSystem, &m_Dir, &Cursor);
+		if(Error < 0)
+		{
+		    return static_cast<littlefs::Error>(Error);
+		}
+
+		return Cursor;
+	    }
+
+	    Result<void> SeekCursor(const lfs_dir_cursor_t& Cursor) noexcept
+	    {
+		return detail::ToVoid(lfs_dir_seekcursor(p_FileSystem, &m_Dir, &Cursor));
+	    }
+
+	    Result<void> Close() noexcept
+	    {
+		if(p_FileSystem == nullptr)
+		{
+		    return {};
+		}
+
+		int Error = lfs_dir_close(p_FileSystem, &m_Dir);
+		p_FileSystem = nullptr;
+
+		return detail::ToVoid(Error);
+	    }
+
+	private:
+	    friend class Filesystem<Geometry>;
+
+	    void MoveFrom(Dir& Other) noexcept
+	    {
+		p_FileSystem = Other.p_FileSystem;
+		m_Dir = Other.m_Dir;
+
+		if(p_FileSystem != nullptr)
+		{
+		    detail::Relink(p_FileSystem, &Other.m_Dir, &m_Dir);
+		}
+
+		Other.p_FileSystem = nullptr;
+	    }
+
+	    lfs_t* p_FileSystem;
+	    lfs_dir_t m_Dir;
+    };
+
+    /** @brief		File system with statically allocated buffers.
+     *			The object must not be moved, the LittleFS keeps pointers into it.
+     *  @tparam Geometry	Geometry of the file system
+     */
+    template<typename Geometry>
+    class Filesystem
+    {
+	public:
+	    using ReadFunction = int (*)(const struct lfs_config*, lfs_block_t, lfs_off_t, void*, lfs_size_t);
+	    using ProgFunction = int (*)(const struct lfs_config*, lfs_block_t, lfs_off_t, const void*, lfs_size_t);
+	    using EraseFunction = int (*)(const struct lfs_config*, lfs_block_t);
+	    using SyncFunction = int (*)(const struct lfs_config*);
+
+	    /** @brief		Constructor.
+	     *  @param Read	Block device read function
+	     *  @param Prog	Block device program function
+	     *  @param Erase	Block device erase function
+	     *  @param Sync	Block device sync function
+	     *  @param p_Context	Context pointer passed to the block device functions
+	     */
+	    Filesystem(ReadFunction Read, ProgFunction Prog, EraseFunction Erase, SyncFunction Sync,
+		       void* p_Context = nullptr) noexcept : m_Config{}, m_FileSystem{}, m_isMounted(false)
+	    {
+		m_Config.context = p_Context;
+		m_Config.read = Read;
+		m_Config.prog = Prog;
+		m_Config.erase = Erase;
+		m_Config.sync = Sync;
+		m_Config.read_size = Geometry::Read_Size;
+		m_Config.prog_size = Geometry::Prog_Size;
+		m_Config.block_size = Geometry::Block_Size;
+		m_Config.block_count = Geometry::Block_Count;
+		m_Config.block_cycles = Geometry::Block_Cycles;
+		m_Config.cache_size = Geometry::Cache_Size;
+		m_Config.lookahead_size = Geometry::Lookahead_Size;
+		m_Config.read_buffer = m_ReadBuffer.data();
+		m_Config.prog_buffer = m_ProgBuffer.data();
+		m_Config.lookahead_buffer = m_LookaheadBuffer.data();
+	    }
+
+	    Filesystem(const Filesystem&) = delete;
+	    Filesystem& operator=(const Filesystem&) = delete;
+
+	    ~Filesystem()
+	    {
+		(void)Unmount();
+	    }
+
+	    Result<void> Format() noexcept
+	    {
+		return detail::ToVoid(lfs_format(&m_FileSystem, &m_Config));
+	    }
+
+	    Result<void> Mount() noexcept
+	    {
+		int Error = lfs_mount(&m_FileSystem, &m_Config);
+		m_isMounted = (Error == 0);
+
+		return detail::ToVoid(Error);
+	    }
+
+	    /** @brief	Unmount the file system. All open files and directories must be closed before.
+	     *  @return	Result of the unmount
+	     */
+	    Result<void> Unmount() noexcept
+	    {
+		if(!m_isMounted)
+		{
+		    return {};
+		}
+
+		m_isMounted = false;
+
+		return detail::ToVoid(lfs_unmount(&m_FileSystem));
+	    }
+
+	    bool isMounted() const noexcept
+	    {
+		return m_isMounted;
+	    }
+
+	    Result<File<Geometry>> Open(const char* p_Path, int Flags) noexcept
+	    {
+		File<Geometry> Handle;
+		Handle.m_Config.buffer = Handle.m_Cache.data();
+
+		int Error = lfs_file_opencfg(&m_FileSystem, &Handle.m_File, p_Path, Flags, &Handle.m_Config);
+		if(Error < 0)
+		{
+		    return static_cast<littlefs::Error>(Error);
+		}
+		Handle.p_FileSystem = &m_FileSystem;
+
+		return Handle;
+	    }
+
+	    Result<File<Geometry>> Open(const lfs_handle_t& Entry, int Flags) noexcept
+	    {
+		File<Geometry> Handle;
+		Handle.m_Config.buffer = Handle.m_Cache.data();
+
+		int Error = lfs_file_openhandlecfg(&m_FileSystem, &Handle.m_File, &Entry, Flags, &Handle.m_Config);
+		if(Error < 0)
+		{
+		    return static_cast<littlefs::Error>(Error);
+		}
+		Handle.p_FileSystem = &m_FileSystem;
+
+		return Handle;
+	    }
+
+	    Result<Dir<Geometry>> OpenDir(const char* p_Path) noexcept
+	    {
+		Dir<Geometry> Handle;
+
+		int Error = lfs_dir_open(&m_FileSystem, &Handle.m_Dir, p_Path);
+		if(Error < 0)
+		{
+		    return static_cast<littlefs::Error>(Error);
+		}
+		Handle.p_FileSystem = &m_FileSystem;
+
+		return Handle;
+	    }
+
+	    Result<void> Mkdir(const char* p_Path) noexcept
+	    {
+		return detail::ToVoid(lfs_mkdir(&m_FileSystem, p_Path));
+	    }
+
+	    Result<void> Remove(const char* p_Path) noexcept
+	    {
+		return detail::ToVoid(lfs_remove(&m_FileSystem, p_Path));
+	    }
+
+	    Result<void> RemoveRecursive(const char* p_Path) noexcept
+	    {
+		return detail::ToVoid(lfs_remove_recursive(&m_FileSystem, p_Path));
+	    }
+
+	    Result<void> Rename(const char* p_OldPath, const char* p_NewPath) noexcept
+	    {
+		return detail::ToVoid(lfs_rename(&m_FileSystem, p_OldPath, p_NewPath));
+	    }
+
+	    Result<struct lfs_info> Stat(const char* p_Path) noexcept
+	    {
+		struct lfs_info Info;
+
+		int Error = lfs_stat(&m_FileSystem, p_Path, &Info);
+		if(Error < 0)
+		{
+		    return static_cast<littlefs::Error>(Error);
+		}
+
+		return Info;
+	    }
+
+	    Result<lfs_ssize_t> Size() noexcept
+	    {
+		return detail::ToResult(lfs_fs_size(&m_FileSystem));
+	    }
+
+	    /** @brief	Get the underlying LittleFS object for calls that are not wrapped.
+	     *  @return	Pointer to LittleFS object
+	     */
+	    lfs_t* Native() noexcept
+	    {
+		return &m_FileSystem;
+	    }
+
+	private:
+	    struct lfs_config m_Config;
+	    lfs_t m_FileSystem;
+	    bool m_isMounted;
+	    std::array<uint8_t, Geometry::Cache_Size> m_ReadBuffer;
+	    std::array<uint8_t, Geometry::Cache_Size> m_ProgBuffer;
+	    alignas(uint32_t) std::array<uint8_t, Geometry::Lookahead_Size> m_LookaheadBuffer;
+    };
+ }
+
+#endif /* LFS_HPP_ */
@@ -0,0 +1,488 @@
+/*****************************************************************************/
+/**
+* @file lfs_async.hpp
+*
+* C++20 coroutine layer for the LittleFS wrapper.
+*
+* File system operations are awaitables which are handed to an executor. The
+* executor runs the LittleFS call and resumes the awaiting coroutine, so any
+* number of logical tasks can share one file system without blocking each
+* other between operations. The LittleFS itself is only ever called from the
+* executor, so no locking is needed.
+*
+* Two executors are provided:
+*  - EventLoop: Single threaded run-to-completion loop for the target. Poll it
+*               from the main loop.
+*  - ThreadExecutor: Runs operations on a worker thread, for host tests.
+*
+******************************************************************************/
+
+#ifndef LFS_ASYNC_HPP_
+#define LFS_ASYNC_HPP_
+
+ #if(__cplusplus < 202002L)
+    #error "lfs_async.hpp requires C++20!"
+ #endif
+
+ #include <coroutine>
+ #include <exception>
+ #include <optional>
+ #include <type_traits>
+ #include <utility>
+
+ #if(__has_include(<thread>) && !defined(LFS_ASYNC_NO_THREADS))
+    #include <condition_variable>
+    #include <mutex>
+    #include <thread>
+
+    #define LFS_ASYNC_THREADS
+ #endif
+
+ #include "lfs.hpp"
+
+ namespace littlefs
+ {
+    /** @brief Intrusive work item of an executor. Awaitables embed the work item, so queueing never allocates.
+     */
+    struct Work
+    {
+	Work* p_Next = nullptr;				/**< Next work item in the queue. */
+	void (*Run)(Work* p_Work) = nullptr;		/**< Function to execute the work item. */
+    };
+
+    /** @brief Executor interface.
+     */
+    class Executor
+    {
+	public:
+	    /** @brief		Queue a work item. The item must stay valid until it was executed.
+	     *  @param p_Work	Pointer to work item
+	     */
+	    virtual void Submit(Work* p_Work) noexcept = 0;
+
+	protected:
+	    ~Executor() = default;
+    };
+
+    /** @brief Single threaded executor which runs the queued work items in FIFO order.
+     *         Submit and Run must be called from the same context (not from an interrupt).
+     */
+    class EventLoop final : public Executor
+    {
+	public:
+	    void Submit(Work* p_Work) noexcept override
+	    {
+		p_Work->p_Next = nullptr;
+		if(p_Tail == nullptr)
+		{
+		    p_Head = p_Work;
+		}
+		else
+		{
+		    p_Tail->p_Next = p_Work;
+		}
+		p_Tail = p_Work;
+	    }
+
+	    /** @brief	Run a single work item.
+	     *  @return	true when a work item was executed
+	     */
+	    bool RunOnce() noexcept
+	    {
+		Work* p_Work = p_Head;
+		if(p_Work == nullptr)
+		{
+		    return false;
+		}
+
+		p_Head = p_Work->p_Next;
+		if(p_Head == nullptr)
+		{
+		    p_Tail = nullptr;
+		}
+
+		p_Work->Run(p_Work);
+
+		return true;
+	    }
+
+	    /** @brief Run work items until the queue is empty.
+	     */
+	    void Run() noexcept
+	    {
+		while(RunOnce())
+		{
+		}
+	    }
+
+	private:
+	    Work* p_Head = nullptr;
+	    Work* p_Tail = nullptr;
+    };
+
+ #ifdef LFS_ASYNC_THREADS
+    /** @brief Executor which runs the queued work items on a single worker thread.
+     */
+    class ThreadExecutor final : public Executor
+    {
+	public:
+	    ThreadExecutor() : m_Worker([this] { Worker(); })
+	    {
+	    }
+
+	    ThreadExecutor(const ThreadExecutor&) = delete;
+	    ThreadExecutor& operator=(const ThreadExecutor&) = delete;
+
+	    ~ThreadExecutor()
+	    {
+		{
+		    std::lock_guard<std::mutex> Lock(m_Mutex);
+		    m_Stop = true;
+		}
+		m_Condition.notify_all();
+		m_Worker.join();
+	    }
+
+	    void Submit(Work* p_Work) noexcept override
+	    {
+		{
+		    std::lock_guard<std::mutex> Lock(m_Mutex);
+		    p_Work->p_Next = nullptr;
+		    if(p_Tail == nullptr)
+		    {
+			p_Head = p_Work;
+		    }
+		    else
+		    {
+			p_Tail->p_Next = p_Work;
+		    }
+		    p_Tail = p_Work;
+		}
+		m_Condition.notify_all();
+	    }
+
+	    /** @brief Wait until the queue is empty and the worker is idle.
+	     */
+	    void Drain()
+	    {
+		std::unique_lock<std::mutex> Lock(m_Mutex);
+		m_Condition.wait(Lock, [this] { return (p_Head == nullptr) && !m_isBusy; });
+	    }
+
+	private:
+	    void Worker()
+	    {
+		std::unique_lock<std::mutex> Lock(m_Mutex);
+		while(true)
+		{
+		    m_Condition.wait(Lock, [this] { return (p_Head != nullptr) || m_Stop; });
+		    if(p_Head == nullptr)
+		    {
+			return;
+		    }
+
+		    Work* p_Work = p_Head;
+		    p_Head = p_Work->p_Next;
+		    if(p_Head == nullptr)
+		    {
+			p_Tail = nullptr;
+		    }
+
+		    m_isBusy = true;
+		    Lock.unlock();
+		    p_Work->Run(p_Work);
+		    Lock.lock();
+		    m_isBusy = false;
+		    m_Condition.notify_all();
+		}
+	    }
+
+	    std::mutex m_Mutex;
+	    std::condition_variable m_Condition;
+	    Work* p_Head = nullptr;
+	    Work* p_Tail = nullptr;
+	    bool m_isBusy = false;
+	    bool m_Stop = false;
+	    std::thread m_Worker;
+    };
+ #endif
+
+    namespace detail
+    {
+	/** @brief Resume the continuation of a finished task, if any.
+	 */
+	template<typename Promise>
+	struct FinalAwaiter
+	{
+	    bool await_ready() const noexcept
+	    {
+		return false;
+	    }
+
+	    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> Handle) noexcept
+	    {
+		std::coroutine_handle<> Continuation = Handle.promise().m_Continuation;
+		if(Continuation)
+		{
+		    return Continuation;
+		}
+
+		return std::noop_coroutine();
+	    }
+
+	    void await_resume() const noexcept
+	    {
+	    }
+	};
+
+	struct PromiseBase
+	{
+	    std::suspend_always initial_suspend() const noexcept
+	    {
+		return {};
+	    }
+
+	    void unhandled_exception() const noexcept
+	    {
+		std::terminate();
+	    }
+
+	    std::coroutine_handle<> m_Continuation;
+	};
+
+	template<typename T>
+	struct Promise : PromiseBase
+	{
+	    void return_value(T Value) noexcept(std::is_nothrow_move_constructible_v<T>)
+	    {
+		m_Value.emplace(std::move(Value));
+	    }
+
+	    std::optional<T> m_Value;
+	};
+
+	template<>
+	struct Promise<void> : PromiseBase
+	{
+	    void return_void() const noexcept
+	    {
+	    }
+	};
+    }
+
+    /** @brief	Lazily started coroutine. Await it from another task or start it on an executor.
+     *  @tparam T	Return type
+     */
+    template<typename T = void>
+    class [[nodiscard]] Task
+    {
+	public:
+	    struct promise_type : detail::Promise<T>
+	    {
+		Task get_return_object() noexcept
+		{
+		    return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		detail::FinalAwaiter<promise_type> final_suspend() const noexcept
+		{
+		    return {};
+		}
+	    };
+
+	    Task(Task&& Other) noexcept : m_Handle(std::exchange(Other.m_Handle, nullptr))
+	    {
+	    }
+
+	    Task(const Task&) = delete;
+	    Task& operator=(const Task&) = delete;
+	    Task& operator=(Task&&) = delete;
+
+	    ~Task()
+	    {
+		if(m_Handle)
+		{
+		    m_Handle.destroy();
+		}
+	    }
+
+	    /** @brief		Start the task on an executor. The task object must stay valid until it is done.
+	     *  @param Exec	Executor used to run the first part of the task
+	     */
+	    void Start(Executor& Exec) noexcept
+	    {
+		m_Start.Run = [](Work* p_Work)
+		{
+		    static_cast<StartWork*>(p_Work)->m_Handle.resume();
+		};
+		m_Start.m_Handle = m_Handle;
+		Exec.Submit(&m_Start);
+	    }
+
+	    bool isDone() const noexcept
+	    {
+		return m_Handle && m_Handle.done();
+	    }
+
+	    /** @brief	Get the result of a finished task.
+	     *  @return	Return value of the task
+	     */
+	    T Get() noexcept
+	    {
+		if constexpr(!std::is_void_v<T>)
+		{
+		    return std::move(*m_Handle.promise().m_Value);
+		}
+	    }
+
+	    bool await_ready() const noexcept
+	    {
+		return false;
+	    }
+
+	    std::coroutine_handle<> await_suspend(std::coroutine_handle<> Continuation) noexcept
+	    {
+		m_Handle.promise().m_Continuation = Continuation;
+
+		return m_Handle;
+	    }
+
+	    T await_resume() noexcept
+	    {
+		return Get();
+	    }
+
+	private:
+	    struct StartWork : Work
+	    {
+		std::coroutine_handle<> m_Handle;
+	    };
+
+	    explicit Task(std::coroutine_handle<promise_type> Handle) noexcept : m_Handle(Handle)
+	    {
+	    }
+
+	    std::coroutine_handle<promise_type> m_Handle;
+	    StartWork m_Start;
+    };
+
+    /** @brief		Awaitable which runs a function on an executor and resumes the awaiting coroutine afterwards.
+     *  @tparam Function	Function type
+     */
+    template<typename Function>
+    class [[nodiscard]] Operation : private Work
+    {
+	public:
+	    using Result_t = std::invoke_result_t<Function&>;
+
+	    Operation(Executor& Exec, Function Func) noexcept : m_Executor(Exec), m_Function(std::move(Func))
+	    {
+		Run = &Operation::Execute;
+	    }
+
+	    bool await_ready() const noexcept
+	    {
+		return false;
+	    }
+
+	    void await_suspend(std::coroutine_handle<> Handle) noexcept
+	    {
+		m_Handle = Handle;
+		m_Executor.Submit(this);
+	    }
+
+	    Result_t await_resume() noexcept
+	    {
+		return std::move(*m_Result);
+	    }
+
+	private:
+	    static void Execute(Work* p_Work) noexcept
+	    {
+		Operation* p_Operation = static_cast<Operation*>(p_Work);
+		p_Operation->m_Result.emplace(p_Operation->m_Function());
+
+		// The operation lives in the frame of the coroutine and may be gone after the resume
+		p_Operation->m_Handle.resume();
+	    }
+
+	    Executor& m_Executor;
+	    Function m_Function;
+	    std::coroutine_handle<> m_Handle;
+	    std::optional<Result_t> m_Result;
+    };
+
+    /** @brief		Awaitable file system operations.
+     *			All operations of one file system must use the same executor.
+     *  @tparam Geometry	Geometry of the file system
+     */
+    template<typename Geometry>
+    class AsyncFilesystem
+    {
+	public:
+	    AsyncFilesystem(Filesystem<Geometry>& FileSystem, Executor& Exec) noexcept : m_FileSystem(FileSystem), m_Executor(Exec)
+	    {
+	    }
+
+	    auto Open(const char* p_Path, int Flags) noexcept
+	    {
+		return Operation(m_Executor, [this, p_Path, Flags] { return m_FileSystem.Open(p_Path, Flags); });
+	    }
+
+	    auto Read(File<Geometry>& Handle, Span<uint8_t> Buffer) noexcept
+	    {
+		return Operation(m_Executor, [&Handle, Buffer] { return Handle.Read(Buffer); });
+	    }
+
+	    auto Write(File<Geometry>& Handle, Span<const uint8_t> Buffer) noexcept
+	    {
+		return Operation(m_Executor, [&Handle, Buffer] { return Handle.Write(Buffer); });
+	    }
+
+	    auto Seek(File<Geometry>& Handle, lfs_soff_t Offset, int Whence = LFS_SEEK_SET) noexcept
+	    {
+		return Operation(m_Executor, [&Handle, Offset, Whence] { return Handle.Seek(Offset, Whence); });
+	    }
+
+	    auto Sync(File<Geometry>& Handle) noexcept
+	    {
+		return Operation(m_Executor, [&Handle] { return Handle.Sync(); });
+	    }
+
+	    auto Close(File<Geometry>& Handle) noexcept
+	    {
+		return Operation(m_Executor, [&Handle] { return Handle.Close(); });
+	    }
+
+	    auto Mkdir(const char* p_Path) noexcept
+	    {
+		return Operation(m_Executor, [this, p_Path] { return m_FileSystem.Mkdir(p_Path); });
+	    }
+
+	    auto Remove(const char* p_Path) noexcept
+	    {
+		return Operation(m_Executor, [this, p_Path] { return m_FileSystem.Remove(p_Path); });
+	    }
+
+	    auto RemoveRecursive(const char* p_Path) noexcept
+	    {
+		return Operation(m_Executor, [this, p_Path] { return m_FileSystem.RemoveRecursive(p_Path); });
+	    }
+
+	    auto Rename(const char* p_OldPath, const char* p_NewPath) noexcept
+	    {
+		return Operation(m_Executor, [this, p_OldPath, p_NewPath] { return m_FileSystem.Rename(p_OldPath, p_NewPath); });
+	    }
+
+	    auto Stat(const char* p_Path) noexcept
+	    {
+		return Operation(m_Executor, [this, p_Path] { return m_FileSystem.Stat(p_Path); });
+	    }
+
+	private:
+	    Filesystem<Geometry>& m_FileSystem;
+	    Executor& m_Executor;
+    };
+ }
+
+#endif /* LFS_ASYNC_HPP_ */
@@ -0,0 +1,249 @@
+/*****************************************************************************/
+/**
+* @file lfs_async_bench.cpp
+*
+* Host benchmark for the C++20 coroutine layer of the LittleFS.
+*
+* A number of logical tasks append records to their own log file and sync
+* each record, under both executors. The flash memory is simulated in RAM.
+* Every access adds the time the S25FL064L would need (SPI transfer at
+* FILESYSTEM_SPI_FREQ_KHZ, page program and sector erase time from the
+* datasheet) to a simulated clock, so throughput and latency are given in
+* simulated time, i.e. host CPU time plus flash time.
+*
+* Build and run on the host:
+*   gcc -std=c99 -O2 -DLFS_NO_DEBUG -c littlefs/lfs.c littlefs/lfs_util.c
+*   g++ -std=c++20 -O2 -pthread -I. -Ilittlefs -ICypress/S25FL064L \
+*       lfs_async_bench.cpp lfs.o lfs_util.o -o lfs_async_bench
+*   ./lfs_async_bench
+*
+******************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "lfs_async.hpp"
+#include "S25FL064L_Defs.h"
+
+namespace
+{
+    /** @brief SPI clock in kHz, same as in filesystem.c.
+     */
+    constexpr uint64_t SPI_Freq_kHz = 8000;
+
+    /** @brief Size of a command header with a 3-byte address.
+     */
+    constexpr uint64_t Header_Size = 4;
+
+    using Geometry = littlefs::Geometry<256, 256, S25FL064L_SECTOR_SIZE, 512, 256, 64>;
+
+    /** @brief RAM flash memory with a simulated clock.
+     */
+    struct Flash
+    {
+	std::vector<uint8_t> Memory = std::vector<uint8_t>(Geometry::Block_Size * Geometry::Block_Count, 0xFF);
+	std::atomic<uint64_t> Busy_ns{0};
+	std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+
+	void Transfer(uint64_t Bytes)
+	{
+	    Busy_ns += ((Header_Size + Bytes) * 8 * 1000000) / SPI_Freq_kHz;
+	}
+
+	/** @brief	Get the simulated time since the start.
+	 *  @return	Time in ns
+	 */
+	uint64_t Now() const
+	{
+	    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Start).count()) + Busy_ns;
+	}
+    };
+
+    int Flash_Read(const struct lfs_config* p_Config, lfs_block_t Block, lfs_off_t Offset, void* p_Buffer, lfs_size_t Size)
+    {
+	Flash* p_Flash = static_cast<Flash*>(p_Config->context);
+
+	memcpy(p_Buffer, &p_Flash->Memory[(Block * p_Config->block_size) + Offset], Size);
+	p_Flash->Transfer(Size);
+
+	return 0;
+    }
+
+    int Flash_Prog(const struct lfs_config* p_Config, lfs_block_t Block, lfs_off_t Offset, const void* p_Buffer, lfs_size_t Size)
+    {
+	Flash* p_Flash = static_cast<Flash*>(p_Config->context);
+	const uint8_t* p_Data = static_cast<const uint8_t*>(p_Buffer);
+	uint32_t Address = (Block * p_Config->block_size) + Offset;
+
+	for(lfs_size_t i = 0; i < Size; i++)
+	{
+	    p_Flash->Memory[Address + i] &= p_Data[i];
+	}
+
+	// Each page is programmed with its own command
+	for(uint32_t Page = Address / S25FL064L_PAGE_SIZE; Page <= ((Address + Size - 1) / S25FL064L_PAGE_SIZE); Page++)
+	{
+	    p_Flash->Busy_ns += S25FL064L_TIME_PP_US * 1000ULL;
+	}
+	p_Flash->Transfer(Size);
+
+	return 0;
+    }
+
+    int Flash_Erase(const struct lfs_config* p_Config, lfs_block_t Block)
+    {
+	Flash* p_Flash = static_cast<Flash*>(p_Config->context);
+
+	memset(&p_Flash->Memory[Block * p_Config->block_size], 0xFF, p_Config->block_size);
+	p_Flash->Busy_ns += S25FL064L_TIME_SE_US * 1000ULL;
+	p_Flash->Transfer(0);
+
+	return 0;
+    }
+
+    int Flash_Sync(const struct lfs_config* p_Config)
+    {
+	(void)p_Config;
+
+	return 0;
+    }
+
+    /** @brief Results of a single logging task.
+     */
+    struct Log
+    {
+	std::vector<uint64_t> Latency_ns;
+	bool isFailed = false;
+    };
+
+    /** @brief		Append records to a log file and sync each of them.
+     *  @param Fs		Asynchronous file system
+     *  @param Memory	Flash memory for the clock
+     *  @param Id		Task ID
+     *  @param Records	Number of records
+     *  @param Length	Record length in bytes
+     *  @param Result	Results of the task
+     */
+    littlefs::Task<> Logger(littlefs::AsyncFilesystem<Geometry>& Fs, Flash& Memory, int Id, int Records, lfs_size_t Length, Log& Result)
+    {
+	char Path[16];
+	uint8_t Record[256];
+
+	snprintf(Path, sizeof(Path), "log%d", Id);
+	memset(Record, 'a' + Id, sizeof(Record));
+
+	auto Opened = co_await Fs.Open(Path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+	if(!Opened)
+	{
+	    Result.isFailed = true;
+	    co_return;
+	}
+	littlefs::File<Geometry> Handle = std::move(Opened).value();
+
+	for(int i = 0; i < Records; i++)
+	{
+	    uint64_t Start = Memory.Now();
+
+	    auto Written = co_await Fs.Write(Handle, littlefs::Span<const uint8_t>(Record, Length));
+	    auto Synced = co_await Fs.Sync(Handle);
+	    if(!Written || !Synced)
+	    {
+		Result.isFailed = true;
+		break;
+	    }
+
+	    Result.Latency_ns.push_back(Memory.Now() - Start);
+	}
+
+	(void)co_await Fs.Close(Handle);
+    }
+
+    /** @brief		Run the logging tasks on an executor and print the results.
+     *  @param p_Name	Name of the executor
+     *  @param Exec	Executor
+     *  @param Wait	Function which runs or waits for the executor until all tasks are done
+     *  @param Tasks	Number of concurrent tasks
+     *  @param Length	Record length in bytes
+     *  @return		true when successful
+     */
+    template<typename W>
+    bool Run(const char* p_Name, littlefs::Executor& Exec, W&& Wait, int Tasks, lfs_size_t Length)
+    {
+	constexpr int Total_Records = 2048;
+
+	Flash Memory;
+	littlefs::Filesystem<Geometry> FileSystem(Flash_Read, Flash_Prog, Flash_Erase, Flash_Sync, &Memory);
+	if(!FileSystem.Format() || !FileSystem.Mount())
+	{
+	    return false;
+	}
+
+	littlefs::AsyncFilesystem<Geometry> Fs(FileSystem, Exec);
+	std::vector<Log> Logs(Tasks);
+	std::vector<littlefs::Task<>> Loggers;
+
+	Loggers.reserve(Tasks);
+	uint64_t Start = Memory.Now();
+	for(int i = 0; i < Tasks; i++)
+	{
+	    Loggers.push_back(Logger(Fs, Memory, i, Total_Records / Tasks, Length, Logs[i]));
+	    Loggers.back().Start(Exec);
+	}
+
+	Wait(Loggers);
+	uint64_t Elapsed = Memory.Now() - Start;
+
+	std::vector<uint64_t> Latency;
+	for(const Log& Result : Logs)
+	{
+	    if(Result.isFailed)
+	    {
+		return false;
+	    }
+	    Latency.insert(Latency.end(), Result.Latency_ns.begin(), Result.Latency_ns.end());
+	}
+	std::sort(Latency.begin(), Latency.end());
+
+	double Seconds = Elapsed / 1e9;
+	printf("%-14s %5d %7u %10.1f %10.1f %9.2f %9.2f %9.2f\n", p_Name, Tasks, static_cast<unsigned>(Length),
+	       Latency.size() / Seconds, (Latency.size() * Length) / Seconds / 1024,
+	       Latency[Latency.size() / 2] / 1e6, Latency[(Latency.size() * 99) / 100] / 1e6, Latency.back() / 1e6);
+
+	return FileSystem.Unmount().has_value();
+    }
+}
+
+int main()
+{
+    printf("%-14s %5s %7s %10s %10s %9s %9s %9s\n", "executor", "tasks", "record", "records/s", "KiB/s", "p50 ms", "p99 ms", "max ms");
+
+    for(lfs_size_t Length : {32u, 256u})
+    {
+	for(int Tasks : {1, 4, 16})
+	{
+	    littlefs::EventLoop Loop;
+	    if(!Run("EventLoop", Loop, [&Loop](auto&) { Loop.Run(); }, Tasks, Length))
+	    {
+		return 1;
+	    }
+
+	    littlefs::ThreadExecutor Thread;
+	    if(!Run("ThreadExecutor", Thread, [&Thread](auto& Loggers)
+	    {
+		while(!std::all_of(Loggers.begin(), Loggers.end(), [](auto& Task) { return Task.isDone(); }))
+		{
+		    Thread.Drain();
+		}
+	    }, Tasks, Length))
+	    {
+		return 1;
+	    }
+	}
+    }
+
+    return 0;
+}
@@ -10,6 +10,65 @@
 #define LFS_BLOCK_NULL ((lfs_block_t)-1)
 #define LFS_BLOCK_INLINE ((lfs_block_t)-2)
 
+/// Geometry ///
+// all geometry is read through these accessors, each LFS_STATIC_* value that
+// is defined replaces the matching lfs_config field with a compile-time
+// constant, so the compiler can turn the block arithmetic in the hot paths
+// into shifts and masks
+static inline lfs_size_t lfs_read_size(const lfs_t *lfs) {
+#ifdef LFS_STATIC_READ_SIZE
+    (void)lfs;
+    return LFS_STATIC_READ_SIZE;
+#else
+    return lfs->cfg->read_size;
+#endif
+}
+
+static inline lfs_size_t lfs_prog_size(const lfs_t *lfs) {
+#ifdef LFS_STATIC_PROG_SIZE
+    (void)lfs;
+    return LFS_STATIC_PROG_SIZE;
+#else
+    return lfs->cfg->prog_size;
+#endif
+}
+
+static inline lfs_size_t lfs_block_size(const lfs_t *lfs) {
+#ifdef LFS_STATIC_BLOCK_SIZE
+    (void)lfs;
+    return LFS_STATIC_BLOCK_SIZE;
+#else
+    return lfs->cfg->block_size;
+#endif
+}
+
+static inline lfs_size_t lfs_block_count(const lfs_t *lfs) {
+#ifdef LFS_STATIC_BLOCK_COUNT
+    (void)lfs;
+    return LFS_STATIC_BLOCK_COUNT;
+#else
+    return lfs->cfg->block_count;
+#endif
+}
+
+static inline lfs_size_t lfs_cache_size(const lfs_t *lfs) {
+#ifdef LFS_STATIC_CACHE_SIZE
+    (void)lfs;
+    return LFS_STATIC_CACHE_SIZE;
+#else
+    return lfs->cfg->cache_size;
+#endif
+}
+
+static inline lfs_size_t lfs_lookahead_size(const lfs_t *lfs) {
+#ifdef LFS_STATIC_LOOKAHEAD_SIZE
+    (void)lfs;
+    return LFS_STATIC_LOOKAHEAD_SIZE;
+#else
+    return lfs->cfg->lookahead_size;
+#endif
+}
+
 /// Caching block device operations ///
 static inline void lfs_cache_drop(lfs_t *lfs, lfs_cache_t *rcache) {
     // do not zero, cheaper if cache is readonly or only going to be
@@ -20,22 +79,220 @@ static inline void lfs_cache_drop(lfs_t *lfs, lfs_cache_t *rcache) {
 
 static inline void lfs_cache_zero(lfs_t *lfs, lfs_cache_t *pcache) {
     // zero to avoid information leak
-    memset(pcache->buffer, 0xff, lfs->cfg->cache_size);
+    memset(pcache->buffer, 0xff, lfs_cache_size(lfs));
     pcache->block = LFS_BLOCK_NULL;
 }
 
+// route block device operations to either the metadata or data device,
+// data blocks are rebased so the data device always starts at block 0
+static inline bool lfs_bd_ismeta(lfs_t *lfs, lfs_block_t block) {
+    return block < lfs->cfg->metadata_block_count;
+}
+
+// when reading through a snapshot, metadata blocks are redirected to the
+// frozen copies taken when the snapshot was created
+static lfs_block_t lfs_bd_snapshotmap(const lfs_snapshot_t *snapshot,
+        lfs_block_t block) {
+    for (lfs_size_t i = 0; i < snapshot->count; i++) {
+        if (block == snapshot->pairs[i].pair[0] ||
+                block == snapshot->pairs[i].pair[1]) {
+            return snapshot->pairs[i].copy;
+        }
+    }
+
+    return block;
+}
+
+static int lfs_bd_rawread(lfs_t *lfs, lfs_block_t block,
+        lfs_off_t off, void *buffer, lfs_size_t size) {
+    if (lfs->snapshot) {
+        block = lfs_bd_snapshotmap(lfs->snapshot, block);
+    }
+
+    if (lfs_bd_ismeta(lfs, block)) {
+        return lfs->cfg->metadata_read(lfs->cfg, block, off, buffer, size);
+    }
+
+    return lfs->cfg->read(lfs->cfg,
+            block - lfs->cfg->metadata_block_count, off, buffer, size);
+}
+
+// vectored reads only ever cover file data, which is never snapshotted, the
+// regions are rebased in place and fall back to single reads if the data
+// device can't gather them or a region lives on the metadata device
+static int lfs_bd_rawreadv(lfs_t *lfs, struct lfs_iovec *iov,
+        lfs_size_t count) {
+    for (lfs_size_t i = 0; i < count; i++) {
+        if (!lfs->cfg->readv || lfs_bd_ismeta(lfs, iov[i].block)) {
+            for (lfs_size_t j = 0; j < count; j++) {
+                int err = lfs_bd_rawread(lfs, iov[j].block, iov[j].off,
+                        iov[j].buffer, iov[j].size);
+                if (err) {
+                    return err;
+                }
+            }
+
+            return 0;
+        }
+    }
+
+    for (lfs_size_t i = 0; i < count; i++) {
+        iov[i].block -= lfs->cfg->metadata_block_count;
+    }
+
+    return lfs->cfg->readv(lfs->cfg, iov, count);
+}
+
+#ifndef LFS_READONLY
+static int lfs_bd_rawprog(lfs_t *lfs, lfs_block_t block,
+        lfs_off_t off, const void *buffer, lfs_size_t size) {
+    if (lfs->snapshot) {
+        // snapshots are read-only
+        return LFS_ERR_INVAL;
+    }
+
+    // a block erased for a pending operation is no longer erased
+    if (block == lfs->erased.block) {
+        lfs->erased.block = LFS_BLOCK_NULL;
+    }
+
+    if (lfs_bd_ismeta(lfs, block)) {
+        return lfs->cfg->metadata_prog(lfs->cfg, block, off, buffer, size);
+    }
+
+    return lfs->cfg->prog(lfs->cfg,
+            block - lfs->cfg->metadata_block_count, off, buffer, size);
+}
+
+static int lfs_bd_rawerase(lfs_t *lfs, lfs_block_t block) {
+    if (lfs->snapshot) {
+        return LFS_ERR_INVAL;
+    }
+
+    if (lfs_bd_ismeta(lfs, block)) {
+        return lfs->cfg->metadata_erase(lfs->cfg, block);
+    }
+
+    return lfs->cfg->erase(lfs->cfg,
+            block - lfs->cfg->metadata_block_count);
+}
+
+static int lfs_bd_rawerasepoll(lfs_t *lfs, lfs_block_t block) {
+    LFS_ASSERT(!lfs_bd_ismeta(lfs, block));
+    return lfs->cfg->erase_poll(lfs->cfg,
+            block - lfs->cfg->metadata_block_count);
+}
+
+static int lfs_bd_rawsync(lfs_t *lfs) {
+    if (lfs->cfg->metadata_block_count) {
+        int err = lfs->cfg->metadata_sync(lfs->cfg);
+        LFS_ASSERT(err <= 0);
+        if (err) {
+            return err;
+        }
+    }
+
+    return lfs->cfg->sync(lfs->cfg);
+}
+#endif
+
+// reads through lfs->rcache or lfs->dcache may use any of the metadata or
+// data read caches, pick the one already holding the region being read or
+// else the least recently used one, any other cache is used as is
+static lfs_cache_t *lfs_rcache_select(lfs_t *lfs, lfs_cache_t *rcache,
+        lfs_block_t block, lfs_off_t off) {
+    struct lfs_rpool *rpool = &lfs->rpool;
+    struct lfs_rway *ways;
+    lfs_size_t count;
+    if (rcache == &lfs->rcache && rpool->mcount) {
+        ways = rpool->ways;
+        count = rpool->mcount;
+    } else if (rcache == lfs->dcache && rpool->dcount) {
+        ways = &rpool->ways[rpool->mcount];
+        count = rpool->dcount;
+    } else {
+        return rcache;
+    }
+
+    rpool->tick += 1;
+    lfs_cache_t *lru = NULL;
+    uint32_t *lrutick = NULL;
+    uint32_t lruage = 0;
+    if (rcache == &lfs->rcache) {
+        // the read cache itself is one of the metadata caches
+        if (rcache->block == block &&
+                off >= rcache->off && off < rcache->off + rcache->size) {
+            rpool->rtick = rpool->tick;
+            return rcache;
+        }
+
+        lru = rcache;
+        lrutick = &rpool->rtick;
+        lruage = (rcache->block == LFS_BLOCK_NULL)
+                ? 0xffffffff
+                : rpool->tick - rpool->rtick;
+    }
+
+    for (lfs_size_t i = 0; i < count; i++) {
+        lfs_cache_t *way = &ways[i].cache;
+        if (way->block == block &&
+                off >= way->off && off < way->off + way->size) {
+            ways[i].tick = rpool->tick;
+            return way;
+        }
+
+        // empty caches go first
+        uint32_t age = (way->block == LFS_BLOCK_NULL)
+                ? 0xffffffff
+                : rpool->tick - ways[i].tick;
+        if (!lru || age > lruage) {
+            lru = way;
+            lrutick = &ways[i].tick;
+            lruage = age;
+        }
+    }
+
+    *lrutick = rpool->tick;
+    return lru;
+}
+
+#ifndef LFS_READONLY
+// drop every read cache, needed when the blocks read change meaning
+static void lfs_rcache_dropall(lfs_t *lfs) {
+    lfs_cache_drop(lfs, &lfs->rcache);
+    for (lfs_size_t i = 0; i < lfs->rpool.mcount+lfs->rpool.dcount; i++) {
+        lfs_cache_drop(lfs, &lfs->rpool.ways[i].cache);
+    }
+}
+
+// drop the metadata and data read caches overlapping a region changing
+// on disk, the read cache itself is dropped by its users as before
+static void lfs_rcache_invalidate(lfs_t *lfs, lfs_block_t block,
+        lfs_off_t off, lfs_size_t size) {
+    for (lfs_size_t i = 0; i < lfs->rpool.mcount+lfs->rpool.dcount; i++) {
+        lfs_cache_t *rcache = &lfs->rpool.ways[i].cache;
+        if (rcache->block == block &&
+                off < rcache->off + rcache->size &&
+                rcache->off < off + size) {
+            lfs_cache_drop(lfs, rcache);
+        }
+    }
+}
+#endif
+
 static int lfs_bd_read(lfs_t *lfs,
-        const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
+        const lfs_cache_t *pcache, lfs_cache_t *shared, lfs_size_t hint,
         lfs_block_t block, lfs_off_t off,
         void *buffer, lfs_size_t size) {
     uint8_t *data = buffer;
-    if (block >= lfs->cfg->block_count ||
-            off+size > lfs->cfg->block_size) {
+    if (block >= lfs_block_count(lfs) ||
+            off+size > lfs_block_size(lfs)) {
         return LFS_ERR_CORRUPT;
     }
 
     while (size > 0) {
         lfs_size_t diff = size;
+        lfs_cache_t *rcache = lfs_rcache_select(lfs, shared, block, off);
 
         if (pcache && block == pcache->block &&
                 off < pcache->off + pcache->size) {
@@ -71,11 +328,11 @@ static int lfs_bd_read(lfs_t *lfs,
             diff = lfs_min(diff, rcache->off-off);
         }
 
-        if (size >= hint && off % lfs->cfg->read_size == 0 &&
-                size >= lfs->cfg->read_size) {
+        if (size >= hint && off % lfs_read_size(lfs) == 0 &&
+                size >= lfs_read_size(lfs)) {
             // bypass cache?
-            diff = lfs_aligndown(diff, lfs->cfg->read_size);
-            int err = lfs->cfg->read(lfs->cfg, block, off, data, diff);
+            diff = lfs_aligndown(diff, lfs_read_size(lfs));
+            int err = lfs_bd_rawread(lfs, block, off, data, diff);
             if (err) {
                 return err;
             }
@@ -87,19 +344,21 @@ static int lfs_bd_read(lfs_t *lfs,
         }
 
         // load to cache, first condition can no longer fail
-        LFS_ASSERT(block < lfs->cfg->block_count);
+        LFS_ASSERT(block < lfs_block_count(lfs));
         rcache->block = block;
-        rcache->off = lfs_aligndown(off, lfs->cfg->read_size);
+        rcache->off = lfs_aligndown(off, lfs_read_size(lfs));
         rcache->size = lfs_min(
                 lfs_min(
-                    lfs_alignup(off+hint, lfs->cfg->read_size),
-                    lfs->cfg->block_size)
+                    lfs_alignup(off+hint, lfs_read_size(lfs)),
+                    lfs_block_size(lfs))
                 - rcache->off,
-                lfs->cfg->cache_size);
-        int err = lfs->cfg->read(lfs->cfg, rcache->block,
+                lfs_cache_size(lfs));
+        int err = lfs_bd_rawread(lfs, rcache->block,
                 rcache->off, rcache->buffer, rcache->size);
         LFS_ASSERT(err <= 0);
         if (err) {
+            // don't leave a half-read cache behind
+            lfs_cache_drop(lfs, rcache);
             return err;
         }
     }
@@ -144,15 +403,17 @@ static int lfs_bd_cmp(lfs_t *lfs,
 static int lfs_bd_flush(lfs_t *lfs,
         lfs_cache_t *pcache, lfs_cache_t *rcache, bool validate) {
     if (pcache->block != LFS_BLOCK_NULL && pcache->block != LFS_BLOCK_INLINE) {
-        LFS_ASSERT(pcache->block < lfs->cfg->block_count);
-        lfs_size_t diff = lfs_alignup(pcache->size, lfs->cfg->prog_size);
-        int err = lfs->cfg->prog(lfs->cfg, pcache->block,
+        LFS_ASSERT(pcache->block < lfs_block_count(lfs));
+        lfs_size_t diff = lfs_alignup(pcache->size, lfs_prog_size(lfs));
+        int err = lfs_bd_rawprog(lfs, pcache->block,
                 pcache->off, pcache->buffer, diff);
         LFS_ASSERT(err <= 0);
         if (err) {
             return err;
         }
 
+        lfs_rcache_invalidate(lfs, pcache->block, pcache->off, diff);
+
         if (validate) {
             // check data on disk
             lfs_cache_drop(lfs, rcache);
@@ -185,7 +446,7 @@ static int lfs_bd_sync(lfs_t *lfs,
         return err;
     }
 
-    err = lfs->cfg->sync(lfs->cfg);
+    err = lfs_bd_rawsync(lfs);
     LFS_ASSERT(err <= 0);
     return err;
 }
@@ -197,16 +458,16 @@ static int lfs_bd_prog(lfs_t *lfs,
         lfs_block_t block, lfs_off_t off,
         const void *buffer, lfs_size_t size) {
     const uint8_t *data = buffer;
-    LFS_ASSERT(block == LFS_BLOCK_INLINE || block < lfs->cfg->block_count);
-    LFS_ASSERT(off + size <= lfs->cfg->block_size);
+    LFS_ASSERT(block == LFS_BLOCK_INLINE || block < lfs_block_count(lfs));
+    LFS_ASSERT(off + size <= lfs_block_size(lfs));
 
     while (size > 0) {
         if (block == pcache->block &&
                 off >= pcache->off &&
-                off < pcache->off + lfs->cfg->cache_size) {
+                off < pcache->off + lfs_cache_size(lfs)) {
             // already fits in pcache?
             lfs_size_t diff = lfs_min(size,
-                    lfs->cfg->cache_size - (off-pcache->off));
+                    lfs_cache_size(lfs) - (off-pcache->off));
             memcpy(&pcache->buffer[off-pcache->off], data, diff);
 
             data += diff;
@@ -214,7 +475,7 @@ static int lfs_bd_prog(lfs_t *lfs,
             size -= diff;
 
             pcache->size = lfs_max(pcache->size, off - pcache->off);
-            if (pcache->size == lfs->cfg->cache_size) {
+            if (pcache->size == lfs_cache_size(lfs)) {
                 // eagerly flush out pcache if we fill up
                 int err = lfs_bd_flush(lfs, pcache, rcache, validate);
                 if (err) {
@@ -231,7 +492,7 @@ static int lfs_bd_prog(lfs_t *lfs,
 
         // prepare pcache, first condition can no longer fail
         pcache->block = block;
-        pcache->off = lfs_aligndown(off, lfs->cfg->prog_size);
+        pcache->off = lfs_aligndown(off, lfs_prog_size(lfs));
         pcache->size = 0;
     }
 
@@ -240,12 +501,53 @@ static int lfs_bd_prog(lfs_t *lfs,
 #endif
 
 #ifndef LFS_READONLY
-static int lfs_bd_erase(lfs_t *lfs, lfs_block_t block) {
-    LFS_ASSERT(block < lfs->cfg->block_count);
-    int err = lfs->cfg->erase(lfs->cfg, block);
+// start erasing a block, the block device may leave the erase running and
+// return LFS_ERR_PENDING, only the operation started by the user can pass
+// that on, lfs_bd_erase waits for it
+static int lfs_bd_erasestart(lfs_t *lfs, lfs_block_t block) {
+    LFS_ASSERT(block < lfs_block_count(lfs));
+    lfs_rcache_invalidate(lfs, block, 0, lfs_block_size(lfs));
+
+    // an erase finished while its operation was pending isn't repeated,
+    // nothing was programmed to the block since
+    if (block == lfs->erased.block) {
+        int err = lfs->erased.err;
+        lfs->erased.block = LFS_BLOCK_NULL;
+        if (err != LFS_ERR_PENDING) {
+            return err;
+        }
+    }
+
+    int err = lfs_bd_rawerase(lfs, block);
     LFS_ASSERT(err <= 0);
+    LFS_ASSERT(err != LFS_ERR_PENDING ||
+            (lfs->cfg->erase_poll && !lfs_bd_ismeta(lfs, block)));
+    return err;
+}
+
+static int lfs_bd_erase(lfs_t *lfs, lfs_block_t block) {
+    int err = lfs_bd_erasestart(lfs, block);
+    while (err == LFS_ERR_PENDING) {
+        err = lfs_bd_rawerasepoll(lfs, block);
+        LFS_ASSERT(err <= 0);
+    }
+
     return err;
 }
+
+// the file of the operation being run for lfs_file_write_start,
+// lfs_file_sync_start or lfs_op_poll, only its erases can be left pending
+static lfs_file_t *lfs_op_file(lfs_t *lfs) {
+    return (lfs->op && lfs->op->running) ? lfs->op->file : NULL;
+}
+
+// leave an erase pending, the operation returns LFS_ERR_PENDING and
+// lfs_op_poll goes on with it once the erase is done
+static void lfs_op_pend(lfs_t *lfs, lfs_block_t block) {
+    lfs->op->erasing = block;
+    lfs->erased.block = block;
+    lfs->erased.err = LFS_ERR_PENDING;
+}
 #endif
 
 
@@ -351,13 +653,13 @@ struct lfs_diskoff {
 
 // operations on global state
 static inline void lfs_gstate_xor(lfs_gstate_t *a, const lfs_gstate_t *b) {
-    for (int i = 0; i < 3; i++) {
+    for (int i = 0; i < 4; i++) {
         ((uint32_t*)a)[i] ^= ((const uint32_t*)b)[i];
     }
 }
 
 static inline bool lfs_gstate_iszero(const lfs_gstate_t *a) {
-    for (int i = 0; i < 3; i++) {
+    for (int i = 0; i < 4; i++) {
         if (((uint32_t*)a)[i] != 0) {
             return false;
         }
@@ -386,12 +688,14 @@ static inline void lfs_gstate_fromle32(lfs_gstate_t *a) {
     a->tag     = lfs_fromle32(a->tag);
     a->pair[0] = lfs_fromle32(a->pair[0]);
     a->pair[1] = lfs_fromle32(a->pair[1]);
+    a->cursor  = lfs_fromle32(a->cursor);
 }
 
 static inline void lfs_gstate_tole32(lfs_gstate_t *a) {
     a->tag     = lfs_tole32(a->tag);
     a->pair[0] = lfs_tole32(a->pair[0]);
     a->pair[1] = lfs_tole32(a->pair[1]);
+    a->cursor  = lfs_tole32(a->cursor);
 }
 
 // other endianness operations
@@ -425,12 +729,21 @@ static inline void lfs_superblock_tole32(lfs_superblock_t *superblock) {
     superblock->attr_max    = lfs_tole32(superblock->attr_max);
 }
 
+// open handles are hashed by their metadata pair, the hash doesn't depend
+// on the order of the blocks since compaction swaps them
+static inline uint8_t lfs_mlist_bucket(const lfs_block_t pair[2]) {
+    return (uint8_t)((((pair[0] ^ pair[1]) * 0x9e3779b1) >> 16)
+            % LFS_MLIST_BUCKETS);
+}
+
 #ifndef LFS_NO_ASSERT
-static bool lfs_mlist_isopen(struct lfs_mlist *head,
-        struct lfs_mlist *node) {
-    for (struct lfs_mlist **p = &head; *p; p = &(*p)->next) {
-        if (*p == (struct lfs_mlist*)node) {
-            return true;
+static bool lfs_mlist_isopen(lfs_t *lfs, struct lfs_mlist *node) {
+    // node may not be open, so its bucket can't be trusted
+    for (int i = 0; i < LFS_MLIST_BUCKETS; i++) {
+        for (struct lfs_mlist *d = lfs->mlist[i]; d; d = d->next) {
+            if (d == node) {
+                return true;
+            }
         }
     }
 
@@ -439,7 +752,8 @@ static bool lfs_mlist_isopen(struct lfs_mlist *head,
 #endif
 
 static void lfs_mlist_remove(lfs_t *lfs, struct lfs_mlist *mlist) {
-    for (struct lfs_mlist **p = &lfs->mlist; *p; p = &(*p)->next) {
+    for (struct lfs_mlist **p = &lfs->mlist[mlist->bucket];
+            *p; p = &(*p)->next) {
         if (*p == mlist) {
             *p = (*p)->next;
             break;
@@ -448,10 +762,49 @@ static void lfs_mlist_remove(lfs_t *lfs, struct lfs_mlist *mlist) {
 }
 
 static void lfs_mlist_append(lfs_t *lfs, struct lfs_mlist *mlist) {
-    mlist->next = lfs->mlist;
-    lfs->mlist = mlist;
+    mlist->bucket = lfs_mlist_bucket(mlist->m.pair);
+    mlist->next = lfs->mlist[mlist->bucket];
+    lfs->mlist[mlist->bucket] = mlist;
+}
+
+// move an open handle to the right bucket after its pair changed
+static void lfs_mlist_rehash(lfs_t *lfs, struct lfs_mlist *mlist) {
+    if (lfs_mlist_bucket(mlist->m.pair) != mlist->bucket) {
+        lfs_mlist_remove(lfs, mlist);
+        lfs_mlist_append(lfs, mlist);
+    }
+}
+
+// handle operations
+static inline uint32_t *lfs_handle_gen(lfs_t *lfs, const lfs_block_t pair[2]) {
+    // pairs swap their blocks as they compact, so hash them in either
+    // order, a sum rather than xor since neighbouring pairs xor the same
+    return &lfs->hgen[(((pair[0] + pair[1]) * 0x9e3779b1) >> 16)
+            % LFS_HGEN_BUCKETS];
+}
+
+static inline void lfs_handle_stale(lfs_t *lfs, const lfs_block_t pair[2]) {
+    // entries in the pair moved or were renumbered, outstanding handles into
+    // it no longer point at the right place, zero is never used so zeroed
+    // handles are always stale. Directory cursors count positions across
+    // whole directories, so they go stale on any change
+    uint32_t *gen = lfs_handle_gen(lfs, pair);
+    *gen += 1;
+    *gen += !*gen;
+    lfs->gen += 1;
+    lfs->gen += !lfs->gen;
 }
 
+#ifndef LFS_READONLY
+static void lfs_hcache_drop(lfs_t *lfs) {
+    // a directory was moved or removed, remembered paths through it would
+    // no longer resolve to the same entries
+    for (lfs_size_t i = 0; i < lfs->cfg->handle_cache_size; i++) {
+        lfs->hcache[i].len = 0;
+    }
+}
+#endif
+
 
 /// Internal operations predeclared here ///
 #ifndef LFS_READONLY
@@ -463,19 +816,23 @@ static int lfs_dir_compact(lfs_t *lfs,
 
 static lfs_ssize_t lfs_file_rawwrite(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size);
+static lfs_ssize_t lfs_file_cachedwrite(lfs_t *lfs, lfs_file_t *file,
+        const void *buffer, lfs_size_t size);
 static int lfs_file_rawsync(lfs_t *lfs, lfs_file_t *file);
 static int lfs_file_outline(lfs_t *lfs, lfs_file_t *file);
+static int lfs_file_writeout(lfs_t *lfs, lfs_file_t *file);
 static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file);
 
 static int lfs_fs_preporphans(lfs_t *lfs, int8_t orphans);
 static void lfs_fs_prepmove(lfs_t *lfs,
         uint16_t id, const lfs_block_t pair[2]);
 static int lfs_fs_pred(lfs_t *lfs, const lfs_block_t dir[2],
-        lfs_mdir_t *pdir);
+        lfs_mdir_t *pdir, lfs_mdir_t *phead);
 static lfs_stag_t lfs_fs_parent(lfs_t *lfs, const lfs_block_t dir[2],
         lfs_mdir_t *parent);
 static int lfs_fs_relocate(lfs_t *lfs,
         const lfs_block_t oldpair[2], lfs_block_t newpair[2]);
+static int lfs_fs_desuperblock(lfs_t *lfs);
 static int lfs_fs_forceconsistency(lfs_t *lfs);
 #endif
 
@@ -486,6 +843,7 @@ static int lfs1_traverse(lfs_t *lfs,
 
 static int lfs_dir_rawrewind(lfs_t *lfs, lfs_dir_t *dir);
 
+static int lfs_file_borrow(lfs_t *lfs, lfs_file_t *file);
 static lfs_ssize_t lfs_file_rawread(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size);
 static int lfs_file_rawclose(lfs_t *lfs, lfs_file_t *file);
@@ -499,16 +857,35 @@ static int lfs_fs_rawtraverse(lfs_t *lfs,
 static int lfs_deinit(lfs_t *lfs);
 static int lfs_rawunmount(lfs_t *lfs);
 
+#ifndef LFS_READONLY
+static int lfs_snapshot_traverse(lfs_t *lfs, const lfs_snapshot_t *snapshot,
+        int (*cb)(void *data, lfs_block_t block), void *data,
+        bool includeorphans);
+#endif
+
 
 /// Block allocator ///
+// offsets into the allocator's region never exceed twice its size, so a
+// compare and subtract is enough to wrap them, which avoids a division for
+// every block seen during a lookahead scan
+static inline lfs_block_t lfs_alloc_wrap(const struct lfs_free *free,
+        lfs_block_t off) {
+    return (off >= free->count) ? off - free->count : off;
+}
+
 #ifndef LFS_READONLY
 static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
-    lfs_t *lfs = (lfs_t*)p;
-    lfs_block_t off = ((block - lfs->free.off)
-            + lfs->cfg->block_count) % lfs->cfg->block_count;
+    struct lfs_free *free = (struct lfs_free*)p;
+    if (block - free->begin >= free->count) {
+        // belongs to the other device
+        return 0;
+    }
+
+    lfs_block_t off = lfs_alloc_wrap(free,
+            (block - free->begin - free->off) + free->count);
 
-    if (off < lfs->free.size) {
-        lfs->free.buffer[off / 32] |= 1U << (off % 32);
+    if (off < free->size) {
+        free->buffer[off / 32] |= 1U << (off % 32);
     }
 
     return 0;
@@ -519,7 +896,15 @@ static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
 // is to prevent blocks from being garbage collected in the middle of a
 // commit operation
 static void lfs_alloc_ack(lfs_t *lfs) {
-    lfs->free.ack = lfs->cfg->block_count;
+    lfs->free.ack = lfs->free.count;
+    lfs->mfree.ack = lfs->mfree.count;
+}
+
+// forget the wear candidates, the window they were taken from changed
+static void lfs_alloc_wearreset(lfs_t *lfs) {
+    lfs->wear.count = 0;
+    lfs->wear.floor = 0;
+    lfs->wear.resume = 0;
 }
 
 // drop the lookahead buffer, this is done during mounting and failed
@@ -527,53 +912,262 @@ static void lfs_alloc_ack(lfs_t *lfs) {
 static void lfs_alloc_drop(lfs_t *lfs) {
     lfs->free.size = 0;
     lfs->free.i = 0;
+    lfs->free.reserved = 0;
+    lfs->mfree.size = 0;
+    lfs->mfree.i = 0;
+    lfs->mfree.reserved = 0;
+    lfs_alloc_wearreset(lfs);
     lfs_alloc_ack(lfs);
 }
 
 #ifndef LFS_READONLY
-static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
+// move the lookahead window forward and find the mask of free blocks in it
+static int lfs_alloc_scan(lfs_t *lfs, struct lfs_free *free) {
+    free->off = lfs_alloc_wrap(free, free->off + free->size);
+    free->size = lfs_min(8*lfs_lookahead_size(lfs), free->ack);
+    free->i = 0;
+    if (free == &lfs->free) {
+        lfs_alloc_wearreset(lfs);
+    }
+
+    // find mask of free blocks from tree
+    memset(free->buffer, 0, lfs_lookahead_size(lfs));
+    int err = lfs_fs_rawtraverse(lfs, lfs_alloc_lookahead, free, true);
+    if (err) {
+        lfs_alloc_drop(lfs);
+        return err;
+    }
+
+    return 0;
+}
+
+// skip blocks in use so an alloc ack can discredit old lookahead blocks
+static void lfs_alloc_skip(struct lfs_free *free) {
+    while (free->i != free->size &&
+            (free->buffer[free->i / 32] & (1U << (free->i % 32)))) {
+        free->i += 1;
+        free->ack -= 1;
+    }
+}
+
+// remember the least worn free blocks left in the lookahead window, in
+// order of wear and then position, no free block left in the window wears
+// less than the floor, so the pass stops early once every candidate is at
+// the floor
+//
+// a pass that stopped early left no block at the floor behind, so the next
+// pass for the same floor picks up where it stopped, and only wraps around
+// to the start of the window if it runs out of blocks at the floor
+static int lfs_alloc_wearpass(lfs_t *lfs, struct lfs_free *free) {
+    struct lfs_wear *w = &lfs->wear;
+    w->count = 0;
+    lfs_block_t start = lfs_max(w->resume, free->i);
+    for (lfs_block_t k = 0; k < free->size - free->i; k++) {
+        lfs_block_t off = start + k;
+        if (off >= free->size) {
+            off -= free->size - free->i;
+        }
+
+        if (free->buffer[off / 32] & (1U << (off % 32))) {
+            continue;
+        }
+
+        int32_t wear = lfs->cfg->wear(lfs->cfg,
+                free->begin + lfs_alloc_wrap(free, free->off + off)
+                    - lfs->cfg->metadata_block_count);
+        if (wear < 0) {
+            return wear;
+        }
+
+        lfs_size_t j = w->count;
+        if (j == LFS_WEAR_CANDIDATES) {
+            if (wear > w->wear[j-1] ||
+                    (wear == w->wear[j-1] && off > w->off[j-1])) {
+                continue;
+            }
+            j -= 1;
+        } else {
+            w->count += 1;
+        }
+
+        while (j > 0 && (w->wear[j-1] > wear ||
+                (w->wear[j-1] == wear && w->off[j-1] > off))) {
+            w->off[j] = w->off[j-1];
+            w->wear[j] = w->wear[j-1];
+            j -= 1;
+        }
+        w->off[j] = off;
+        w->wear[j] = wear;
+
+        if (w->count == LFS_WEAR_CANDIDATES &&
+                w->wear[w->count-1] <= w->floor) {
+            w->resume = off+1;
+            return 0;
+        }
+    }
+
+    // looked at the whole window, the candidates may be above the floor
+    w->resume = 0;
+    return 0;
+}
+
+// hand out the least worn free block left in the lookahead window, it is
+// marked in use so the window's later allocations skip it, the wear of
+// the window's blocks is asked for once per pass rather than once per
+// allocation
+static int lfs_alloc_wear(lfs_t *lfs, struct lfs_free *free,
+        lfs_block_t *block) {
+    struct lfs_wear *w = &lfs->wear;
+    while (true) {
+        if (w->count == 0) {
+            int err = lfs_alloc_wearpass(lfs, free);
+            if (err) {
+                return err;
+            }
+
+            if (w->count == 0) {
+                return LFS_ERR_NOSPC;
+            }
+        }
+
+        lfs_block_t off = w->off[0];
+        int32_t wear = w->wear[0];
+        w->count -= 1;
+        memmove(&w->off[0], &w->off[1], w->count*sizeof(lfs_block_t));
+        memmove(&w->wear[0], &w->wear[1], w->count*sizeof(int32_t));
+
+        // candidates may have been taken or skipped since the pass
+        if (off < free->i || (free->buffer[off / 32] & (1U << (off % 32)))) {
+            continue;
+        }
+
+        w->floor = wear;
+        free->buffer[off / 32] |= 1U << (off % 32);
+        *block = free->begin + lfs_alloc_wrap(free, free->off + off);
+        lfs_alloc_skip(free);
+        return 0;
+    }
+}
+
+static int lfs_alloc_from(lfs_t *lfs, struct lfs_free *free,
+        bool wear, lfs_block_t *block) {
+    // runs lined up by lfs_alloc_reserve are handed out in order
+    wear = wear && free->reserved == 0;
+    if (free->reserved > 0) {
+        free->reserved -= 1;
+    }
+
     while (true) {
-        while (lfs->free.i != lfs->free.size) {
-            lfs_block_t off = lfs->free.i;
-            lfs->free.i += 1;
-            lfs->free.ack -= 1;
+        if (wear) {
+            int err = lfs_alloc_wear(lfs, free, block);
+            if (err != LFS_ERR_NOSPC) {
+                return err;
+            }
+
+            // nothing free in this window
+            free->ack -= free->size - free->i;
+            free->i = free->size;
+        }
 
-            if (!(lfs->free.buffer[off / 32] & (1U << (off % 32)))) {
+        while (free->i != free->size) {
+            lfs_block_t off = free->i;
+            free->i += 1;
+            free->ack -= 1;
+
+            if (!(free->buffer[off / 32] & (1U << (off % 32)))) {
                 // found a free block
-                *block = (lfs->free.off + off) % lfs->cfg->block_count;
+                *block = free->begin + lfs_alloc_wrap(free, free->off + off);
 
                 // eagerly find next off so an alloc ack can
                 // discredit old lookahead blocks
-                while (lfs->free.i != lfs->free.size &&
-                        (lfs->free.buffer[lfs->free.i / 32]
-                            & (1U << (lfs->free.i % 32)))) {
-                    lfs->free.i += 1;
-                    lfs->free.ack -= 1;
-                }
-
+                lfs_alloc_skip(free);
                 return 0;
             }
         }
 
         // check if we have looked at all blocks since last ack
-        if (lfs->free.ack == 0) {
+        if (free->ack == 0) {
             LFS_ERROR("No more free space %"PRIu32,
-                    lfs->free.i + lfs->free.off);
+                    free->begin + free->i + free->off);
             return LFS_ERR_NOSPC;
         }
 
-        lfs->free.off = (lfs->free.off + lfs->free.size)
-                % lfs->cfg->block_count;
-        lfs->free.size = lfs_min(8*lfs->cfg->lookahead_size, lfs->free.ack);
-        lfs->free.i = 0;
+        int err = lfs_alloc_scan(lfs, free);
+        if (err) {
+            return err;
+        }
+    }
+}
+
+// the sequential policies keep the data allocator's position in the
+// gstate, so the next commit takes it to disk
+static void lfs_alloc_setcursor(lfs_t *lfs) {
+    if (lfs->cfg->alloc_policy != LFS_ALLOC_RANDOM) {
+        lfs->gstate.cursor = lfs_alloc_wrap(&lfs->free,
+                lfs->free.off + lfs->free.i);
+    }
+}
+
+// allocate a block for file data
+static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
+    return lfs_alloc_from(lfs, &lfs->free,
+            lfs->cfg->alloc_policy == LFS_ALLOC_WEAR, block);
+}
+
+// allocate a block for a metadata pair, which lives on the metadata block
+// device if one is provided, the wear policy only applies to file data
+static int lfs_alloc_meta(lfs_t *lfs, lfs_block_t *block) {
+    return lfs_alloc_from(lfs,
+            (lfs->cfg->metadata_block_count) ? &lfs->mfree : &lfs->free,
+            false, block);
+}
+
+// line up the data allocator with a run of n contiguous free blocks, so the
+// next n allocations are sequential, the run must fit in the lookahead
+// window and can't wrap around the end of the device
+static int lfs_alloc_reserve(lfs_t *lfs, lfs_block_t n) {
+    struct lfs_free *free = &lfs->free;
+    if (n > 8*lfs_lookahead_size(lfs) || n > free->count) {
+        return LFS_ERR_NOSPC;
+    }
+
+    lfs_block_t scanned = 0;
+    while (true) {
+        lfs_block_t run = 0;
+        for (lfs_block_t off = free->i; off < free->size; off++) {
+            if (free->buffer[off / 32] & (1U << (off % 32))) {
+                run = 0;
+                continue;
+            }
+
+            if (lfs_alloc_wrap(free, free->off + off) == 0) {
+                // wrapped around, not contiguous with the previous block
+                run = 0;
+            }
+
+            run += 1;
+            if (run == n) {
+                // skip ahead to the start of the run
+                lfs_block_t start = off+1 - n;
+                free->ack -= start - free->i;
+                free->i = start;
+                free->reserved = n;
+                return 0;
+            }
+        }
+
+        // not in this window, look at the next one
+        if (scanned >= free->count || free->ack <= free->size - free->i) {
+            return LFS_ERR_NOSPC;
+        }
 
-        // find mask of free blocks from tree
-        memset(lfs->free.buffer, 0, lfs->cfg->lookahead_size);
-        int err = lfs_fs_rawtraverse(lfs, lfs_alloc_lookahead, lfs, true);
+        free->ack -= free->size - free->i;
+        free->i = free->size;
+        int err = lfs_alloc_scan(lfs, free);
         if (err) {
-            lfs_alloc_drop(lfs);
             return err;
         }
+        scanned += free->size;
     }
 }
 #endif
@@ -653,7 +1247,7 @@ static int lfs_dir_getread(lfs_t *lfs, const lfs_mdir_t *dir,
         lfs_tag_t gmask, lfs_tag_t gtag,
         lfs_off_t off, void *buffer, lfs_size_t size) {
     uint8_t *data = buffer;
-    if (off+size > lfs->cfg->block_size) {
+    if (off+size > lfs_block_size(lfs)) {
         return LFS_ERR_CORRUPT;
     }
 
@@ -696,9 +1290,9 @@ static int lfs_dir_getread(lfs_t *lfs, const lfs_mdir_t *dir,
 
         // load to cache, first condition can no longer fail
         rcache->block = LFS_BLOCK_INLINE;
-        rcache->off = lfs_aligndown(off, lfs->cfg->read_size);
-        rcache->size = lfs_min(lfs_alignup(off+hint, lfs->cfg->read_size),
-                lfs->cfg->cache_size);
+        rcache->off = lfs_aligndown(off, lfs_read_size(lfs));
+        rcache->size = lfs_min(lfs_alignup(off+hint, lfs_read_size(lfs)),
+                lfs_cache_size(lfs));
         int err = lfs_dir_getslice(lfs, dir, gmask, gtag,
                 rcache->off, rcache->buffer, rcache->size);
         if (err < 0) {
@@ -845,7 +1439,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
 
     // if either block address is invalid we return LFS_ERR_CORRUPT here,
     // otherwise later writes to the pair could fail
-    if (pair[0] >= lfs->cfg->block_count || pair[1] >= lfs->cfg->block_count) {
+    if (pair[0] >= lfs_block_count(lfs) || pair[1] >= lfs_block_count(lfs)) {
         return LFS_ERR_CORRUPT;
     }
 
@@ -880,6 +1474,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
         uint16_t tempcount = 0;
         lfs_block_t temptail[2] = {LFS_BLOCK_NULL, LFS_BLOCK_NULL};
         bool tempsplit = false;
+        lfs_block_t tempdirindex = LFS_BLOCK_NULL;
         lfs_stag_t tempbesttag = besttag;
 
         dir->rev = lfs_tole32(dir->rev);
@@ -891,7 +1486,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
             lfs_tag_t tag;
             off += lfs_tag_dsize(ptag);
             int err = lfs_bd_read(lfs,
-                    NULL, &lfs->rcache, lfs->cfg->block_size,
+                    NULL, &lfs->rcache, lfs_block_size(lfs),
                     dir->pair[0], off, &tag, sizeof(tag));
             if (err) {
                 if (err == LFS_ERR_CORRUPT) {
@@ -908,9 +1503,9 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
             // next commit not yet programmed or we're not in valid range
             if (!lfs_tag_isvalid(tag)) {
                 dir->erased = (lfs_tag_type1(ptag) == LFS_TYPE_CRC &&
-                        dir->off % lfs->cfg->prog_size == 0);
+                        dir->off % lfs_prog_size(lfs) == 0);
                 break;
-            } else if (off + lfs_tag_dsize(tag) > lfs->cfg->block_size) {
+            } else if (off + lfs_tag_dsize(tag) > lfs_block_size(lfs)) {
                 dir->erased = false;
                 break;
             }
@@ -921,7 +1516,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                 // check the crc attr
                 uint32_t dcrc;
                 err = lfs_bd_read(lfs,
-                        NULL, &lfs->rcache, lfs->cfg->block_size,
+                        NULL, &lfs->rcache, lfs_block_size(lfs),
                         dir->pair[0], off+sizeof(tag), &dcrc, sizeof(dcrc));
                 if (err) {
                     if (err == LFS_ERR_CORRUPT) {
@@ -954,6 +1549,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                 dir->tail[0] = temptail[0];
                 dir->tail[1] = temptail[1];
                 dir->split = tempsplit;
+                dir->dirindex = tempdirindex;
 
                 // reset crc
                 crc = 0xffffffff;
@@ -964,7 +1560,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
             for (lfs_off_t j = sizeof(tag); j < lfs_tag_dsize(tag); j++) {
                 uint8_t dat;
                 err = lfs_bd_read(lfs,
-                        NULL, &lfs->rcache, lfs->cfg->block_size,
+                        NULL, &lfs->rcache, lfs_block_size(lfs),
                         dir->pair[0], off+j, &dat, 1);
                 if (err) {
                     if (err == LFS_ERR_CORRUPT) {
@@ -997,7 +1593,7 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                 tempsplit = (lfs_tag_chunk(tag) & 1);
 
                 err = lfs_bd_read(lfs,
-                        NULL, &lfs->rcache, lfs->cfg->block_size,
+                        NULL, &lfs->rcache, lfs_block_size(lfs),
                         dir->pair[0], off+sizeof(tag), &temptail, 8);
                 if (err) {
                     if (err == LFS_ERR_CORRUPT) {
@@ -1006,6 +1602,19 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
                     }
                 }
                 lfs_pair_fromle32(temptail);
+            } else if (lfs_tag_type3(tag) == LFS_TYPE_DIRINDEX) {
+                err = lfs_bd_read(lfs,
+                        NULL, &lfs->rcache, lfs_block_size(lfs),
+                        dir->pair[0], off+sizeof(tag),
+                        &tempdirindex, sizeof(tempdirindex));
+                if (err) {
+                    if (err == LFS_ERR_CORRUPT) {
+                        dir->erased = false;
+                        break;
+                    }
+                    return err;
+                }
+                tempdirindex = lfs_fromle32(tempdirindex);
             }
 
             // found a match for our fetcher?
@@ -1100,6 +1709,11 @@ static int lfs_dir_getgstate(lfs_t *lfs, const lfs_mdir_t *dir,
 
 static int lfs_dir_getinfo(lfs_t *lfs, lfs_mdir_t *dir,
         uint16_t id, struct lfs_info *info) {
+    info->handle.pair[0] = dir->pair[0];
+    info->handle.pair[1] = dir->pair[1];
+    info->handle.id = id;
+    info->handle.gen = *lfs_handle_gen(lfs, dir->pair);
+
     if (id == 0x3ff) {
         // special case for root
         strcpy(info->name, "/");
@@ -1123,7 +1737,8 @@ static int lfs_dir_getinfo(lfs_t *lfs, lfs_mdir_t *dir,
     }
     lfs_ctz_fromle32(&ctz);
 
-    if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT) {
+    if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT ||
+            lfs_tag_type3(tag) == LFS_TYPE_INDEXSTRUCT) {
         info->size = ctz.size;
     } else if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
         info->size = lfs_tag_size(tag);
@@ -1132,11 +1747,202 @@ static int lfs_dir_getinfo(lfs_t *lfs, lfs_mdir_t *dir,
     return 0;
 }
 
-struct lfs_dir_find_match {
-    lfs_t *lfs;
-    const void *name;
-    lfs_size_t size;
-};
+// Reads the entries from id begin onwards in one backwards pass over the
+// log, where lfs_dir_getinfo walks the log twice per entry. The count
+// entries from entries[slot] on are filled and compacted, entries without
+// a name (the superblock or a pending move) are dropped. Returns the number
+// of ids consumed, which is short of count if the name buffer runs out.
+static lfs_ssize_t lfs_dir_getbatch(lfs_t *lfs, const lfs_mdir_t *dir,
+        uint16_t begin, struct lfs_dirent *entries, lfs_size_t slot,
+        lfs_size_t count, const struct lfs_dir_batch *batch,
+        lfs_size_t *nameoff, lfs_size_t *filled) {
+    struct lfs_dirent *e = &entries[slot];
+    lfs_size_t attrcount = (batch) ? batch->attr_count : 0;
+
+    // the entries double as scratch space during the scan, handle.id is the
+    // entry's id at the current point in the log, handle.pair is where its
+    // name lives and handle.gen marks the attrs already resolved
+    lfs_size_t active = count;
+    for (lfs_size_t i = 0; i < count; i++) {
+        e[i].type = 0;
+        e[i].size = (lfs_size_t)-1;
+        e[i].name = NULL;
+        e[i].attrs = 0;
+        e[i].handle.pair[0] = 0;
+        e[i].handle.pair[1] = 0;
+        e[i].handle.id = begin + i;
+        e[i].handle.gen = 0;
+
+        if (lfs_gstate_hasmovehere(&lfs->gdisk, dir->pair) &&
+                lfs_tag_id(lfs->gdisk.tag) <= begin + i) {
+            // synthetic moves
+            e[i].handle.id += 1;
+        }
+    }
+
+    // iterate over dir block backwards, the first tag found is the most
+    // recent one
+    lfs_off_t off = dir->off;
+    lfs_tag_t ntag = dir->etag;
+    while (active > 0 && off >= sizeof(lfs_tag_t) + lfs_tag_dsize(ntag)) {
+        off -= lfs_tag_dsize(ntag);
+        lfs_tag_t tag = ntag;
+        int err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, sizeof(ntag),
+                dir->pair[0], off, &ntag, sizeof(ntag));
+        if (err) {
+            return err;
+        }
+
+        ntag = (lfs_frombe32(ntag) ^ tag) & 0x7fffffff;
+
+        if (lfs_tag_id(tag) == 0x3ff) {
+            continue;
+        }
+
+        for (lfs_size_t i = 0; i < count; i++) {
+            if (e[i].handle.id == 0x3ff) {
+                continue;
+            }
+
+            if (lfs_tag_type1(tag) == LFS_TYPE_SPLICE) {
+                if (lfs_tag_id(tag) > e[i].handle.id) {
+                    continue;
+                }
+
+                if (tag == LFS_MKTAG(LFS_TYPE_CREATE, e[i].handle.id, 0)) {
+                    // found where we were created
+                    e[i].handle.id = 0x3ff;
+                    active -= 1;
+                } else {
+                    // move around splices
+                    e[i].handle.id -= lfs_tag_splice(tag);
+                }
+                continue;
+            }
+
+            if (lfs_tag_id(tag) != e[i].handle.id) {
+                continue;
+            }
+
+            if ((tag & LFS_MKTAG(0x780, 0, 0)) ==
+                    LFS_MKTAG(LFS_TYPE_NAME, 0, 0)) {
+                if (e[i].type == 0) {
+                    e[i].type = lfs_tag_type3(tag);
+                    e[i].handle.pair[0] = off+sizeof(tag);
+                    e[i].handle.pair[1] = lfs_min(lfs_tag_size(tag),
+                            lfs->name_max);
+                }
+            } else if (lfs_tag_type1(tag) == LFS_TYPE_STRUCT) {
+                if (e[i].size != (lfs_size_t)-1) {
+                    // already resolved
+                } else if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT ||
+                        lfs_tag_type3(tag) == LFS_TYPE_INDEXSTRUCT) {
+                    struct lfs_ctz ctz;
+                    err = lfs_bd_read(lfs,
+                            NULL, &lfs->rcache, sizeof(ctz),
+                            dir->pair[0], off+sizeof(tag), &ctz, sizeof(ctz));
+                    if (err) {
+                        return err;
+                    }
+                    lfs_ctz_fromle32(&ctz);
+                    e[i].size = ctz.size;
+                } else if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
+                    e[i].size = lfs_tag_size(tag);
+                } else {
+                    e[i].size = 0;
+                }
+            } else if (lfs_tag_type1(tag) == LFS_TYPE_USERATTR) {
+                for (lfs_size_t j = 0; j < attrcount; j++) {
+                    const struct lfs_attr *a = &batch->attrs[j];
+                    if (lfs_tag_type3(tag) != LFS_TYPE_USERATTR + a->type ||
+                            (e[i].handle.gen & (1U << j))) {
+                        continue;
+                    }
+
+                    e[i].handle.gen |= 1U << j;
+                    if (lfs_tag_isdelete(tag)) {
+                        continue;
+                    }
+
+                    uint8_t *buffer = (uint8_t*)a->buffer + (slot+i)*a->size;
+                    lfs_size_t diff = lfs_min(lfs_tag_size(tag), a->size);
+                    err = lfs_bd_read(lfs,
+                            NULL, &lfs->rcache, diff,
+                            dir->pair[0], off+sizeof(tag), buffer, diff);
+                    if (err) {
+                        return err;
+                    }
+
+                    memset(buffer + diff, 0, a->size - diff);
+                    e[i].attrs |= 1U << j;
+                }
+            }
+
+            // ids are unique, no other entry can match
+            break;
+        }
+    }
+
+    // compact the entries in id order and copy out their names
+    lfs_size_t n = 0;
+    lfs_size_t i = 0;
+    for (; i < count; i++) {
+        if (e[i].type == 0) {
+            continue;
+        }
+
+        const char *name = NULL;
+        if (batch && batch->name_buffer) {
+            lfs_size_t nlen = e[i].handle.pair[1];
+            if (*nameoff + nlen+1 > batch->name_size) {
+                break;
+            }
+
+            char *buffer = batch->name_buffer + *nameoff;
+            int err = lfs_bd_read(lfs,
+                    NULL, &lfs->rcache, nlen,
+                    dir->pair[0], e[i].handle.pair[0], buffer, nlen);
+            if (err) {
+                return err;
+            }
+
+            buffer[nlen] = '\0';
+            *nameoff += nlen+1;
+            name = buffer;
+        }
+
+        for (lfs_size_t j = 0; j < attrcount; j++) {
+            const struct lfs_attr *a = &batch->attrs[j];
+            uint8_t *buffer = (uint8_t*)a->buffer + (slot+n)*a->size;
+            if (!(e[i].attrs & (1U << j))) {
+                memset(buffer, 0, a->size);
+            } else if (n != i) {
+                memcpy(buffer, (uint8_t*)a->buffer + (slot+i)*a->size,
+                        a->size);
+            }
+        }
+
+        e[n].type = e[i].type;
+        e[n].size = (e[i].size == (lfs_size_t)-1) ? 0 : e[i].size;
+        e[n].name = name;
+        e[n].attrs = e[i].attrs;
+        e[n].handle.pair[0] = dir->pair[0];
+        e[n].handle.pair[1] = dir->pair[1];
+        e[n].handle.id = begin + i;
+        e[n].handle.gen = *lfs_handle_gen(lfs, dir->pair);
+        n += 1;
+    }
+
+    *filled = n;
+    return i;
+}
+
+struct lfs_dir_find_match {
+    lfs_t *lfs;
+    const void *name;
+    lfs_size_t size;
+};
 
 static int lfs_dir_find_match(void *data,
         lfs_tag_t tag, const void *buffer) {
@@ -1162,6 +1968,93 @@ static int lfs_dir_find_match(void *data,
     return LFS_CMP_EQ;
 }
 
+// a directory index is a single block listing the pairs of a directory
+// after its head, each entry holds the leading bytes of the first name in
+// a pair, zero padded, followed by the pair. Entries are in directory order
+// and so sorted by name, a trailer at the end of the block holds the number
+// of entries and the number of pairs seen when the index was built.
+//
+// The index is only ever a hint, pairs split off after it was built are
+// simply not in it. Anything that takes a pair out of the directory or
+// moves it first swaps in a copy of the index without or with the pair.
+#define LFS_DIRINDEX_KEY 16
+#define LFS_DIRINDEX_ENTRY (LFS_DIRINDEX_KEY + 2*sizeof(lfs_block_t))
+
+static inline lfs_size_t lfs_dirindex_cap(lfs_t *lfs) {
+    // the trailer needs a prog unit to itself
+    return lfs_aligndown(lfs_block_size(lfs) - 2*sizeof(uint32_t),
+            lfs_prog_size(lfs)) / LFS_DIRINDEX_ENTRY;
+}
+
+static int lfs_dirindex_trailer(lfs_t *lfs, lfs_block_t block,
+        uint32_t trailer[2]) {
+    int err = lfs_bd_read(lfs,
+            NULL, &lfs->rcache, 2*sizeof(uint32_t),
+            block, lfs_block_size(lfs) - 2*sizeof(uint32_t),
+            trailer, 2*sizeof(uint32_t));
+    if (err) {
+        return err;
+    }
+
+    trailer[0] = lfs_fromle32(trailer[0]);
+    trailer[1] = lfs_fromle32(trailer[1]);
+    if (trailer[0] > lfs_dirindex_cap(lfs)) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    return 0;
+}
+
+// find the last indexed pair whose first name sorts before name, lookups
+// can start there since every name in earlier pairs sorts before it too,
+// leaves pair untouched if the name belongs in the head or first pairs
+static int lfs_dirindex_find(lfs_t *lfs, lfs_block_t block,
+        const char *name, lfs_size_t namelen, lfs_block_t pair[2]) {
+    uint8_t key[LFS_DIRINDEX_KEY] = {0};
+    memcpy(key, name, lfs_min(namelen, LFS_DIRINDEX_KEY));
+
+    uint32_t trailer[2];
+    int err = lfs_dirindex_trailer(lfs, block, trailer);
+    if (err) {
+        return err;
+    }
+
+    // keys are strictly below the name only if the names are, equal keys
+    // could hide a longer first name, so those can't be skipped
+    lfs_size_t lo = 0;
+    lfs_size_t hi = trailer[0];
+    while (lo < hi) {
+        lfs_size_t mid = lo + (hi-lo)/2;
+        int res = lfs_bd_cmp(lfs,
+                NULL, &lfs->rcache, LFS_DIRINDEX_KEY,
+                block, mid*LFS_DIRINDEX_ENTRY, key, LFS_DIRINDEX_KEY);
+        if (res < 0) {
+            return res;
+        }
+
+        if (res == LFS_CMP_LT) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0) {
+        return 0;
+    }
+
+    err = lfs_bd_read(lfs,
+            NULL, &lfs->rcache, 2*sizeof(lfs_block_t),
+            block, (lo-1)*LFS_DIRINDEX_ENTRY + LFS_DIRINDEX_KEY,
+            pair, 2*sizeof(lfs_block_t));
+    if (err) {
+        return err;
+    }
+    lfs_pair_fromle32(pair);
+
+    return 0;
+}
+
 static lfs_stag_t lfs_dir_find(lfs_t *lfs, lfs_mdir_t *dir,
         const char **path, uint16_t *id) {
     // we reduce path to a single name if we can find it
@@ -1236,6 +2129,7 @@ nextname:
         }
 
         // find entry matching name
+        bool head = true;
         while (true) {
             tag = lfs_dir_fetchmatch(lfs, dir, dir->tail,
                     LFS_MKTAG(0x780, 0, 0),
@@ -1255,6 +2149,16 @@ nextname:
             if (!dir->split) {
                 return LFS_ERR_NOENT;
             }
+
+            // indexed directory? skip ahead to the pair holding the name
+            if (head && dir->dirindex != LFS_BLOCK_NULL) {
+                int err = lfs_dirindex_find(lfs, dir->dirindex,
+                        name, namelen, dir->tail);
+                if (err) {
+                    return err;
+                }
+            }
+            head = false;
         }
 
         // to next name
@@ -1262,6 +2166,71 @@ nextname:
     }
 }
 
+static lfs_stag_t lfs_handle_find(lfs_t *lfs, lfs_mdir_t *dir,
+        const lfs_handle_t *handle, uint16_t *id) {
+    if (handle->gen != *lfs_handle_gen(lfs, handle->pair)) {
+        return LFS_ERR_STALE;
+    }
+
+    *id = handle->id;
+    if (handle->id == 0x3ff) {
+        // root has no entry of its own
+        return LFS_MKTAG(LFS_TYPE_DIR, 0x3ff, 0);
+    }
+
+    int err = lfs_dir_fetch(lfs, dir, handle->pair);
+    if (err) {
+        return err;
+    }
+
+    // only the name's tag is needed, the name itself stays on disk
+    uint8_t name;
+    lfs_stag_t tag = lfs_dir_get(lfs, dir, LFS_MKTAG(0x780, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_NAME, handle->id, 0), &name);
+    if (tag == LFS_ERR_NOENT) {
+        return LFS_ERR_STALE;
+    }
+
+    return tag;
+}
+
+static lfs_stag_t lfs_dir_findcached(lfs_t *lfs, lfs_mdir_t *dir,
+        const char **path, uint16_t *id) {
+    if (!lfs->cfg->handle_cache_size) {
+        return lfs_dir_find(lfs, dir, path, id);
+    }
+
+    lfs_size_t len = strlen(*path);
+    if (len == 0 || len > LFS_HCACHE_PATH_MAX) {
+        return lfs_dir_find(lfs, dir, path, id);
+    }
+
+    // remembered this path? its handle skips the walk unless it went stale,
+    // the crc only picks the slot, the path itself must match
+    struct lfs_hcache *slot = &lfs->hcache[
+            lfs_crc(0xffffffff, *path, len) % lfs->cfg->handle_cache_size];
+    if (slot->len == len && memcmp(slot->path, *path, len) == 0) {
+        lfs_stag_t tag = lfs_handle_find(lfs, dir, &slot->handle, id);
+        if (tag != LFS_ERR_STALE) {
+            return tag;
+        }
+    }
+
+    const char *name = *path;
+    lfs_stag_t tag = lfs_dir_find(lfs, dir, path, id);
+    if (tag < 0) {
+        return tag;
+    }
+
+    memcpy(slot->path, name, len);
+    slot->len = len;
+    slot->handle.pair[0] = dir->pair[0];
+    slot->handle.pair[1] = dir->pair[1];
+    slot->handle.id = lfs_tag_id(tag);
+    slot->handle.gen = *lfs_handle_gen(lfs, dir->pair);
+    return tag;
+}
+
 // commit logic
 struct lfs_commit {
     lfs_block_t block;
@@ -1341,7 +2310,7 @@ static int lfs_dir_commitattr(lfs_t *lfs, struct lfs_commit *commit,
 static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
     // align to program units
     const lfs_off_t end = lfs_alignup(commit->off + 2*sizeof(uint32_t),
-            lfs->cfg->prog_size);
+            lfs_prog_size(lfs));
 
     lfs_off_t off1 = 0;
     uint32_t crc1 = 0;
@@ -1443,7 +2412,7 @@ static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
 static int lfs_dir_alloc(lfs_t *lfs, lfs_mdir_t *dir) {
     // allocate pair of dir blocks (backwards, so we write block 1 first)
     for (int i = 0; i < 2; i++) {
-        int err = lfs_alloc(lfs, &dir->pair[(i+1)%2]);
+        int err = lfs_alloc_meta(lfs, &dir->pair[(i+1)%2]);
         if (err) {
             return err;
         }
@@ -1477,6 +2446,7 @@ static int lfs_dir_alloc(lfs_t *lfs, lfs_mdir_t *dir) {
     dir->tail[1] = LFS_BLOCK_NULL;
     dir->erased = false;
     dir->split = false;
+    dir->dirindex = LFS_BLOCK_NULL;
 
     // don't write out yet, let caller take care of that
     return 0;
@@ -1504,6 +2474,165 @@ static int lfs_dir_drop(lfs_t *lfs, lfs_mdir_t *dir, lfs_mdir_t *tail) {
 }
 #endif
 
+#ifndef LFS_READONLY
+// copy a directory index with the entry for oldpair pointing to newpair, or
+// left out if newpair is NULL, an index without the entry is still correct,
+// lookups for the pair's names just start at an earlier pair. Hands back
+// the index unchanged if it doesn't list oldpair, and LFS_BLOCK_NULL if
+// there is no room for the copy
+static int lfs_dirindex_repoint(lfs_t *lfs, lfs_block_t block,
+        const lfs_block_t oldpair[2], const lfs_block_t newpair[2],
+        lfs_block_t *nblock) {
+    uint32_t trailer[2];
+    int err = lfs_dirindex_trailer(lfs, block, trailer);
+    if (err) {
+        return err;
+    }
+
+    lfs_size_t found = trailer[0];
+    for (lfs_size_t i = 0; i < trailer[0]; i++) {
+        lfs_block_t epair[2];
+        err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, sizeof(epair),
+                block, i*LFS_DIRINDEX_ENTRY + LFS_DIRINDEX_KEY,
+                epair, sizeof(epair));
+        if (err) {
+            return err;
+        }
+
+        lfs_pair_fromle32(epair);
+        if (lfs_pair_cmp(epair, oldpair) == 0) {
+            found = i;
+            break;
+        }
+    }
+
+    if (found == trailer[0]) {
+        *nblock = block;
+        return 0;
+    }
+
+    while (true) {
+        err = lfs_alloc(lfs, nblock);
+        if (err) {
+            if (err == LFS_ERR_NOSPC) {
+                *nblock = LFS_BLOCK_NULL;
+                return 0;
+            }
+            return err;
+        }
+
+        {
+            err = lfs_bd_erase(lfs, *nblock);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            lfs_size_t count = 0;
+            for (lfs_size_t i = 0; i < trailer[0]; i++) {
+                if (i == found && !newpair) {
+                    continue;
+                }
+
+                uint8_t entry[LFS_DIRINDEX_ENTRY];
+                err = lfs_bd_read(lfs,
+                        NULL, &lfs->rcache, LFS_DIRINDEX_ENTRY,
+                        block, i*LFS_DIRINDEX_ENTRY,
+                        entry, LFS_DIRINDEX_ENTRY);
+                if (err) {
+                    return err;
+                }
+
+                if (i == found) {
+                    lfs_block_t epair[2] = {newpair[0], newpair[1]};
+                    lfs_pair_tole32(epair);
+                    memcpy(&entry[LFS_DIRINDEX_KEY], epair, sizeof(epair));
+                }
+
+                err = lfs_bd_prog(lfs, &lfs->pcache, &lfs->rcache, true,
+                        *nblock, count*LFS_DIRINDEX_ENTRY,
+                        entry, LFS_DIRINDEX_ENTRY);
+                if (err) {
+                    if (err == LFS_ERR_CORRUPT) {
+                        goto relocate;
+                    }
+                    return err;
+                }
+
+                count += 1;
+            }
+
+            err = lfs_bd_flush(lfs, &lfs->pcache, &lfs->rcache, true);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            uint32_t ntrailer[2] = {lfs_tole32(count), lfs_tole32(trailer[1])};
+            err = lfs_bd_prog(lfs, &lfs->pcache, &lfs->rcache, true,
+                    *nblock, lfs_block_size(lfs) - sizeof(ntrailer),
+                    ntrailer, sizeof(ntrailer));
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            err = lfs_bd_flush(lfs, &lfs->pcache, &lfs->rcache, true);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            return 0;
+        }
+
+relocate:
+        LFS_DEBUG("Bad block at 0x%"PRIx32, *nblock);
+
+        // just clear cache and try a new block
+        lfs_cache_drop(lfs, &lfs->pcache);
+    }
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_dir_unindex(lfs_t *lfs, lfs_mdir_t *head, lfs_mdir_t *pred,
+        const lfs_block_t pair[2]) {
+    // taking a pair out of an indexed directory? the index would go stale,
+    // so before pred stops pointing to the pair, swap in a copy of the
+    // index without it, that copy is good both before and after
+    if (!pred->split || head->dirindex == LFS_BLOCK_NULL) {
+        return 0;
+    }
+
+    lfs_block_t dirindex;
+    int err = lfs_dirindex_repoint(lfs, head->dirindex, pair, NULL,
+            &dirindex);
+    if (err) {
+        return err;
+    }
+
+    if (dirindex == head->dirindex) {
+        return 0;
+    }
+
+    dirindex = lfs_tole32(dirindex);
+    return lfs_dir_commit(lfs,
+            (lfs_pair_cmp(head->pair, pred->pair) == 0) ? pred : head,
+            LFS_MKATTRS(
+                {LFS_MKTAG(LFS_TYPE_DIRINDEX, 0x3ff, 4), &dirindex}));
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_dir_split(lfs_t *lfs,
         lfs_mdir_t *dir, const struct lfs_mattr *attrs, int attrcount,
@@ -1520,6 +2649,12 @@ static int lfs_dir_split(lfs_t *lfs,
     tail.tail[0] = dir->tail[0];
     tail.tail[1] = dir->tail[1];
 
+    // moving the whole root? the directory index follows it
+    bool moveroot = (lfs_pair_cmp(dir->pair, lfs->root) == 0 && split == 0);
+    if (moveroot) {
+        tail.dirindex = dir->dirindex;
+    }
+
     err = lfs_dir_compact(lfs, &tail, attrs, attrcount, source, split, end);
     if (err) {
         return err;
@@ -1528,13 +2663,20 @@ static int lfs_dir_split(lfs_t *lfs,
     dir->tail[0] = tail.pair[0];
     dir->tail[1] = tail.pair[1];
     dir->split = true;
+    lfs_handle_stale(lfs, dir->pair);
 
     // update root if needed
-    if (lfs_pair_cmp(dir->pair, lfs->root) == 0 && split == 0) {
+    if (moveroot) {
         lfs->root[0] = tail.pair[0];
         lfs->root[1] = tail.pair[1];
+        dir->dirindex = LFS_BLOCK_NULL;
     }
 
+    // remember the split so the directory's index can be rebuilt once
+    // the commit has settled
+    lfs->dirsplit[0] = dir->pair[0];
+    lfs->dirsplit[1] = dir->pair[1];
+
     return 0;
 }
 #endif
@@ -1590,10 +2732,10 @@ static int lfs_dir_compact(lfs_t *lfs,
         // cleanup delete, and we cap at half a block to give room
         // for metadata updates.
         if (end - begin < 0xff &&
-                size <= lfs_min(lfs->cfg->block_size - 36,
+                size <= lfs_min(lfs_block_size(lfs) - 36,
                     lfs_alignup((lfs->cfg->metadata_max ?
-                            lfs->cfg->metadata_max : lfs->cfg->block_size)/2,
-                        lfs->cfg->prog_size))) {
+                            lfs->cfg->metadata_max : lfs_block_size(lfs))/2,
+                        lfs_prog_size(lfs)))) {
             break;
         }
 
@@ -1607,7 +2749,7 @@ static int lfs_dir_compact(lfs_t *lfs,
             // if we fail to split, we may be able to overcompact, unless
             // we're too big for even the full block, in which case our
             // only option is to error
-            if (err == LFS_ERR_NOSPC && size <= lfs->cfg->block_size - 36) {
+            if (err == LFS_ERR_NOSPC && size <= lfs_block_size(lfs) - 36) {
                 break;
             }
             return err;
@@ -1636,7 +2778,7 @@ static int lfs_dir_compact(lfs_t *lfs,
 
             // do we have extra space? littlefs can't reclaim this space
             // by itself, so expand cautiously
-            if ((lfs_size_t)res < lfs->cfg->block_count/2) {
+            if ((lfs_size_t)res < lfs_block_count(lfs)/2) {
                 LFS_DEBUG("Expanding superblock at rev %"PRIu32, dir->rev);
                 int err = lfs_dir_split(lfs, dir, attrs, attrcount,
                         source, begin, end);
@@ -1678,14 +2820,26 @@ static int lfs_dir_compact(lfs_t *lfs,
 
                 .begin = 0,
                 .end = (lfs->cfg->metadata_max ?
-                    lfs->cfg->metadata_max : lfs->cfg->block_size) - 8,
+                    lfs->cfg->metadata_max : lfs_block_size(lfs)) - 8,
             };
 
-            // erase block to write to
-            int err = lfs_bd_erase(lfs, dir->pair[1]);
-            if (err) {
-                if (err == LFS_ERR_CORRUPT) {
-                    goto relocate;
+            // erase block to write to, the operation of the file this
+            // pair belongs to can leave the erase pending, nothing of the
+            // compaction is written yet
+            lfs_file_t *opfile = lfs_op_file(lfs);
+            int err;
+            if (opfile && dir == &opfile->m && !relocated) {
+                err = lfs_bd_erasestart(lfs, dir->pair[1]);
+                if (err == LFS_ERR_PENDING) {
+                    lfs_op_pend(lfs, dir->pair[1]);
+                    return err;
+                }
+            } else {
+                err = lfs_bd_erase(lfs, dir->pair[1]);
+            }
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
                 }
                 return err;
             }
@@ -1732,6 +2886,19 @@ static int lfs_dir_compact(lfs_t *lfs,
                 }
             }
 
+            // commit directory index, only ever found in the head
+            if (dir->dirindex != LFS_BLOCK_NULL) {
+                lfs_block_t dirindex = lfs_tole32(dir->dirindex);
+                err = lfs_dir_commitattr(lfs, &commit,
+                        LFS_MKTAG(LFS_TYPE_DIRINDEX, 0x3ff, 4), &dirindex);
+                if (err) {
+                    if (err == LFS_ERR_CORRUPT) {
+                        goto relocate;
+                    }
+                    return err;
+                }
+            }
+
             // bring over gstate?
             lfs_gstate_t delta = {0};
             if (!relocated) {
@@ -1769,7 +2936,7 @@ static int lfs_dir_compact(lfs_t *lfs,
             }
 
             // successful compaction, swap dir pair to indicate most recent
-            LFS_ASSERT(commit.off % lfs->cfg->prog_size == 0);
+            LFS_ASSERT(commit.off % lfs_prog_size(lfs) == 0);
             lfs_pair_swap(dir->pair);
             dir->count = end - begin;
             dir->off = commit.off;
@@ -1798,7 +2965,7 @@ relocate:
         }
 
         // relocate half of pair
-        int err = lfs_alloc(lfs, &dir->pair[1]);
+        int err = lfs_alloc_meta(lfs, &dir->pair[1]);
         if (err && (err != LFS_ERR_NOSPC || !tired)) {
             return err;
         }
@@ -1827,16 +2994,15 @@ static int lfs_dir_commit(lfs_t *lfs, lfs_mdir_t *dir,
         const struct lfs_mattr *attrs, int attrcount) {
     // check for any inline files that aren't RAM backed and
     // forcefully evict them, needed for filesystem consistency
-    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
+    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist[
+                lfs_mlist_bucket(dir->pair)]; f; f = f->next) {
         if (dir != &f->m && lfs_pair_cmp(f->m.pair, dir->pair) == 0 &&
                 f->type == LFS_TYPE_REG && (f->flags & LFS_F_INLINE) &&
-                f->ctz.size > lfs->cfg->cache_size) {
-            int err = lfs_file_outline(lfs, f);
-            if (err) {
-                return err;
-            }
-
-            err = lfs_file_flush(lfs, f);
+                f->ctz.size > lfs_cache_size(lfs)) {
+            // these files hold their cache while open, borrowing here could
+            // write out other files in the middle of our commit
+            LFS_ASSERT(f->cache.buffer);
+            int err = lfs_file_writeout(lfs, f);
             if (err) {
                 return err;
             }
@@ -1849,28 +3015,40 @@ static int lfs_dir_commit(lfs_t *lfs, lfs_mdir_t *dir,
     for (int i = 0; i < attrcount; i++) {
         if (lfs_tag_type3(attrs[i].tag) == LFS_TYPE_CREATE) {
             dir->count += 1;
+            lfs_handle_stale(lfs, dir->pair);
         } else if (lfs_tag_type3(attrs[i].tag) == LFS_TYPE_DELETE) {
             LFS_ASSERT(dir->count > 0);
             dir->count -= 1;
             hasdelete = true;
+            lfs_handle_stale(lfs, dir->pair);
         } else if (lfs_tag_type1(attrs[i].tag) == LFS_TYPE_TAIL) {
             dir->tail[0] = ((lfs_block_t*)attrs[i].buffer)[0];
             dir->tail[1] = ((lfs_block_t*)attrs[i].buffer)[1];
             dir->split = (lfs_tag_chunk(attrs[i].tag) & 1);
             lfs_pair_fromle32(dir->tail);
+        } else if (lfs_tag_type3(attrs[i].tag) == LFS_TYPE_DIRINDEX) {
+            dir->dirindex = lfs_fromle32(
+                    *(const lfs_block_t*)attrs[i].buffer);
         }
     }
 
     // should we actually drop the directory block?
     if (hasdelete && dir->count == 0) {
         lfs_mdir_t pdir;
-        int err = lfs_fs_pred(lfs, dir->pair, &pdir);
+        lfs_mdir_t phead;
+        int err = lfs_fs_pred(lfs, dir->pair, &pdir, &phead);
         if (err && err != LFS_ERR_NOENT) {
             *dir = olddir;
             return err;
         }
 
         if (err != LFS_ERR_NOENT && pdir.split) {
+            err = lfs_dir_unindex(lfs, &phead, &pdir, dir->pair);
+            if (err) {
+                *dir = olddir;
+                return err;
+            }
+
             err = lfs_dir_drop(lfs, &pdir, dir);
             if (err) {
                 *dir = olddir;
@@ -1889,7 +3067,7 @@ static int lfs_dir_commit(lfs_t *lfs, lfs_mdir_t *dir,
 
             .begin = dir->off,
             .end = (lfs->cfg->metadata_max ?
-                lfs->cfg->metadata_max : lfs->cfg->block_size) - 8,
+                lfs->cfg->metadata_max : lfs_block_size(lfs)) - 8,
         };
 
         // traverse attrs that need to be written out
@@ -1945,7 +3123,7 @@ static int lfs_dir_commit(lfs_t *lfs, lfs_mdir_t *dir,
         }
 
         // successful commit, update dir
-        LFS_ASSERT(commit.off % lfs->cfg->prog_size == 0);
+        LFS_ASSERT(commit.off % lfs_prog_size(lfs) == 0);
         dir->off = commit.off;
         dir->etag = commit.ptag;
         // and update gstate
@@ -1971,8 +3149,29 @@ compact:
     // lfs_dir_commit could also be in this list, and even then
     // we need to copy the pair so they don't get clobbered if we refetch
     // our mdir.
-    for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
-        if (&d->m != dir && lfs_pair_cmp(d->m.pair, olddir.pair) == 0) {
+    //
+    // only the buckets of the old and new pair can hold affected handles,
+    // a relocation has already moved handles over to the new pair
+    uint8_t buckets[2] = {
+        lfs_mlist_bucket(olddir.pair),
+        lfs_mlist_bucket(dir->pair),
+    };
+    int bucketcount = (buckets[0] == buckets[1]) ? 1 : 2;
+
+    for (int b = 0; b < bucketcount; b++) {
+        struct lfs_mlist *next;
+        for (struct lfs_mlist *d = lfs->mlist[buckets[b]]; d; d = next) {
+            next = d->next;
+            if (&d->m == dir) {
+                // our own handle may have relocated
+                lfs_mlist_rehash(lfs, d);
+                continue;
+            }
+
+            if (lfs_pair_cmp(d->m.pair, olddir.pair) != 0) {
+                continue;
+            }
+
             d->m = *dir;
             for (int i = 0; i < attrcount; i++) {
                 if (lfs_tag_type3(attrs[i].tag) == LFS_TYPE_DELETE &&
@@ -1993,17 +3192,26 @@ compact:
                     }
                 }
             }
+
+            lfs_mlist_rehash(lfs, d);
         }
     }
 
-    for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
-        if (lfs_pair_cmp(d->m.pair, olddir.pair) == 0) {
-            while (d->id >= d->m.count && d->m.split) {
-                // we split and id is on tail now
-                d->id -= d->m.count;
-                int err = lfs_dir_fetch(lfs, &d->m, d->m.tail);
-                if (err) {
-                    return err;
+    // handles that moved to a tail land in other buckets, we may see them
+    // again but they no longer match
+    for (int b = 0; b < bucketcount; b++) {
+        struct lfs_mlist *next;
+        for (struct lfs_mlist *d = lfs->mlist[buckets[b]]; d; d = next) {
+            next = d->next;
+            if (lfs_pair_cmp(d->m.pair, olddir.pair) == 0) {
+                while (d->id >= d->m.count && d->m.split) {
+                    // we split and id is on tail now
+                    d->id -= d->m.count;
+                    int err = lfs_dir_fetch(lfs, &d->m, d->m.tail);
+                    lfs_mlist_rehash(lfs, d);
+                    if (err) {
+                        return err;
+                    }
                 }
             }
         }
@@ -2013,6 +3221,176 @@ compact:
 }
 #endif
 
+#ifndef LFS_READONLY
+// rebuild the index of the directory that last split, the index only speeds
+// up lookups, so running out of space simply leaves things as they were
+static int lfs_dir_reindex(lfs_t *lfs) {
+    lfs_block_t pair[2] = {lfs->dirsplit[0], lfs->dirsplit[1]};
+    lfs->dirsplit[0] = LFS_BLOCK_NULL;
+    lfs->dirsplit[1] = LFS_BLOCK_NULL;
+    if (!lfs->cfg->dir_index_min || lfs_pair_isnull(pair)) {
+        return 0;
+    }
+
+    // find the head of the directory that split
+    lfs_mdir_t pdir;
+    lfs_mdir_t head;
+    int err = lfs_fs_pred(lfs, pair, &pdir, &head);
+    if (err) {
+        // already gone? nothing to index
+        return (err == LFS_ERR_NOENT) ? 0 : err;
+    }
+
+    // the pair may have relocated since it split, so fetch the head through
+    // its current address
+    if (lfs_pair_cmp(pair, lfs->root) == 0) {
+        err = lfs_dir_fetch(lfs, &head, lfs->root);
+        if (err) {
+            return err;
+        }
+    } else if (!pdir.split) {
+        err = lfs_dir_fetch(lfs, &head, pdir.tail);
+        if (err) {
+            return err;
+        }
+    }
+
+    // how many pairs follow the head? the last index remembers, otherwise
+    // we need to count them
+    lfs_size_t pairs = 0;
+    if (head.dirindex != LFS_BLOCK_NULL) {
+        uint32_t trailer[2];
+        err = lfs_dirindex_trailer(lfs, head.dirindex, trailer);
+        if (err) {
+            return err;
+        }
+
+        pairs = trailer[1] + 1;
+    } else {
+        lfs_mdir_t dir = head;
+        while (dir.split) {
+            err = lfs_dir_fetch(lfs, &dir, dir.tail);
+            if (err) {
+                return err;
+            }
+
+            pairs += 1;
+        }
+
+        if (pairs == 0 || pairs+1 < lfs->cfg->dir_index_min) {
+            return 0;
+        }
+    }
+
+    // if there are more pairs than fit, sample them evenly
+    lfs_size_t cap = lfs_dirindex_cap(lfs);
+    lfs_size_t stride = (pairs + cap-1) / cap;
+
+    lfs_alloc_ack(lfs);
+    while (true) {
+        lfs_block_t nblock;
+        err = lfs_alloc(lfs, &nblock);
+        if (err) {
+            return (err == LFS_ERR_NOSPC) ? 0 : err;
+        }
+
+        {
+            err = lfs_bd_erase(lfs, nblock);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            uint32_t trailer[2] = {0, 0};
+            lfs_mdir_t dir = head;
+            while (dir.split) {
+                err = lfs_dir_fetch(lfs, &dir, dir.tail);
+                if (err) {
+                    return err;
+                }
+
+                if (trailer[1] % stride == 0 && trailer[0] < cap) {
+                    uint8_t entry[LFS_DIRINDEX_ENTRY];
+                    lfs_stag_t res = lfs_dir_get(lfs, &dir,
+                            LFS_MKTAG(0x780, 0x3ff, 0),
+                            LFS_MKTAG(LFS_TYPE_NAME, 0, LFS_DIRINDEX_KEY),
+                            entry);
+                    if (res < 0 && res != LFS_ERR_NOENT) {
+                        return res;
+                    }
+
+                    // empty pairs say nothing about where names go
+                    if (res != LFS_ERR_NOENT) {
+                        lfs_block_t epair[2] = {dir.pair[0], dir.pair[1]};
+                        lfs_pair_tole32(epair);
+                        memcpy(&entry[LFS_DIRINDEX_KEY], epair, sizeof(epair));
+                        err = lfs_bd_prog(lfs, &lfs->pcache, &lfs->rcache, true,
+                                nblock, trailer[0]*LFS_DIRINDEX_ENTRY,
+                                entry, LFS_DIRINDEX_ENTRY);
+                        if (err) {
+                            if (err == LFS_ERR_CORRUPT) {
+                                goto relocate;
+                            }
+                            return err;
+                        }
+
+                        trailer[0] += 1;
+                    }
+                }
+
+                trailer[1] += 1;
+            }
+
+            err = lfs_bd_flush(lfs, &lfs->pcache, &lfs->rcache, true);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            trailer[0] = lfs_tole32(trailer[0]);
+            trailer[1] = lfs_tole32(trailer[1]);
+            err = lfs_bd_prog(lfs, &lfs->pcache, &lfs->rcache, true,
+                    nblock, lfs_block_size(lfs) - sizeof(trailer),
+                    trailer, sizeof(trailer));
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            err = lfs_bd_flush(lfs, &lfs->pcache, &lfs->rcache, true);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+
+            // and point the head at the new index
+            lfs_block_t dirindex = lfs_tole32(nblock);
+            err = lfs_dir_commit(lfs, &head, LFS_MKATTRS(
+                    {LFS_MKTAG(LFS_TYPE_DIRINDEX, 0x3ff, 4), &dirindex}));
+            if (err) {
+                return (err == LFS_ERR_NOSPC) ? 0 : err;
+            }
+
+            return 0;
+        }
+
+relocate:
+        LFS_DEBUG("Bad block at 0x%"PRIx32, nblock);
+
+        // just clear cache and try a new block
+        lfs_cache_drop(lfs, &lfs->pcache);
+    }
+}
+#endif
+
 
 /// Top level directory operations ///
 #ifndef LFS_READONLY
@@ -2024,7 +3402,6 @@ static int lfs_rawmkdir(lfs_t *lfs, const char *path) {
     }
 
     struct lfs_mlist cwd;
-    cwd.next = lfs->mlist;
     uint16_t id;
     err = lfs_dir_find(lfs, &cwd.m, &path, &id);
     if (!(err == LFS_ERR_NOENT && id != 0x3ff)) {
@@ -2077,18 +3454,17 @@ static int lfs_rawmkdir(lfs_t *lfs, const char *path) {
         // ourselves into littlefs to catch this
         cwd.type = 0;
         cwd.id = 0;
-        lfs->mlist = &cwd;
+        lfs_mlist_append(lfs, &cwd);
 
         lfs_pair_tole32(dir.pair);
         err = lfs_dir_commit(lfs, &pred, LFS_MKATTRS(
                 {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8), dir.pair}));
         lfs_pair_fromle32(dir.pair);
+        lfs_mlist_remove(lfs, &cwd);
         if (err) {
-            lfs->mlist = cwd.next;
             return err;
         }
 
-        lfs->mlist = cwd.next;
         err = lfs_fs_preporphans(lfs, -1);
         if (err) {
             return err;
@@ -2108,7 +3484,8 @@ static int lfs_rawmkdir(lfs_t *lfs, const char *path) {
         return err;
     }
 
-    return 0;
+    // did our parent split? update its index
+    return lfs_dir_reindex(lfs);
 }
 #endif
 
@@ -2186,6 +3563,7 @@ static int lfs_dir_rawread(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
             }
 
             int err = lfs_dir_fetch(lfs, &dir->m, dir->m.tail);
+            lfs_mlist_rehash(lfs, (struct lfs_mlist*)dir);
             if (err) {
                 return err;
             }
@@ -2208,19 +3586,96 @@ static int lfs_dir_rawread(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
     return true;
 }
 
-static int lfs_dir_rawseek(lfs_t *lfs, lfs_dir_t *dir, lfs_off_t off) {
-    // simply walk from head dir
-    int err = lfs_dir_rawrewind(lfs, dir);
-    if (err) {
-        return err;
+static lfs_ssize_t lfs_dir_rawreadbatch(lfs_t *lfs, lfs_dir_t *dir,
+        struct lfs_dirent *entries, lfs_size_t count,
+        const struct lfs_dir_batch *batch) {
+    if (batch && batch->attr_count > 32) {
+        return LFS_ERR_INVAL;
+    }
+
+    lfs_size_t filled = 0;
+    lfs_size_t nameoff = 0;
+
+    // special offset for '.' and '..'
+    while (dir->pos < 2 && filled < count) {
+        const char *name = (dir->pos == 0) ? "." : "..";
+        struct lfs_dirent *e = &entries[filled];
+        memset(e, 0, sizeof(*e));
+        e->type = LFS_TYPE_DIR;
+
+        if (batch && batch->name_buffer) {
+            lfs_size_t nlen = strlen(name)+1;
+            if (nameoff + nlen > batch->name_size) {
+                return (filled > 0) ? (lfs_ssize_t)filled : LFS_ERR_NOSPC;
+            }
+
+            memcpy(batch->name_buffer + nameoff, name, nlen);
+            e->name = batch->name_buffer + nameoff;
+            nameoff += nlen;
+        }
+
+        dir->pos += 1;
+        filled += 1;
+    }
+
+    while (filled < count) {
+        if (dir->id == dir->m.count) {
+            if (!dir->m.split) {
+                break;
+            }
+
+            int err = lfs_dir_fetch(lfs, &dir->m, dir->m.tail);
+            lfs_mlist_rehash(lfs, (struct lfs_mlist*)dir);
+            if (err) {
+                return err;
+            }
+
+            dir->id = 0;
+        }
+
+        // one scan covers as many ids of this pair as we have room for
+        lfs_size_t want = lfs_min(count - filled, dir->m.count - dir->id);
+        lfs_size_t n = 0;
+        lfs_ssize_t res = lfs_dir_getbatch(lfs, &dir->m, dir->id,
+                entries, filled, want, batch, &nameoff, &n);
+        if (res < 0) {
+            return res;
+        }
+
+        dir->id += res;
+        dir->pos += n;
+        filled += n;
+
+        if ((lfs_size_t)res < want) {
+            // out of name buffer
+            if (filled == 0) {
+                return LFS_ERR_NOSPC;
+            }
+            break;
+        }
     }
 
-    // first two for ./..
-    dir->pos = lfs_min(2, off);
-    off -= dir->pos;
+    return filled;
+}
+
+static int lfs_dir_rawseek(lfs_t *lfs, lfs_dir_t *dir, lfs_off_t off) {
+    if (off >= dir->pos && dir->pos >= 2) {
+        // seeking forward, continue from where we are
+        off -= dir->pos;
+    } else {
+        // walk from head dir
+        int err = lfs_dir_rawrewind(lfs, dir);
+        if (err) {
+            return err;
+        }
+
+        // first two for ./..
+        dir->pos = lfs_min(2, off);
+        off -= dir->pos;
 
-    // skip superblock entry
-    dir->id = (off > 0 && lfs_pair_cmp(dir->head, lfs->root) == 0);
+        // skip superblock entry
+        dir->id = (off > 0 && lfs_pair_cmp(dir->head, lfs->root) == 0);
+    }
 
     while (off > 0) {
         int diff = lfs_min(dir->m.count - dir->id, off);
@@ -2233,7 +3688,8 @@ static int lfs_dir_rawseek(lfs_t *lfs, lfs_dir_t *dir, lfs_off_t off) {
                 return LFS_ERR_INVAL;
             }
 
-            err = lfs_dir_fetch(lfs, &dir->m, dir->m.tail);
+            int err = lfs_dir_fetch(lfs, &dir->m, dir->m.tail);
+            lfs_mlist_rehash(lfs, (struct lfs_mlist*)dir);
             if (err) {
                 return err;
             }
@@ -2253,6 +3709,7 @@ static lfs_soff_t lfs_dir_rawtell(lfs_t *lfs, lfs_dir_t *dir) {
 static int lfs_dir_rawrewind(lfs_t *lfs, lfs_dir_t *dir) {
     // reload the head dir
     int err = lfs_dir_fetch(lfs, &dir->m, dir->head);
+    lfs_mlist_rehash(lfs, (struct lfs_mlist*)dir);
     if (err) {
         return err;
     }
@@ -2262,11 +3719,42 @@ static int lfs_dir_rawrewind(lfs_t *lfs, lfs_dir_t *dir) {
     return 0;
 }
 
+static int lfs_dir_rawtellcursor(lfs_t *lfs, lfs_dir_t *dir,
+        lfs_dir_cursor_t *cursor) {
+    cursor->pair[0] = dir->m.pair[0];
+    cursor->pair[1] = dir->m.pair[1];
+    cursor->id = dir->id;
+    cursor->pos = dir->pos;
+    cursor->gen = lfs->gen;
+    return 0;
+}
+
+static int lfs_dir_rawseekcursor(lfs_t *lfs, lfs_dir_t *dir,
+        const lfs_dir_cursor_t *cursor) {
+    if (cursor->gen != lfs->gen || cursor->pos < 2) {
+        // entries may have moved, fall back to walking the directory
+        return lfs_dir_rawseek(lfs, dir, cursor->pos);
+    }
+
+    // nothing has moved, jump straight to the cursor's pair
+    if (lfs_pair_cmp(dir->m.pair, cursor->pair) != 0) {
+        int err = lfs_dir_fetch(lfs, &dir->m, cursor->pair);
+        lfs_mlist_rehash(lfs, (struct lfs_mlist*)dir);
+        if (err) {
+            return err;
+        }
+    }
+
+    dir->id = cursor->id;
+    dir->pos = cursor->pos;
+    return 0;
+}
+
 
 /// File index list operations ///
 static int lfs_ctz_index(lfs_t *lfs, lfs_off_t *off) {
     lfs_off_t size = *off;
-    lfs_off_t b = lfs->cfg->block_size - 2*4;
+    lfs_off_t b = lfs_block_size(lfs) - 2*4;
     lfs_off_t i = size / b;
     if (i == 0) {
         return 0;
@@ -2316,16 +3804,36 @@ static int lfs_ctz_extend(lfs_t *lfs,
         lfs_cache_t *pcache, lfs_cache_t *rcache,
         lfs_block_t head, lfs_size_t size,
         lfs_block_t *block, lfs_off_t *off) {
+    // the operation of the file being extended can leave the erase of the
+    // new block pending and hold on to the block until it comes back
+    lfs_file_t *opfile = lfs_op_file(lfs);
+    bool pend = (opfile && pcache == &opfile->cache);
+
     while (true) {
         // go ahead and grab a block
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
-        if (err) {
-            return err;
+        int err;
+        if (pend && lfs->op->held != LFS_BLOCK_NULL) {
+            nblock = lfs->op->held;
+            lfs->op->held = LFS_BLOCK_NULL;
+        } else {
+            err = lfs_alloc(lfs, &nblock);
+            if (err) {
+                return err;
+            }
         }
 
         {
-            err = lfs_bd_erase(lfs, nblock);
+            if (pend) {
+                err = lfs_bd_erasestart(lfs, nblock);
+                if (err == LFS_ERR_PENDING) {
+                    lfs_op_pend(lfs, nblock);
+                    lfs->op->held = nblock;
+                    return err;
+                }
+            } else {
+                err = lfs_bd_erase(lfs, nblock);
+            }
             if (err) {
                 if (err == LFS_ERR_CORRUPT) {
                     goto relocate;
@@ -2344,7 +3852,7 @@ static int lfs_ctz_extend(lfs_t *lfs,
             noff = noff + 1;
 
             // just copy out the last block if it is incomplete
-            if (noff != lfs->cfg->block_size) {
+            if (noff != lfs_block_size(lfs)) {
                 for (lfs_off_t i = 0; i < noff; i++) {
                     uint8_t data;
                     err = lfs_bd_read(lfs,
@@ -2455,200 +3963,134 @@ static int lfs_ctz_traverse(lfs_t *lfs,
 }
 
 
-/// Top level file operations ///
-static int lfs_file_rawopencfg(lfs_t *lfs, lfs_file_t *file,
-        const char *path, int flags,
-        const struct lfs_file_config *cfg) {
-#ifndef LFS_READONLY
-    // deorphan if we haven't yet, needed at most once after poweron
-    if ((flags & LFS_O_WRONLY) == LFS_O_WRONLY) {
-        int err = lfs_fs_forceconsistency(lfs);
-        if (err) {
-            return err;
-        }
-    }
-#else
-    LFS_ASSERT((flags & LFS_O_RDONLY) == LFS_O_RDONLY);
-#endif
+/// File block index operations ///
+// indexed files keep their data blocks in a radix tree of block addresses,
+// each index block holds block_size/4 little-endian pointers and the depth of
+// the tree is implied by the file size, a file with a single block points
+// directly at its data
+#define LFS_INDEX_DEPTH 8
 
-    // setup simple file details
-    int err;
-    file->cfg = cfg;
-    file->flags = flags;
-    file->pos = 0;
-    file->off = 0;
-    file->cache.buffer = NULL;
+static lfs_size_t lfs_index_count(lfs_t *lfs, lfs_size_t size) {
+    return (size == 0) ? 0 : (size-1) / lfs_block_size(lfs) + 1;
+}
 
-    // allocate entry for file if it doesn't exist
-    lfs_stag_t tag = lfs_dir_find(lfs, &file->m, &path, &file->id);
-    if (tag < 0 && !(tag == LFS_ERR_NOENT && file->id != 0x3ff)) {
-        err = tag;
-        goto cleanup;
+// find the depth of the index and the number of data blocks addressed by
+// each pointer at every level
+static lfs_size_t lfs_index_spans(lfs_t *lfs, lfs_size_t count,
+        lfs_size_t spans[LFS_INDEX_DEPTH]) {
+    lfs_size_t fanout = lfs_block_size(lfs) / 4;
+    lfs_size_t depth = 0;
+    lfs_size_t span = 1;
+    while (span < count) {
+        span *= fanout;
+        depth += 1;
     }
+    LFS_ASSERT(depth <= LFS_INDEX_DEPTH);
 
-    // get id, add to list of mdirs to catch update changes
-    file->type = LFS_TYPE_REG;
-    lfs_mlist_append(lfs, (struct lfs_mlist *)file);
-
-#ifdef LFS_READONLY
-    if (tag == LFS_ERR_NOENT) {
-        err = LFS_ERR_NOENT;
-        goto cleanup;
-#else
-    if (tag == LFS_ERR_NOENT) {
-        if (!(flags & LFS_O_CREAT)) {
-            err = LFS_ERR_NOENT;
-            goto cleanup;
-        }
+    span = 1;
+    for (lfs_size_t k = depth; k > 0; k--) {
+        spans[k-1] = span;
+        span *= fanout;
+    }
 
-        // check that name fits
-        lfs_size_t nlen = strlen(path);
-        if (nlen > lfs->name_max) {
-            err = LFS_ERR_NAMETOOLONG;
-            goto cleanup;
-        }
+    return depth;
+}
 
-        // get next slot and create entry to remember name
-        err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
-                {LFS_MKTAG(LFS_TYPE_CREATE, file->id, 0), NULL},
-                {LFS_MKTAG(LFS_TYPE_REG, file->id, nlen), path},
-                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0), NULL}));
-        if (err) {
-            err = LFS_ERR_NAMETOOLONG;
-            goto cleanup;
-        }
+static int lfs_index_find(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache,
+        lfs_block_t head, lfs_size_t size,
+        lfs_size_t pos, lfs_block_t *block, lfs_off_t *off) {
+    if (size == 0) {
+        *block = LFS_BLOCK_NULL;
+        *off = 0;
+        return 0;
+    }
 
-        tag = LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, 0);
-    } else if (flags & LFS_O_EXCL) {
-        err = LFS_ERR_EXIST;
-        goto cleanup;
-#endif
-    } else if (lfs_tag_type3(tag) != LFS_TYPE_REG) {
-        err = LFS_ERR_ISDIR;
-        goto cleanup;
-#ifndef LFS_READONLY
-    } else if (flags & LFS_O_TRUNC) {
-        // truncate if requested
-        tag = LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0);
-        file->flags |= LFS_F_DIRTY;
-#endif
-    } else {
-        // try to load what's on disk, if it's inlined we'll fix it later
-        tag = lfs_dir_get(lfs, &file->m, LFS_MKTAG(0x700, 0x3ff, 0),
-                LFS_MKTAG(LFS_TYPE_STRUCT, file->id, 8), &file->ctz);
-        if (tag < 0) {
-            err = tag;
-            goto cleanup;
+    lfs_size_t fanout = lfs_block_size(lfs) / 4;
+    lfs_size_t spans[LFS_INDEX_DEPTH];
+    lfs_size_t depth = lfs_index_spans(lfs,
+            lfs_index_count(lfs, size), spans);
+    lfs_size_t index = pos / lfs_block_size(lfs);
+
+    for (lfs_size_t k = 0; k < depth; k++) {
+        lfs_off_t entry = (index / spans[k]) % fanout;
+        int err = lfs_bd_read(lfs,
+                pcache, rcache, sizeof(head),
+                head, 4*entry, &head, sizeof(head));
+        head = lfs_fromle32(head);
+        if (err) {
+            return err;
         }
-        lfs_ctz_fromle32(&file->ctz);
     }
 
-    // fetch attrs
-    for (unsigned i = 0; i < file->cfg->attr_count; i++) {
-        // if opened for read / read-write operations
-        if ((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY) {
-            lfs_stag_t res = lfs_dir_get(lfs, &file->m,
-                    LFS_MKTAG(0x7ff, 0x3ff, 0),
-                    LFS_MKTAG(LFS_TYPE_USERATTR + file->cfg->attrs[i].type,
-                        file->id, file->cfg->attrs[i].size),
-                        file->cfg->attrs[i].buffer);
-            if (res < 0 && res != LFS_ERR_NOENT) {
-                err = res;
-                goto cleanup;
-            }
-        }
+    *block = head;
+    *off = pos % lfs_block_size(lfs);
+    return 0;
+}
 
-#ifndef LFS_READONLY
-        // if opened for write / read-write operations
-        if ((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY) {
-            if (file->cfg->attrs[i].size > lfs->attr_max) {
-                err = LFS_ERR_NOSPC;
-                goto cleanup;
-            }
+static int lfs_index_traverse(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache,
+        lfs_block_t head, lfs_size_t size,
+        int (*cb)(void*, lfs_block_t), void *data) {
+    if (size == 0) {
+        return 0;
+    }
 
-            file->flags |= LFS_F_DIRTY;
-        }
-#endif
+    int err = cb(data, head);
+    if (err) {
+        return err;
     }
 
-    // allocate buffer if needed
-    if (file->cfg->buffer) {
-        file->cache.buffer = file->cfg->buffer;
-    } else {
-        file->cache.buffer = lfs_malloc(lfs->cfg->cache_size);
-        if (!file->cache.buffer) {
-            err = LFS_ERR_NOMEM;
-            goto cleanup;
-        }
+    lfs_size_t fanout = lfs_block_size(lfs) / 4;
+    lfs_size_t count = lfs_index_count(lfs, size);
+    lfs_size_t spans[LFS_INDEX_DEPTH];
+    lfs_size_t depth = lfs_index_spans(lfs, count, spans);
+    if (depth == 0) {
+        return 0;
     }
 
-    // zero to avoid information leak
-    lfs_cache_zero(lfs, &file->cache);
+    // walk the data blocks in order, keeping the path to the current block
+    // so each index block is only entered once
+    lfs_block_t path[LFS_INDEX_DEPTH];
+    path[0] = head;
+    for (lfs_size_t index = 0; index < count; index++) {
+        lfs_size_t k = 0;
+        while (index % spans[k] != 0) {
+            k += 1;
+        }
 
-    if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
-        // load inline files
-        file->ctz.head = LFS_BLOCK_INLINE;
-        file->ctz.size = lfs_tag_size(tag);
-        file->flags |= LFS_F_INLINE;
-        file->cache.block = file->ctz.head;
-        file->cache.off = 0;
-        file->cache.size = lfs->cfg->cache_size;
+        for (; k < depth; k++) {
+            lfs_off_t entry = (index / spans[k]) % fanout;
+            lfs_block_t child;
+            err = lfs_bd_read(lfs,
+                    pcache, rcache, lfs_block_size(lfs) - 4*entry,
+                    path[k], 4*entry, &child, sizeof(child));
+            child = lfs_fromle32(child);
+            if (err) {
+                return err;
+            }
 
-        // don't always read (may be new/trunc file)
-        if (file->ctz.size > 0) {
-            lfs_stag_t res = lfs_dir_get(lfs, &file->m,
-                    LFS_MKTAG(0x700, 0x3ff, 0),
-                    LFS_MKTAG(LFS_TYPE_STRUCT, file->id,
-                        lfs_min(file->cache.size, 0x3fe)),
-                    file->cache.buffer);
-            if (res < 0) {
-                err = res;
-                goto cleanup;
+            err = cb(data, child);
+            if (err) {
+                return err;
+            }
+
+            if (k+1 < depth) {
+                path[k+1] = child;
             }
         }
     }
 
     return 0;
-
-cleanup:
-    // clean up lingering resources
-#ifndef LFS_READONLY
-    file->flags |= LFS_F_ERRED;
-#endif
-    lfs_file_rawclose(lfs, file);
-    return err;
-}
-
-static int lfs_file_rawopen(lfs_t *lfs, lfs_file_t *file,
-        const char *path, int flags) {
-    static const struct lfs_file_config defaults = {0};
-    int err = lfs_file_rawopencfg(lfs, file, path, flags, &defaults);
-    return err;
-}
-
-static int lfs_file_rawclose(lfs_t *lfs, lfs_file_t *file) {
-#ifndef LFS_READONLY
-    int err = lfs_file_rawsync(lfs, file);
-#else
-    int err = 0;
-#endif
-
-    // remove from list of mdirs
-    lfs_mlist_remove(lfs, (struct lfs_mlist*)file);
-
-    // clean up memory
-    if (!file->cfg->buffer) {
-        lfs_free(file->cache.buffer);
-    }
-
-    return err;
 }
 
-
 #ifndef LFS_READONLY
-static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
+// write a copy of an index block with one pointer replaced, node may be
+// LFS_BLOCK_NULL if the index block doesn't exist yet
+static int lfs_index_rewrite(lfs_t *lfs, lfs_block_t node,
+        lfs_size_t count, lfs_off_t entry, lfs_block_t child,
+        lfs_block_t *block) {
     while (true) {
-        // just relocate what exists into new block
         lfs_block_t nblock;
         int err = lfs_alloc(lfs, &nblock);
         if (err) {
@@ -2663,31 +4105,22 @@ static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
             return err;
         }
 
-        // either read from dirty cache or disk
-        for (lfs_off_t i = 0; i < file->off; i++) {
-            uint8_t data;
-            if (file->flags & LFS_F_INLINE) {
-                err = lfs_dir_getread(lfs, &file->m,
-                        // note we evict inline files before they can be dirty
-                        NULL, &file->cache, file->off-i,
-                        LFS_MKTAG(0xfff, 0x1ff, 0),
-                        LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0),
-                        i, &data, 1);
-                if (err) {
-                    return err;
-                }
-            } else {
+        for (lfs_off_t i = 0; i < count; i++) {
+            lfs_block_t ptr = child;
+            if (i != entry) {
+                LFS_ASSERT(node != LFS_BLOCK_NULL);
                 err = lfs_bd_read(lfs,
-                        &file->cache, &lfs->rcache, file->off-i,
-                        file->block, i, &data, 1);
+                        NULL, lfs->dcache, 4*(count-i),
+                        node, 4*i, &ptr, sizeof(ptr));
                 if (err) {
                     return err;
                 }
+            } else {
+                ptr = lfs_tole32(ptr);
             }
 
-            err = lfs_bd_prog(lfs,
-                    &lfs->pcache, &lfs->rcache, true,
-                    nblock, i, &data, 1);
+            err = lfs_bd_prog(lfs, &lfs->pcache, lfs->dcache, true,
+                    nblock, 4*i, &ptr, sizeof(ptr));
             if (err) {
                 if (err == LFS_ERR_CORRUPT) {
                     goto relocate;
@@ -2696,15 +4129,15 @@ static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
             }
         }
 
-        // copy over new state of file
-        memcpy(file->cache.buffer, lfs->pcache.buffer, lfs->cfg->cache_size);
-        file->cache.block = lfs->pcache.block;
-        file->cache.off = lfs->pcache.off;
-        file->cache.size = lfs->pcache.size;
-        lfs_cache_zero(lfs, &lfs->pcache);
+        err = lfs_bd_flush(lfs, &lfs->pcache, lfs->dcache, true);
+        if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
+            }
+            return err;
+        }
 
-        file->block = nblock;
-        file->flags |= LFS_F_WRITING;
+        *block = nblock;
         return 0;
 
 relocate:
@@ -2714,1542 +4147,4007 @@ relocate:
         lfs_cache_drop(lfs, &lfs->pcache);
     }
 }
-#endif
 
-#ifndef LFS_READONLY
-static int lfs_file_outline(lfs_t *lfs, lfs_file_t *file) {
-    file->off = file->pos;
-    lfs_alloc_ack(lfs);
-    int err = lfs_file_relocate(lfs, file);
-    if (err) {
-        return err;
+// point data block index at block, copying the path from the root on write,
+// the index may only grow by appending a single block at a time
+static int lfs_index_set(lfs_t *lfs, struct lfs_ctz *ctz,
+        lfs_size_t index, lfs_block_t block, lfs_size_t size) {
+    lfs_size_t fanout = lfs_block_size(lfs) / 4;
+    lfs_size_t ocount = lfs_index_count(lfs, ctz->size);
+    lfs_size_t count = lfs_index_count(lfs, size);
+    LFS_ASSERT(index <= ocount && index < count && count >= ocount);
+
+    lfs_size_t spans[LFS_INDEX_DEPTH];
+    lfs_size_t odepth = lfs_index_spans(lfs, ocount, spans);
+    lfs_size_t depth = lfs_index_spans(lfs, count, spans);
+
+    // grow the tree by putting new roots on top of the old one
+    lfs_block_t head = ctz->head;
+    if (ocount > 0) {
+        for (lfs_size_t k = odepth; k < depth; k++) {
+            int err = lfs_index_rewrite(lfs, LFS_BLOCK_NULL,
+                    1, 0, head, &head);
+            if (err) {
+                return err;
+            }
+        }
     }
 
-    file->flags &= ~LFS_F_INLINE;
+    // find the old path, index blocks past the old end don't exist yet
+    lfs_block_t path[LFS_INDEX_DEPTH];
+    for (lfs_size_t k = 0; k < depth; k++) {
+        lfs_size_t base = index - index % (spans[k]*fanout);
+        if (base >= ocount) {
+            path[k] = LFS_BLOCK_NULL;
+            continue;
+        }
+
+        path[k] = head;
+        lfs_off_t entry = (index / spans[k]) % fanout;
+        int err = lfs_bd_read(lfs,
+                NULL, lfs->dcache, sizeof(head),
+                head, 4*entry, &head, sizeof(head));
+        head = lfs_fromle32(head);
+        if (err) {
+            return err;
+        }
+    }
+
+    // copy the path bottom-up
+    head = block;
+    for (lfs_size_t k = depth; k > 0; k--) {
+        lfs_size_t span = spans[k-1];
+        lfs_size_t base = index - index % (span*fanout);
+        int err = lfs_index_rewrite(lfs, path[k-1],
+                lfs_min(fanout, (count-1 - base) / span + 1),
+                (index / span) % fanout, head, &head);
+        if (err) {
+            return err;
+        }
+    }
+
+    ctz->head = head;
+    ctz->size = size;
     return 0;
 }
-#endif
 
-#ifndef LFS_READONLY
-static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
-    if (file->flags & LFS_F_READING) {
-        if (!(file->flags & LFS_F_INLINE)) {
-            lfs_cache_drop(lfs, &file->cache);
+// drop the index levels no longer needed after shrinking the file, blocks
+// past the new end are released along with the old index
+static int lfs_index_truncate(lfs_t *lfs, lfs_cache_t *rcache,
+        struct lfs_ctz *ctz, lfs_size_t size) {
+    lfs_size_t spans[LFS_INDEX_DEPTH];
+    lfs_size_t odepth = lfs_index_spans(lfs,
+            lfs_index_count(lfs, ctz->size), spans);
+    lfs_size_t depth = lfs_index_spans(lfs,
+            lfs_index_count(lfs, size), spans);
+
+    for (lfs_size_t k = depth; k < odepth; k++) {
+        int err = lfs_bd_read(lfs,
+                NULL, rcache, sizeof(ctz->head),
+                ctz->head, 0, &ctz->head, sizeof(ctz->head));
+        ctz->head = lfs_fromle32(ctz->head);
+        if (err) {
+            return err;
         }
-        file->flags &= ~LFS_F_READING;
     }
 
-    if (file->flags & LFS_F_WRITING) {
-        lfs_off_t pos = file->pos;
-
-        if (!(file->flags & LFS_F_INLINE)) {
-            // copy over anything after current branch
-            lfs_file_t orig = {
-                .ctz.head = file->ctz.head,
-                .ctz.size = file->ctz.size,
-                .flags = LFS_O_RDONLY,
-                .pos = file->pos,
-                .cache = lfs->rcache,
-            };
-            lfs_cache_drop(lfs, &lfs->rcache);
+    if (size == 0) {
+        ctz->head = LFS_BLOCK_NULL;
+    }
+    ctz->size = size;
+    return 0;
+}
+#endif
 
-            while (file->pos < file->ctz.size) {
-                // copy over a byte at a time, leave it up to caching
-                // to make this efficient
-                uint8_t data;
-                lfs_ssize_t res = lfs_file_rawread(lfs, &orig, &data, 1);
-                if (res < 0) {
-                    return res;
-                }
 
-                res = lfs_file_rawwrite(lfs, file, &data, 1);
-                if (res < 0) {
-                    return res;
-                }
+/// File cache pool operations ///
+// a file can't give its cache back while its contents only live there
+static bool lfs_file_ispinned(lfs_t *lfs, const lfs_file_t *file) {
+    if ((file->flags & LFS_F_INLINE) && lfs_pair_isnull(file->m.pair)) {
+        // removed while open, the cache holds the only copy
+        return true;
+    }
 
-                // keep our reference to the rcache in sync
-                if (lfs->rcache.block != LFS_BLOCK_NULL) {
-                    lfs_cache_drop(lfs, &orig.cache);
-                    lfs_cache_drop(lfs, &lfs->rcache);
-                }
-            }
-
-            // write out what we have
-            while (true) {
-                int err = lfs_bd_flush(lfs, &file->cache, &lfs->rcache, true);
-                if (err) {
-                    if (err == LFS_ERR_CORRUPT) {
-                        goto relocate;
-                    }
-                    return err;
-                }
-
-                break;
-
-relocate:
-                LFS_DEBUG("Bad block at 0x%"PRIx32, file->block);
-                err = lfs_file_relocate(lfs, file);
-                if (err) {
-                    return err;
-                }
-            }
-        } else {
-            file->pos = lfs_max(file->pos, file->ctz.size);
-        }
-
-        // actual file updates
-        file->ctz.head = file->block;
-        file->ctz.size = file->pos;
-        file->flags &= ~LFS_F_WRITING;
-        file->flags |= LFS_F_DIRTY;
+#ifndef LFS_READONLY
+    if ((file->flags & LFS_F_INLINE) &&
+            file->ctz.size > lfs_cache_size(lfs)) {
+        // inline files larger than our cache are outlined by the next
+        // commit to their pair, which must not borrow a cache
+        return true;
+    }
 
-        file->pos = pos;
+    if ((file->flags & LFS_F_ERRED) &&
+            ((file->flags & LFS_F_WRITING) ||
+                ((file->flags & LFS_F_INLINE) &&
+                    (file->flags & LFS_F_DIRTY)))) {
+        // failed writes can't be written out
+        return true;
     }
+#else
+    (void)lfs;
+#endif
 
-    return 0;
+    return false;
 }
-#endif
 
+// a file whose cache is the only place its pending writes live, taking the
+// cache back means moving them out to a block
+static bool lfs_file_isheld(const lfs_file_t *file) {
 #ifndef LFS_READONLY
-static int lfs_file_rawsync(lfs_t *lfs, lfs_file_t *file) {
-    if (file->flags & LFS_F_ERRED) {
-        // it's not safe to do anything if our file errored
-        return 0;
-    }
-
-    int err = lfs_file_flush(lfs, file);
-    if (err) {
-        file->flags |= LFS_F_ERRED;
-        return err;
-    }
+    return (file->flags & LFS_F_INLINE) &&
+            (file->flags & (LFS_F_WRITING | LFS_F_DIRTY));
+#else
+    (void)file;
+    return false;
+#endif
+}
 
+static void lfs_file_release(lfs_t *lfs, lfs_file_t *file) {
+    lfs_size_t slot = (lfs_size_t)(file->cache.buffer - lfs->fpool.buffer)
+            / lfs_cache_size(lfs);
+    lfs->fpool.used &= ~(1U << slot);
+    file->cache.buffer = NULL;
+    lfs_cache_drop(lfs, &file->cache);
+}
 
-    if ((file->flags & LFS_F_DIRTY) &&
-            !lfs_pair_isnull(file->m.pair)) {
-        // update dir entry
-        uint16_t type;
-        const void *buffer;
-        lfs_size_t size;
-        struct lfs_ctz ctz;
-        if (file->flags & LFS_F_INLINE) {
-            // inline the whole file
-            type = LFS_TYPE_INLINESTRUCT;
-            buffer = file->cache.buffer;
-            size = file->ctz.size;
-        } else {
-            // update the ctz reference
-            type = LFS_TYPE_CTZSTRUCT;
-            // copy ctz so alloc will work during a relocate
-            ctz = file->ctz;
-            lfs_ctz_tole32(&ctz);
-            buffer = &ctz;
-            size = sizeof(ctz);
+static int lfs_file_evict(lfs_t *lfs, lfs_file_t *file) {
+#ifndef LFS_READONLY
+    if (lfs_file_isheld(file)) {
+        // inline files live in the cache until committed, move them out
+        // to a block instead
+        int err = lfs_file_writeout(lfs, file);
+        if (err) {
+            file->flags |= LFS_F_ERRED;
+            return err;
         }
 
-        // commit file data and attributes
-        err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
-                {LFS_MKTAG(type, file->id, size), buffer},
-                {LFS_MKTAG(LFS_FROM_USERATTRS, file->id,
-                    file->cfg->attr_count), file->cfg->attrs}));
+        lfs->fpool.stat.flushes += 1;
+    } else if (file->flags & LFS_F_WRITING) {
+        int err = lfs_file_flush(lfs, file);
         if (err) {
             file->flags |= LFS_F_ERRED;
             return err;
         }
 
-        file->flags &= ~LFS_F_DIRTY;
+        lfs->fpool.stat.flushes += 1;
     }
+#endif
 
+    lfs_file_release(lfs, file);
+    lfs->fpool.stat.evictions += 1;
     return 0;
 }
-#endif
-
-static lfs_ssize_t lfs_file_rawread(lfs_t *lfs, lfs_file_t *file,
-        void *buffer, lfs_size_t size) {
-    LFS_ASSERT((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY);
-
-    uint8_t *data = buffer;
-    lfs_size_t nsize = size;
 
-#ifndef LFS_READONLY
-    if (file->flags & LFS_F_WRITING) {
-        // flush out any writes
-        int err = lfs_file_flush(lfs, file);
-        if (err) {
-            return err;
-        }
+// make sure a file holds a cache, files drawing from the shared pool
+// borrow one here, taking it from the least recently used file if needed
+static int lfs_file_borrow(lfs_t *lfs, lfs_file_t *file) {
+    if (!(file->flags & LFS_F_POOLED)) {
+        return 0;
     }
-#endif
 
-    if (file->pos >= file->ctz.size) {
-        // eof if past end
+    lfs->fpool.tick += 1;
+    file->tick = lfs->fpool.tick;
+    if (file->cache.buffer) {
+        lfs->fpool.stat.hits += 1;
         return 0;
     }
 
-    size = lfs_min(size, file->ctz.size - file->pos);
-    nsize = size;
-
-    while (nsize > 0) {
-        // check if we need a new block
-        if (!(file->flags & LFS_F_READING) ||
-                file->off == lfs->cfg->block_size) {
-            if (!(file->flags & LFS_F_INLINE)) {
-                int err = lfs_ctz_find(lfs, NULL, &file->cache,
-                        file->ctz.head, file->ctz.size,
-                        file->pos, &file->block, &file->off);
-                if (err) {
-                    return err;
+    lfs->fpool.stat.misses += 1;
+    lfs_size_t slot = 0;
+    while (slot < lfs->cfg->file_cache_count &&
+            (lfs->fpool.used & (1U << slot))) {
+        slot += 1;
+    }
+
+    if (slot == lfs->cfg->file_cache_count) {
+        // files holding unsynced inline writes go last, moving them to a
+        // block costs an erase for a few bytes and they would never be
+        // inline again, so they only give up their cache if all others do
+        lfs_file_t *lru = NULL;
+        for (int i = 0; i < LFS_MLIST_BUCKETS; i++) {
+            for (lfs_file_t *f = (lfs_file_t*)lfs->mlist[i];
+                    f; f = f->next) {
+                if (f->type == LFS_TYPE_REG && (f->flags & LFS_F_POOLED) &&
+                        f->cache.buffer && !lfs_file_ispinned(lfs, f) &&
+                        (!lru || (lfs_file_isheld(lru) &&
+                                !lfs_file_isheld(f)) ||
+                            (lfs_file_isheld(lru) == lfs_file_isheld(f) &&
+                                lfs->fpool.tick - f->tick
+                                    > lfs->fpool.tick - lru->tick))) {
+                    lru = f;
                 }
-            } else {
-                file->block = LFS_BLOCK_INLINE;
-                file->off = file->pos;
             }
-
-            file->flags |= LFS_F_READING;
         }
 
-        // read as much as we can in current block
-        lfs_size_t diff = lfs_min(nsize, lfs->cfg->block_size - file->off);
-        if (file->flags & LFS_F_INLINE) {
-            int err = lfs_dir_getread(lfs, &file->m,
-                    NULL, &file->cache, lfs->cfg->block_size,
-                    LFS_MKTAG(0xfff, 0x1ff, 0),
-                    LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0),
-                    file->off, data, diff);
-            if (err) {
-                return err;
-            }
-        } else {
-            int err = lfs_bd_read(lfs,
-                    NULL, &file->cache, lfs->cfg->block_size,
-                    file->block, file->off, data, diff);
-            if (err) {
-                return err;
-            }
+        if (!lru) {
+            return LFS_ERR_NOMEM;
         }
 
-        file->pos += diff;
-        file->off += diff;
-        data += diff;
-        nsize -= diff;
-    }
-
-    return size;
-}
-
-#ifndef LFS_READONLY
-static lfs_ssize_t lfs_file_rawwrite(lfs_t *lfs, lfs_file_t *file,
-        const void *buffer, lfs_size_t size) {
-    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
-
-    const uint8_t *data = buffer;
-    lfs_size_t nsize = size;
-
-    if (file->flags & LFS_F_READING) {
-        // drop any reads
-        int err = lfs_file_flush(lfs, file);
+        slot = (lfs_size_t)(lru->cache.buffer - lfs->fpool.buffer)
+                / lfs_cache_size(lfs);
+        int err = lfs_file_evict(lfs, lru);
         if (err) {
             return err;
         }
     }
 
-    if ((file->flags & LFS_O_APPEND) && file->pos < file->ctz.size) {
-        file->pos = file->ctz.size;
-    }
-
-    if (file->pos + size > lfs->file_max) {
-        // Larger than file limit?
-        return LFS_ERR_FBIG;
-    }
+    lfs->fpool.used |= 1U << slot;
+    file->cache.buffer = &lfs->fpool.buffer[slot*lfs_cache_size(lfs)];
+    lfs_cache_zero(lfs, &file->cache);
 
-    if (!(file->flags & LFS_F_WRITING) && file->pos > file->ctz.size) {
-        // fill with zeros
-        lfs_off_t pos = file->pos;
-        file->pos = file->ctz.size;
+    if (file->flags & LFS_F_INLINE) {
+        // inline files keep their whole contents in the cache
+        file->cache.block = LFS_BLOCK_INLINE;
+        file->cache.off = 0;
+        file->cache.size = lfs_cache_size(lfs);
 
-        while (file->pos < pos) {
-            lfs_ssize_t res = lfs_file_rawwrite(lfs, file, &(uint8_t){0}, 1);
+        if (file->ctz.size > 0) {
+            lfs_stag_t res = lfs_dir_get(lfs, &file->m,
+                    LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_STRUCT, file->id,
+                        lfs_min(file->cache.size, 0x3fe)),
+                    file->cache.buffer);
             if (res < 0) {
+                lfs_file_release(lfs, file);
                 return res;
             }
         }
     }
 
-    if ((file->flags & LFS_F_INLINE) &&
-            lfs_max(file->pos+nsize, file->ctz.size) >
-            lfs_min(0x3fe, lfs_min(
-                lfs->cfg->cache_size,
-                (lfs->cfg->metadata_max ?
-                    lfs->cfg->metadata_max : lfs->cfg->block_size) / 8))) {
-        // inline file doesn't fit anymore
-        int err = lfs_file_outline(lfs, file);
+    return 0;
+}
+
+
+/// Top level file operations ///
+static int lfs_file_rawopenat(lfs_t *lfs, lfs_file_t *file,
+        const char *path, const lfs_handle_t *handle, int flags,
+        const struct lfs_file_config *cfg) {
+#ifndef LFS_READONLY
+    // deorphan if we haven't yet, needed at most once after poweron
+    if ((flags & LFS_O_WRONLY) == LFS_O_WRONLY) {
+        int err = lfs_fs_forceconsistency(lfs);
         if (err) {
-            file->flags |= LFS_F_ERRED;
             return err;
         }
     }
+#else
+    LFS_ASSERT((flags & LFS_O_RDONLY) == LFS_O_RDONLY);
+#endif
 
-    while (nsize > 0) {
-        // check if we need a new block
-        if (!(file->flags & LFS_F_WRITING) ||
-                file->off == lfs->cfg->block_size) {
-            if (!(file->flags & LFS_F_INLINE)) {
-                if (!(file->flags & LFS_F_WRITING) && file->pos > 0) {
-                    // find out which block we're extending from
-                    int err = lfs_ctz_find(lfs, NULL, &file->cache,
-                            file->ctz.head, file->ctz.size,
-                            file->pos-1, &file->block, &file->off);
-                    if (err) {
-                        file->flags |= LFS_F_ERRED;
-                        return err;
-                    }
+    // setup simple file details
+    int err;
+    file->cfg = cfg;
+    file->flags = flags;
+    file->pos = 0;
+    file->off = 0;
+    file->cache.buffer = NULL;
+    // not hashed until the entry is found, but a failed lookup still closes
+    // the file and looks for it in its bucket
+    file->bucket = 0;
+
+    // allocate entry for file if it doesn't exist, a handle always refers
+    // to an existing entry
+    lfs_stag_t tag;
+    if (handle) {
+        file->id = 0x3ff;
+        tag = lfs_handle_find(lfs, &file->m, handle, &file->id);
+    } else {
+        tag = lfs_dir_findcached(lfs, &file->m, &path, &file->id);
+    }
+    if (tag < 0 && !(tag == LFS_ERR_NOENT && file->id != 0x3ff)) {
+        err = tag;
+        goto cleanup;
+    }
 
-                    // mark cache as dirty since we may have read data into it
-                    lfs_cache_zero(lfs, &file->cache);
-                }
+    // get id, add to list of mdirs to catch update changes
+    file->type = LFS_TYPE_REG;
+    lfs_mlist_append(lfs, (struct lfs_mlist *)file);
 
-                // extend file with new blocks
-                lfs_alloc_ack(lfs);
-                int err = lfs_ctz_extend(lfs, &file->cache, &lfs->rcache,
-                        file->block, file->pos,
-                        &file->block, &file->off);
-                if (err) {
-                    file->flags |= LFS_F_ERRED;
-                    return err;
-                }
-            } else {
-                file->block = LFS_BLOCK_INLINE;
-                file->off = file->pos;
-            }
+#ifdef LFS_READONLY
+    if (tag == LFS_ERR_NOENT) {
+        err = LFS_ERR_NOENT;
+        goto cleanup;
+#else
+    if (tag == LFS_ERR_NOENT) {
+        if (!(flags & LFS_O_CREAT)) {
+            err = LFS_ERR_NOENT;
+            goto cleanup;
+        }
 
-            file->flags |= LFS_F_WRITING;
+        // check that name fits
+        lfs_size_t nlen = strlen(path);
+        if (nlen > lfs->name_max) {
+            err = LFS_ERR_NAMETOOLONG;
+            goto cleanup;
         }
 
-        // program as much as we can in current block
-        lfs_size_t diff = lfs_min(nsize, lfs->cfg->block_size - file->off);
-        while (true) {
-            int err = lfs_bd_prog(lfs, &file->cache, &lfs->rcache, true,
-                    file->block, file->off, data, diff);
-            if (err) {
-                if (err == LFS_ERR_CORRUPT) {
-                    goto relocate;
-                }
-                file->flags |= LFS_F_ERRED;
-                return err;
-            }
-
-            break;
-relocate:
-            err = lfs_file_relocate(lfs, file);
-            if (err) {
-                file->flags |= LFS_F_ERRED;
-                return err;
-            }
+        // get next slot and create entry to remember name
+        err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
+                {LFS_MKTAG(LFS_TYPE_CREATE, file->id, 0), NULL},
+                {LFS_MKTAG(LFS_TYPE_REG, file->id, nlen), path},
+                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0), NULL}));
+        if (err) {
+            err = LFS_ERR_NAMETOOLONG;
+            goto cleanup;
         }
 
-        file->pos += diff;
-        file->off += diff;
-        data += diff;
-        nsize -= diff;
+        // did our parent split? update its index
+        err = lfs_dir_reindex(lfs);
+        if (err) {
+            goto cleanup;
+        }
 
-        lfs_alloc_ack(lfs);
+        tag = LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, 0);
+    } else if (flags & LFS_O_EXCL) {
+        err = LFS_ERR_EXIST;
+        goto cleanup;
+#endif
+    } else if (lfs_tag_type3(tag) != LFS_TYPE_REG) {
+        err = LFS_ERR_ISDIR;
+        goto cleanup;
+#ifndef LFS_READONLY
+    } else if (flags & LFS_O_TRUNC) {
+        // truncate if requested
+        tag = LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0);
+        file->flags |= LFS_F_DIRTY;
+#endif
+    } else {
+        // try to load what's on disk, if it's inlined we'll fix it later
+        tag = lfs_dir_get(lfs, &file->m, LFS_MKTAG(0x700, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_STRUCT, file->id, 8), &file->ctz);
+        if (tag < 0) {
+            err = tag;
+            goto cleanup;
+        }
+        lfs_ctz_fromle32(&file->ctz);
+        if (lfs_tag_type3(tag) == LFS_TYPE_INDEXSTRUCT) {
+            file->flags |= LFS_F_INDEX;
+        }
     }
 
-    file->flags &= ~LFS_F_ERRED;
-    return size;
-}
-#endif
+    // fetch attrs
+    for (unsigned i = 0; i < file->cfg->attr_count; i++) {
+        // if opened for read / read-write operations
+        if ((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY) {
+            lfs_stag_t res = lfs_dir_get(lfs, &file->m,
+                    LFS_MKTAG(0x7ff, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_USERATTR + file->cfg->attrs[i].type,
+                        file->id, file->cfg->attrs[i].size),
+                        file->cfg->attrs[i].buffer);
+            if (res < 0 && res != LFS_ERR_NOENT) {
+                err = res;
+                goto cleanup;
+            }
+        }
 
-static lfs_soff_t lfs_file_rawseek(lfs_t *lfs, lfs_file_t *file,
-        lfs_soff_t off, int whence) {
-    // find new pos
-    lfs_off_t npos = file->pos;
-    if (whence == LFS_SEEK_SET) {
-        npos = off;
-    } else if (whence == LFS_SEEK_CUR) {
-        npos = file->pos + off;
-    } else if (whence == LFS_SEEK_END) {
-        npos = lfs_file_rawsize(lfs, file) + off;
-    }
+#ifndef LFS_READONLY
+        // if opened for write / read-write operations
+        if ((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY) {
+            if (file->cfg->attrs[i].size > lfs->attr_max) {
+                err = LFS_ERR_NOSPC;
+                goto cleanup;
+            }
 
-    if (npos > lfs->file_max) {
-        // file position out of range
-        return LFS_ERR_INVAL;
+            file->flags |= LFS_F_DIRTY;
+        }
+#endif
     }
 
-    if (file->pos == npos) {
-        // noop - position has not changed
-        return npos;
+    if (lfs_tag_type3(tag) == LFS_TYPE_INLINESTRUCT) {
+        file->ctz.head = LFS_BLOCK_INLINE;
+        file->ctz.size = lfs_tag_size(tag);
+        file->flags |= LFS_F_INLINE;
     }
 
+    // allocate buffer if needed
+    if (file->cfg->buffer) {
+        file->cache.buffer = file->cfg->buffer;
+    } else if (lfs->fpool.buffer) {
+        // borrow from the shared pool once we're read or written
+        file->flags |= LFS_F_POOLED;
+        file->tick = 0;
+        lfs_cache_drop(lfs, &file->cache);
 #ifndef LFS_READONLY
-    // write out everything beforehand, may be noop if rdonly
-    int err = lfs_file_flush(lfs, file);
-    if (err) {
-        return err;
-    }
+        if ((file->flags & LFS_F_INLINE) &&
+                file->ctz.size > lfs_cache_size(lfs)) {
+            // pinned until outlined, see lfs_file_ispinned
+            err = lfs_file_borrow(lfs, file);
+            if (err) {
+                goto cleanup;
+            }
+        }
 #endif
-
-    // update pos
-    file->pos = npos;
-    return npos;
-}
-
-#ifndef LFS_READONLY
-static int lfs_file_rawtruncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
-    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
-
-    if (size > LFS_FILE_MAX) {
-        return LFS_ERR_INVAL;
-    }
-
-    lfs_off_t pos = file->pos;
-    lfs_off_t oldsize = lfs_file_rawsize(lfs, file);
-    if (size < oldsize) {
-        // need to flush since directly changing metadata
-        int err = lfs_file_flush(lfs, file);
-        if (err) {
-            return err;
+        return 0;
+    } else {
+        file->cache.buffer = lfs_malloc(lfs_cache_size(lfs));
+        if (!file->cache.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
         }
+    }
 
-        // lookup new head in ctz skip list
-        err = lfs_ctz_find(lfs, NULL, &file->cache,
-                file->ctz.head, file->ctz.size,
-                size, &file->block, &file->off);
-        if (err) {
-            return err;
-        }
+    // zero to avoid information leak
+    lfs_cache_zero(lfs, &file->cache);
 
-        // need to set pos/block/off consistently so seeking back to
-        // the old position does not get confused
-        file->pos = size;
-        file->ctz.head = file->block;
-        file->ctz.size = size;
-        file->flags |= LFS_F_DIRTY | LFS_F_READING;
-    } else if (size > oldsize) {
-        // flush+seek if not already at end
-        lfs_soff_t res = lfs_file_rawseek(lfs, file, 0, LFS_SEEK_END);
-        if (res < 0) {
-            return (int)res;
-        }
+    if (file->flags & LFS_F_INLINE) {
+        // load inline files
+        file->cache.block = file->ctz.head;
+        file->cache.off = 0;
+        file->cache.size = lfs_cache_size(lfs);
 
-        // fill with zeros
-        while (file->pos < size) {
-            res = lfs_file_rawwrite(lfs, file, &(uint8_t){0}, 1);
+        // don't always read (may be new/trunc file)
+        if (file->ctz.size > 0) {
+            lfs_stag_t res = lfs_dir_get(lfs, &file->m,
+                    LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_STRUCT, file->id,
+                        lfs_min(file->cache.size, 0x3fe)),
+                    file->cache.buffer);
             if (res < 0) {
-                return (int)res;
+                err = res;
+                goto cleanup;
             }
         }
     }
 
-    // restore pos
-    lfs_soff_t res = lfs_file_rawseek(lfs, file, pos, LFS_SEEK_SET);
-    if (res < 0) {
-      return (int)res;
-    }
-
     return 0;
-}
+
+cleanup:
+    // clean up lingering resources
+#ifndef LFS_READONLY
+    file->flags |= LFS_F_ERRED;
 #endif
+    lfs_file_rawclose(lfs, file);
+    return err;
+}
 
-static lfs_soff_t lfs_file_rawtell(lfs_t *lfs, lfs_file_t *file) {
-    (void)lfs;
-    return file->pos;
+static int lfs_file_rawopencfg(lfs_t *lfs, lfs_file_t *file,
+        const char *path, int flags,
+        const struct lfs_file_config *cfg) {
+    return lfs_file_rawopenat(lfs, file, path, NULL, flags, cfg);
 }
 
-static int lfs_file_rawrewind(lfs_t *lfs, lfs_file_t *file) {
-    lfs_soff_t res = lfs_file_rawseek(lfs, file, 0, LFS_SEEK_SET);
-    if (res < 0) {
-        return (int)res;
-    }
+static int lfs_file_rawopenhandlecfg(lfs_t *lfs, lfs_file_t *file,
+        const lfs_handle_t *handle, int flags,
+        const struct lfs_file_config *cfg) {
+    return lfs_file_rawopenat(lfs, file, NULL, handle, flags, cfg);
+}
 
-    return 0;
+static int lfs_file_rawopen(lfs_t *lfs, lfs_file_t *file,
+        const char *path, int flags) {
+    static const struct lfs_file_config defaults = {0};
+    int err = lfs_file_rawopencfg(lfs, file, path, flags, &defaults);
+    return err;
 }
 
-static lfs_soff_t lfs_file_rawsize(lfs_t *lfs, lfs_file_t *file) {
-    (void)lfs;
+static int lfs_file_rawopenhandle(lfs_t *lfs, lfs_file_t *file,
+        const lfs_handle_t *handle, int flags) {
+    static const struct lfs_file_config defaults = {0};
+    int err = lfs_file_rawopenhandlecfg(lfs, file, handle, flags, &defaults);
+    return err;
+}
 
+static int lfs_file_rawclose(lfs_t *lfs, lfs_file_t *file) {
 #ifndef LFS_READONLY
-    if (file->flags & LFS_F_WRITING) {
-        return lfs_max(file->pos, file->ctz.size);
-    }
+    int err = lfs_file_rawsync(lfs, file);
+#else
+    int err = 0;
 #endif
 
-    return file->ctz.size;
-}
-
+    // remove from list of mdirs
+    lfs_mlist_remove(lfs, (struct lfs_mlist*)file);
 
-/// General fs operations ///
-static int lfs_rawstat(lfs_t *lfs, const char *path, struct lfs_info *info) {
-    lfs_mdir_t cwd;
-    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
-    if (tag < 0) {
-        return (int)tag;
+    // clean up memory
+    if (file->flags & LFS_F_POOLED) {
+        if (file->cache.buffer) {
+            lfs_file_release(lfs, file);
+        }
+    } else if (!file->cfg->buffer) {
+        lfs_free(file->cache.buffer);
     }
 
-    return lfs_dir_getinfo(lfs, &cwd, lfs_tag_id(tag), info);
+    return err;
 }
 
-#ifndef LFS_READONLY
-static int lfs_rawremove(lfs_t *lfs, const char *path) {
-    // deorphan if we haven't yet, needed at most once after poweron
-    int err = lfs_fs_forceconsistency(lfs);
-    if (err) {
-        return err;
-    }
 
-    lfs_mdir_t cwd;
-    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
-    if (tag < 0 || lfs_tag_id(tag) == 0x3ff) {
-        return (tag < 0) ? (int)tag : LFS_ERR_INVAL;
-    }
+#ifndef LFS_READONLY
+static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
+    while (true) {
+        // just relocate what exists into new block
+        lfs_block_t nblock;
+        int err = lfs_alloc(lfs, &nblock);
+        if (err) {
+            return err;
+        }
 
-    struct lfs_mlist dir;
-    dir.next = lfs->mlist;
-    if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
-        // must be empty before removal
-        lfs_block_t pair[2];
-        lfs_stag_t res = lfs_dir_get(lfs, &cwd, LFS_MKTAG(0x700, 0x3ff, 0),
-                LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), 8), pair);
-        if (res < 0) {
-            return (int)res;
-        }
-        lfs_pair_fromle32(pair);
-
-        err = lfs_dir_fetch(lfs, &dir.m, pair);
+        err = lfs_bd_erase(lfs, nblock);
         if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
+            }
             return err;
         }
 
-        if (dir.m.count > 0 || dir.m.split) {
-            return LFS_ERR_NOTEMPTY;
-        }
+        // either read from dirty cache or disk
+        for (lfs_off_t i = 0; i < file->off; i++) {
+            uint8_t data;
+            if (file->flags & LFS_F_INLINE) {
+                err = lfs_dir_getread(lfs, &file->m,
+                        // note we evict inline files before they can be dirty
+                        NULL, &file->cache, file->off-i,
+                        LFS_MKTAG(0xfff, 0x1ff, 0),
+                        LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0),
+                        i, &data, 1);
+                if (err) {
+                    return err;
+                }
+            } else {
+                err = lfs_bd_read(lfs,
+                        &file->cache, lfs->dcache, file->off-i,
+                        file->block, i, &data, 1);
+                if (err) {
+                    return err;
+                }
+            }
 
-        // mark fs as orphaned
-        err = lfs_fs_preporphans(lfs, +1);
-        if (err) {
-            return err;
+            err = lfs_bd_prog(lfs,
+                    &lfs->pcache, lfs->dcache, true,
+                    nblock, i, &data, 1);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
         }
 
-        // I know it's crazy but yes, dir can be changed by our parent's
-        // commit (if predecessor is child)
-        dir.type = 0;
-        dir.id = 0;
-        lfs->mlist = &dir;
-    }
-
-    // delete the entry
-    err = lfs_dir_commit(lfs, &cwd, LFS_MKATTRS(
-            {LFS_MKTAG(LFS_TYPE_DELETE, lfs_tag_id(tag), 0), NULL}));
-    if (err) {
-        lfs->mlist = dir.next;
-        return err;
-    }
+        // copy over new state of file
+        memcpy(file->cache.buffer, lfs->pcache.buffer, lfs_cache_size(lfs));
+        file->cache.block = lfs->pcache.block;
+        file->cache.off = lfs->pcache.off;
+        file->cache.size = lfs->pcache.size;
+        lfs_cache_zero(lfs, &lfs->pcache);
 
-    lfs->mlist = dir.next;
-    if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
-        // fix orphan
-        err = lfs_fs_preporphans(lfs, -1);
-        if (err) {
-            return err;
-        }
+        file->block = nblock;
+        file->flags |= LFS_F_WRITING;
+        return 0;
 
-        err = lfs_fs_pred(lfs, dir.m.pair, &cwd);
-        if (err) {
-            return err;
-        }
+relocate:
+        LFS_DEBUG("Bad block at 0x%"PRIx32, nblock);
 
-        err = lfs_dir_drop(lfs, &cwd, &dir.m);
-        if (err) {
-            return err;
-        }
+        // just clear cache and try a new block
+        lfs_cache_drop(lfs, &lfs->pcache);
     }
-
-    return 0;
 }
 #endif
 
 #ifndef LFS_READONLY
-static int lfs_rawrename(lfs_t *lfs, const char *oldpath, const char *newpath) {
-    // deorphan if we haven't yet, needed at most once after poweron
-    int err = lfs_fs_forceconsistency(lfs);
+static int lfs_file_outline(lfs_t *lfs, lfs_file_t *file) {
+    file->off = file->pos;
+    lfs_alloc_ack(lfs);
+    int err = lfs_file_relocate(lfs, file);
     if (err) {
         return err;
     }
 
-    // find old entry
-    lfs_mdir_t oldcwd;
-    lfs_stag_t oldtag = lfs_dir_find(lfs, &oldcwd, &oldpath, NULL);
-    if (oldtag < 0 || lfs_tag_id(oldtag) == 0x3ff) {
-        return (oldtag < 0) ? (int)oldtag : LFS_ERR_INVAL;
+    file->flags &= ~LFS_F_INLINE;
+    if (file->flags & LFS_O_INDEX) {
+        // the block being written becomes the first block of an empty
+        // index, the write that outlined the file always covers the rest
+        // of the inline data
+        file->ctz.head = LFS_BLOCK_NULL;
+        file->ctz.size = 0;
+        file->flags |= LFS_F_INDEX;
     }
+    return 0;
+}
+#endif
 
-    // find new entry
-    lfs_mdir_t newcwd;
-    uint16_t newid;
-    lfs_stag_t prevtag = lfs_dir_find(lfs, &newcwd, &newpath, &newid);
-    if ((prevtag < 0 || lfs_tag_id(prevtag) == 0x3ff) &&
-            !(prevtag == LFS_ERR_NOENT && newid != 0x3ff)) {
-        return (prevtag < 0) ? (int)prevtag : LFS_ERR_INVAL;
+#ifndef LFS_READONLY
+// move the whole of an inline file out to a block, nothing is committed,
+// the file's new struct is committed when the file is synced
+static int lfs_file_writeout(lfs_t *lfs, lfs_file_t *file) {
+    lfs_off_t pos = file->pos;
+    file->pos = lfs_file_rawsize(lfs, file);
+    int err = lfs_file_outline(lfs, file);
+    if (!err) {
+        err = lfs_file_flush(lfs, file);
     }
+    file->pos = pos;
+    return err;
+}
+#endif
 
-    // if we're in the same pair there's a few special cases...
-    bool samepair = (lfs_pair_cmp(oldcwd.pair, newcwd.pair) == 0);
-    uint16_t newoldid = lfs_tag_id(oldtag);
-
-    struct lfs_mlist prevdir;
-    prevdir.next = lfs->mlist;
-    if (prevtag == LFS_ERR_NOENT) {
-        // check that name fits
-        lfs_size_t nlen = strlen(newpath);
-        if (nlen > lfs->name_max) {
-            return LFS_ERR_NAMETOOLONG;
+#ifndef LFS_READONLY
+// start a new copy of the indexed block at the current position, anything
+// before the position is copied over from the old block
+static int lfs_file_indexbegin(lfs_t *lfs, lfs_file_t *file) {
+    lfs_off_t off = file->pos % lfs_block_size(lfs);
+    lfs_block_t oblock = LFS_BLOCK_NULL;
+    if (off > 0) {
+        lfs_off_t ooff;
+        int err = lfs_index_find(lfs, NULL, lfs->dcache,
+                file->ctz.head, file->ctz.size,
+                file->pos, &oblock, &ooff);
+        if (err) {
+            return err;
         }
+    }
 
-        // there is a small chance we are being renamed in the same
-        // directory/ to an id less than our old id, the global update
-        // to handle this is a bit messy
-        if (samepair && newid <= newoldid) {
-            newoldid += 1;
-        }
-    } else if (lfs_tag_type3(prevtag) != lfs_tag_type3(oldtag)) {
-        return LFS_ERR_ISDIR;
-    } else if (samepair && newid == newoldid) {
-        // we're renaming to ourselves??
-        return 0;
-    } else if (lfs_tag_type3(prevtag) == LFS_TYPE_DIR) {
-        // must be empty before removal
-        lfs_block_t prevpair[2];
-        lfs_stag_t res = lfs_dir_get(lfs, &newcwd, LFS_MKTAG(0x700, 0x3ff, 0),
-                LFS_MKTAG(LFS_TYPE_STRUCT, newid, 8), prevpair);
-        if (res < 0) {
-            return (int)res;
-        }
-        lfs_pair_fromle32(prevpair);
+    // mark cache as dirty since we may have read data into it
+    lfs_cache_zero(lfs, &file->cache);
 
-        // must be empty before removal
-        err = lfs_dir_fetch(lfs, &prevdir.m, prevpair);
+    while (true) {
+        lfs_block_t nblock;
+        int err = lfs_alloc(lfs, &nblock);
         if (err) {
             return err;
         }
 
-        if (prevdir.m.count > 0 || prevdir.m.split) {
-            return LFS_ERR_NOTEMPTY;
-        }
-
-        // mark fs as orphaned
-        err = lfs_fs_preporphans(lfs, +1);
+        err = lfs_bd_erase(lfs, nblock);
         if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
+            }
             return err;
         }
 
-        // I know it's crazy but yes, dir can be changed by our parent's
-        // commit (if predecessor is child)
-        prevdir.type = 0;
-        prevdir.id = 0;
-        lfs->mlist = &prevdir;
-    }
+        for (lfs_off_t i = 0; i < off; i++) {
+            uint8_t data;
+            err = lfs_bd_read(lfs,
+                    NULL, lfs->dcache, off-i,
+                    oblock, i, &data, 1);
+            if (err) {
+                return err;
+            }
 
-    if (!samepair) {
-        lfs_fs_prepmove(lfs, newoldid, oldcwd.pair);
+            err = lfs_bd_prog(lfs,
+                    &file->cache, lfs->dcache, true,
+                    nblock, i, &data, 1);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
+            }
+        }
+
+        file->block = nblock;
+        file->off = off;
+        file->flags |= LFS_F_WRITING;
+        return 0;
+
+relocate:
+        LFS_DEBUG("Bad block at 0x%"PRIx32, nblock);
+
+        // just clear cache and try a new block
+        lfs_cache_drop(lfs, &file->cache);
     }
+}
 
-    // move over all attributes
-    err = lfs_dir_commit(lfs, &newcwd, LFS_MKATTRS(
-            {LFS_MKTAG_IF(prevtag != LFS_ERR_NOENT,
-                LFS_TYPE_DELETE, newid, 0), NULL},
-            {LFS_MKTAG(LFS_TYPE_CREATE, newid, 0), NULL},
-            {LFS_MKTAG(lfs_tag_type3(oldtag), newid, strlen(newpath)), newpath},
-            {LFS_MKTAG(LFS_FROM_MOVE, newid, lfs_tag_id(oldtag)), &oldcwd},
-            {LFS_MKTAG_IF(samepair,
-                LFS_TYPE_DELETE, newoldid, 0), NULL}));
-    if (err) {
-        lfs->mlist = prevdir.next;
-        return err;
+// finish the block being written and link it into the index
+static int lfs_file_indexlink(lfs_t *lfs, lfs_file_t *file) {
+    lfs_off_t start = file->pos - file->off;
+
+    // copy over the rest of the old block
+    lfs_off_t end = 0;
+    if (file->ctz.size > start) {
+        end = lfs_min(lfs_block_size(lfs), file->ctz.size - start);
     }
 
-    // let commit clean up after move (if we're different! otherwise move
-    // logic already fixed it for us)
-    if (!samepair && lfs_gstate_hasmove(&lfs->gstate)) {
-        // prep gstate and delete move id
-        lfs_fs_prepmove(lfs, 0x3ff, NULL);
-        err = lfs_dir_commit(lfs, &oldcwd, LFS_MKATTRS(
-                {LFS_MKTAG(LFS_TYPE_DELETE, lfs_tag_id(oldtag), 0), NULL}));
+    if (file->off < end) {
+        lfs_block_t oblock;
+        lfs_off_t ooff;
+        int err = lfs_index_find(lfs, NULL, lfs->dcache,
+                file->ctz.head, file->ctz.size,
+                start, &oblock, &ooff);
         if (err) {
-            lfs->mlist = prevdir.next;
             return err;
         }
-    }
 
-    lfs->mlist = prevdir.next;
-    if (prevtag != LFS_ERR_NOENT && lfs_tag_type3(prevtag) == LFS_TYPE_DIR) {
-        // fix orphan
-        err = lfs_fs_preporphans(lfs, -1);
-        if (err) {
-            return err;
+        while (file->off < end) {
+            uint8_t data;
+            err = lfs_bd_read(lfs,
+                    NULL, lfs->dcache, end - file->off,
+                    oblock, file->off, &data, 1);
+            if (err) {
+                return err;
+            }
+
+            err = lfs_bd_prog(lfs,
+                    &file->cache, lfs->dcache, true,
+                    file->block, file->off, &data, 1);
+            if (err) {
+                if (err != LFS_ERR_CORRUPT) {
+                    return err;
+                }
+
+                LFS_DEBUG("Bad block at 0x%"PRIx32, file->block);
+                err = lfs_file_relocate(lfs, file);
+                if (err) {
+                    return err;
+                }
+                continue;
+            }
+
+            file->off += 1;
         }
+    }
 
-        err = lfs_fs_pred(lfs, prevdir.m.pair, &newcwd);
+    // write out what we have
+    while (true) {
+        int err = lfs_bd_flush(lfs, &file->cache, lfs->dcache, true);
         if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
+            }
             return err;
         }
 
-        err = lfs_dir_drop(lfs, &newcwd, &prevdir.m);
+        break;
+
+relocate:
+        LFS_DEBUG("Bad block at 0x%"PRIx32, file->block);
+        err = lfs_file_relocate(lfs, file);
         if (err) {
             return err;
         }
     }
 
-    return 0;
-}
+    lfs_alloc_ack(lfs);
+    int err = lfs_index_set(lfs, &file->ctz,
+            start / lfs_block_size(lfs), file->block,
+            lfs_max(file->ctz.size, start + file->off));
+    if (err) {
+        return err;
+    }
+
+    file->flags &= ~LFS_F_WRITING;
+    file->flags |= LFS_F_DIRTY;
+    return 0;
+}
 #endif
 
-static lfs_ssize_t lfs_rawgetattr(lfs_t *lfs, const char *path,
-        uint8_t type, void *buffer, lfs_size_t size) {
-    lfs_mdir_t cwd;
-    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
-    if (tag < 0) {
-        return tag;
+#ifndef LFS_READONLY
+static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
+    if (file->flags & LFS_F_READING) {
+        if (!(file->flags & LFS_F_INLINE)) {
+            lfs_cache_drop(lfs, &file->cache);
+        }
+        file->flags &= ~LFS_F_READING;
     }
 
-    uint16_t id = lfs_tag_id(tag);
-    if (id == 0x3ff) {
-        // special case for root
-        id = 0;
-        int err = lfs_dir_fetch(lfs, &cwd, lfs->root);
-        if (err) {
-            return err;
-        }
+    if ((file->flags & LFS_F_WRITING) && (file->flags & LFS_F_INDEX)) {
+        // only the block being written changes, nothing after it moves
+        return lfs_file_indexlink(lfs, file);
     }
 
-    tag = lfs_dir_get(lfs, &cwd, LFS_MKTAG(0x7ff, 0x3ff, 0),
-            LFS_MKTAG(LFS_TYPE_USERATTR + type,
-                id, lfs_min(size, lfs->attr_max)),
-            buffer);
-    if (tag < 0) {
-        if (tag == LFS_ERR_NOENT) {
-            return LFS_ERR_NOATTR;
+    if (file->flags & LFS_F_WRITING) {
+        lfs_off_t pos = file->pos;
+
+        if (!(file->flags & LFS_F_INLINE)) {
+            // copy over anything after current branch
+            lfs_file_t orig = {
+                .ctz.head = file->ctz.head,
+                .ctz.size = file->ctz.size,
+                .flags = LFS_O_RDONLY,
+                .pos = file->pos,
+                .cache = lfs->rcache,
+            };
+            lfs_cache_drop(lfs, &lfs->rcache);
+
+            while (file->pos < file->ctz.size) {
+                // copy over a byte at a time, leave it up to caching
+                // to make this efficient
+                uint8_t data;
+                lfs_ssize_t res = lfs_file_rawread(lfs, &orig, &data, 1);
+                if (res < 0) {
+                    return res;
+                }
+
+                res = lfs_file_cachedwrite(lfs, file, &data, 1);
+                if (res < 0) {
+                    return res;
+                }
+
+                // keep our reference to the rcache in sync
+                if (lfs->rcache.block != LFS_BLOCK_NULL) {
+                    lfs_cache_drop(lfs, &orig.cache);
+                    lfs_cache_drop(lfs, &lfs->rcache);
+                }
+            }
+
+            // write out what we have
+            while (true) {
+                int err = lfs_bd_flush(lfs, &file->cache, lfs->dcache, true);
+                if (err) {
+                    if (err == LFS_ERR_CORRUPT) {
+                        goto relocate;
+                    }
+                    return err;
+                }
+
+                break;
+
+relocate:
+                LFS_DEBUG("Bad block at 0x%"PRIx32, file->block);
+                err = lfs_file_relocate(lfs, file);
+                if (err) {
+                    return err;
+                }
+            }
+        } else {
+            file->pos = lfs_max(file->pos, file->ctz.size);
         }
 
-        return tag;
+        // actual file updates
+        file->ctz.head = file->block;
+        file->ctz.size = file->pos;
+        file->flags &= ~LFS_F_WRITING;
+        file->flags |= LFS_F_DIRTY;
+
+        file->pos = pos;
     }
 
-    return lfs_tag_size(tag);
+    return 0;
 }
+#endif
 
 #ifndef LFS_READONLY
-static int lfs_commitattr(lfs_t *lfs, const char *path,
-        uint8_t type, const void *buffer, lfs_size_t size) {
-    lfs_mdir_t cwd;
-    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
-    if (tag < 0) {
-        return tag;
+static int lfs_file_rawsync(lfs_t *lfs, lfs_file_t *file) {
+    if (file->flags & LFS_F_ERRED) {
+        // it's not safe to do anything if our file errored
+        return 0;
     }
 
-    uint16_t id = lfs_tag_id(tag);
-    if (id == 0x3ff) {
-        // special case for root
-        id = 0;
-        int err = lfs_dir_fetch(lfs, &cwd, lfs->root);
+    if ((file->flags & LFS_F_INLINE) && (file->flags & LFS_F_DIRTY) &&
+            !file->cache.buffer) {
+        // we commit inline files from the cache
+        int err = lfs_file_borrow(lfs, file);
         if (err) {
             return err;
         }
     }
 
-    return lfs_dir_commit(lfs, &cwd, LFS_MKATTRS(
-            {LFS_MKTAG(LFS_TYPE_USERATTR + type, id, size), buffer}));
-}
-#endif
+    int err = lfs_file_flush(lfs, file);
+    if (err) {
+        // a pending operation comes back to finish the flush
+        if (err != LFS_ERR_PENDING) {
+            file->flags |= LFS_F_ERRED;
+        }
+        return err;
+    }
 
-#ifndef LFS_READONLY
-static int lfs_rawsetattr(lfs_t *lfs, const char *path,
-        uint8_t type, const void *buffer, lfs_size_t size) {
-    if (size > lfs->attr_max) {
-        return LFS_ERR_NOSPC;
+
+    if ((file->flags & LFS_F_DIRTY) &&
+            !lfs_pair_isnull(file->m.pair)) {
+        // update dir entry
+        uint16_t type;
+        const void *buffer;
+        lfs_size_t size;
+        struct lfs_ctz ctz;
+        if (file->flags & LFS_F_INLINE) {
+            // inline the whole file
+            type = LFS_TYPE_INLINESTRUCT;
+            buffer = file->cache.buffer;
+            size = file->ctz.size;
+        } else {
+            // update the ctz or index reference
+            type = (file->flags & LFS_F_INDEX)
+                    ? LFS_TYPE_INDEXSTRUCT
+                    : LFS_TYPE_CTZSTRUCT;
+            // copy ctz so alloc will work during a relocate
+            ctz = file->ctz;
+            lfs_ctz_tole32(&ctz);
+            buffer = &ctz;
+            size = sizeof(ctz);
+        }
+
+        // commit file data and attributes, along with the allocator's
+        // position
+        lfs_alloc_setcursor(lfs);
+        err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
+                {LFS_MKTAG(type, file->id, size), buffer},
+                {LFS_MKTAG(LFS_FROM_USERATTRS, file->id,
+                    file->cfg->attr_count), file->cfg->attrs}));
+        if (err) {
+            if (err != LFS_ERR_PENDING) {
+                file->flags |= LFS_F_ERRED;
+            }
+            return err;
+        }
+
+        file->flags &= ~LFS_F_DIRTY;
     }
 
-    return lfs_commitattr(lfs, path, type, buffer, size);
+    return 0;
 }
 #endif
 
-#ifndef LFS_READONLY
-static int lfs_rawremoveattr(lfs_t *lfs, const char *path, uint8_t type) {
-    return lfs_commitattr(lfs, path, type, NULL, 0x3ff);
-}
-#endif
+// read a span of several blocks with one vectored read straight into the
+// buffer, only the edges not aligned to read_size go through the file's
+// cache, returns 0 if the read fits in a single block
+static lfs_ssize_t lfs_file_readvec(lfs_t *lfs, lfs_file_t *file,
+        void *buffer, lfs_size_t size) {
+    // lay out the regions, offsets only depend on the file's position
+    struct lfs_iovec iov[LFS_READV_MAX];
+    uint8_t *data = buffer;
+    lfs_size_t count = 0;
+    lfs_size_t nsize = size;
+    while (nsize > 0 && count < LFS_READV_MAX) {
+        lfs_off_t off = file->pos + (data - (uint8_t*)buffer);
+        if (file->flags & LFS_F_INDEX) {
+            off = off % lfs_block_size(lfs);
+        } else {
+            lfs_ctz_index(lfs, &off);
+        }
 
+        lfs_size_t diff = lfs_min(nsize, lfs_block_size(lfs) - off);
+        iov[count].off = off;
+        iov[count].buffer = data;
+        iov[count].size = diff;
+        count += 1;
+        data += diff;
+        nsize -= diff;
+    }
 
-/// Filesystem operations ///
-static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
-    lfs->cfg = cfg;
-    int err = 0;
+    if (count < 2) {
+        return 0;
+    }
 
-    // validate that the lfs-cfg sizes were initiated properly before
-    // performing any arithmetic logics with them
-    LFS_ASSERT(lfs->cfg->read_size != 0);
-    LFS_ASSERT(lfs->cfg->prog_size != 0);
-    LFS_ASSERT(lfs->cfg->cache_size != 0);
+    // find the blocks, CTZ blocks point back at their predecessor so only
+    // the last one needs a search
+    lfs_size_t last = (lfs_size_t)((uint8_t*)iov[count-1].buffer
+            - (uint8_t*)buffer);
+    if (file->flags & LFS_F_INDEX) {
+        for (lfs_size_t i = 0; i < count; i++) {
+            int err = lfs_index_find(lfs, NULL, &file->cache,
+                    file->ctz.head, file->ctz.size,
+                    file->pos + ((uint8_t*)iov[i].buffer - (uint8_t*)buffer),
+                    &iov[i].block, &(lfs_off_t){0});
+            if (err) {
+                return err;
+            }
+        }
+    } else {
+        int err = lfs_ctz_find(lfs, NULL, &file->cache,
+                file->ctz.head, file->ctz.size,
+                file->pos + last, &iov[count-1].block, &(lfs_off_t){0});
+        if (err) {
+            return err;
+        }
 
-    // check that block size is a multiple of cache size is a multiple
-    // of prog and read sizes
-    LFS_ASSERT(lfs->cfg->cache_size % lfs->cfg->read_size == 0);
-    LFS_ASSERT(lfs->cfg->cache_size % lfs->cfg->prog_size == 0);
-    LFS_ASSERT(lfs->cfg->block_size % lfs->cfg->cache_size == 0);
+        for (lfs_size_t i = count-1; i > 0; i--) {
+            lfs_block_t prev;
+            err = lfs_bd_read(lfs, NULL, &file->cache, sizeof(prev),
+                    iov[i].block, 0, &prev, sizeof(prev));
+            if (err) {
+                return err;
+            }
+            iov[i-1].block = lfs_fromle32(prev);
+        }
+    }
 
-    // check that the block size is large enough to fit ctz pointers
-    LFS_ASSERT(4*lfs_npw2(0xffffffff / (lfs->cfg->block_size-2*4))
-            <= lfs->cfg->block_size);
+    lfs_block_t block = iov[count-1].block;
+    lfs_off_t end = iov[count-1].off + iov[count-1].size;
 
-    // block_cycles = 0 is no longer supported.
-    //
-    // block_cycles is the number of erase cycles before littlefs evicts
-    // metadata logs as a part of wear leveling. Suggested values are in the
-    // range of 100-1000, or set block_cycles to -1 to disable block-level
-    // wear-leveling.
-    LFS_ASSERT(lfs->cfg->block_cycles != 0);
+    // read the unaligned edges through the cache and gather the rest
+    lfs_size_t n = 0;
+    for (lfs_size_t i = 0; i < count; i++) {
+        lfs_block_t rblock = iov[i].block;
+        lfs_off_t roff = iov[i].off;
+        lfs_off_t rend = roff + iov[i].size;
+        uint8_t *rdata = iov[i].buffer;
+        lfs_off_t astart = lfs_min(
+                lfs_alignup(roff, lfs_read_size(lfs)), rend);
+        lfs_off_t aend = lfs_max(
+                lfs_aligndown(rend, lfs_read_size(lfs)), astart);
 
+        if (astart > roff) {
+            int err = lfs_bd_read(lfs, NULL, &file->cache, astart-roff,
+                    rblock, roff, rdata, astart-roff);
+            if (err) {
+                return err;
+            }
+        }
 
-    // setup read cache
-    if (lfs->cfg->read_buffer) {
-        lfs->rcache.buffer = lfs->cfg->read_buffer;
-    } else {
-        lfs->rcache.buffer = lfs_malloc(lfs->cfg->cache_size);
-        if (!lfs->rcache.buffer) {
-            err = LFS_ERR_NOMEM;
-            goto cleanup;
+        if (rend > aend) {
+            int err = lfs_bd_read(lfs, NULL, &file->cache, rend-aend,
+                    rblock, aend, rdata + (aend-roff), rend-aend);
+            if (err) {
+                return err;
+            }
         }
-    }
 
-    // setup program cache
-    if (lfs->cfg->prog_buffer) {
-        lfs->pcache.buffer = lfs->cfg->prog_buffer;
-    } else {
-        lfs->pcache.buffer = lfs_malloc(lfs->cfg->cache_size);
-        if (!lfs->pcache.buffer) {
-            err = LFS_ERR_NOMEM;
-            goto cleanup;
+        if (aend > astart) {
+            iov[n].block = rblock;
+            iov[n].off = astart;
+            iov[n].buffer = rdata + (astart-roff);
+            iov[n].size = aend-astart;
+            n += 1;
         }
     }
 
-    // zero to avoid information leaks
-    lfs_cache_zero(lfs, &lfs->rcache);
-    lfs_cache_zero(lfs, &lfs->pcache);
-
-    // setup lookahead, must be multiple of 64-bits, 32-bit aligned
-    LFS_ASSERT(lfs->cfg->lookahead_size > 0);
-    LFS_ASSERT(lfs->cfg->lookahead_size % 8 == 0 &&
-            (uintptr_t)lfs->cfg->lookahead_buffer % 4 == 0);
-    if (lfs->cfg->lookahead_buffer) {
-        lfs->free.buffer = lfs->cfg->lookahead_buffer;
-    } else {
-        lfs->free.buffer = lfs_malloc(lfs->cfg->lookahead_size);
-        if (!lfs->free.buffer) {
-            err = LFS_ERR_NOMEM;
-            goto cleanup;
+    if (n > 0) {
+        int err = lfs_bd_rawreadv(lfs, iov, n);
+        if (err) {
+            return err;
         }
     }
 
-    // check that the size limits are sane
-    LFS_ASSERT(lfs->cfg->name_max <= LFS_NAME_MAX);
-    lfs->name_max = lfs->cfg->name_max;
-    if (!lfs->name_max) {
-        lfs->name_max = LFS_NAME_MAX;
+    file->pos += size - nsize;
+    file->block = block;
+    file->off = end;
+    file->flags |= LFS_F_READING;
+    return size - nsize;
+}
+
+// find the block at the file's position if the reader needs a new one
+static int lfs_file_readfind(lfs_t *lfs, lfs_file_t *file) {
+    if ((file->flags & LFS_F_READING) &&
+            file->off != lfs_block_size(lfs)) {
+        return 0;
     }
 
-    LFS_ASSERT(lfs->cfg->file_max <= LFS_FILE_MAX);
-    lfs->file_max = lfs->cfg->file_max;
-    if (!lfs->file_max) {
-        lfs->file_max = LFS_FILE_MAX;
+    if (file->flags & LFS_F_INDEX) {
+        int err = lfs_index_find(lfs, NULL, &file->cache,
+                file->ctz.head, file->ctz.size,
+                file->pos, &file->block, &file->off);
+        if (err) {
+            return err;
+        }
+    } else if (!(file->flags & LFS_F_INLINE)) {
+        int err = lfs_ctz_find(lfs, NULL, &file->cache,
+                file->ctz.head, file->ctz.size,
+                file->pos, &file->block, &file->off);
+        if (err) {
+            return err;
+        }
+    } else {
+        file->block = LFS_BLOCK_INLINE;
+        file->off = file->pos;
     }
 
-    LFS_ASSERT(lfs->cfg->attr_max <= LFS_ATTR_MAX);
-    lfs->attr_max = lfs->cfg->attr_max;
-    if (!lfs->attr_max) {
-        lfs->attr_max = LFS_ATTR_MAX;
-    }
+    file->flags |= LFS_F_READING;
+    return 0;
+}
 
-    LFS_ASSERT(lfs->cfg->metadata_max <= lfs->cfg->block_size);
+// read through the file's cache, which the file must already hold
+static lfs_ssize_t lfs_file_cachedread(lfs_t *lfs, lfs_file_t *file,
+        void *buffer, lfs_size_t size) {
+    uint8_t *data = buffer;
+    lfs_size_t nsize = size;
 
-    // setup default state
-    lfs->root[0] = LFS_BLOCK_NULL;
-    lfs->root[1] = LFS_BLOCK_NULL;
-    lfs->mlist = NULL;
-    lfs->seed = 0;
-    lfs->gdisk = (lfs_gstate_t){0};
-    lfs->gstate = (lfs_gstate_t){0};
-    lfs->gdelta = (lfs_gstate_t){0};
-#ifdef LFS_MIGRATE
-    lfs->lfs1 = NULL;
+#ifndef LFS_READONLY
+    if (file->flags & LFS_F_WRITING) {
+        // flush out any writes
+        int err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
 #endif
 
-    return 0;
+    if (file->pos >= file->ctz.size) {
+        // eof if past end
+        return 0;
+    }
 
-cleanup:
-    lfs_deinit(lfs);
-    return err;
-}
+    size = lfs_min(size, file->ctz.size - file->pos);
+    nsize = size;
 
-static int lfs_deinit(lfs_t *lfs) {
-    // free allocated memory
-    if (!lfs->cfg->read_buffer) {
-        lfs_free(lfs->rcache.buffer);
-    }
+    while (nsize > 0) {
+        // spans of several blocks go out as one vectored read
+        if (lfs->cfg->readv && !(file->flags & LFS_F_INLINE)) {
+            lfs_ssize_t res = lfs_file_readvec(lfs, file, data, nsize);
+            if (res < 0) {
+                return res;
+            }
 
-    if (!lfs->cfg->prog_buffer) {
-        lfs_free(lfs->pcache.buffer);
+            if (res > 0) {
+                data += res;
+                nsize -= res;
+                continue;
+            }
+        }
+
+        // check if we need a new block
+        int err = lfs_file_readfind(lfs, file);
+        if (err) {
+            return err;
+        }
+
+        // read as much as we can in current block
+        lfs_size_t diff = lfs_min(nsize, lfs_block_size(lfs) - file->off);
+        if (file->flags & LFS_F_INLINE) {
+            err = lfs_dir_getread(lfs, &file->m,
+                    NULL, &file->cache, lfs_block_size(lfs),
+                    LFS_MKTAG(0xfff, 0x1ff, 0),
+                    LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0),
+                    file->off, data, diff);
+            if (err) {
+                return err;
+            }
+        } else {
+            err = lfs_bd_read(lfs,
+                    NULL, &file->cache, lfs_block_size(lfs),
+                    file->block, file->off, data, diff);
+            if (err) {
+                return err;
+            }
+        }
+
+        file->pos += diff;
+        file->off += diff;
+        data += diff;
+        nsize -= diff;
     }
 
-    if (!lfs->cfg->lookahead_buffer) {
-        lfs_free(lfs->free.buffer);
+    return size;
+}
+
+static lfs_ssize_t lfs_file_rawread(lfs_t *lfs, lfs_file_t *file,
+        void *buffer, lfs_size_t size) {
+    LFS_ASSERT((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY);
+
+    int err = lfs_file_borrow(lfs, file);
+    if (err) {
+        return err;
     }
 
-    return 0;
+    return lfs_file_cachedread(lfs, file, buffer, size);
 }
 
+// read through the file's cache and hand out views into the cache instead
+// of copying, which the file must already hold
+static lfs_ssize_t lfs_file_cachedreadcb(lfs_t *lfs, lfs_file_t *file,
+        lfs_size_t size,
+        int (*cb)(void *data, const void *buffer, lfs_size_t size),
+        void *data) {
 #ifndef LFS_READONLY
-static int lfs_rawformat(lfs_t *lfs, const struct lfs_config *cfg) {
-    int err = 0;
-    {
-        err = lfs_init(lfs, cfg);
+    if (file->flags & LFS_F_WRITING) {
+        // flush out any writes
+        int err = lfs_file_flush(lfs, file);
         if (err) {
             return err;
         }
+    }
+#endif
 
-        // create free lookahead
-        memset(lfs->free.buffer, 0, lfs->cfg->lookahead_size);
-        lfs->free.off = 0;
-        lfs->free.size = lfs_min(8*lfs->cfg->lookahead_size,
-                lfs->cfg->block_count);
-        lfs->free.i = 0;
-        lfs_alloc_ack(lfs);
-
-        // create root dir
-        lfs_mdir_t root;
-        err = lfs_dir_alloc(lfs, &root);
-        if (err) {
-            goto cleanup;
-        }
+    if (file->pos >= file->ctz.size) {
+        // eof if past end
+        return 0;
+    }
 
-        // write one superblock
-        lfs_superblock_t superblock = {
-            .version     = LFS_DISK_VERSION,
-            .block_size  = lfs->cfg->block_size,
-            .block_count = lfs->cfg->block_count,
-            .name_max    = lfs->name_max,
-            .file_max    = lfs->file_max,
-            .attr_max    = lfs->attr_max,
-        };
+    size = lfs_min(size, file->ctz.size - file->pos);
+    lfs_size_t nsize = size;
 
-        lfs_superblock_tole32(&superblock);
-        err = lfs_dir_commit(lfs, &root, LFS_MKATTRS(
-                {LFS_MKTAG(LFS_TYPE_CREATE, 0, 0), NULL},
-                {LFS_MKTAG(LFS_TYPE_SUPERBLOCK, 0, 8), "littlefs"},
-                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
-                    &superblock}));
+    while (nsize > 0) {
+        int err = lfs_file_readfind(lfs, file);
         if (err) {
-            goto cleanup;
+            return err;
         }
 
-        // force compaction to prevent accidentally mounting any
-        // older version of littlefs that may live on disk
-        root.erased = false;
-        err = lfs_dir_commit(lfs, &root, NULL, 0);
+        // load the cache, a single byte is never read around it
+        uint8_t peek;
+        if (file->flags & LFS_F_INLINE) {
+            err = lfs_dir_getread(lfs, &file->m,
+                    NULL, &file->cache, lfs_block_size(lfs),
+                    LFS_MKTAG(0xfff, 0x1ff, 0),
+                    LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0),
+                    file->off, &peek, 1);
+        } else {
+            err = lfs_bd_read(lfs,
+                    NULL, &file->cache, lfs_block_size(lfs),
+                    file->block, file->off, &peek, 1);
+        }
         if (err) {
-            goto cleanup;
+            return err;
         }
 
-        // sanity check that fetch works
-        err = lfs_dir_fetch(lfs, &root, (const lfs_block_t[2]){0, 1});
+        // hand out as much of the cache as we can
+        lfs_size_t diff = lfs_min(nsize, lfs_min(
+                lfs_block_size(lfs) - file->off,
+                file->cache.off + file->cache.size - file->off));
+        err = cb(data, &file->cache.buffer[file->off - file->cache.off],
+                diff);
         if (err) {
-            goto cleanup;
+            return (err < 0) ? err : (lfs_ssize_t)(size - nsize);
         }
-    }
 
-cleanup:
-    lfs_deinit(lfs);
-    return err;
+        file->pos += diff;
+        file->off += diff;
+        nsize -= diff;
+    }
 
+    return size;
 }
-#endif
 
-static int lfs_rawmount(lfs_t *lfs, const struct lfs_config *cfg) {
-    int err = lfs_init(lfs, cfg);
+static lfs_ssize_t lfs_file_rawreadcb(lfs_t *lfs, lfs_file_t *file,
+        lfs_size_t size,
+        int (*cb)(void *data, const void *buffer, lfs_size_t size),
+        void *data) {
+    LFS_ASSERT((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY);
+
+    int err = lfs_file_borrow(lfs, file);
     if (err) {
         return err;
     }
 
-    // scan directory blocks for superblock and any global updates
-    lfs_mdir_t dir = {.tail = {0, 1}};
-    lfs_block_t cycle = 0;
-    while (!lfs_pair_isnull(dir.tail)) {
-        if (cycle >= lfs->cfg->block_count/2) {
-            // loop detected
-            err = LFS_ERR_CORRUPT;
-            goto cleanup;
-        }
-        cycle += 1;
+    return lfs_file_cachedreadcb(lfs, file, size, cb, data);
+}
 
-        // fetch next block in tail list
-        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, &dir, dir.tail,
-                LFS_MKTAG(0x7ff, 0x3ff, 0),
-                LFS_MKTAG(LFS_TYPE_SUPERBLOCK, 0, 8),
-                NULL,
-                lfs_dir_find_match, &(struct lfs_dir_find_match){
-                    lfs, "littlefs", 8});
-        if (tag < 0) {
-            err = tag;
-            goto cleanup;
+#ifndef LFS_READONLY
+// write through the file's cache, which the file must already hold
+static lfs_ssize_t lfs_file_cachedwrite(lfs_t *lfs, lfs_file_t *file,
+        const void *buffer, lfs_size_t size) {
+    const uint8_t *data = buffer;
+    lfs_size_t nsize = size;
+
+    if (file->flags & LFS_F_READING) {
+        // drop any reads
+        int err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
         }
+    }
 
-        // has superblock?
-        if (tag && !lfs_tag_isdelete(tag)) {
-            // update root
-            lfs->root[0] = dir.pair[0];
-            lfs->root[1] = dir.pair[1];
+    if ((file->flags & LFS_O_APPEND) && file->pos < file->ctz.size) {
+        file->pos = file->ctz.size;
+    }
 
-            // grab superblock
-            lfs_superblock_t superblock;
-            tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
-                    LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
-                    &superblock);
-            if (tag < 0) {
-                err = tag;
-                goto cleanup;
-            }
-            lfs_superblock_fromle32(&superblock);
+    if (file->pos + size > lfs->file_max) {
+        // Larger than file limit?
+        return LFS_ERR_FBIG;
+    }
 
-            // check version
-            uint16_t major_version = (0xffff & (superblock.version >> 16));
-            uint16_t minor_version = (0xffff & (superblock.version >>  0));
-            if ((major_version != LFS_DISK_VERSION_MAJOR ||
-                 minor_version > LFS_DISK_VERSION_MINOR)) {
-                LFS_ERROR("Invalid version v%"PRIu16".%"PRIu16,
-                        major_version, minor_version);
-                err = LFS_ERR_INVAL;
-                goto cleanup;
-            }
+    if (!(file->flags & LFS_F_WRITING) && file->pos > file->ctz.size) {
+        // fill with zeros
+        lfs_off_t pos = file->pos;
+        file->pos = file->ctz.size;
 
-            // check superblock configuration
-            if (superblock.name_max) {
-                if (superblock.name_max > lfs->name_max) {
-                    LFS_ERROR("Unsupported name_max (%"PRIu32" > %"PRIu32")",
-                            superblock.name_max, lfs->name_max);
-                    err = LFS_ERR_INVAL;
-                    goto cleanup;
+        while (file->pos < pos) {
+            lfs_ssize_t res = lfs_file_cachedwrite(lfs, file,
+                    &(uint8_t){0}, 1);
+            if (res < 0) {
+                if (res == LFS_ERR_PENDING) {
+                    // remember where the data goes
+                    lfs->op->pos = pos;
                 }
-
-                lfs->name_max = superblock.name_max;
+                return res;
             }
+        }
+    }
 
-            if (superblock.file_max) {
-                if (superblock.file_max > lfs->file_max) {
-                    LFS_ERROR("Unsupported file_max (%"PRIu32" > %"PRIu32")",
-                            superblock.file_max, lfs->file_max);
-                    err = LFS_ERR_INVAL;
+    if ((file->flags & LFS_F_INLINE) &&
+            lfs_max(file->pos+nsize, file->ctz.size) >
+            lfs_min(0x3fe, lfs_min(
+                lfs_cache_size(lfs),
+                (lfs->cfg->metadata_max ?
+                    lfs->cfg->metadata_max : lfs_block_size(lfs)) / 8))) {
+        // inline file doesn't fit anymore
+        int err = lfs_file_outline(lfs, file);
+        if (err) {
+            file->flags |= LFS_F_ERRED;
+            return err;
+        }
+    }
+
+    while (nsize > 0) {
+        // check if we need a new block
+        if (!(file->flags & LFS_F_WRITING) ||
+                file->off == lfs_block_size(lfs)) {
+            if (file->flags & LFS_F_INDEX) {
+                if (file->flags & LFS_F_WRITING) {
+                    // block is full, link it before starting the next one
+                    int err = lfs_file_indexlink(lfs, file);
+                    if (err) {
+                        file->flags |= LFS_F_ERRED;
+                        return err;
+                    }
+                }
+
+                lfs_alloc_ack(lfs);
+                int err = lfs_file_indexbegin(lfs, file);
+                if (err) {
+                    file->flags |= LFS_F_ERRED;
+                    return err;
+                }
+            } else if (!(file->flags & LFS_F_INLINE)) {
+                if (!(file->flags & LFS_F_WRITING) && file->pos > 0) {
+                    // find out which block we're extending from
+                    int err = lfs_ctz_find(lfs, NULL, &file->cache,
+                            file->ctz.head, file->ctz.size,
+                            file->pos-1, &file->block, &file->off);
+                    if (err) {
+                        file->flags |= LFS_F_ERRED;
+                        return err;
+                    }
+
+                    // mark cache as dirty since we may have read data into it
+                    lfs_cache_zero(lfs, &file->cache);
+                }
+
+                // extend file with new blocks
+                lfs_alloc_ack(lfs);
+                int err = lfs_ctz_extend(lfs, &file->cache, lfs->dcache,
+                        file->block, file->pos,
+                        &file->block, &file->off);
+                if (err) {
+                    if (err == LFS_ERR_PENDING) {
+                        // lfs_op_poll picks up the rest of the data
+                        lfs->op->done += data - (const uint8_t*)buffer;
+                        return err;
+                    }
+                    file->flags |= LFS_F_ERRED;
+                    return err;
+                }
+            } else {
+                file->block = LFS_BLOCK_INLINE;
+                file->off = file->pos;
+            }
+
+            file->flags |= LFS_F_WRITING;
+        }
+
+        // program as much as we can in current block
+        lfs_size_t diff = lfs_min(nsize, lfs_block_size(lfs) - file->off);
+        while (true) {
+            int err = lfs_bd_prog(lfs, &file->cache, lfs->dcache, true,
+                    file->block, file->off, data, diff);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                file->flags |= LFS_F_ERRED;
+                return err;
+            }
+
+            break;
+relocate:
+            err = lfs_file_relocate(lfs, file);
+            if (err) {
+                file->flags |= LFS_F_ERRED;
+                return err;
+            }
+        }
+
+        file->pos += diff;
+        file->off += diff;
+        data += diff;
+        nsize -= diff;
+
+        lfs_alloc_ack(lfs);
+    }
+
+    file->flags &= ~LFS_F_ERRED;
+    return size;
+}
+
+static lfs_ssize_t lfs_file_rawwrite(lfs_t *lfs, lfs_file_t *file,
+        const void *buffer, lfs_size_t size) {
+    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
+
+    int err = lfs_file_borrow(lfs, file);
+    if (err) {
+        return err;
+    }
+
+    return lfs_file_cachedwrite(lfs, file, buffer, size);
+}
+
+enum {
+    LFS_OP_WRITE = 1,
+    LFS_OP_SYNC  = 2,
+};
+
+// go on with a write, the gap before the data is filled in first if that
+// was left pending
+static lfs_ssize_t lfs_file_opwrite(lfs_t *lfs, lfs_op_t *op) {
+    lfs_file_t *file = op->file;
+    int err = lfs_file_borrow(lfs, file);
+    if (err) {
+        return err;
+    }
+
+    while (file->pos < op->pos) {
+        lfs_ssize_t res = lfs_file_cachedwrite(lfs, file, &(uint8_t){0}, 1);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    lfs_ssize_t res = lfs_file_cachedwrite(lfs, file,
+            (const uint8_t*)op->buffer + op->done, op->size - op->done);
+    if (res < 0) {
+        return res;
+    }
+
+    op->done += res;
+    return op->done;
+}
+
+// run an operation until it completes or leaves an erase pending
+static lfs_ssize_t lfs_op_run(lfs_t *lfs, lfs_op_t *op) {
+    op->running = true;
+    lfs_ssize_t res = (op->type == LFS_OP_WRITE)
+            ? lfs_file_opwrite(lfs, op)
+            : lfs_file_rawsync(lfs, op->file);
+    op->running = false;
+    if (res == LFS_ERR_PENDING) {
+        return res;
+    }
+
+    if (op->type == LFS_OP_SYNC) {
+        // a flush left pending loses track of the file's position
+        op->file->pos = op->pos;
+    }
+
+    lfs->op = NULL;
+    return res;
+}
+
+static lfs_ssize_t lfs_file_rawwrite_start(lfs_t *lfs, lfs_op_t *op,
+        lfs_file_t *file, const void *buffer, lfs_size_t size) {
+    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
+    LFS_ASSERT(!lfs->op);
+    *op = (lfs_op_t){
+        .type = LFS_OP_WRITE,
+        .file = file,
+        .buffer = buffer,
+        .size = size,
+        .erasing = LFS_BLOCK_NULL,
+        .held = LFS_BLOCK_NULL,
+    };
+    lfs->op = op;
+    return lfs_op_run(lfs, op);
+}
+
+static int lfs_file_rawsync_start(lfs_t *lfs, lfs_op_t *op,
+        lfs_file_t *file) {
+    LFS_ASSERT(!lfs->op);
+    *op = (lfs_op_t){
+        .type = LFS_OP_SYNC,
+        .file = file,
+        .pos = file->pos,
+        .erasing = LFS_BLOCK_NULL,
+        .held = LFS_BLOCK_NULL,
+    };
+    lfs->op = op;
+    return lfs_op_run(lfs, op);
+}
+
+static lfs_ssize_t lfs_op_rawpoll(lfs_t *lfs, lfs_op_t *op) {
+    LFS_ASSERT(lfs->op == op && op->erasing != LFS_BLOCK_NULL);
+    int err = lfs_bd_rawerasepoll(lfs, op->erasing);
+    LFS_ASSERT(err <= 0);
+    if (err == LFS_ERR_PENDING) {
+        return err;
+    }
+
+    // the operation finds the block erased when it comes back to it,
+    // unless something was written to it in the meantime
+    if (lfs->erased.block == op->erasing) {
+        lfs->erased.err = err;
+    }
+    op->erasing = LFS_BLOCK_NULL;
+
+    return lfs_op_run(lfs, op);
+}
+#endif
+
+// move a reader to a new position without dropping its cache, returns 1 if
+// the reader could continue from the block it already knows
+static int lfs_file_readseek(lfs_t *lfs, lfs_file_t *file, lfs_off_t npos) {
+    if (file->flags & LFS_F_INLINE) {
+        file->off = npos;
+        return 1;
+    }
+
+    // the reader's block holds the byte before its position
+    if (file->pos == 0) {
+        return 0;
+    }
+
+    lfs_off_t pos = file->pos - 1;
+    if (file->flags & LFS_F_INDEX) {
+        if (npos / lfs_block_size(lfs) != pos / lfs_block_size(lfs)) {
+            return 0;
+        }
+
+        file->off = npos % lfs_block_size(lfs);
+        return 1;
+    }
+
+    lfs_off_t off = pos;
+    lfs_off_t noff = npos;
+    lfs_off_t current = lfs_ctz_index(lfs, &off);
+    lfs_off_t target = lfs_ctz_index(lfs, &noff);
+    if (target > current) {
+        // the skip-list only points backwards, this needs the head
+        return 0;
+    }
+
+    if (target < current) {
+        // resume the search from the current block
+        int err = lfs_file_borrow(lfs, file);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_ctz_find(lfs, NULL, &file->cache,
+                file->block, file->pos,
+                npos, &file->block, &file->off);
+        if (err) {
+            return err;
+        }
+
+        return 1;
+    }
+
+    file->off = noff;
+    return 1;
+}
+
+static lfs_soff_t lfs_file_rawseek(lfs_t *lfs, lfs_file_t *file,
+        lfs_soff_t off, int whence) {
+    // find new pos
+    lfs_off_t npos = file->pos;
+    if (whence == LFS_SEEK_SET) {
+        npos = off;
+    } else if (whence == LFS_SEEK_CUR) {
+        npos = file->pos + off;
+    } else if (whence == LFS_SEEK_END) {
+        npos = lfs_file_rawsize(lfs, file) + off;
+    }
+
+    if (npos > lfs->file_max) {
+        // file position out of range
+        return LFS_ERR_INVAL;
+    }
+
+    if (file->pos == npos) {
+        // noop - position has not changed
+        return npos;
+    }
+
+    if (file->flags & LFS_F_READING) {
+        // readers have nothing to write out, keep the cache if we can
+        int res = lfs_file_readseek(lfs, file, npos);
+        if (res < 0) {
+            return res;
+        }
+
+        if (res) {
+            file->pos = npos;
+            return npos;
+        }
+    }
+
+#ifndef LFS_READONLY
+    // write out everything beforehand, may be noop if rdonly
+    int err = lfs_file_flush(lfs, file);
+    if (err) {
+        return err;
+    }
+#else
+    file->flags &= ~LFS_F_READING;
+#endif
+
+    // update pos
+    file->pos = npos;
+    return npos;
+}
+
+#ifndef LFS_READONLY
+static int lfs_file_rawtruncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
+    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
+
+    if (size > LFS_FILE_MAX) {
+        return LFS_ERR_INVAL;
+    }
+
+    int err = lfs_file_borrow(lfs, file);
+    if (err) {
+        return err;
+    }
+
+    lfs_off_t pos = file->pos;
+    lfs_off_t oldsize = lfs_file_rawsize(lfs, file);
+    if (size < oldsize) {
+        // need to flush since directly changing metadata
+        err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
+        }
+
+        if (file->flags & LFS_F_INDEX) {
+            // the index is addressed by position, only its depth changes
+            err = lfs_index_truncate(lfs, &file->cache, &file->ctz, size);
+            if (err) {
+                return err;
+            }
+
+            file->pos = size;
+            file->flags |= LFS_F_DIRTY;
+        } else {
+            // lookup new head in ctz skip list
+            err = lfs_ctz_find(lfs, NULL, &file->cache,
+                    file->ctz.head, file->ctz.size,
+                    size, &file->block, &file->off);
+            if (err) {
+                return err;
+            }
+
+            // need to set pos/block/off consistently so seeking back to
+            // the old position does not get confused
+            file->pos = size;
+            file->ctz.head = file->block;
+            file->ctz.size = size;
+            file->flags |= LFS_F_DIRTY | LFS_F_READING;
+        }
+    } else if (size > oldsize) {
+        // flush+seek if not already at end
+        lfs_soff_t res = lfs_file_rawseek(lfs, file, 0, LFS_SEEK_END);
+        if (res < 0) {
+            return (int)res;
+        }
+
+        // fill with zeros
+        while (file->pos < size) {
+            res = lfs_file_cachedwrite(lfs, file, &(uint8_t){0}, 1);
+            if (res < 0) {
+                return (int)res;
+            }
+        }
+    }
+
+    // restore pos
+    lfs_soff_t res = lfs_file_rawseek(lfs, file, pos, LFS_SEEK_SET);
+    if (res < 0) {
+      return (int)res;
+    }
+
+    return 0;
+}
+#endif
+
+static lfs_soff_t lfs_file_rawtell(lfs_t *lfs, lfs_file_t *file) {
+    (void)lfs;
+    return file->pos;
+}
+
+static int lfs_file_rawrewind(lfs_t *lfs, lfs_file_t *file) {
+    lfs_soff_t res = lfs_file_rawseek(lfs, file, 0, LFS_SEEK_SET);
+    if (res < 0) {
+        return (int)res;
+    }
+
+    return 0;
+}
+
+static lfs_soff_t lfs_file_rawsize(lfs_t *lfs, lfs_file_t *file) {
+    (void)lfs;
+
+#ifndef LFS_READONLY
+    if (file->flags & LFS_F_WRITING) {
+        return lfs_max(file->pos, file->ctz.size);
+    }
+#endif
+
+    return file->ctz.size;
+}
+
+
+/// General fs operations ///
+static int lfs_rawstat(lfs_t *lfs, const char *path, struct lfs_info *info) {
+    lfs_mdir_t cwd;
+    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+    if (tag < 0) {
+        return (int)tag;
+    }
+
+    return lfs_dir_getinfo(lfs, &cwd, lfs_tag_id(tag), info);
+}
+
+#ifndef LFS_READONLY
+static int lfs_rawremove(lfs_t *lfs, const char *path) {
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    lfs_mdir_t cwd;
+    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+    if (tag < 0 || lfs_tag_id(tag) == 0x3ff) {
+        return (tag < 0) ? (int)tag : LFS_ERR_INVAL;
+    }
+
+    struct lfs_mlist dir;
+    bool tracked = false;
+    if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
+        // must be empty before removal
+        lfs_block_t pair[2];
+        lfs_stag_t res = lfs_dir_get(lfs, &cwd, LFS_MKTAG(0x700, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), 8), pair);
+        if (res < 0) {
+            return (int)res;
+        }
+        lfs_pair_fromle32(pair);
+
+        err = lfs_dir_fetch(lfs, &dir.m, pair);
+        if (err) {
+            return err;
+        }
+
+        if (dir.m.count > 0 || dir.m.split) {
+            return LFS_ERR_NOTEMPTY;
+        }
+
+        // mark fs as orphaned
+        err = lfs_fs_preporphans(lfs, +1);
+        if (err) {
+            return err;
+        }
+
+        // I know it's crazy but yes, dir can be changed by our parent's
+        // commit (if predecessor is child)
+        dir.type = 0;
+        dir.id = 0;
+        lfs_mlist_append(lfs, &dir);
+        tracked = true;
+        lfs_hcache_drop(lfs);
+    }
+
+    // delete the entry
+    err = lfs_dir_commit(lfs, &cwd, LFS_MKATTRS(
+            {LFS_MKTAG(LFS_TYPE_DELETE, lfs_tag_id(tag), 0), NULL}));
+    if (tracked) {
+        lfs_mlist_remove(lfs, &dir);
+    }
+    if (err) {
+        return err;
+    }
+
+    if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
+        // fix orphan
+        err = lfs_fs_preporphans(lfs, -1);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_fs_pred(lfs, dir.m.pair, &cwd, NULL);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_drop(lfs, &cwd, &dir.m);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static void lfs_mlist_detach(lfs_t *lfs, const lfs_block_t pair[2]) {
+    // open files in a dropped pair have nothing left to sync to, same as
+    // when their entry is deleted
+    struct lfs_mlist *next;
+    for (struct lfs_mlist *d = lfs->mlist[lfs_mlist_bucket(pair)];
+            d; d = next) {
+        next = d->next;
+        if (d->type == LFS_TYPE_REG && lfs_pair_cmp(d->m.pair, pair) == 0) {
+            d->m.pair[0] = LFS_BLOCK_NULL;
+            d->m.pair[1] = LFS_BLOCK_NULL;
+            lfs_mlist_rehash(lfs, d);
+        }
+    }
+}
+
+static int lfs_dir_findchild(lfs_t *lfs, lfs_mdir_t *dir,
+        uint16_t *id, lfs_block_t pair[2]) {
+    // find the first subdirectory, leaving dir at the pair holding it
+    while (true) {
+        for (uint16_t i = 0; i < dir->count; i++) {
+            uint8_t name;
+            lfs_stag_t tag = lfs_dir_get(lfs, dir, LFS_MKTAG(0x780, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_NAME, i, 0), &name);
+            if (tag < 0) {
+                return tag;
+            }
+
+            if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
+                lfs_stag_t res = lfs_dir_get(lfs, dir,
+                        LFS_MKTAG(0x700, 0x3ff, 0),
+                        LFS_MKTAG(LFS_TYPE_STRUCT, i, 8), pair);
+                if (res < 0) {
+                    return res;
+                }
+                lfs_pair_fromle32(pair);
+
+                *id = i;
+                return 0;
+            }
+        }
+
+        if (!dir->split) {
+            return LFS_ERR_NOENT;
+        }
+
+        int err = lfs_dir_fetch(lfs, dir, dir->tail);
+        if (err) {
+            return err;
+        }
+    }
+}
+
+static int lfs_dir_removetree(lfs_t *lfs, struct lfs_mlist *top) {
+    // remove directories bottom up, each is dropped as a whole with the
+    // files in it, the top entry is tracked in mlist since our commits may
+    // change the pair holding it
+    while (true) {
+        lfs_mdir_t parent = top->m;
+        uint16_t id = top->id;
+        lfs_block_t pair[2];
+        lfs_stag_t res = lfs_dir_get(lfs, &parent, LFS_MKTAG(0x700, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_STRUCT, id, 8), pair);
+        if (res < 0) {
+            return res;
+        }
+        lfs_pair_fromle32(pair);
+
+        // descend to a directory without subdirectories
+        struct lfs_mlist dir;
+        bool istop = true;
+        while (true) {
+            int err = lfs_dir_fetch(lfs, &dir.m, pair);
+            if (err) {
+                return err;
+            }
+
+            lfs_mdir_t child = dir.m;
+            uint16_t childid;
+            err = lfs_dir_findchild(lfs, &child, &childid, pair);
+            if (err && err != LFS_ERR_NOENT) {
+                return err;
+            } else if (err == LFS_ERR_NOENT) {
+                break;
+            }
+
+            parent = child;
+            id = childid;
+            istop = false;
+        }
+
+        if (dir.m.split) {
+            // cut the rest of the directory's pairs loose first, a single
+            // pair is all lfs_fs_deorphan knows how to drop if we lose power
+            // while the directory is orphaned
+            lfs_mdir_t tail = dir.m;
+            while (tail.split) {
+                int err = lfs_dir_fetch(lfs, &tail, tail.tail);
+                if (err) {
+                    return err;
+                }
+
+                err = lfs_dir_getgstate(lfs, &tail, &lfs->gdelta);
+                if (err) {
+                    return err;
+                }
+
+                lfs_mlist_detach(lfs, tail.pair);
+            }
+
+            lfs_block_t dirindex = lfs_tole32(LFS_BLOCK_NULL);
+            lfs_pair_tole32(tail.tail);
+            int err = lfs_dir_commit(lfs, &dir.m, LFS_MKATTRS(
+                    {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8), tail.tail},
+                    {LFS_MKTAG_IF(dir.m.dirindex != LFS_BLOCK_NULL,
+                        LFS_TYPE_DIRINDEX, 0x3ff, 4), &dirindex}));
+            lfs_pair_fromle32(tail.tail);
+            if (err) {
+                return err;
+            }
+
+            // our commit may have moved things around, look again
+            continue;
+        }
+
+        // mark fs as orphaned
+        int err = lfs_fs_preporphans(lfs, +1);
+        if (err) {
+            return err;
+        }
+
+        // dir can be changed by our parent's commit (if predecessor is
+        // child)
+        dir.type = 0;
+        dir.id = 0;
+        lfs_mlist_append(lfs, &dir);
+
+        // delete the entry
+        err = lfs_dir_commit(lfs, &parent, LFS_MKATTRS(
+                {LFS_MKTAG(LFS_TYPE_DELETE, id, 0), NULL}));
+        lfs_mlist_remove(lfs, &dir);
+        if (err) {
+            return err;
+        }
+
+        // fix orphan
+        lfs_mlist_detach(lfs, dir.m.pair);
+        err = lfs_fs_preporphans(lfs, -1);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_fs_pred(lfs, dir.m.pair, &parent, NULL);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_drop(lfs, &parent, &dir.m);
+        if (err) {
+            return err;
+        }
+
+        if (istop) {
+            return 0;
+        }
+    }
+}
+
+static int lfs_rawremove_recursive(lfs_t *lfs, const char *path) {
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    struct lfs_mlist top;
+    lfs_stag_t tag = lfs_dir_find(lfs, &top.m, &path, NULL);
+    if (tag < 0 || lfs_tag_id(tag) == 0x3ff) {
+        return (tag < 0) ? (int)tag : LFS_ERR_INVAL;
+    }
+
+    if (lfs_tag_type3(tag) != LFS_TYPE_DIR) {
+        // plain files are just deleted
+        return lfs_dir_commit(lfs, &top.m, LFS_MKATTRS(
+                {LFS_MKTAG(LFS_TYPE_DELETE, lfs_tag_id(tag), 0), NULL}));
+    }
+
+    top.type = 0;
+    top.id = lfs_tag_id(tag);
+    lfs_mlist_append(lfs, &top);
+    lfs_hcache_drop(lfs);
+    err = lfs_dir_removetree(lfs, &top);
+    lfs_mlist_remove(lfs, &top);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_rawrename(lfs_t *lfs, const char *oldpath, const char *newpath) {
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // find old entry
+    lfs_mdir_t oldcwd;
+    lfs_stag_t oldtag = lfs_dir_find(lfs, &oldcwd, &oldpath, NULL);
+    if (oldtag < 0 || lfs_tag_id(oldtag) == 0x3ff) {
+        return (oldtag < 0) ? (int)oldtag : LFS_ERR_INVAL;
+    }
+
+    // find new entry
+    lfs_mdir_t newcwd;
+    uint16_t newid;
+    lfs_stag_t prevtag = lfs_dir_find(lfs, &newcwd, &newpath, &newid);
+    if ((prevtag < 0 || lfs_tag_id(prevtag) == 0x3ff) &&
+            !(prevtag == LFS_ERR_NOENT && newid != 0x3ff)) {
+        return (prevtag < 0) ? (int)prevtag : LFS_ERR_INVAL;
+    }
+
+    // if we're in the same pair there's a few special cases...
+    bool samepair = (lfs_pair_cmp(oldcwd.pair, newcwd.pair) == 0);
+    uint16_t newoldid = lfs_tag_id(oldtag);
+
+    struct lfs_mlist prevdir;
+    bool tracked = false;
+    if (prevtag == LFS_ERR_NOENT) {
+        // check that name fits
+        lfs_size_t nlen = strlen(newpath);
+        if (nlen > lfs->name_max) {
+            return LFS_ERR_NAMETOOLONG;
+        }
+
+        // there is a small chance we are being renamed in the same
+        // directory/ to an id less than our old id, the global update
+        // to handle this is a bit messy
+        if (samepair && newid <= newoldid) {
+            newoldid += 1;
+        }
+    } else if (lfs_tag_type3(prevtag) != lfs_tag_type3(oldtag)) {
+        return LFS_ERR_ISDIR;
+    } else if (samepair && newid == newoldid) {
+        // we're renaming to ourselves??
+        return 0;
+    } else if (lfs_tag_type3(prevtag) == LFS_TYPE_DIR) {
+        // must be empty before removal
+        lfs_block_t prevpair[2];
+        lfs_stag_t res = lfs_dir_get(lfs, &newcwd, LFS_MKTAG(0x700, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_STRUCT, newid, 8), prevpair);
+        if (res < 0) {
+            return (int)res;
+        }
+        lfs_pair_fromle32(prevpair);
+
+        // must be empty before removal
+        err = lfs_dir_fetch(lfs, &prevdir.m, prevpair);
+        if (err) {
+            return err;
+        }
+
+        if (prevdir.m.count > 0 || prevdir.m.split) {
+            return LFS_ERR_NOTEMPTY;
+        }
+
+        // mark fs as orphaned
+        err = lfs_fs_preporphans(lfs, +1);
+        if (err) {
+            return err;
+        }
+
+        // I know it's crazy but yes, dir can be changed by our parent's
+        // commit (if predecessor is child)
+        prevdir.type = 0;
+        prevdir.id = 0;
+        lfs_mlist_append(lfs, &prevdir);
+        tracked = true;
+    }
+
+    if (!samepair) {
+        lfs_fs_prepmove(lfs, newoldid, oldcwd.pair);
+    }
+
+    if (lfs_tag_type3(oldtag) == LFS_TYPE_DIR) {
+        lfs_hcache_drop(lfs);
+    }
+
+    // move over all attributes
+    err = lfs_dir_commit(lfs, &newcwd, LFS_MKATTRS(
+            {LFS_MKTAG_IF(prevtag != LFS_ERR_NOENT,
+                LFS_TYPE_DELETE, newid, 0), NULL},
+            {LFS_MKTAG(LFS_TYPE_CREATE, newid, 0), NULL},
+            {LFS_MKTAG(lfs_tag_type3(oldtag), newid, strlen(newpath)), newpath},
+            {LFS_MKTAG(LFS_FROM_MOVE, newid, lfs_tag_id(oldtag)), &oldcwd},
+            {LFS_MKTAG_IF(samepair,
+                LFS_TYPE_DELETE, newoldid, 0), NULL}));
+    if (err) {
+        if (tracked) {
+            lfs_mlist_remove(lfs, &prevdir);
+        }
+        return err;
+    }
+
+    // let commit clean up after move (if we're different! otherwise move
+    // logic already fixed it for us)
+    if (!samepair && lfs_gstate_hasmove(&lfs->gstate)) {
+        // prep gstate and delete move id
+        lfs_fs_prepmove(lfs, 0x3ff, NULL);
+        err = lfs_dir_commit(lfs, &oldcwd, LFS_MKATTRS(
+                {LFS_MKTAG(LFS_TYPE_DELETE, lfs_tag_id(oldtag), 0), NULL}));
+        if (err) {
+            if (tracked) {
+                lfs_mlist_remove(lfs, &prevdir);
+            }
+            return err;
+        }
+    }
+
+    if (tracked) {
+        lfs_mlist_remove(lfs, &prevdir);
+    }
+    if (prevtag != LFS_ERR_NOENT && lfs_tag_type3(prevtag) == LFS_TYPE_DIR) {
+        // fix orphan
+        err = lfs_fs_preporphans(lfs, -1);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_fs_pred(lfs, prevdir.m.pair, &newcwd, NULL);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_drop(lfs, &newcwd, &prevdir.m);
+        if (err) {
+            return err;
+        }
+    }
+
+    // did the new parent split? update its index
+    return lfs_dir_reindex(lfs);
+}
+#endif
+
+static lfs_ssize_t lfs_rawgetattr(lfs_t *lfs, const char *path,
+        uint8_t type, void *buffer, lfs_size_t size) {
+    lfs_mdir_t cwd;
+    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+    if (tag < 0) {
+        return tag;
+    }
+
+    uint16_t id = lfs_tag_id(tag);
+    if (id == 0x3ff) {
+        // special case for root
+        id = 0;
+        int err = lfs_dir_fetch(lfs, &cwd, lfs->root);
+        if (err) {
+            return err;
+        }
+    }
+
+    tag = lfs_dir_get(lfs, &cwd, LFS_MKTAG(0x7ff, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_USERATTR + type,
+                id, lfs_min(size, lfs->attr_max)),
+            buffer);
+    if (tag < 0) {
+        if (tag == LFS_ERR_NOENT) {
+            return LFS_ERR_NOATTR;
+        }
+
+        return tag;
+    }
+
+    return lfs_tag_size(tag);
+}
+
+#ifndef LFS_READONLY
+static int lfs_commitattr(lfs_t *lfs, const char *path,
+        uint8_t type, const void *buffer, lfs_size_t size) {
+    int err = lfs_fs_desuperblock(lfs);
+    if (err) {
+        return err;
+    }
+
+    lfs_mdir_t cwd;
+    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+    if (tag < 0) {
+        return tag;
+    }
+
+    uint16_t id = lfs_tag_id(tag);
+    if (id == 0x3ff) {
+        // special case for root
+        id = 0;
+        err = lfs_dir_fetch(lfs, &cwd, lfs->root);
+        if (err) {
+            return err;
+        }
+    }
+
+    return lfs_dir_commit(lfs, &cwd, LFS_MKATTRS(
+            {LFS_MKTAG(LFS_TYPE_USERATTR + type, id, size), buffer}));
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_rawsetattr(lfs_t *lfs, const char *path,
+        uint8_t type, const void *buffer, lfs_size_t size) {
+    if (size > lfs->attr_max) {
+        return LFS_ERR_NOSPC;
+    }
+
+    return lfs_commitattr(lfs, path, type, buffer, size);
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_rawremoveattr(lfs_t *lfs, const char *path, uint8_t type) {
+    return lfs_commitattr(lfs, path, type, NULL, 0x3ff);
+}
+#endif
+
+
+/// Filesystem operations ///
+static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
+    lfs->cfg = cfg;
+    int err = 0;
+
+    // the config may leave static geometry zeroed, but if it is provided it
+    // must agree with what littlefs was compiled for
+#ifdef LFS_STATIC_READ_SIZE
+    LFS_ASSERT(!cfg->read_size || cfg->read_size == LFS_STATIC_READ_SIZE);
+#endif
+#ifdef LFS_STATIC_PROG_SIZE
+    LFS_ASSERT(!cfg->prog_size || cfg->prog_size == LFS_STATIC_PROG_SIZE);
+#endif
+#ifdef LFS_STATIC_BLOCK_SIZE
+    LFS_ASSERT(!cfg->block_size || cfg->block_size == LFS_STATIC_BLOCK_SIZE);
+#endif
+#ifdef LFS_STATIC_BLOCK_COUNT
+    LFS_ASSERT(!cfg->block_count || cfg->block_count == LFS_STATIC_BLOCK_COUNT);
+#endif
+#ifdef LFS_STATIC_CACHE_SIZE
+    LFS_ASSERT(!cfg->cache_size || cfg->cache_size == LFS_STATIC_CACHE_SIZE);
+#endif
+#ifdef LFS_STATIC_LOOKAHEAD_SIZE
+    LFS_ASSERT(!cfg->lookahead_size ||
+            cfg->lookahead_size == LFS_STATIC_LOOKAHEAD_SIZE);
+#endif
+
+    // validate that the lfs-cfg sizes were initiated properly before
+    // performing any arithmetic logics with them
+    LFS_ASSERT(lfs_read_size(lfs) != 0);
+    LFS_ASSERT(lfs_prog_size(lfs) != 0);
+    LFS_ASSERT(lfs_cache_size(lfs) != 0);
+
+    // check that block size is a multiple of cache size is a multiple
+    // of prog and read sizes
+    LFS_ASSERT(lfs_cache_size(lfs) % lfs_read_size(lfs) == 0);
+    LFS_ASSERT(lfs_cache_size(lfs) % lfs_prog_size(lfs) == 0);
+    LFS_ASSERT(lfs_block_size(lfs) % lfs_cache_size(lfs) == 0);
+
+    // check that the block size is large enough to fit ctz pointers
+    LFS_ASSERT(4*lfs_npw2(0xffffffff / (lfs_block_size(lfs)-2*4))
+            <= lfs_block_size(lfs));
+
+    // block_cycles = 0 is no longer supported.
+    //
+    // block_cycles is the number of erase cycles before littlefs evicts
+    // metadata logs as a part of wear leveling. Suggested values are in the
+    // range of 100-1000, or set block_cycles to -1 to disable block-level
+    // wear-leveling.
+    LFS_ASSERT(lfs->cfg->block_cycles != 0);
+
+
+    // setup read cache
+    if (lfs->cfg->read_buffer) {
+        lfs->rcache.buffer = lfs->cfg->read_buffer;
+    } else {
+        lfs->rcache.buffer = lfs_malloc(lfs_cache_size(lfs));
+        if (!lfs->rcache.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+    }
+
+    // setup program cache
+    if (lfs->cfg->prog_buffer) {
+        lfs->pcache.buffer = lfs->cfg->prog_buffer;
+    } else {
+        lfs->pcache.buffer = lfs_malloc(lfs_cache_size(lfs));
+        if (!lfs->pcache.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+    }
+
+    // zero to avoid information leaks
+    lfs_cache_zero(lfs, &lfs->rcache);
+    lfs_cache_zero(lfs, &lfs->pcache);
+
+    // setup lookahead, must be multiple of 64-bits, 32-bit aligned
+    LFS_ASSERT(lfs_lookahead_size(lfs) > 0);
+    LFS_ASSERT(lfs_lookahead_size(lfs) % 8 == 0 &&
+            (uintptr_t)lfs->cfg->lookahead_buffer % 4 == 0);
+    if (lfs->cfg->lookahead_buffer) {
+        lfs->free.buffer = lfs->cfg->lookahead_buffer;
+    } else {
+        lfs->free.buffer = lfs_malloc(lfs_lookahead_size(lfs));
+        if (!lfs->free.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+    }
+
+    // the wear policy asks the block device for the wear of blocks
+    LFS_ASSERT(lfs->cfg->alloc_policy <= LFS_ALLOC_WEAR);
+    LFS_ASSERT(lfs->cfg->alloc_policy != LFS_ALLOC_WEAR || lfs->cfg->wear);
+    lfs_alloc_wearreset(lfs);
+
+    // setup the allocator regions, metadata pairs get their own lookahead
+    // if they live on a separate block device
+    lfs->free.begin = lfs->cfg->metadata_block_count;
+    lfs->free.count = lfs_block_count(lfs) - lfs->cfg->metadata_block_count;
+    lfs->mfree.begin = 0;
+    lfs->mfree.count = lfs->cfg->metadata_block_count;
+    lfs->mfree.buffer = NULL;
+    if (lfs->cfg->metadata_block_count) {
+        LFS_ASSERT(lfs->cfg->metadata_block_count >= 2);
+        LFS_ASSERT(lfs->cfg->metadata_block_count < lfs_block_count(lfs));
+        LFS_ASSERT(lfs->cfg->metadata_read);
+        LFS_ASSERT(lfs->cfg->metadata_prog);
+        LFS_ASSERT(lfs->cfg->metadata_erase);
+        LFS_ASSERT(lfs->cfg->metadata_sync);
+        LFS_ASSERT((uintptr_t)lfs->cfg->metadata_lookahead_buffer % 4 == 0);
+        if (lfs->cfg->metadata_lookahead_buffer) {
+            lfs->mfree.buffer = lfs->cfg->metadata_lookahead_buffer;
+        } else {
+            lfs->mfree.buffer = lfs_malloc(lfs_lookahead_size(lfs));
+            if (!lfs->mfree.buffer) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+    }
+
+    // check that the size limits are sane
+    LFS_ASSERT(lfs->cfg->name_max <= LFS_NAME_MAX);
+    lfs->name_max = lfs->cfg->name_max;
+    if (!lfs->name_max) {
+        lfs->name_max = LFS_NAME_MAX;
+    }
+
+    LFS_ASSERT(lfs->cfg->file_max <= LFS_FILE_MAX);
+    lfs->file_max = lfs->cfg->file_max;
+    if (!lfs->file_max) {
+        lfs->file_max = LFS_FILE_MAX;
+    }
+
+    LFS_ASSERT(lfs->cfg->attr_max <= LFS_ATTR_MAX);
+    lfs->attr_max = lfs->cfg->attr_max;
+    if (!lfs->attr_max) {
+        lfs->attr_max = LFS_ATTR_MAX;
+    }
+
+    // anything we format is written with our version
+    lfs->disk_version = LFS_DISK_VERSION;
+
+    LFS_ASSERT(lfs->cfg->metadata_max <= lfs_block_size(lfs));
+
+    // setup handle cache, zeroed slots never match
+    lfs->hcache = NULL;
+    if (lfs->cfg->handle_cache_size) {
+        if (lfs->cfg->handle_cache_buffer) {
+            lfs->hcache = lfs->cfg->handle_cache_buffer;
+        } else {
+            lfs->hcache = lfs_malloc(lfs->cfg->handle_cache_size
+                    * sizeof(struct lfs_hcache));
+            if (!lfs->hcache) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+
+        memset(lfs->hcache, 0,
+                lfs->cfg->handle_cache_size * sizeof(struct lfs_hcache));
+    }
+
+    // setup file cache pool
+    LFS_ASSERT(lfs->cfg->file_cache_count <= 32);
+    lfs->fpool.buffer = NULL;
+    if (lfs->cfg->file_cache_count) {
+        if (lfs->cfg->file_cache_buffer) {
+            lfs->fpool.buffer = lfs->cfg->file_cache_buffer;
+        } else {
+            lfs->fpool.buffer = lfs_malloc(lfs->cfg->file_cache_count
+                    * lfs_cache_size(lfs));
+            if (!lfs->fpool.buffer) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+    }
+    lfs->fpool.used = 0;
+    lfs->fpool.tick = 0;
+    memset(&lfs->fpool.stat, 0, sizeof(lfs->fpool.stat));
+
+    // setup read caches, the metadata ways come first followed by the
+    // data ways, their buffers follow the array of ways
+    LFS_ASSERT(lfs->cfg->metadata_cache_count <= 0xff);
+    LFS_ASSERT(lfs->cfg->data_cache_count <= 0xff);
+    LFS_ASSERT((uintptr_t)lfs->cfg->read_cache_buffer % 4 == 0);
+    lfs->rpool.ways = NULL;
+    lfs->rpool.mcount = lfs->cfg->metadata_cache_count;
+    lfs->rpool.dcount = lfs->cfg->data_cache_count;
+    lfs->rpool.tick = 0;
+    lfs->rpool.rtick = 0;
+    lfs->dcache = &lfs->rcache;
+    if (lfs->rpool.mcount + lfs->rpool.dcount) {
+        lfs_size_t ways = lfs->rpool.mcount + lfs->rpool.dcount;
+        if (lfs->cfg->read_cache_buffer) {
+            lfs->rpool.ways = lfs->cfg->read_cache_buffer;
+        } else {
+            lfs->rpool.ways = lfs_malloc(ways
+                    * (sizeof(struct lfs_rway) + lfs_cache_size(lfs)));
+            if (!lfs->rpool.ways) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+
+        uint8_t *buffer = (uint8_t*)&lfs->rpool.ways[ways];
+        for (lfs_size_t i = 0; i < ways; i++) {
+            lfs->rpool.ways[i].cache.buffer = &buffer[i*lfs_cache_size(lfs)];
+            lfs->rpool.ways[i].tick = 0;
+            lfs_cache_zero(lfs, &lfs->rpool.ways[i].cache);
+        }
+
+        // data reads name the first data way, which stands in for all of
+        // them
+        if (lfs->rpool.dcount) {
+            lfs->dcache = &lfs->rpool.ways[lfs->rpool.mcount].cache;
+        }
+    }
+
+    // setup default state
+    lfs->root[0] = LFS_BLOCK_NULL;
+    lfs->root[1] = LFS_BLOCK_NULL;
+    for (int i = 0; i < LFS_MLIST_BUCKETS; i++) {
+        lfs->mlist[i] = NULL;
+    }
+    lfs->seed = 0;
+    lfs->snapshots = NULL;
+    lfs->snapshot = NULL;
+    lfs->op = NULL;
+    lfs->erased.block = LFS_BLOCK_NULL;
+    lfs->erased.err = 0;
+    lfs->gdisk = (lfs_gstate_t){0};
+    lfs->gstate = (lfs_gstate_t){0};
+    lfs->gdelta = (lfs_gstate_t){0};
+    lfs->dirsplit[0] = LFS_BLOCK_NULL;
+    lfs->dirsplit[1] = LFS_BLOCK_NULL;
+    lfs->gen = 1;
+    for (int i = 0; i < LFS_HGEN_BUCKETS; i++) {
+        lfs->hgen[i] = 1;
+    }
+#ifdef LFS_MIGRATE
+    lfs->lfs1 = NULL;
+#endif
+
+    return 0;
+
+cleanup:
+    lfs_deinit(lfs);
+    return err;
+}
+
+static int lfs_deinit(lfs_t *lfs) {
+    // free allocated memory
+    if (!lfs->cfg->read_buffer) {
+        lfs_free(lfs->rcache.buffer);
+    }
+
+    if (!lfs->cfg->prog_buffer) {
+        lfs_free(lfs->pcache.buffer);
+    }
+
+    if (!lfs->cfg->lookahead_buffer) {
+        lfs_free(lfs->free.buffer);
+    }
+
+    if (!lfs->cfg->metadata_lookahead_buffer) {
+        lfs_free(lfs->mfree.buffer);
+    }
+
+    if (!lfs->cfg->handle_cache_buffer) {
+        lfs_free(lfs->hcache);
+    }
+
+    if (!lfs->cfg->file_cache_buffer) {
+        lfs_free(lfs->fpool.buffer);
+    }
+
+    if (!lfs->cfg->read_cache_buffer) {
+        lfs_free(lfs->rpool.ways);
+    }
+
+    return 0;
+}
+
+#ifndef LFS_READONLY
+static int lfs_rawformat(lfs_t *lfs, const struct lfs_config *cfg) {
+    int err = 0;
+    {
+        err = lfs_init(lfs, cfg);
+        if (err) {
+            return err;
+        }
+
+        // create free lookahead
+        memset(lfs->free.buffer, 0, lfs_lookahead_size(lfs));
+        lfs->free.off = 0;
+        lfs->free.size = lfs_min(8*lfs_lookahead_size(lfs),
+                lfs->free.count);
+        lfs->free.i = 0;
+        if (lfs->cfg->metadata_block_count) {
+            memset(lfs->mfree.buffer, 0, lfs_lookahead_size(lfs));
+            lfs->mfree.off = 0;
+            lfs->mfree.size = lfs_min(8*lfs_lookahead_size(lfs),
+                    lfs->mfree.count);
+            lfs->mfree.i = 0;
+        }
+        lfs_alloc_ack(lfs);
+
+        // create root dir
+        lfs_mdir_t root;
+        err = lfs_dir_alloc(lfs, &root);
+        if (err) {
+            goto cleanup;
+        }
+
+        // write one superblock
+        lfs_superblock_t superblock = {
+            .version     = LFS_DISK_VERSION,
+            .block_size  = lfs_block_size(lfs),
+            .block_count = lfs_block_count(lfs),
+            .name_max    = lfs->name_max,
+            .file_max    = lfs->file_max,
+            .attr_max    = lfs->attr_max,
+        };
+
+        lfs_superblock_tole32(&superblock);
+        err = lfs_dir_commit(lfs, &root, LFS_MKATTRS(
+                {LFS_MKTAG(LFS_TYPE_CREATE, 0, 0), NULL},
+                {LFS_MKTAG(LFS_TYPE_SUPERBLOCK, 0, 8), "littlefs"},
+                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
+                    &superblock}));
+        if (err) {
+            goto cleanup;
+        }
+
+        // force compaction to prevent accidentally mounting any
+        // older version of littlefs that may live on disk
+        root.erased = false;
+        err = lfs_dir_commit(lfs, &root, NULL, 0);
+        if (err) {
+            goto cleanup;
+        }
+
+        // sanity check that fetch works
+        err = lfs_dir_fetch(lfs, &root, (const lfs_block_t[2]){0, 1});
+        if (err) {
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    lfs_deinit(lfs);
+    return err;
+
+}
+#endif
+
+// does a config share a statically allocated buffer with another config?
+static bool lfs_config_sharesbuffers(const struct lfs_config *a,
+        const struct lfs_config *b) {
+    const void *abuffers[] = {
+        a->read_buffer, a->prog_buffer, a->lookahead_buffer,
+        a->handle_cache_buffer, a->file_cache_buffer, a->read_cache_buffer,
+        a->metadata_lookahead_buffer,
+    };
+    const void *bbuffers[] = {
+        b->read_buffer, b->prog_buffer, b->lookahead_buffer,
+        b->handle_cache_buffer, b->file_cache_buffer, b->read_cache_buffer,
+        b->metadata_lookahead_buffer,
+    };
+
+    for (unsigned i = 0; i < sizeof(abuffers)/sizeof(abuffers[0]); i++) {
+        for (unsigned j = 0; j < sizeof(bbuffers)/sizeof(bbuffers[0]); j++) {
+            if (abuffers[i] && abuffers[i] == bbuffers[j]) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static int lfs_rawmount(lfs_t *lfs, const struct lfs_config *cfg,
+        const lfs_snapshot_t *snapshot) {
+    // a view must not share its caches with the live filesystem
+    if (snapshot && lfs_config_sharesbuffers(cfg, snapshot->cfg)) {
+        return LFS_ERR_INVAL;
+    }
+
+    int err = lfs_init(lfs, cfg);
+    if (err) {
+        return err;
+    }
+
+    // mounting a snapshot? all metadata reads go through its copies
+    lfs->snapshot = snapshot;
+
+    // scan directory blocks for superblock and any global updates
+    lfs_mdir_t dir = {.tail = {0, 1}};
+    lfs_block_t cycle = 0;
+    while (!lfs_pair_isnull(dir.tail)) {
+        if (cycle >= lfs_block_count(lfs)/2) {
+            // loop detected
+            err = LFS_ERR_CORRUPT;
+            goto cleanup;
+        }
+        cycle += 1;
+
+        // fetch next block in tail list
+        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, &dir, dir.tail,
+                LFS_MKTAG(0x7ff, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_SUPERBLOCK, 0, 8),
+                NULL,
+                lfs_dir_find_match, &(struct lfs_dir_find_match){
+                    lfs, "littlefs", 8});
+        if (tag < 0) {
+            err = tag;
+            goto cleanup;
+        }
+
+        // has superblock?
+        if (tag && !lfs_tag_isdelete(tag)) {
+            // update root
+            lfs->root[0] = dir.pair[0];
+            lfs->root[1] = dir.pair[1];
+
+            // grab superblock
+            lfs_superblock_t superblock;
+            tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
+                    &superblock);
+            if (tag < 0) {
+                err = tag;
+                goto cleanup;
+            }
+            lfs_superblock_fromle32(&superblock);
+
+            // check version
+            uint16_t major_version = (0xffff & (superblock.version >> 16));
+            uint16_t minor_version = (0xffff & (superblock.version >>  0));
+            if ((major_version != LFS_DISK_VERSION_MAJOR ||
+                 minor_version > LFS_DISK_VERSION_MINOR)) {
+                LFS_ERROR("Invalid version v%"PRIu16".%"PRIu16,
+                        major_version, minor_version);
+                err = LFS_ERR_INVAL;
+                goto cleanup;
+            }
+
+            // older minor versions are upgraded before our first write
+            lfs->disk_version = superblock.version;
+
+            // check superblock configuration
+            if (superblock.name_max) {
+                if (superblock.name_max > lfs->name_max) {
+                    LFS_ERROR("Unsupported name_max (%"PRIu32" > %"PRIu32")",
+                            superblock.name_max, lfs->name_max);
+                    err = LFS_ERR_INVAL;
+                    goto cleanup;
+                }
+
+                lfs->name_max = superblock.name_max;
+            }
+
+            if (superblock.file_max) {
+                if (superblock.file_max > lfs->file_max) {
+                    LFS_ERROR("Unsupported file_max (%"PRIu32" > %"PRIu32")",
+                            superblock.file_max, lfs->file_max);
+                    err = LFS_ERR_INVAL;
+                    goto cleanup;
+                }
+
+                lfs->file_max = superblock.file_max;
+            }
+
+            if (superblock.attr_max) {
+                if (superblock.attr_max > lfs->attr_max) {
+                    LFS_ERROR("Unsupported attr_max (%"PRIu32" > %"PRIu32")",
+                            superblock.attr_max, lfs->attr_max);
+                    err = LFS_ERR_INVAL;
                     goto cleanup;
                 }
 
-                lfs->file_max = superblock.file_max;
+                lfs->attr_max = superblock.attr_max;
+            }
+        }
+
+        // has gstate?
+        err = lfs_dir_getgstate(lfs, &dir, &lfs->gstate);
+        if (err) {
+            goto cleanup;
+        }
+    }
+
+    // found superblock?
+    if (lfs_pair_isnull(lfs->root)) {
+        err = LFS_ERR_INVAL;
+        goto cleanup;
+    }
+
+    // update littlefs with gstate
+    if (lfs->gstate.tag || lfs->gstate.pair[0] || lfs->gstate.pair[1]) {
+        LFS_DEBUG("Found pending gstate 0x%08"PRIx32"%08"PRIx32"%08"PRIx32,
+                lfs->gstate.tag,
+                lfs->gstate.pair[0],
+                lfs->gstate.pair[1]);
+    }
+    lfs->gstate.tag += !lfs_tag_isvalid(lfs->gstate.tag);
+    lfs->gdisk = lfs->gstate;
+
+    // start handles from the seed, so handles kept across a remount are
+    // unlikely to match
+    lfs->gen = lfs->seed + !lfs->seed;
+    for (int i = 0; i < LFS_HGEN_BUCKETS; i++) {
+        lfs->hgen[i] = lfs->gen;
+    }
+
+    // setup free lookahead, to distribute allocations uniformly across
+    // boots, we start the allocator at a random location, unless the
+    // policy continues where the last mount left off
+    lfs->free.off = lfs->seed % lfs->free.count;
+    if (lfs->cfg->alloc_policy != LFS_ALLOC_RANDOM) {
+        lfs->free.off = lfs->gstate.cursor % lfs->free.count;
+    }
+    lfs->mfree.off = 0;
+    if (lfs->cfg->metadata_block_count) {
+        lfs->mfree.off = lfs->seed % lfs->mfree.count;
+    }
+    lfs_alloc_drop(lfs);
+
+    return 0;
+
+cleanup:
+    lfs_deinit(lfs);
+    return err;
+}
+
+#ifndef LFS_READONLY
+// commit the allocator's position if no other commit took it along, an
+// unchanged cursor writes nothing
+static int lfs_alloc_persist(lfs_t *lfs) {
+    if (lfs->snapshot) {
+        return 0;
+    }
+
+    lfs_alloc_setcursor(lfs);
+    if (lfs->gstate.cursor == lfs->gdisk.cursor) {
+        return 0;
+    }
+
+    // older images are upgraded first, which may take the cursor along
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    if (lfs->gstate.cursor == lfs->gdisk.cursor) {
+        return 0;
+    }
+
+    lfs_mdir_t root;
+    err = lfs_dir_fetch(lfs, &root, lfs->root);
+    if (err) {
+        return err;
+    }
+
+    return lfs_dir_commit(lfs, &root, NULL, 0);
+}
+#endif
+
+static int lfs_rawunmount(lfs_t *lfs) {
+#ifndef LFS_READONLY
+    int err = lfs_alloc_persist(lfs);
+    if (err) {
+        lfs_deinit(lfs);
+        return err;
+    }
+#endif
+
+    return lfs_deinit(lfs);
+}
+
+
+/// Filesystem filesystem operations ///
+int lfs_fs_rawtraverse(lfs_t *lfs,
+        int (*cb)(void *data, lfs_block_t block), void *data,
+        bool includeorphans) {
+    // iterate over metadata pairs
+    lfs_mdir_t dir = {.tail = {0, 1}};
+
+#ifdef LFS_MIGRATE
+    // also consider v1 blocks during migration
+    if (lfs->lfs1) {
+        int err = lfs1_traverse(lfs, cb, data);
+        if (err) {
+            return err;
+        }
+
+        dir.tail[0] = lfs->root[0];
+        dir.tail[1] = lfs->root[1];
+    }
+#endif
+
+    lfs_block_t cycle = 0;
+    while (!lfs_pair_isnull(dir.tail)) {
+        if (cycle >= lfs_block_count(lfs)/2) {
+            // loop detected
+            return LFS_ERR_CORRUPT;
+        }
+        cycle += 1;
+
+        for (int i = 0; i < 2; i++) {
+            int err = cb(data, dir.tail[i]);
+            if (err) {
+                return err;
+            }
+        }
+
+        // iterate through ids in directory
+        int err = lfs_dir_fetch(lfs, &dir, dir.tail);
+        if (err) {
+            return err;
+        }
+
+        if (dir.dirindex != LFS_BLOCK_NULL) {
+            err = cb(data, dir.dirindex);
+            if (err) {
+                return err;
+            }
+        }
+
+        for (uint16_t id = 0; id < dir.count; id++) {
+            struct lfs_ctz ctz;
+            lfs_stag_t tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_STRUCT, id, sizeof(ctz)), &ctz);
+            if (tag < 0) {
+                if (tag == LFS_ERR_NOENT) {
+                    continue;
+                }
+                return tag;
+            }
+            lfs_ctz_fromle32(&ctz);
+
+            if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT) {
+                err = lfs_ctz_traverse(lfs, NULL, lfs->dcache,
+                        ctz.head, ctz.size, cb, data);
+                if (err) {
+                    return err;
+                }
+            } else if (lfs_tag_type3(tag) == LFS_TYPE_INDEXSTRUCT) {
+                err = lfs_index_traverse(lfs, NULL, lfs->dcache,
+                        ctz.head, ctz.size, cb, data);
+                if (err) {
+                    return err;
+                }
+            } else if (includeorphans &&
+                    lfs_tag_type3(tag) == LFS_TYPE_DIRSTRUCT) {
+                for (int i = 0; i < 2; i++) {
+                    err = cb(data, (&ctz.head)[i]);
+                    if (err) {
+                        return err;
+                    }
+                }
+            }
+        }
+    }
+
+#ifndef LFS_READONLY
+    if (lfs->snapshot) {
+        // traversing a snapshot, open files and other snapshots are not
+        // part of it
+        return 0;
+    }
+
+    // iterate over any held snapshots
+    for (lfs_snapshot_t *s = lfs->snapshots; s; s = s->next) {
+        int err = lfs_snapshot_traverse(lfs, s, cb, data, includeorphans);
+        if (err) {
+            return err;
+        }
+    }
+
+    // iterate over any open files
+    for (int i = 0; i < LFS_MLIST_BUCKETS; i++) {
+        for (lfs_file_t *f = (lfs_file_t*)lfs->mlist[i]; f; f = f->next) {
+            if (f->type != LFS_TYPE_REG) {
+                continue;
+            }
+
+            if ((f->flags & LFS_F_DIRTY) && (f->flags & LFS_F_INDEX)) {
+                int err = lfs_index_traverse(lfs, &f->cache, lfs->dcache,
+                        f->ctz.head, f->ctz.size, cb, data);
+                if (err) {
+                    return err;
+                }
+            } else if ((f->flags & LFS_F_DIRTY) &&
+                    !(f->flags & LFS_F_INLINE)) {
+                int err = lfs_ctz_traverse(lfs, &f->cache, lfs->dcache,
+                        f->ctz.head, f->ctz.size, cb, data);
+                if (err) {
+                    return err;
+                }
+            }
+
+            if ((f->flags & LFS_F_WRITING) && (f->flags & LFS_F_INDEX)) {
+                // the block being written isn't linked into the index yet
+                int err = cb(data, f->block);
+                if (err) {
+                    return err;
+                }
+            } else if ((f->flags & LFS_F_WRITING) &&
+                    !(f->flags & LFS_F_INLINE)) {
+                int err = lfs_ctz_traverse(lfs, &f->cache, lfs->dcache,
+                        f->block, f->pos, cb, data);
+                if (err) {
+                    return err;
+                }
+            }
+        }
+    }
+
+    // a pending write holds on to the block being erased for it
+    if (lfs->op && lfs->op->held != LFS_BLOCK_NULL) {
+        int err = cb(data, lfs->op->held);
+        if (err) {
+            return err;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+#ifndef LFS_READONLY
+static int lfs_fs_pred(lfs_t *lfs,
+        const lfs_block_t pair[2], lfs_mdir_t *pdir, lfs_mdir_t *phead) {
+    // iterate over all directory directory entries
+    pdir->tail[0] = 0;
+    pdir->tail[1] = 1;
+    pdir->split = false;
+    lfs_block_t cycle = 0;
+    while (!lfs_pair_isnull(pdir->tail)) {
+        if (cycle >= lfs_block_count(lfs)/2) {
+            // loop detected
+            return LFS_ERR_CORRUPT;
+        }
+        cycle += 1;
+
+        if (lfs_pair_cmp(pdir->tail, pair) == 0) {
+            return 0;
+        }
+
+        bool head = (!pdir->split ||
+                lfs_pair_cmp(pdir->tail, lfs->root) == 0);
+        int err = lfs_dir_fetch(lfs, pdir, pdir->tail);
+        if (err) {
+            return err;
+        }
+
+        // keep track of the head of the directory we're in?
+        if (phead && head) {
+            *phead = *pdir;
+        }
+    }
+
+    return LFS_ERR_NOENT;
+}
+#endif
+
+#ifndef LFS_READONLY
+struct lfs_fs_parent_match {
+    lfs_t *lfs;
+    const lfs_block_t pair[2];
+};
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_parent_match(void *data,
+        lfs_tag_t tag, const void *buffer) {
+    struct lfs_fs_parent_match *find = data;
+    lfs_t *lfs = find->lfs;
+    const struct lfs_diskoff *disk = buffer;
+    (void)tag;
+
+    lfs_block_t child[2];
+    int err = lfs_bd_read(lfs,
+            &lfs->pcache, &lfs->rcache, lfs_block_size(lfs),
+            disk->block, disk->off, &child, sizeof(child));
+    if (err) {
+        return err;
+    }
+
+    lfs_pair_fromle32(child);
+    return (lfs_pair_cmp(child, find->pair) == 0) ? LFS_CMP_EQ : LFS_CMP_LT;
+}
+#endif
+
+#ifndef LFS_READONLY
+static lfs_stag_t lfs_fs_parent(lfs_t *lfs, const lfs_block_t pair[2],
+        lfs_mdir_t *parent) {
+    // use fetchmatch with callback to find pairs
+    parent->tail[0] = 0;
+    parent->tail[1] = 1;
+    lfs_block_t cycle = 0;
+    while (!lfs_pair_isnull(parent->tail)) {
+        if (cycle >= lfs_block_count(lfs)/2) {
+            // loop detected
+            return LFS_ERR_CORRUPT;
+        }
+        cycle += 1;
+
+        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, parent, parent->tail,
+                LFS_MKTAG(0x7ff, 0, 0x3ff),
+                LFS_MKTAG(LFS_TYPE_DIRSTRUCT, 0, 8),
+                NULL,
+                lfs_fs_parent_match, &(struct lfs_fs_parent_match){
+                    lfs, {pair[0], pair[1]}});
+        if (tag && tag != LFS_ERR_NOENT) {
+            return tag;
+        }
+    }
+
+    return LFS_ERR_NOENT;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_relocate(lfs_t *lfs,
+        const lfs_block_t oldpair[2], lfs_block_t newpair[2]) {
+    lfs_handle_stale(lfs, oldpair);
+
+    // update internal root
+    if (lfs_pair_cmp(oldpair, lfs->root) == 0) {
+        lfs->root[0] = newpair[0];
+        lfs->root[1] = newpair[1];
+    }
+
+    // update internally tracked dirs, directory heads aren't hashed so
+    // this looks at every bucket, handles we move may be seen twice
+    for (int i = 0; i < LFS_MLIST_BUCKETS; i++) {
+        struct lfs_mlist *next;
+        for (struct lfs_mlist *d = lfs->mlist[i]; d; d = next) {
+            next = d->next;
+            if (d->type == LFS_TYPE_DIR &&
+                    lfs_pair_cmp(oldpair, ((lfs_dir_t*)d)->head) == 0) {
+                ((lfs_dir_t*)d)->head[0] = newpair[0];
+                ((lfs_dir_t*)d)->head[1] = newpair[1];
+            }
+
+            if (lfs_pair_cmp(oldpair, d->m.pair) == 0) {
+                d->m.pair[0] = newpair[0];
+                d->m.pair[1] = newpair[1];
+                lfs_mlist_rehash(lfs, d);
+            }
+        }
+    }
+
+    // find parent
+    lfs_mdir_t parent;
+    lfs_stag_t tag = lfs_fs_parent(lfs, oldpair, &parent);
+    if (tag < 0 && tag != LFS_ERR_NOENT) {
+        return tag;
+    }
+
+    if (tag != LFS_ERR_NOENT) {
+        // update disk, this creates a desync
+        int err = lfs_fs_preporphans(lfs, +1);
+        if (err) {
+            return err;
+        }
+
+        // fix pending move in this pair? this looks like an optimization but
+        // is in fact _required_ since relocating may outdate the move.
+        uint16_t moveid = 0x3ff;
+        if (lfs_gstate_hasmovehere(&lfs->gstate, parent.pair)) {
+            moveid = lfs_tag_id(lfs->gstate.tag);
+            LFS_DEBUG("Fixing move while relocating "
+                    "{0x%"PRIx32", 0x%"PRIx32"} 0x%"PRIx16"\n",
+                    parent.pair[0], parent.pair[1], moveid);
+            lfs_fs_prepmove(lfs, 0x3ff, NULL);
+            if (moveid < lfs_tag_id(tag)) {
+                tag -= LFS_MKTAG(0, 1, 0);
+            }
+        }
+
+        lfs_pair_tole32(newpair);
+        err = lfs_dir_commit(lfs, &parent, LFS_MKATTRS(
+                {LFS_MKTAG_IF(moveid != 0x3ff,
+                    LFS_TYPE_DELETE, moveid, 0), NULL},
+                {tag, newpair}));
+        lfs_pair_fromle32(newpair);
+        if (err) {
+            return err;
+        }
+
+        // next step, clean up orphans
+        err = lfs_fs_preporphans(lfs, -1);
+        if (err) {
+            return err;
+        }
+    }
+
+    // find pred
+    lfs_mdir_t head;
+    int err = lfs_fs_pred(lfs, oldpair, &parent, &head);
+    if (err && err != LFS_ERR_NOENT) {
+        return err;
+    }
+
+    // if we can't find dir, it must be new
+    if (err != LFS_ERR_NOENT) {
+        // the directory's index still points to the old pair, copy it with
+        // the new pair in its place. If the index lives in the pair we are
+        // about to commit to, the copy goes in with the same commit,
+        // otherwise a copy without the pair stands in until the tail moves
+        lfs_block_t olddirindex = head.dirindex;
+        lfs_block_t dirindex = head.dirindex;
+        if (parent.split && head.dirindex != LFS_BLOCK_NULL) {
+            err = lfs_dirindex_repoint(lfs, head.dirindex,
+                    oldpair, newpair, &dirindex);
+            if (err) {
+                return err;
+            }
+        }
+
+        bool inhead = (lfs_pair_cmp(head.pair, parent.pair) == 0);
+        if (!inhead && dirindex != olddirindex) {
+            err = lfs_dir_unindex(lfs, &head, &parent, oldpair);
+            if (err) {
+                return err;
+            }
+        }
+
+        // fix pending move in this pair? this looks like an optimization but
+        // is in fact _required_ since relocating may outdate the move.
+        uint16_t moveid = 0x3ff;
+        if (lfs_gstate_hasmovehere(&lfs->gstate, parent.pair)) {
+            moveid = lfs_tag_id(lfs->gstate.tag);
+            LFS_DEBUG("Fixing move while relocating "
+                    "{0x%"PRIx32", 0x%"PRIx32"} 0x%"PRIx16"\n",
+                    parent.pair[0], parent.pair[1], moveid);
+            lfs_fs_prepmove(lfs, 0x3ff, NULL);
+        }
+
+        // replace bad pair, either we clean up desync, or no desync occured
+        lfs_block_t ledirindex = lfs_tole32(dirindex);
+        lfs_pair_tole32(newpair);
+        err = lfs_dir_commit(lfs, &parent, LFS_MKATTRS(
+                {LFS_MKTAG_IF(moveid != 0x3ff,
+                    LFS_TYPE_DELETE, moveid, 0), NULL},
+                {LFS_MKTAG_IF(inhead && dirindex != olddirindex,
+                    LFS_TYPE_DIRINDEX, 0x3ff, 4), &ledirindex},
+                {LFS_MKTAG(LFS_TYPE_TAIL + parent.split, 0x3ff, 8), newpair}));
+        lfs_pair_fromle32(newpair);
+        if (err) {
+            return err;
+        }
+
+        // now the tail has moved, swap the full copy in for the stand-in,
+        // finding the head again in case the commit moved it
+        if (!inhead && dirindex != olddirindex
+                && dirindex != LFS_BLOCK_NULL) {
+            lfs_block_t standin = head.dirindex;
+            err = lfs_fs_pred(lfs, newpair, &parent, &head);
+            if (err) {
+                return err;
+            }
+
+            if (head.dirindex == standin) {
+                err = lfs_dir_commit(lfs, &head, LFS_MKATTRS(
+                        {LFS_MKTAG(LFS_TYPE_DIRINDEX, 0x3ff, 4),
+                            &ledirindex}));
+                if (err) {
+                    return err;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_preporphans(lfs_t *lfs, int8_t orphans) {
+    LFS_ASSERT(lfs_tag_size(lfs->gstate.tag) > 0 || orphans >= 0);
+    lfs->gstate.tag += orphans;
+    lfs->gstate.tag = ((lfs->gstate.tag & ~LFS_MKTAG(0x800, 0, 0)) |
+            ((uint32_t)lfs_gstate_hasorphans(&lfs->gstate) << 31));
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static void lfs_fs_prepmove(lfs_t *lfs,
+        uint16_t id, const lfs_block_t pair[2]) {
+    lfs->gstate.tag = ((lfs->gstate.tag & ~LFS_MKTAG(0x7ff, 0x3ff, 0)) |
+            ((id != 0x3ff) ? LFS_MKTAG(LFS_TYPE_DELETE, id, 0) : 0));
+    lfs->gstate.pair[0] = (id != 0x3ff) ? pair[0] : 0;
+    lfs->gstate.pair[1] = (id != 0x3ff) ? pair[1] : 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_demove(lfs_t *lfs) {
+    if (!lfs_gstate_hasmove(&lfs->gdisk)) {
+        return 0;
+    }
+
+    // Fix bad moves
+    LFS_DEBUG("Fixing move {0x%"PRIx32", 0x%"PRIx32"} 0x%"PRIx16,
+            lfs->gdisk.pair[0],
+            lfs->gdisk.pair[1],
+            lfs_tag_id(lfs->gdisk.tag));
+
+    // fetch and delete the moved entry
+    lfs_mdir_t movedir;
+    int err = lfs_dir_fetch(lfs, &movedir, lfs->gdisk.pair);
+    if (err) {
+        return err;
+    }
+
+    // prep gstate and delete move id
+    uint16_t moveid = lfs_tag_id(lfs->gdisk.tag);
+    lfs_fs_prepmove(lfs, 0x3ff, NULL);
+    err = lfs_dir_commit(lfs, &movedir, LFS_MKATTRS(
+            {LFS_MKTAG(LFS_TYPE_DELETE, moveid, 0), NULL}));
+    if (err) {
+        return err;
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_deorphan(lfs_t *lfs) {
+    if (!lfs_gstate_hasorphans(&lfs->gstate)) {
+        return 0;
+    }
+
+    // Fix any orphans
+    lfs_mdir_t pdir = {.split = true, .tail = {0, 1}};
+    lfs_mdir_t dir;
+
+    // iterate over all directory directory entries
+    while (!lfs_pair_isnull(pdir.tail)) {
+        int err = lfs_dir_fetch(lfs, &dir, pdir.tail);
+        if (err) {
+            return err;
+        }
+
+        // check head blocks for orphans
+        if (!pdir.split) {
+            // check if we have a parent
+            lfs_mdir_t parent;
+            lfs_stag_t tag = lfs_fs_parent(lfs, pdir.tail, &parent);
+            if (tag < 0 && tag != LFS_ERR_NOENT) {
+                return tag;
             }
 
-            if (superblock.attr_max) {
-                if (superblock.attr_max > lfs->attr_max) {
-                    LFS_ERROR("Unsupported attr_max (%"PRIu32" > %"PRIu32")",
-                            superblock.attr_max, lfs->attr_max);
-                    err = LFS_ERR_INVAL;
-                    goto cleanup;
+            if (tag == LFS_ERR_NOENT) {
+                // we are an orphan
+                LFS_DEBUG("Fixing orphan {0x%"PRIx32", 0x%"PRIx32"}",
+                        pdir.tail[0], pdir.tail[1]);
+
+                err = lfs_dir_drop(lfs, &pdir, &dir);
+                if (err) {
+                    return err;
+                }
+
+                // refetch tail
+                continue;
+            }
+
+            lfs_block_t pair[2];
+            lfs_stag_t res = lfs_dir_get(lfs, &parent,
+                    LFS_MKTAG(0x7ff, 0x3ff, 0), tag, pair);
+            if (res < 0) {
+                return res;
+            }
+            lfs_pair_fromle32(pair);
+
+            if (!lfs_pair_sync(pair, pdir.tail)) {
+                // we have desynced
+                LFS_DEBUG("Fixing half-orphan {0x%"PRIx32", 0x%"PRIx32"} "
+                            "-> {0x%"PRIx32", 0x%"PRIx32"}",
+                        pdir.tail[0], pdir.tail[1], pair[0], pair[1]);
+
+                lfs_pair_tole32(pair);
+                err = lfs_dir_commit(lfs, &pdir, LFS_MKATTRS(
+                        {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8), pair}));
+                lfs_pair_fromle32(pair);
+                if (err) {
+                    return err;
                 }
 
-                lfs->attr_max = superblock.attr_max;
+                // refetch tail
+                continue;
             }
         }
 
-        // has gstate?
-        err = lfs_dir_getgstate(lfs, &dir, &lfs->gstate);
-        if (err) {
-            goto cleanup;
-        }
+        pdir = dir;
     }
 
-    // found superblock?
-    if (lfs_pair_isnull(lfs->root)) {
-        err = LFS_ERR_INVAL;
-        goto cleanup;
+    // mark orphans as fixed
+    return lfs_fs_preporphans(lfs, -lfs_gstate_getorphans(&lfs->gstate));
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_desuperblock(lfs_t *lfs) {
+    if (lfs->disk_version >= LFS_DISK_VERSION) {
+        return 0;
     }
 
-    // update littlefs with gstate
-    if (!lfs_gstate_iszero(&lfs->gstate)) {
-        LFS_DEBUG("Found pending gstate 0x%08"PRIx32"%08"PRIx32"%08"PRIx32,
-                lfs->gstate.tag,
-                lfs->gstate.pair[0],
-                lfs->gstate.pair[1]);
+    // the image may be missing on-disk structures of this minor version,
+    // bump the superblock before writing any of them so older versions
+    // of littlefs refuse to mount it
+    LFS_DEBUG("Upgrading superblock v%"PRIu16".%"PRIu16" -> v%"PRIu16".%"PRIu16,
+            (uint16_t)(0xffff & (lfs->disk_version >> 16)),
+            (uint16_t)(0xffff & (lfs->disk_version >>  0)),
+            (uint16_t)LFS_DISK_VERSION_MAJOR,
+            (uint16_t)LFS_DISK_VERSION_MINOR);
+
+    lfs_mdir_t root;
+    int err = lfs_dir_fetch(lfs, &root, lfs->root);
+    if (err) {
+        return err;
     }
-    lfs->gstate.tag += !lfs_tag_isvalid(lfs->gstate.tag);
-    lfs->gdisk = lfs->gstate;
 
-    // setup free lookahead, to distribute allocations uniformly across
-    // boots, we start the allocator at a random location
-    lfs->free.off = lfs->seed % lfs->cfg->block_count;
-    lfs_alloc_drop(lfs);
+    lfs_superblock_t superblock;
+    lfs_stag_t tag = lfs_dir_get(lfs, &root, LFS_MKTAG(0x7ff, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
+            &superblock);
+    if (tag < 0) {
+        return tag;
+    }
+    lfs_superblock_fromle32(&superblock);
+
+    superblock.version = LFS_DISK_VERSION;
+    lfs_superblock_tole32(&superblock);
+    err = lfs_dir_commit(lfs, &root, LFS_MKATTRS(
+            {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
+                &superblock}));
+    if (err) {
+        return err;
+    }
 
+    lfs->disk_version = LFS_DISK_VERSION;
     return 0;
+}
+#endif
 
-cleanup:
-    lfs_rawunmount(lfs);
-    return err;
+#ifndef LFS_READONLY
+static int lfs_fs_forceconsistency(lfs_t *lfs) {
+    int err = lfs_fs_desuperblock(lfs);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_fs_demove(lfs);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_fs_deorphan(lfs);
+    if (err) {
+        return err;
+    }
+
+    return 0;
 }
+#endif
 
-static int lfs_rawunmount(lfs_t *lfs) {
-    return lfs_deinit(lfs);
+static int lfs_fs_size_count(void *p, lfs_block_t block) {
+    (void)block;
+    lfs_size_t *size = p;
+    *size += 1;
+    return 0;
 }
 
+static lfs_ssize_t lfs_fs_rawsize(lfs_t *lfs) {
+    lfs_size_t size = 0;
+    int err = lfs_fs_rawtraverse(lfs, lfs_fs_size_count, &size, false);
+    if (err) {
+        return err;
+    }
 
-/// Filesystem filesystem operations ///
-int lfs_fs_rawtraverse(lfs_t *lfs,
-        int (*cb)(void *data, lfs_block_t block), void *data,
-        bool includeorphans) {
-    // iterate over metadata pairs
-    lfs_mdir_t dir = {.tail = {0, 1}};
+    return size;
+}
 
-#ifdef LFS_MIGRATE
-    // also consider v1 blocks during migration
-    if (lfs->lfs1) {
-        int err = lfs1_traverse(lfs, cb, data);
-        if (err) {
-            return err;
-        }
+static int lfs_fs_rawcachestat(lfs_t *lfs, struct lfs_cachestat *stat) {
+    *stat = lfs->fpool.stat;
+    return 0;
+}
 
-        dir.tail[0] = lfs->root[0];
-        dir.tail[1] = lfs->root[1];
+struct lfs_fs_export {
+    uint32_t *map;
+    lfs_block_t count;
+};
+
+static int lfs_fs_export_mark(void *p, lfs_block_t block) {
+    struct lfs_fs_export *export = p;
+    if (block < export->count) {
+        export->map[block / 32] |= 1U << (block % 32);
     }
-#endif
 
+    return 0;
+}
+
+static int lfs_fs_export_markmdirs(lfs_t *lfs, uint32_t *map, bool set) {
+    lfs_mdir_t dir = {.tail = {0, 1}};
     lfs_block_t cycle = 0;
     while (!lfs_pair_isnull(dir.tail)) {
-        if (cycle >= lfs->cfg->block_count/2) {
+        if (cycle >= lfs_block_count(lfs)/2) {
             // loop detected
             return LFS_ERR_CORRUPT;
         }
         cycle += 1;
 
         for (int i = 0; i < 2; i++) {
-            int err = cb(data, dir.tail[i]);
-            if (err) {
-                return err;
+            // tails come from disk, don't trust them to index the map
+            if (dir.tail[i] >= lfs_block_count(lfs)) {
+                return LFS_ERR_CORRUPT;
+            }
+
+            if (set) {
+                map[dir.tail[i] / 32] |= 1U << (dir.tail[i] % 32);
+            } else {
+                map[dir.tail[i] / 32] &= ~(1U << (dir.tail[i] % 32));
             }
         }
 
-        // iterate through ids in directory
         int err = lfs_dir_fetch(lfs, &dir, dir.tail);
         if (err) {
             return err;
         }
+    }
 
-        for (uint16_t id = 0; id < dir.count; id++) {
-            struct lfs_ctz ctz;
-            lfs_stag_t tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x700, 0x3ff, 0),
-                    LFS_MKTAG(LFS_TYPE_STRUCT, id, sizeof(ctz)), &ctz);
-            if (tag < 0) {
-                if (tag == LFS_ERR_NOENT) {
-                    continue;
-                }
-                return tag;
-            }
-            lfs_ctz_fromle32(&ctz);
+    return 0;
+}
 
-            if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT) {
-                err = lfs_ctz_traverse(lfs, NULL, &lfs->rcache,
-                        ctz.head, ctz.size, cb, data);
-                if (err) {
-                    return err;
-                }
-            } else if (includeorphans &&
-                    lfs_tag_type3(tag) == LFS_TYPE_DIRSTRUCT) {
-                for (int i = 0; i < 2; i++) {
-                    err = cb(data, (&ctz.head)[i]);
-                    if (err) {
-                        return err;
-                    }
-                }
-            }
-        }
-    }
+static int lfs_fs_export_blocks(lfs_t *lfs, const uint32_t *map,
+        void *buffer, lfs_size_t *count,
+        int (*cb)(void *data, const void *buffer, lfs_size_t size),
+        void *data) {
+    for (lfs_block_t i = 0; i < lfs_block_count(lfs); i += 32) {
+        uint32_t word = map[i / 32];
+        while (word) {
+            lfs_block_t block = i + lfs_ctz(word);
+            word &= word - 1;
 
-#ifndef LFS_READONLY
-    // iterate over any open files
-    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
-        if (f->type != LFS_TYPE_REG) {
-            continue;
-        }
+            // one block-sized read bypasses the caches entirely
+            int err = lfs_bd_read(lfs,
+                    NULL, &lfs->rcache, lfs_block_size(lfs),
+                    block, 0, buffer, lfs_block_size(lfs));
+            if (err) {
+                return err;
+            }
 
-        if ((f->flags & LFS_F_DIRTY) && !(f->flags & LFS_F_INLINE)) {
-            int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
-                    f->ctz.head, f->ctz.size, cb, data);
+            uint32_t record = lfs_tole32(block);
+            err = cb(data, &record, sizeof(record));
             if (err) {
                 return err;
             }
-        }
 
-        if ((f->flags & LFS_F_WRITING) && !(f->flags & LFS_F_INLINE)) {
-            int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
-                    f->block, f->pos, cb, data);
+            err = cb(data, buffer, lfs_block_size(lfs));
             if (err) {
                 return err;
             }
+
+            *count += 1;
         }
     }
-#endif
 
     return 0;
 }
 
-#ifndef LFS_READONLY
-static int lfs_fs_pred(lfs_t *lfs,
-        const lfs_block_t pair[2], lfs_mdir_t *pdir) {
-    // iterate over all directory directory entries
-    pdir->tail[0] = 0;
-    pdir->tail[1] = 1;
-    lfs_block_t cycle = 0;
-    while (!lfs_pair_isnull(pdir->tail)) {
-        if (cycle >= lfs->cfg->block_count/2) {
-            // loop detected
-            return LFS_ERR_CORRUPT;
-        }
-        cycle += 1;
-
-        if (lfs_pair_cmp(pdir->tail, pair) == 0) {
-            return 0;
-        }
+static int lfs_fs_rawexport(lfs_t *lfs, uint32_t *map, void *buffer,
+        int (*cb)(void *data, const void *buffer, lfs_size_t size),
+        void *data) {
+    lfs_size_t words = (lfs_block_count(lfs) + 31) / 32;
+    uint32_t header[4] = {
+        lfs_tole32(LFS_EXPORT_MAGIC),
+        lfs_tole32(LFS_EXPORT_VERSION),
+        lfs_tole32(lfs_block_size(lfs)),
+        lfs_tole32(lfs_block_count(lfs)),
+    };
+    int err = cb(data, header, sizeof(header));
+    if (err) {
+        return err;
+    }
 
-        int err = lfs_dir_fetch(lfs, pdir, pdir->tail);
-        if (err) {
-            return err;
-        }
+    // metadata pairs first, in address order
+    lfs_size_t count = 0;
+    memset(map, 0, words*sizeof(uint32_t));
+    err = lfs_fs_export_markmdirs(lfs, map, true);
+    if (err) {
+        return err;
     }
 
-    return LFS_ERR_NOENT;
-}
-#endif
+    err = lfs_fs_export_blocks(lfs, map, buffer, &count, cb, data);
+    if (err) {
+        return err;
+    }
 
-#ifndef LFS_READONLY
-struct lfs_fs_parent_match {
-    lfs_t *lfs;
-    const lfs_block_t pair[2];
-};
-#endif
+    // then everything else in use, in address order
+    memset(map, 0, words*sizeof(uint32_t));
+    err = lfs_fs_rawtraverse(lfs, lfs_fs_export_mark,
+            &(struct lfs_fs_export){map, lfs_block_count(lfs)}, true);
+    if (err) {
+        return err;
+    }
 
-#ifndef LFS_READONLY
-static int lfs_fs_parent_match(void *data,
-        lfs_tag_t tag, const void *buffer) {
-    struct lfs_fs_parent_match *find = data;
-    lfs_t *lfs = find->lfs;
-    const struct lfs_diskoff *disk = buffer;
-    (void)tag;
+    err = lfs_fs_export_markmdirs(lfs, map, false);
+    if (err) {
+        return err;
+    }
 
-    lfs_block_t child[2];
-    int err = lfs_bd_read(lfs,
-            &lfs->pcache, &lfs->rcache, lfs->cfg->block_size,
-            disk->block, disk->off, &child, sizeof(child));
+    err = lfs_fs_export_blocks(lfs, map, buffer, &count, cb, data);
     if (err) {
         return err;
     }
 
-    lfs_pair_fromle32(child);
-    return (lfs_pair_cmp(child, find->pair) == 0) ? LFS_CMP_EQ : LFS_CMP_LT;
+    // terminate with the number of exported blocks
+    uint32_t trailer[2] = {
+        lfs_tole32(LFS_BLOCK_NULL),
+        lfs_tole32(count),
+    };
+    return cb(data, trailer, sizeof(trailer));
 }
-#endif
+
 
 #ifndef LFS_READONLY
-static lfs_stag_t lfs_fs_parent(lfs_t *lfs, const lfs_block_t pair[2],
-        lfs_mdir_t *parent) {
-    // use fetchmatch with callback to find pairs
-    parent->tail[0] = 0;
-    parent->tail[1] = 1;
-    lfs_block_t cycle = 0;
-    while (!lfs_pair_isnull(parent->tail)) {
-        if (cycle >= lfs->cfg->block_count/2) {
-            // loop detected
-            return LFS_ERR_CORRUPT;
+// count the runs of physically contiguous blocks in a CTZ skip-list
+static int lfs_fs_defrag_runs(lfs_t *lfs, const struct lfs_ctz *ctz,
+        lfs_size_t *runs) {
+    *runs = 0;
+    if (ctz->size == 0) {
+        return 0;
+    }
+
+    lfs_off_t off = ctz->size-1;
+    lfs_off_t current = lfs_ctz_index(lfs, &off);
+    lfs_block_t block = ctz->head;
+    *runs = 1;
+    while (current > 0) {
+        lfs_block_t prev;
+        int err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, sizeof(prev),
+                block, 0, &prev, sizeof(prev));
+        if (err) {
+            return err;
         }
-        cycle += 1;
+        prev = lfs_fromle32(prev);
 
-        lfs_stag_t tag = lfs_dir_fetchmatch(lfs, parent, parent->tail,
-                LFS_MKTAG(0x7ff, 0, 0x3ff),
-                LFS_MKTAG(LFS_TYPE_DIRSTRUCT, 0, 8),
-                NULL,
-                lfs_fs_parent_match, &(struct lfs_fs_parent_match){
-                    lfs, {pair[0], pair[1]}});
-        if (tag && tag != LFS_ERR_NOENT) {
-            return tag;
+        if (block != prev+1) {
+            *runs += 1;
+        }
+
+        block = prev;
+        current -= 1;
+    }
+
+    return 0;
+}
+
+// rewrite a file into freshly allocated blocks and commit the new skip-list
+// atomically, the old blocks stay intact until the commit
+static int lfs_fs_defrag_file(lfs_t *lfs, lfs_defrag_t *defrag,
+        lfs_mdir_t *dir, uint16_t *id, const struct lfs_ctz *ctz) {
+    static const struct lfs_file_config defaults = {0};
+    lfs_file_t file = {
+        .id = *id,
+        .type = LFS_TYPE_REG,
+        .m = *dir,
+        .ctz.head = LFS_BLOCK_NULL,
+        .ctz.size = 0,
+        .flags = LFS_O_WRONLY,
+        .pos = 0,
+        .block = LFS_BLOCK_NULL,
+        .off = 0,
+        .cfg = &defaults,
+    };
+
+    if (defrag->buffer) {
+        file.cache.buffer = defrag->buffer;
+    } else {
+        file.cache.buffer = lfs_malloc(lfs_cache_size(lfs));
+        if (!file.cache.buffer) {
+            return LFS_ERR_NOMEM;
+        }
+    }
+    lfs_cache_zero(lfs, &file.cache);
+
+    // track like any open file so the allocator sees our new blocks and
+    // commits to the mdir keep us up to date
+    lfs_mlist_append(lfs, (struct lfs_mlist*)&file);
+
+    lfs_file_t orig = {
+        .ctz = *ctz,
+        .flags = LFS_O_RDONLY,
+        .pos = 0,
+        .cache = lfs->rcache,
+    };
+    lfs_cache_drop(lfs, &lfs->rcache);
+
+    int err = 0;
+    while (file.pos < ctz->size) {
+        // copy over a byte at a time, leave it up to caching
+        // to make this efficient
+        uint8_t data;
+        lfs_ssize_t res = lfs_file_rawread(lfs, &orig, &data, 1);
+        if (res < 0) {
+            err = res;
+            goto cleanup;
+        }
+
+        res = lfs_file_rawwrite(lfs, &file, &data, 1);
+        if (res < 0) {
+            err = res;
+            goto cleanup;
+        }
+
+        // keep our reference to the rcache in sync
+        if (lfs->rcache.block != LFS_BLOCK_NULL) {
+            lfs_cache_drop(lfs, &orig.cache);
+            lfs_cache_drop(lfs, &lfs->rcache);
         }
     }
 
-    return LFS_ERR_NOENT;
-}
-#endif
+    err = lfs_file_rawsync(lfs, &file);
+    if (err) {
+        goto cleanup;
+    }
 
-#ifndef LFS_READONLY
-static int lfs_fs_relocate(lfs_t *lfs,
-        const lfs_block_t oldpair[2], lfs_block_t newpair[2]) {
-    // update internal root
-    if (lfs_pair_cmp(oldpair, lfs->root) == 0) {
-        lfs->root[0] = newpair[0];
-        lfs->root[1] = newpair[1];
+    // commits may have moved our entry
+    *dir = file.m;
+    *id = file.id;
+
+cleanup:
+    lfs_mlist_remove(lfs, (struct lfs_mlist*)&file);
+    if (!defrag->buffer) {
+        lfs_free(file.cache.buffer);
     }
+    return err;
+}
 
-    // update internally tracked dirs
-    for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
-        if (lfs_pair_cmp(oldpair, d->m.pair) == 0) {
-            d->m.pair[0] = newpair[0];
-            d->m.pair[1] = newpair[1];
-        }
+static int lfs_fs_rawdefrag(lfs_t *lfs, lfs_defrag_t *defrag,
+        lfs_size_t budget) {
+    if (defrag->pair[0] == LFS_BLOCK_NULL) {
+        // pass already complete
+        return 0;
+    }
 
-        if (d->type == LFS_TYPE_DIR &&
-                lfs_pair_cmp(oldpair, ((lfs_dir_t*)d)->head) == 0) {
-            ((lfs_dir_t*)d)->head[0] = newpair[0];
-            ((lfs_dir_t*)d)->head[1] = newpair[1];
-        }
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
     }
 
-    // find parent
-    lfs_mdir_t parent;
-    lfs_stag_t tag = lfs_fs_parent(lfs, oldpair, &parent);
-    if (tag < 0 && tag != LFS_ERR_NOENT) {
-        return tag;
+    if (defrag->pair[0] == 0 && defrag->pair[1] == 0) {
+        // start a new pass at the root
+        defrag->pair[1] = 1;
     }
 
-    if (tag != LFS_ERR_NOENT) {
-        // update disk, this creates a desync
-        int err = lfs_fs_preporphans(lfs, +1);
+    lfs_mdir_t dir;
+    err = lfs_dir_fetch(lfs, &dir, defrag->pair);
+    if (err) {
+        if (err != LFS_ERR_CORRUPT) {
+            return err;
+        }
+
+        // our metadata pair was relocated by writes since the last call,
+        // start over from the root
+        defrag->pair[0] = 0;
+        defrag->pair[1] = 1;
+        defrag->id = 0;
+        err = lfs_dir_fetch(lfs, &dir, defrag->pair);
         if (err) {
             return err;
         }
+    }
 
-        // fix pending move in this pair? this looks like an optimization but
-        // is in fact _required_ since relocating may outdate the move.
-        uint16_t moveid = 0x3ff;
-        if (lfs_gstate_hasmovehere(&lfs->gstate, parent.pair)) {
-            moveid = lfs_tag_id(lfs->gstate.tag);
-            LFS_DEBUG("Fixing move while relocating "
-                    "{0x%"PRIx32", 0x%"PRIx32"} 0x%"PRIx16"\n",
-                    parent.pair[0], parent.pair[1], moveid);
-            lfs_fs_prepmove(lfs, 0x3ff, NULL);
-            if (moveid < lfs_tag_id(tag)) {
-                tag -= LFS_MKTAG(0, 1, 0);
+    lfs_size_t used = 0;
+    while (true) {
+        for (; defrag->id < dir.count; defrag->id++) {
+            struct lfs_ctz ctz;
+            lfs_stag_t tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_STRUCT, defrag->id, sizeof(ctz)), &ctz);
+            if (tag < 0) {
+                if (tag == LFS_ERR_NOENT) {
+                    continue;
+                }
+                return tag;
+            }
+            lfs_ctz_fromle32(&ctz);
+
+            if (lfs_tag_type3(tag) != LFS_TYPE_CTZSTRUCT) {
+                continue;
+            }
+
+            // leave open files alone, their handles may hold a
+            // different view of the file
+            bool isopen = false;
+            for (struct lfs_mlist *m = lfs->mlist[lfs_mlist_bucket(dir.pair)];
+                    m; m = m->next) {
+                if (m->type == LFS_TYPE_REG && m->id == defrag->id &&
+                        lfs_pair_cmp(m->m.pair, dir.pair) == 0) {
+                    isopen = true;
+                    break;
+                }
+            }
+            if (isopen) {
+                continue;
+            }
+
+            lfs_size_t runs;
+            err = lfs_fs_defrag_runs(lfs, &ctz, &runs);
+            if (err) {
+                return err;
+            }
+
+            lfs_off_t off = ctz.size-1;
+            lfs_block_t count = lfs_ctz_index(lfs, &off) + 1;
+            if (runs > 1 && used > 0 && used + count > budget) {
+                // out of budget, pick up here next time
+                return 1;
+            }
+
+            defrag->files += 1;
+            defrag->runs_before += runs;
+            if (runs > 1) {
+                // rewrite into a contiguous run if one can be found
+                lfs_alloc_ack(lfs);
+                err = lfs_alloc_reserve(lfs, count);
+                if (err && err != LFS_ERR_NOSPC) {
+                    return err;
+                }
+
+                if (!err) {
+                    err = lfs_fs_defrag_file(lfs, defrag,
+                            &dir, &defrag->id, &ctz);
+                    if (err) {
+                        return err;
+                    }
+
+                    tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x700, 0x3ff, 0),
+                            LFS_MKTAG(LFS_TYPE_STRUCT, defrag->id,
+                                sizeof(ctz)), &ctz);
+                    if (tag < 0) {
+                        return tag;
+                    }
+                    lfs_ctz_fromle32(&ctz);
+                    err = lfs_fs_defrag_runs(lfs, &ctz, &runs);
+                    if (err) {
+                        return err;
+                    }
+
+                    defrag->rewritten += 1;
+                    used += count;
+                }
             }
+            defrag->runs_after += runs;
         }
 
-        lfs_pair_tole32(newpair);
-        err = lfs_dir_commit(lfs, &parent, LFS_MKATTRS(
-                {LFS_MKTAG_IF(moveid != 0x3ff,
-                    LFS_TYPE_DELETE, moveid, 0), NULL},
-                {tag, newpair}));
-        lfs_pair_fromle32(newpair);
-        if (err) {
-            return err;
+        // continue with next metadata pair
+        defrag->id = 0;
+        if (lfs_pair_isnull(dir.tail)) {
+            defrag->pair[0] = LFS_BLOCK_NULL;
+            defrag->pair[1] = LFS_BLOCK_NULL;
+            return 0;
         }
 
-        // next step, clean up orphans
-        err = lfs_fs_preporphans(lfs, -1);
+        defrag->pair[0] = dir.tail[0];
+        defrag->pair[1] = dir.tail[1];
+        err = lfs_dir_fetch(lfs, &dir, defrag->pair);
         if (err) {
             return err;
         }
     }
+}
 
-    // find pred
-    int err = lfs_fs_pred(lfs, oldpair, &parent);
-    if (err && err != LFS_ERR_NOENT) {
-        return err;
+static int lfs_fs_rawgc(lfs_t *lfs) {
+    // a view of a snapshot doesn't see the blocks of the live filesystem
+    if (lfs->snapshot) {
+        return 0;
     }
 
-    // if we can't find dir, it must be new
-    if (err != LFS_ERR_NOENT) {
-        // fix pending move in this pair? this looks like an optimization but
-        // is in fact _required_ since relocating may outdate the move.
-        uint16_t moveid = 0x3ff;
-        if (lfs_gstate_hasmovehere(&lfs->gstate, parent.pair)) {
-            moveid = lfs_tag_id(lfs->gstate.tag);
-            LFS_DEBUG("Fixing move while relocating "
-                    "{0x%"PRIx32", 0x%"PRIx32"} 0x%"PRIx16"\n",
-                    parent.pair[0], parent.pair[1], moveid);
-            lfs_fs_prepmove(lfs, 0x3ff, NULL);
+    struct lfs_free *free = &lfs->free;
+    if (free->i == free->size) {
+        if (free->ack == 0) {
+            // every block was looked at since the last ack
+            return 0;
         }
 
-        // replace bad pair, either we clean up desync, or no desync occured
-        lfs_pair_tole32(newpair);
-        err = lfs_dir_commit(lfs, &parent, LFS_MKATTRS(
-                {LFS_MKTAG_IF(moveid != 0x3ff,
-                    LFS_TYPE_DELETE, moveid, 0), NULL},
-                {LFS_MKTAG(LFS_TYPE_TAIL + parent.split, 0x3ff, 8), newpair}));
-        lfs_pair_fromle32(newpair);
+        // move on to the next window
+        int err = lfs_alloc_scan(lfs, free);
+        if (err) {
+            return err;
+        }
+    } else {
+        // look at the current window again, blocks freed since it was
+        // scanned can then be allocated right away, the blocks before i
+        // have already been handed out or skipped
+        memset(free->buffer, 0, lfs_lookahead_size(lfs));
+        lfs_alloc_wearreset(lfs);
+        int err = lfs_fs_rawtraverse(lfs, lfs_alloc_lookahead, free, true);
         if (err) {
+            lfs_alloc_drop(lfs);
             return err;
         }
     }
 
-    return 0;
-}
-#endif
-
-#ifndef LFS_READONLY
-static int lfs_fs_preporphans(lfs_t *lfs, int8_t orphans) {
-    LFS_ASSERT(lfs_tag_size(lfs->gstate.tag) > 0 || orphans >= 0);
-    lfs->gstate.tag += orphans;
-    lfs->gstate.tag = ((lfs->gstate.tag & ~LFS_MKTAG(0x800, 0, 0)) |
-            ((uint32_t)lfs_gstate_hasorphans(&lfs->gstate) << 31));
-
-    return 0;
-}
-#endif
-
-#ifndef LFS_READONLY
-static void lfs_fs_prepmove(lfs_t *lfs,
-        uint16_t id, const lfs_block_t pair[2]) {
-    lfs->gstate.tag = ((lfs->gstate.tag & ~LFS_MKTAG(0x7ff, 0x3ff, 0)) |
-            ((id != 0x3ff) ? LFS_MKTAG(LFS_TYPE_DELETE, id, 0) : 0));
-    lfs->gstate.pair[0] = (id != 0x3ff) ? pair[0] : 0;
-    lfs->gstate.pair[1] = (id != 0x3ff) ? pair[1] : 0;
-}
-#endif
-
-#ifndef LFS_READONLY
-static int lfs_fs_demove(lfs_t *lfs) {
-    if (!lfs_gstate_hasmove(&lfs->gdisk)) {
+    if (!lfs->cfg->discard) {
         return 0;
     }
 
-    // Fix bad moves
-    LFS_DEBUG("Fixing move {0x%"PRIx32", 0x%"PRIx32"} 0x%"PRIx16,
-            lfs->gdisk.pair[0],
-            lfs->gdisk.pair[1],
-            lfs_tag_id(lfs->gdisk.tag));
-
-    // fetch and delete the moved entry
-    lfs_mdir_t movedir;
-    int err = lfs_dir_fetch(lfs, &movedir, lfs->gdisk.pair);
-    if (err) {
-        return err;
-    }
+    // no operation is in flight, so every block in the window that isn't
+    // reachable from the filesystem, a snapshot or an open file is free
+    for (lfs_block_t off = free->i; off < free->size; off++) {
+        if (free->buffer[off / 32] & (1U << (off % 32))) {
+            continue;
+        }
 
-    // prep gstate and delete move id
-    uint16_t moveid = lfs_tag_id(lfs->gdisk.tag);
-    lfs_fs_prepmove(lfs, 0x3ff, NULL);
-    err = lfs_dir_commit(lfs, &movedir, LFS_MKATTRS(
-            {LFS_MKTAG(LFS_TYPE_DELETE, moveid, 0), NULL}));
-    if (err) {
-        return err;
+        int err = lfs->cfg->discard(lfs->cfg,
+                free->begin + lfs_alloc_wrap(free, free->off + off)
+                    - lfs->cfg->metadata_block_count);
+        if (err) {
+            return err;
+        }
     }
 
     return 0;
 }
 #endif
 
+/// Snapshot operations ///
 #ifndef LFS_READONLY
-static int lfs_fs_deorphan(lfs_t *lfs) {
-    if (!lfs_gstate_hasorphans(&lfs->gstate)) {
-        return 0;
-    }
-
-    // Fix any orphans
-    lfs_mdir_t pdir = {.split = true, .tail = {0, 1}};
-    lfs_mdir_t dir;
-
-    // iterate over all directory directory entries
-    while (!lfs_pair_isnull(pdir.tail)) {
-        int err = lfs_dir_fetch(lfs, &dir, pdir.tail);
+static int lfs_snapshot_traverse(lfs_t *lfs, const lfs_snapshot_t *snapshot,
+        int (*cb)(void *data, lfs_block_t block), void *data,
+        bool includeorphans) {
+    // the frozen copies are in use
+    for (lfs_size_t i = 0; i < snapshot->count; i++) {
+        int err = cb(data, snapshot->pairs[i].copy);
         if (err) {
             return err;
         }
+    }
 
-        // check head blocks for orphans
-        if (!pdir.split) {
-            // check if we have a parent
-            lfs_mdir_t parent;
-            lfs_stag_t tag = lfs_fs_parent(lfs, pdir.tail, &parent);
-            if (tag < 0 && tag != LFS_ERR_NOENT) {
-                return tag;
-            }
+    // as is everything reachable from them, traverse the snapshot as if it
+    // were mounted, this needs the gstate the snapshot was taken with so
+    // pending moves resolve the same way
+    const lfs_snapshot_t *psnapshot = lfs->snapshot;
+    lfs_gstate_t gdisk = lfs->gdisk;
+    lfs->snapshot = snapshot;
+    lfs->gdisk = snapshot->gdisk;
+    lfs_rcache_dropall(lfs);
 
-            if (tag == LFS_ERR_NOENT) {
-                // we are an orphan
-                LFS_DEBUG("Fixing orphan {0x%"PRIx32", 0x%"PRIx32"}",
-                        pdir.tail[0], pdir.tail[1]);
+    int err = lfs_fs_rawtraverse(lfs, cb, data, includeorphans);
 
-                err = lfs_dir_drop(lfs, &pdir, &dir);
-                if (err) {
-                    return err;
-                }
+    lfs->snapshot = psnapshot;
+    lfs->gdisk = gdisk;
+    lfs_rcache_dropall(lfs);
+    return err;
+}
 
-                // refetch tail
-                continue;
-            }
+static int lfs_snapshot_copy(lfs_t *lfs, lfs_block_t src, lfs_size_t size,
+        lfs_block_t *copy) {
+    while (true) {
+        int err = lfs_alloc_meta(lfs, copy);
+        if (err) {
+            return err;
+        }
 
-            lfs_block_t pair[2];
-            lfs_stag_t res = lfs_dir_get(lfs, &parent,
-                    LFS_MKTAG(0x7ff, 0x3ff, 0), tag, pair);
-            if (res < 0) {
-                return res;
+        err = lfs_bd_erase(lfs, *copy);
+        if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
             }
-            lfs_pair_fromle32(pair);
-
-            if (!lfs_pair_sync(pair, pdir.tail)) {
-                // we have desynced
-                LFS_DEBUG("Fixing half-orphan {0x%"PRIx32", 0x%"PRIx32"} "
-                            "-> {0x%"PRIx32", 0x%"PRIx32"}",
-                        pdir.tail[0], pdir.tail[1], pair[0], pair[1]);
+            return err;
+        }
 
-                lfs_pair_tole32(pair);
-                err = lfs_dir_commit(lfs, &pdir, LFS_MKATTRS(
-                        {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8), pair}));
-                lfs_pair_fromle32(pair);
-                if (err) {
-                    return err;
-                }
+        for (lfs_off_t off = 0; off < size; off += 8) {
+            uint8_t dat[8];
+            lfs_size_t diff = lfs_min(size-off, sizeof(dat));
+            err = lfs_bd_read(lfs,
+                    NULL, &lfs->rcache, size-off,
+                    src, off, &dat, diff);
+            if (err) {
+                return err;
+            }
 
-                // refetch tail
-                continue;
+            err = lfs_bd_prog(lfs, &lfs->pcache, &lfs->rcache, true,
+                    *copy, off, &dat, diff);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    goto relocate;
+                }
+                return err;
             }
         }
 
-        pdir = dir;
-    }
+        err = lfs_bd_sync(lfs, &lfs->pcache, &lfs->rcache, true);
+        if (err) {
+            if (err == LFS_ERR_CORRUPT) {
+                goto relocate;
+            }
+            return err;
+        }
 
-    // mark orphans as fixed
-    return lfs_fs_preporphans(lfs, -lfs_gstate_getorphans(&lfs->gstate));
-}
-#endif
+        return 0;
 
-#ifndef LFS_READONLY
-static int lfs_fs_forceconsistency(lfs_t *lfs) {
-    int err = lfs_fs_demove(lfs);
-    if (err) {
-        return err;
+relocate:
+        LFS_DEBUG("Bad block at 0x%"PRIx32, *copy);
+        lfs_cache_drop(lfs, &lfs->pcache);
     }
+}
 
-    err = lfs_fs_deorphan(lfs);
-    if (err) {
-        return err;
+static int lfs_snapshot_rawrelease(lfs_t *lfs, lfs_snapshot_t *snapshot) {
+    for (lfs_snapshot_t **p = &lfs->snapshots; *p; p = &(*p)->next) {
+        if (*p == snapshot) {
+            *p = (*p)->next;
+            return 0;
+        }
     }
 
-    return 0;
+    return LFS_ERR_INVAL;
 }
-#endif
 
-static int lfs_fs_size_count(void *p, lfs_block_t block) {
-    (void)block;
-    lfs_size_t *size = p;
-    *size += 1;
-    return 0;
-}
+static int lfs_snapshot_rawcreate(lfs_t *lfs, lfs_snapshot_t *snapshot,
+        struct lfs_snapshot_pair *pairs, lfs_size_t size) {
+    snapshot->cfg = lfs->cfg;
+    snapshot->gdisk = lfs->gdisk;
+    snapshot->pairs = pairs;
+    snapshot->count = 0;
+    snapshot->size = size;
 
-static lfs_ssize_t lfs_fs_rawsize(lfs_t *lfs) {
-    lfs_size_t size = 0;
-    int err = lfs_fs_rawtraverse(lfs, lfs_fs_size_count, &size, false);
-    if (err) {
-        return err;
+    // hold the snapshot while it is being built so copies made so far
+    // are not handed out again by the allocator
+    snapshot->next = lfs->snapshots;
+    lfs->snapshots = snapshot;
+    lfs_alloc_ack(lfs);
+
+    // copy every metadata pair reachable from the root, only the active
+    // block up to the last commit is needed
+    lfs_mdir_t dir = {.tail = {0, 1}};
+    lfs_block_t cycle = 0;
+    int err = 0;
+    while (!lfs_pair_isnull(dir.tail)) {
+        if (cycle >= lfs_block_count(lfs)/2) {
+            // loop detected
+            err = LFS_ERR_CORRUPT;
+            goto cleanup;
+        }
+        cycle += 1;
+
+        err = lfs_dir_fetch(lfs, &dir, dir.tail);
+        if (err) {
+            goto cleanup;
+        }
+
+        if (snapshot->count >= snapshot->size) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+
+        lfs_block_t copy;
+        err = lfs_snapshot_copy(lfs, dir.pair[0], dir.off, &copy);
+        if (err) {
+            goto cleanup;
+        }
+
+        snapshot->pairs[snapshot->count] = (struct lfs_snapshot_pair){
+            .pair = {dir.pair[0], dir.pair[1]},
+            .copy = copy,
+        };
+        snapshot->count += 1;
     }
 
-    return size;
+    // copies are now reachable through the snapshot
+    lfs_alloc_ack(lfs);
+    return 0;
+
+cleanup:
+    lfs_snapshot_rawrelease(lfs, snapshot);
+    return err;
 }
+#endif
 
 #ifdef LFS_MIGRATE
 ////// Migration from littelfs v1 below this //////
@@ -4425,7 +8323,7 @@ static int lfs1_dir_fetch(lfs_t *lfs,
         }
 
         if ((0x7fffffff & test.size) < sizeof(test)+4 ||
-            (0x7fffffff & test.size) > lfs->cfg->block_size) {
+            (0x7fffffff & test.size) > lfs_block_size(lfs)) {
             continue;
         }
 
@@ -4528,7 +8426,7 @@ int lfs1_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data) {
 
             dir.off += lfs1_entry_size(&entry);
             if ((0x70 & entry.d.type) == (0x70 & LFS1_TYPE_REG)) {
-                err = lfs_ctz_traverse(lfs, NULL, &lfs->rcache,
+                err = lfs_ctz_traverse(lfs, NULL, lfs->dcache,
                         entry.d.u.file.head, entry.d.u.file.size, cb, data);
                 if (err) {
                     return err;
@@ -4621,6 +8519,9 @@ static int lfs1_mount(lfs_t *lfs, struct lfs1 *lfs1,
         lfs->free.off = 0;
         lfs->free.size = 0;
         lfs->free.i = 0;
+        lfs->mfree.off = 0;
+        lfs->mfree.size = 0;
+        lfs->mfree.i = 0;
         lfs_alloc_ack(lfs);
 
         // load superblock
@@ -4859,8 +8760,8 @@ static int lfs_rawmigrate(lfs_t *lfs, const struct lfs_config *cfg) {
 
         lfs_superblock_t superblock = {
             .version     = LFS_DISK_VERSION,
-            .block_size  = lfs->cfg->block_size,
-            .block_count = lfs->cfg->block_count,
+            .block_size  = lfs_block_size(lfs),
+            .block_count = lfs_block_count(lfs),
             .name_max    = lfs->name_max,
             .file_max    = lfs->file_max,
             .attr_max    = lfs->attr_max,
@@ -4965,7 +8866,7 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *cfg) {
             cfg->read_buffer, cfg->prog_buffer, cfg->lookahead_buffer,
             cfg->name_max, cfg->file_max, cfg->attr_max);
 
-    err = lfs_rawmount(lfs, cfg);
+    err = lfs_rawmount(lfs, cfg, NULL);
 
     LFS_TRACE("lfs_mount -> %d", err);
     LFS_UNLOCK(cfg);
@@ -5002,6 +8903,22 @@ int lfs_remove(lfs_t *lfs, const char *path) {
 }
 #endif
 
+#ifndef LFS_READONLY
+int lfs_remove_recursive(lfs_t *lfs, const char *path) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_remove_recursive(%p, \"%s\")", (void*)lfs, path);
+
+    err = lfs_rawremove_recursive(lfs, path);
+
+    LFS_TRACE("lfs_remove_recursive -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
 #ifndef LFS_READONLY
 int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
     int err = LFS_LOCK(lfs->cfg);
@@ -5089,7 +9006,7 @@ int lfs_file_open(lfs_t *lfs, lfs_file_t *file, const char *path, int flags) {
     }
     LFS_TRACE("lfs_file_open(%p, %p, \"%s\", %x)",
             (void*)lfs, (void*)file, path, flags);
-    LFS_ASSERT(!lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+    LFS_ASSERT(!lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
 
     err = lfs_file_rawopen(lfs, file, path, flags);
 
@@ -5109,7 +9026,7 @@ int lfs_file_opencfg(lfs_t *lfs, lfs_file_t *file,
                  ".buffer=%p, .attrs=%p, .attr_count=%"PRIu32"})",
             (void*)lfs, (void*)file, path, flags,
             (void*)cfg, cfg->buffer, (void*)cfg->attrs, cfg->attr_count);
-    LFS_ASSERT(!lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+    LFS_ASSERT(!lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
 
     err = lfs_file_rawopencfg(lfs, file, path, flags, cfg);
 
@@ -5118,13 +9035,54 @@ int lfs_file_opencfg(lfs_t *lfs, lfs_file_t *file,
     return err;
 }
 
+int lfs_file_openhandle(lfs_t *lfs, lfs_file_t *file,
+        const lfs_handle_t *handle, int flags) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_openhandle(%p, %p, %p {.pair={0x%"PRIx32", "
+                "0x%"PRIx32"}, .id=%"PRIu16", .gen=%"PRIu32"}, %x)",
+            (void*)lfs, (void*)file, (void*)handle,
+            handle->pair[0], handle->pair[1], handle->id, handle->gen, flags);
+    LFS_ASSERT(!lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
+
+    err = lfs_file_rawopenhandle(lfs, file, handle, flags);
+
+    LFS_TRACE("lfs_file_openhandle -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+int lfs_file_openhandlecfg(lfs_t *lfs, lfs_file_t *file,
+        const lfs_handle_t *handle, int flags,
+        const struct lfs_file_config *cfg) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_openhandlecfg(%p, %p, %p {.pair={0x%"PRIx32", "
+                "0x%"PRIx32"}, .id=%"PRIu16", .gen=%"PRIu32"}, %x, %p {"
+                ".buffer=%p, .attrs=%p, .attr_count=%"PRIu32"})",
+            (void*)lfs, (void*)file, (void*)handle,
+            handle->pair[0], handle->pair[1], handle->id, handle->gen, flags,
+            (void*)cfg, cfg->buffer, (void*)cfg->attrs, cfg->attr_count);
+    LFS_ASSERT(!lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
+
+    err = lfs_file_rawopenhandlecfg(lfs, file, handle, flags, cfg);
+
+    LFS_TRACE("lfs_file_openhandlecfg -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
 int lfs_file_close(lfs_t *lfs, lfs_file_t *file) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
         return err;
     }
     LFS_TRACE("lfs_file_close(%p, %p)", (void*)lfs, (void*)file);
-    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
 
     err = lfs_file_rawclose(lfs, file);
 
@@ -5140,7 +9098,7 @@ int lfs_file_sync(lfs_t *lfs, lfs_file_t *file) {
         return err;
     }
     LFS_TRACE("lfs_file_sync(%p, %p)", (void*)lfs, (void*)file);
-    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
 
     err = lfs_file_rawsync(lfs, file);
 
@@ -5158,7 +9116,7 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
     }
     LFS_TRACE("lfs_file_read(%p, %p, %p, %"PRIu32")",
             (void*)lfs, (void*)file, buffer, size);
-    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
 
     lfs_ssize_t res = lfs_file_rawread(lfs, file, buffer, size);
 
@@ -5167,6 +9125,24 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
     return res;
 }
 
+lfs_ssize_t lfs_file_readcb(lfs_t *lfs, lfs_file_t *file, lfs_size_t size,
+        int (*cb)(void *data, const void *buffer, lfs_size_t size),
+        void *data) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_readcb(%p, %p, %"PRIu32", %p, %p)",
+            (void*)lfs, (void*)file, size, (void*)(uintptr_t)cb, data);
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_rawreadcb(lfs, file, size, cb, data);
+
+    LFS_TRACE("lfs_file_readcb -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+
 #ifndef LFS_READONLY
 lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size) {
@@ -5176,7 +9152,7 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
     }
     LFS_TRACE("lfs_file_write(%p, %p, %p, %"PRIu32")",
             (void*)lfs, (void*)file, buffer, size);
-    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
 
     lfs_ssize_t res = lfs_file_rawwrite(lfs, file, buffer, size);
 
@@ -5184,6 +9160,53 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
     LFS_UNLOCK(lfs->cfg);
     return res;
 }
+
+lfs_ssize_t lfs_file_write_start(lfs_t *lfs, lfs_op_t *op,
+        lfs_file_t *file, const void *buffer, lfs_size_t size) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_write_start(%p, %p, %p, %p, %"PRIu32")",
+            (void*)lfs, (void*)op, (void*)file, buffer, size);
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_rawwrite_start(lfs, op, file, buffer, size);
+
+    LFS_TRACE("lfs_file_write_start -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+
+int lfs_file_sync_start(lfs_t *lfs, lfs_op_t *op, lfs_file_t *file) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_sync_start(%p, %p, %p)",
+            (void*)lfs, (void*)op, (void*)file);
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
+
+    err = lfs_file_rawsync_start(lfs, op, file);
+
+    LFS_TRACE("lfs_file_sync_start -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+lfs_ssize_t lfs_op_poll(lfs_t *lfs, lfs_op_t *op) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_op_poll(%p, %p)", (void*)lfs, (void*)op);
+
+    lfs_ssize_t res = lfs_op_rawpoll(lfs, op);
+
+    LFS_TRACE("lfs_op_poll -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
 #endif
 
 lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
@@ -5194,7 +9217,7 @@ lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
     }
     LFS_TRACE("lfs_file_seek(%p, %p, %"PRId32", %d)",
             (void*)lfs, (void*)file, off, whence);
-    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
 
     lfs_soff_t res = lfs_file_rawseek(lfs, file, off, whence);
 
@@ -5211,7 +9234,7 @@ int lfs_file_truncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
     }
     LFS_TRACE("lfs_file_truncate(%p, %p, %"PRIu32")",
             (void*)lfs, (void*)file, size);
-    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
 
     err = lfs_file_rawtruncate(lfs, file, size);
 
@@ -5227,7 +9250,7 @@ lfs_soff_t lfs_file_tell(lfs_t *lfs, lfs_file_t *file) {
         return err;
     }
     LFS_TRACE("lfs_file_tell(%p, %p)", (void*)lfs, (void*)file);
-    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
 
     lfs_soff_t res = lfs_file_rawtell(lfs, file);
 
@@ -5256,7 +9279,7 @@ lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file) {
         return err;
     }
     LFS_TRACE("lfs_file_size(%p, %p)", (void*)lfs, (void*)file);
-    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+    LFS_ASSERT(lfs_mlist_isopen(lfs, (struct lfs_mlist*)file));
 
     lfs_soff_t res = lfs_file_rawsize(lfs, file);
 
@@ -5287,7 +9310,7 @@ int lfs_dir_open(lfs_t *lfs, lfs_dir_t *dir, const char *path) {
         return err;
     }
     LFS_TRACE("lfs_dir_open(%p, %p, \"%s\")", (void*)lfs, (void*)dir, path);
-    LFS_ASSERT(!lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)dir));
+    LFS_ASSERT(!lfs_mlist_isopen(lfs, (struct lfs_mlist*)dir));
 
     err = lfs_dir_rawopen(lfs, dir, path);
 
@@ -5368,6 +9391,54 @@ int lfs_dir_rewind(lfs_t *lfs, lfs_dir_t *dir) {
     return err;
 }
 
+lfs_ssize_t lfs_dir_readbatch(lfs_t *lfs, lfs_dir_t *dir,
+        struct lfs_dirent *entries, lfs_size_t count,
+        const struct lfs_dir_batch *batch) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_dir_readbatch(%p, %p, %p, %"PRIu32", %p)",
+            (void*)lfs, (void*)dir, (void*)entries, count, (void*)batch);
+
+    lfs_ssize_t res = lfs_dir_rawreadbatch(lfs, dir, entries, count, batch);
+
+    LFS_TRACE("lfs_dir_readbatch -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+
+int lfs_dir_tellcursor(lfs_t *lfs, lfs_dir_t *dir, lfs_dir_cursor_t *cursor) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_dir_tellcursor(%p, %p, %p)",
+            (void*)lfs, (void*)dir, (void*)cursor);
+
+    err = lfs_dir_rawtellcursor(lfs, dir, cursor);
+
+    LFS_TRACE("lfs_dir_tellcursor -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+int lfs_dir_seekcursor(lfs_t *lfs, lfs_dir_t *dir,
+        const lfs_dir_cursor_t *cursor) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_dir_seekcursor(%p, %p, %p)",
+            (void*)lfs, (void*)dir, (void*)cursor);
+
+    err = lfs_dir_rawseekcursor(lfs, dir, cursor);
+
+    LFS_TRACE("lfs_dir_seekcursor -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
 lfs_ssize_t lfs_fs_size(lfs_t *lfs) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
@@ -5382,6 +9453,20 @@ lfs_ssize_t lfs_fs_size(lfs_t *lfs) {
     return res;
 }
 
+int lfs_fs_cachestat(lfs_t *lfs, struct lfs_cachestat *stat) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_cachestat(%p, %p)", (void*)lfs, (void*)stat);
+
+    err = lfs_fs_rawcachestat(lfs, stat);
+
+    LFS_TRACE("lfs_fs_cachestat -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
 int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void *, lfs_block_t), void *data) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
@@ -5397,6 +9482,102 @@ int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void *, lfs_block_t), void *data) {
     return err;
 }
 
+int lfs_fs_export(lfs_t *lfs, uint32_t *map, void *buffer,
+        int (*cb)(void *data, const void *buffer, lfs_size_t size),
+        void *data) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_export(%p, %p, %p, %p, %p)",
+            (void*)lfs, (void*)map, buffer, (void*)(uintptr_t)cb, data);
+
+    err = lfs_fs_rawexport(lfs, map, buffer, cb, data);
+
+    LFS_TRACE("lfs_fs_export -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+#ifndef LFS_READONLY
+int lfs_fs_defrag(lfs_t *lfs, lfs_defrag_t *defrag, lfs_size_t budget) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_defrag(%p, %p, %"PRIu32")",
+            (void*)lfs, (void*)defrag, budget);
+
+    err = lfs_fs_rawdefrag(lfs, defrag, budget);
+
+    LFS_TRACE("lfs_fs_defrag -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+int lfs_fs_gc(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_gc(%p)", (void*)lfs);
+
+    err = lfs_fs_rawgc(lfs);
+
+    LFS_TRACE("lfs_fs_gc -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_snapshot_create(lfs_t *lfs, lfs_snapshot_t *snapshot,
+        struct lfs_snapshot_pair *pairs, lfs_size_t size) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_snapshot_create(%p, %p, %p, %"PRIu32")",
+            (void*)lfs, (void*)snapshot, (void*)pairs, size);
+
+    err = lfs_snapshot_rawcreate(lfs, snapshot, pairs, size);
+
+    LFS_TRACE("lfs_snapshot_create -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+int lfs_snapshot_release(lfs_t *lfs, lfs_snapshot_t *snapshot) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_snapshot_release(%p, %p)", (void*)lfs, (void*)snapshot);
+
+    err = lfs_snapshot_rawrelease(lfs, snapshot);
+
+    LFS_TRACE("lfs_snapshot_release -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+int lfs_snapshot_mount(lfs_t *lfs, const struct lfs_config *cfg,
+        const lfs_snapshot_t *snapshot) {
+    int err = LFS_LOCK(cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_snapshot_mount(%p, %p, %p)",
+            (void*)lfs, (void*)cfg, (void*)snapshot);
+
+    err = lfs_rawmount(lfs, cfg, snapshot);
+
+    LFS_TRACE("lfs_snapshot_mount -> %d", err);
+    LFS_UNLOCK(cfg);
+    return err;
+}
+
 #ifdef LFS_MIGRATE
 int lfs_migrate(lfs_t *lfs, const struct lfs_config *cfg) {
     int err = LFS_LOCK(cfg);
@@ -29,10 +29,15 @@ extern "C"
 // Version of On-disk data structures
 // Major (top-nibble), incremented on backwards incompatible changes
 // Minor (bottom-nibble), incremented on feature additions
-#define LFS_DISK_VERSION 0x00020000
+#define LFS_DISK_VERSION 0x00020003
 #define LFS_DISK_VERSION_MAJOR (0xffff & (LFS_DISK_VERSION >> 16))
 #define LFS_DISK_VERSION_MINOR (0xffff & (LFS_DISK_VERSION >>  0))
 
+// Archive format produced by lfs_fs_export, the magic is "LFSX" in
+// little-endian
+#define LFS_EXPORT_MAGIC   0x5853464c
+#define LFS_EXPORT_VERSION 0x00000001
+
 
 /// Definitions ///
 
@@ -67,6 +72,49 @@ typedef uint32_t lfs_block_t;
 #define LFS_ATTR_MAX 1022
 #endif
 
+// Maximum length of a path remembered by the handle cache in bytes, may be
+// redefined. Longer paths are always walked. Sets the size of
+// struct lfs_hcache.
+#ifndef LFS_HCACHE_PATH_MAX
+#define LFS_HCACHE_PATH_MAX 64
+#endif
+
+// Maximum number of regions passed to a single vectored read, may be
+// redefined. File reads spanning more blocks are split into several calls.
+// Bounds a stack allocated array of struct lfs_iovec.
+#ifndef LFS_READV_MAX
+#define LFS_READV_MAX 8
+#endif
+
+// Number of buckets open files and directories are hashed into by their
+// metadata pair, may be redefined. Commits only look at the handles in the
+// bucket of the pair they change. Must be at most 256.
+#ifndef LFS_MLIST_BUCKETS
+#define LFS_MLIST_BUCKETS 8
+#endif
+
+// Number of generations handles are checked against, may be redefined.
+// Metadata pairs are hashed into these, and a change to a pair only makes
+// handles into pairs sharing its generation stale.
+#ifndef LFS_HGEN_BUCKETS
+#define LFS_HGEN_BUCKETS 16
+#endif
+
+// Number of least worn free blocks LFS_ALLOC_WEAR remembers from a pass
+// over the lookahead window, may be redefined. Each costs 8 bytes of RAM,
+// and a pass asks for the wear of each free block in the window once.
+#ifndef LFS_WEAR_CANDIDATES
+#define LFS_WEAR_CANDIDATES 8
+#endif
+
+// Fixed geometry, any of LFS_STATIC_READ_SIZE, LFS_STATIC_PROG_SIZE,
+// LFS_STATIC_BLOCK_SIZE, LFS_STATIC_BLOCK_COUNT, LFS_STATIC_CACHE_SIZE and
+// LFS_STATIC_LOOKAHEAD_SIZE may be defined to replace the matching lfs_config
+// field with a compile-time constant. This lets the compiler fold the block
+// arithmetic, but every filesystem in the image must then share that value.
+// The matching lfs_config fields may be left as zero, otherwise they are
+// asserted to match.
+
 // Possible error codes, these are negative to allow
 // valid positive return values
 enum lfs_error {
@@ -85,6 +133,8 @@ enum lfs_error {
     LFS_ERR_NOMEM       = -12,  // No more memory available
     LFS_ERR_NOATTR      = -61,  // No data/attr available
     LFS_ERR_NAMETOOLONG = -36,  // File name too long
+    LFS_ERR_STALE       = -116, // Stale file handle
+    LFS_ERR_PENDING     = -115, // Erase still running
 };
 
 // File types
@@ -110,8 +160,10 @@ enum lfs_type {
     LFS_TYPE_DIRSTRUCT      = 0x200,
     LFS_TYPE_CTZSTRUCT      = 0x202,
     LFS_TYPE_INLINESTRUCT   = 0x201,
+    LFS_TYPE_INDEXSTRUCT    = 0x203,
     LFS_TYPE_SOFTTAIL       = 0x600,
     LFS_TYPE_HARDTAIL       = 0x601,
+    LFS_TYPE_DIRINDEX       = 0x7fe,
     LFS_TYPE_MOVESTATE      = 0x7ff,
 
     // internal chip sources
@@ -131,6 +183,7 @@ enum lfs_open_flags {
     LFS_O_EXCL   = 0x0200,    // Fail if a file already exists
     LFS_O_TRUNC  = 0x0400,    // Truncate the existing file to zero size
     LFS_O_APPEND = 0x0800,    // Move to end of file on every write
+    LFS_O_INDEX  = 0x1000,    // Store the file with a block index
 #endif
 
     // internally used flags
@@ -143,6 +196,8 @@ enum lfs_open_flags {
     LFS_F_ERRED   = 0x080000, // An error occurred during write
 #endif
     LFS_F_INLINE  = 0x100000, // Currently inlined in directory entry
+    LFS_F_INDEX   = 0x200000, // Currently stored with a block index
+    LFS_F_POOLED  = 0x400000, // Borrows its cache from the shared pool
 };
 
 // File seek flags
@@ -152,6 +207,21 @@ enum lfs_whence_flags {
     LFS_SEEK_END = 2,   // Seek relative to the end of the file
 };
 
+// Block allocation policies
+enum lfs_alloc_policy {
+    LFS_ALLOC_RANDOM     = 0, // Start each mount at a random block
+    LFS_ALLOC_SEQUENTIAL = 1, // Continue where the last sync left off
+    LFS_ALLOC_WEAR       = 2, // Sequential, least worn free blocks first
+};
+
+
+// Region of a vectored block device operation, lies within a single block
+struct lfs_iovec {
+    lfs_block_t block;
+    lfs_off_t off;
+    void *buffer;
+    lfs_size_t size;
+};
 
 // Configuration provided during initialization of the littlefs
 struct lfs_config {
@@ -174,12 +244,24 @@ struct lfs_config {
     // The state of an erased block is undefined. Negative error codes
     // are propogated to the user.
     // May return LFS_ERR_CORRUPT if the block should be considered bad.
+    // The erase may still be running when erase returns, as long as the
+    // next read, prog or erase of the block device waits for it. This
+    // overlaps the erase with the work done until then. With erase_poll,
+    // erase may instead return LFS_ERR_PENDING, see erase_poll.
     int (*erase)(const struct lfs_config *c, lfs_block_t block);
 
     // Sync the state of the underlying block device. Negative error codes
     // are propogated to the user.
     int (*sync)(const struct lfs_config *c);
 
+    // Optional vectored read, reads count regions in one call so the block
+    // device can serve regions that lie next to each other on disk in a
+    // single transfer. Each region follows the rules of read. Used for file
+    // reads spanning several blocks. When NULL, read is called per region.
+    // Negative error codes are propogated to the user.
+    int (*readv)(const struct lfs_config *c,
+            const struct lfs_iovec *iov, lfs_size_t count);
+
 #ifdef LFS_THREADSAFE
     // Lock the underlying block device. Negative error codes
     // are propogated to the user.
@@ -262,8 +344,144 @@ struct lfs_config {
     // can help bound the metadata compaction time. Must be <= block_size.
     // Defaults to block_size when zero.
     lfs_size_t metadata_max;
+
+    // Optional number of metadata pairs a directory must span before an
+    // on-disk index of its pairs is kept, letting lookups skip straight to
+    // the pair holding a name instead of scanning the whole chain. The index
+    // is rebuilt when a directory splits and costs one block per indexed
+    // directory. Defaults to zero, which disables building new indexes.
+    lfs_size_t dir_index_min;
+
+    // Optional number of paths remembered by lfs_file_open. Reopening a
+    // remembered path goes straight to its entry through a handle instead of
+    // walking every directory in the path. Entries go stale on any rename,
+    // remove or other change to directory entries and are then looked up
+    // again. Paths longer than LFS_HCACHE_PATH_MAX are not remembered.
+    // Defaults to zero, which disables the cache.
+    lfs_size_t handle_cache_size;
+
+    // Optional statically allocated handle cache. Must be handle_cache_size
+    // times sizeof(struct lfs_hcache). By default lfs_malloc is used to
+    // allocate this buffer.
+    void *handle_cache_buffer;
+
+    // Optional number of file caches shared by all open files, at most 32.
+    // Files opened without their own buffer borrow one of these caches
+    // while they are read or written instead of holding one for as long as
+    // they are open. When every cache is in use the least recently used
+    // one is taken back, its file's pending writes are written out to a
+    // block first but only committed when that file is synced. Inline files
+    // with unsynced writes are taken back last, since writing them out
+    // moves them to a block for good. Inline files larger than cache_size
+    // keep their cache while open.
+    // Defaults to zero, which gives every file its own cache.
+    lfs_size_t file_cache_count;
+
+    // Optional statically allocated file cache pool. Must be
+    // file_cache_count*cache_size bytes. By default lfs_malloc is used to
+    // allocate this buffer.
+    void *file_cache_buffer;
+
+    // Optional number of read caches kept for metadata blocks in addition
+    // to the read cache, at most 255. Metadata reads pick the cache already
+    // holding their block, otherwise they reload the least recently used
+    // one, so alternating between a few metadata pairs does not read them
+    // again each time. Defaults to zero, a single read cache.
+    lfs_size_t metadata_cache_count;
+
+    // Optional number of read caches kept for data blocks, at most 255.
+    // CTZ skip-lists, file indexes and allocator traversals read through
+    // these instead of the metadata read caches, so reading file data does
+    // not push metadata out of the cache. Defaults to zero, which reads
+    // data blocks through the metadata read caches.
+    lfs_size_t data_cache_count;
+
+    // Optional statically allocated read caches. Must be
+    // (metadata_cache_count+data_cache_count) times
+    // sizeof(struct lfs_rway)+cache_size bytes and 32-bit aligned. By
+    // default lfs_malloc is used to allocate this buffer.
+    void *read_cache_buffer;
+
+    // Optional number of blocks provided by a separate metadata block
+    // device. When non-zero, blocks 0 to metadata_block_count-1 of the
+    // filesystem are routed to the metadata_* operations below and only
+    // ever hold metadata pairs, while file data is restricted to the
+    // remaining blocks, which are passed to read/prog/erase/sync starting
+    // at block 0. block_count covers both devices. Both devices share
+    // read_size, prog_size, block_size and block_cycles. Must be >= 2 to
+    // fit the superblock. Stored implicitly and must match on every mount.
+    lfs_size_t metadata_block_count;
+
+    // Read a region in a block of the metadata block device.
+    int (*metadata_read)(const struct lfs_config *c, lfs_block_t block,
+            lfs_off_t off, void *buffer, lfs_size_t size);
+
+    // Program a region in a block of the metadata block device.
+    int (*metadata_prog)(const struct lfs_config *c, lfs_block_t block,
+            lfs_off_t off, const void *buffer, lfs_size_t size);
+
+    // Erase a block of the metadata block device. Never left pending.
+    int (*metadata_erase)(const struct lfs_config *c, lfs_block_t block);
+
+    // Sync the state of the metadata block device.
+    int (*metadata_sync)(const struct lfs_config *c);
+
+    // Optional statically allocated lookahead buffer for the metadata block
+    // device. Must be lookahead_size and aligned to a 32-bit boundary. By
+    // default lfs_malloc is used to allocate this buffer.
+    void *metadata_lookahead_buffer;
+
+    // Optional policy of the data block allocator. LFS_ALLOC_RANDOM starts
+    // each mount at a random block and scans forward from there.
+    // LFS_ALLOC_SEQUENTIAL keeps the allocator's position in the global
+    // state on every file sync and at unmount, so allocation continues as
+    // one sequential log across mounts. Unmount only writes if the position
+    // moved since the last commit. LFS_ALLOC_WEAR works the same but hands out
+    // the least worn free block in each lookahead window for file data, as
+    // reported by wear. Metadata pairs are allocated in order, and the
+    // metadata allocator of a separate metadata block device always uses
+    // LFS_ALLOC_RANDOM. Defaults to LFS_ALLOC_RANDOM.
+    enum lfs_alloc_policy alloc_policy;
+
+    // Report the wear of a block, e.g. its erase count, lower values are
+    // preferred. Blocks are numbered as for read. Required by
+    // LFS_ALLOC_WEAR. The least worn free blocks of the lookahead window
+    // are remembered, so a block is asked about again only when the least
+    // wear left in the window goes up, see LFS_WEAR_CANDIDATES. Wear must
+    // not go down while a block is free. Negative error codes are
+    // propogated to the user.
+    int32_t (*wear)(const struct lfs_config *c, lfs_block_t block);
+
+    // Optional notification that a block is no longer in use, so the block
+    // device can erase it ahead of time or track its state. Blocks are
+    // numbered as for read, only blocks of the data block device are
+    // reported. Called by lfs_fs_gc for the free blocks it finds, a block
+    // may be reported again until it is allocated. An allocated block is
+    // always erased before it is programmed. Negative error codes are
+    // propogated to the user.
+    int (*discard)(const struct lfs_config *c, lfs_block_t block);
+
+    // Optional check on an erase that erase left running by returning
+    // LFS_ERR_PENDING. Returns LFS_ERR_PENDING while the erase runs, 0
+    // once it is done, or the error of the erase. Blocks are numbered as
+    // for read. Operations started with lfs_file_write_start or
+    // lfs_file_sync_start return to the caller while their erase runs,
+    // every other erase is waited for by calling erase_poll until it
+    // returns. Other reads, progs and erases may still reach the block
+    // device while an erase is pending and must wait for it.
+    int (*erase_poll)(const struct lfs_config *c, lfs_block_t block);
 };
 
+// Handle to a directory entry, reopens the entry without resolving its path.
+// Handles are only valid while the filesystem stays mounted and go stale
+// when the metadata pair holding the entry gains or loses entries, splits or
+// relocates. A zeroed handle is always stale.
+typedef struct lfs_handle {
+    lfs_block_t pair[2];
+    uint16_t id;
+    uint32_t gen;
+} lfs_handle_t;
+
 // File info structure
 struct lfs_info {
     // Type of the file, either LFS_TYPE_REG or LFS_TYPE_DIR
@@ -277,6 +495,10 @@ struct lfs_info {
     // reduce RAM. LFS_NAME_MAX is stored in superblock and must be
     // respected by other littlefs drivers.
     char name[LFS_NAME_MAX+1];
+
+    // Handle to the entry, see lfs_file_openhandle. Not valid for the '.'
+    // and '..' entries returned by lfs_dir_read.
+    lfs_handle_t handle;
 };
 
 // Custom attribute structure, used to describe custom attributes
@@ -316,6 +538,71 @@ struct lfs_file_config {
     lfs_size_t attr_count;
 };
 
+// Directory entry filled out by lfs_dir_readbatch
+struct lfs_dirent {
+    // Type of the entry, either LFS_TYPE_REG or LFS_TYPE_DIR
+    uint8_t type;
+
+    // Size of the entry, only valid for REG files. Limited to 32-bits.
+    lfs_size_t size;
+
+    // Null-terminated name of the entry, stored in the batch's name buffer.
+    // NULL if the batch has no name buffer.
+    const char *name;
+
+    // Bitmask of the batch's custom attributes found on this entry, bit i
+    // is set if attrs[i] was read.
+    uint32_t attrs;
+
+    // Handle to the entry, see lfs_file_openhandle. Not valid for the '.'
+    // and '..' entries.
+    lfs_handle_t handle;
+};
+
+// Optional configuration provided during lfs_dir_readbatch
+struct lfs_dir_batch {
+    // Buffer receiving the names of the entries. The names of a batch are
+    // packed back to back, a batch stops early when the buffer is full.
+    char *name_buffer;
+
+    // Size of the name buffer in bytes. At least LFS_NAME_MAX+1 bytes
+    // guarantee that every call makes progress.
+    lfs_size_t name_size;
+
+    // Optional list of custom attributes to read for every entry. Each
+    // attribute's buffer holds one slot of size bytes per entry, the
+    // attribute of entry n is stored at buffer + n*size. Attributes are
+    // padded with zeros like in lfs_file_opencfg, missing attributes are
+    // zeroed. Limited to 32 attributes.
+    struct lfs_attr *attrs;
+
+    // Number of custom attributes in the list
+    lfs_size_t attr_count;
+};
+
+// Usage of the shared file cache pool, see lfs_fs_cachestat
+struct lfs_cachestat {
+    // Number of file operations that found their file's cache in place
+    lfs_size_t hits;
+
+    // Number of file operations that had to borrow a cache first
+    lfs_size_t misses;
+
+    // Number of caches taken back from another file
+    lfs_size_t evictions;
+
+    // Number of evictions that had to write out pending data first
+    lfs_size_t flushes;
+};
+
+// Position in a directory, see lfs_dir_tellcursor
+typedef struct lfs_dir_cursor {
+    lfs_block_t pair[2];
+    uint16_t id;
+    lfs_off_t pos;
+    uint32_t gen;
+} lfs_dir_cursor_t;
+
 
 /// internal littlefs data structures ///
 typedef struct lfs_cache {
@@ -334,6 +621,7 @@ typedef struct lfs_mdir {
     bool erased;
     bool split;
     lfs_block_t tail[2];
+    lfs_block_t dirindex;
 } lfs_mdir_t;
 
 // littlefs directory type
@@ -341,6 +629,7 @@ typedef struct lfs_dir {
     struct lfs_dir *next;
     uint16_t id;
     uint8_t type;
+    uint8_t bucket;
     lfs_mdir_t m;
 
     lfs_off_t pos;
@@ -352,6 +641,7 @@ typedef struct lfs_file {
     struct lfs_file *next;
     uint16_t id;
     uint8_t type;
+    uint8_t bucket;
     lfs_mdir_t m;
 
     struct lfs_ctz {
@@ -364,10 +654,28 @@ typedef struct lfs_file {
     lfs_block_t block;
     lfs_off_t off;
     lfs_cache_t cache;
+    uint32_t tick;
 
     const struct lfs_file_config *cfg;
 } lfs_file_t;
 
+// state of a file operation that returns while its erase runs, filled in
+// by lfs_file_write_start or lfs_file_sync_start
+typedef struct lfs_op {
+    uint8_t type;
+    bool running;
+    lfs_file_t *file;
+    const void *buffer;
+    lfs_size_t size;
+    lfs_size_t done;
+    lfs_off_t pos;
+
+    // the block being erased and the block a write holds on to until its
+    // erase is done
+    lfs_block_t erasing;
+    lfs_block_t held;
+} lfs_op_t;
+
 typedef struct lfs_superblock {
     uint32_t version;
     lfs_size_t block_size;
@@ -380,8 +688,41 @@ typedef struct lfs_superblock {
 typedef struct lfs_gstate {
     uint32_t tag;
     lfs_block_t pair[2];
+    lfs_block_t cursor;
 } lfs_gstate_t;
 
+// defragmentation state, zero to start a new pass
+typedef struct lfs_defrag {
+    // where the pass picks up on the next call
+    lfs_block_t pair[2];
+    uint16_t id;
+
+    // optional statically allocated cache buffer, must be cache_size, by
+    // default lfs_malloc is used to allocate this buffer
+    void *buffer;
+
+    // statistics over the files examined so far, a run is a sequence of
+    // physically contiguous blocks
+    lfs_size_t files;
+    lfs_size_t rewritten;
+    lfs_size_t runs_before;
+    lfs_size_t runs_after;
+} lfs_defrag_t;
+
+// snapshot state, holds frozen copies of every metadata pair reachable at
+// the time the snapshot was taken, must be allocated while held
+typedef struct lfs_snapshot {
+    struct lfs_snapshot *next;
+    const struct lfs_config *cfg;
+    lfs_gstate_t gdisk;
+    struct lfs_snapshot_pair {
+        lfs_block_t pair[2];
+        lfs_block_t copy;
+    } *pairs;
+    lfs_size_t count;
+    lfs_size_t size;
+} lfs_snapshot_t;
+
 // The littlefs filesystem type
 typedef struct lfs {
     lfs_cache_t rcache;
@@ -392,26 +733,74 @@ typedef struct lfs {
         struct lfs_mlist *next;
         uint16_t id;
         uint8_t type;
+        uint8_t bucket;
         lfs_mdir_t m;
-    } *mlist;
+    } *mlist[LFS_MLIST_BUCKETS];
     uint32_t seed;
 
     lfs_gstate_t gstate;
     lfs_gstate_t gdisk;
     lfs_gstate_t gdelta;
+    lfs_block_t dirsplit[2];
+    uint32_t gen;
+    uint32_t hgen[LFS_HGEN_BUCKETS];
+    struct lfs_hcache {
+        lfs_size_t len;
+        lfs_handle_t handle;
+        char path[LFS_HCACHE_PATH_MAX];
+    } *hcache;
+
+    struct lfs_fpool {
+        uint8_t *buffer;
+        uint32_t used;
+        uint32_t tick;
+        struct lfs_cachestat stat;
+    } fpool;
+
+    struct lfs_rpool {
+        struct lfs_rway {
+            lfs_cache_t cache;
+            uint32_t tick;
+        } *ways;
+        uint8_t mcount;
+        uint8_t dcount;
+        uint32_t tick;
+        uint32_t rtick;
+    } rpool;
+    lfs_cache_t *dcache;
 
     struct lfs_free {
+        lfs_block_t begin;
+        lfs_block_t count;
         lfs_block_t off;
         lfs_block_t size;
         lfs_block_t i;
         lfs_block_t ack;
+        lfs_block_t reserved;
         uint32_t *buffer;
-    } free;
+    } free, mfree;
+    struct lfs_wear {
+        lfs_block_t off[LFS_WEAR_CANDIDATES];
+        int32_t wear[LFS_WEAR_CANDIDATES];
+        lfs_size_t count;
+        int32_t floor;
+        lfs_block_t resume;
+    } wear;
+
+    lfs_snapshot_t *snapshots;
+    const lfs_snapshot_t *snapshot;
+
+    lfs_op_t *op;
+    struct lfs_erased {
+        lfs_block_t block;
+        int err;
+    } erased;
 
     const struct lfs_config *cfg;
     lfs_size_t name_max;
     lfs_size_t file_max;
     lfs_size_t attr_max;
+    uint32_t disk_version;
 
 #ifdef LFS_MIGRATE
     struct lfs1 *lfs1;
@@ -444,7 +833,9 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *config);
 
 // Unmounts a littlefs
 //
-// Does nothing besides releasing any allocated resources.
+// Commits the allocator's position if a sequential alloc_policy moved it
+// since the last commit, otherwise does nothing besides releasing any
+// allocated resources. Resources are released even on failure.
 // Returns a negative error code on failure.
 int lfs_unmount(lfs_t *lfs);
 
@@ -458,6 +849,17 @@ int lfs_unmount(lfs_t *lfs);
 int lfs_remove(lfs_t *lfs, const char *path);
 #endif
 
+#ifndef LFS_READONLY
+// Removes a file or directory and everything in it
+//
+// Each directory in the tree is dropped as a whole, without deleting the
+// files in it one at a time. If power is lost part way, the directories
+// already removed stay removed. Files open in the tree are detached like
+// removed files, directories in the tree must not be open.
+// Returns a negative error code on failure.
+int lfs_remove_recursive(lfs_t *lfs, const char *path);
+#endif
+
 #ifndef LFS_READONLY
 // Rename or move a file or directory
 //
@@ -518,6 +920,12 @@ int lfs_removeattr(lfs_t *lfs, const char *path, uint8_t type);
 // The mode that the file is opened in is determined by the flags, which
 // are values from the enum lfs_open_flags that are bitwise-ored together.
 //
+// With LFS_O_INDEX, a new or inline file that outgrows the metadata pair is
+// stored with a block index instead of a CTZ skip-list. Overwriting the
+// middle of an indexed file only rewrites the modified block and its path
+// through the index, at the cost of the index blocks themselves. The flag has
+// no effect on files that are already stored outside of the metadata pair.
+//
 // Returns a negative error code on failure.
 int lfs_file_open(lfs_t *lfs, lfs_file_t *file,
         const char *path, int flags);
@@ -536,6 +944,27 @@ int lfs_file_opencfg(lfs_t *lfs, lfs_file_t *file,
         const char *path, int flags,
         const struct lfs_file_config *config);
 
+// Open a file through a handle
+//
+// The handle comes from lfs_stat or lfs_dir_read and skips resolving the
+// file's path. The file must already exist, LFS_O_CREAT has no effect.
+//
+// Returns LFS_ERR_STALE if the handle no longer refers to the entry, in which
+// case the file should be opened by path. Returns a negative error code on
+// failure.
+int lfs_file_openhandle(lfs_t *lfs, lfs_file_t *file,
+        const lfs_handle_t *handle, int flags);
+
+// Open a file through a handle with extra configuration
+//
+// Same as lfs_file_openhandle, with the config struct described in
+// lfs_file_opencfg.
+//
+// Returns a negative error code on failure.
+int lfs_file_openhandlecfg(lfs_t *lfs, lfs_file_t *file,
+        const lfs_handle_t *handle, int flags,
+        const struct lfs_file_config *config);
+
 // Close a file
 //
 // Any pending writes are written out to storage as though
@@ -557,6 +986,20 @@ int lfs_file_sync(lfs_t *lfs, lfs_file_t *file);
 lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size);
 
+// Read data from file into a callback
+//
+// Hands the data to cb in chunks which point straight into the file's
+// cache, so no intermediate buffer or copy is needed. The chunks are only
+// valid during the callback and the callback must not call back into
+// littlefs. A positive return value from cb stops the read early, a negative
+// error code is returned as is. The file position only advances past the
+// chunks the callback accepted.
+//
+// Returns the number of bytes read, or a negative error code on failure.
+lfs_ssize_t lfs_file_readcb(lfs_t *lfs, lfs_file_t *file, lfs_size_t size,
+        int (*cb)(void *data, const void *buffer, lfs_size_t size),
+        void *data);
+
 #ifndef LFS_READONLY
 // Write data to file
 //
@@ -566,6 +1009,38 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
 // Returns the number of bytes written, or a negative error code on failure.
 lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size);
+
+// Start writing data to file without waiting for erases
+//
+// Same as lfs_file_write, but when the file needs a new block and the block
+// device leaves its erase pending, returns LFS_ERR_PENDING instead of
+// waiting. The write then goes on with lfs_op_poll. Until the write
+// completes, op, the file and the buffer must be left alone, and no other
+// operation can be started on the filesystem. Other filesystem calls are
+// fine. Without erase_poll in the config, this is lfs_file_write.
+//
+// Returns the number of bytes written, LFS_ERR_PENDING, or a negative error
+// code on failure.
+lfs_ssize_t lfs_file_write_start(lfs_t *lfs, lfs_op_t *op,
+        lfs_file_t *file, const void *buffer, lfs_size_t size);
+
+// Start synchronizing a file without waiting for erases
+//
+// Same as lfs_file_sync, but returns LFS_ERR_PENDING when an erase for the
+// file's data or the compaction of its metadata pair is left pending, under
+// the same rules as lfs_file_write_start.
+//
+// Returns 0, LFS_ERR_PENDING, or a negative error code on failure.
+int lfs_file_sync_start(lfs_t *lfs, lfs_op_t *op, lfs_file_t *file);
+
+// Continue an operation left pending
+//
+// Checks on the erase the operation waits for, and once it is done goes on
+// with the operation, which may leave another erase pending.
+//
+// Returns LFS_ERR_PENDING while the operation is pending, otherwise what
+// the operation returns.
+lfs_ssize_t lfs_op_poll(lfs_t *lfs, lfs_op_t *op);
 #endif
 
 // Change the position of the file
@@ -650,6 +1125,39 @@ lfs_soff_t lfs_dir_tell(lfs_t *lfs, lfs_dir_t *dir);
 // Returns a negative error code on failure.
 int lfs_dir_rewind(lfs_t *lfs, lfs_dir_t *dir);
 
+// Read a batch of entries in the directory
+//
+// Fills out up to count entries with their types, sizes, names and the
+// custom attributes listed in batch, which may be NULL. Each metadata pair
+// of the directory is scanned once per batch instead of once per entry and
+// attribute.
+//
+// Returns the number of entries read, 0 at the end of directory, or a
+// negative error code on failure. Returns LFS_ERR_NOSPC if the name buffer
+// can not hold the next name.
+lfs_ssize_t lfs_dir_readbatch(lfs_t *lfs, lfs_dir_t *dir,
+        struct lfs_dirent *entries, lfs_size_t count,
+        const struct lfs_dir_batch *batch);
+
+// Return the position of the directory as a cursor
+//
+// Unlike tell, the cursor records where in the metadata the iteration is,
+// so seeking back to it does not walk the directory from its head.
+//
+// Returns a negative error code on failure.
+int lfs_dir_tellcursor(lfs_t *lfs, lfs_dir_t *dir, lfs_dir_cursor_t *cursor);
+
+// Change the position of the directory to a cursor
+//
+// The cursor must come from tellcursor on the same directory. Seeking is
+// constant time as long as no entries have been created, removed or
+// relocated since the cursor was taken, otherwise this falls back to seek
+// with the cursor's offset.
+//
+// Returns a negative error code on failure.
+int lfs_dir_seekcursor(lfs_t *lfs, lfs_dir_t *dir,
+        const lfs_dir_cursor_t *cursor);
+
 
 /// Filesystem-level filesystem operations
 
@@ -661,6 +1169,14 @@ int lfs_dir_rewind(lfs_t *lfs, lfs_dir_t *dir);
 // Returns the number of allocated blocks, or a negative error code on failure.
 lfs_ssize_t lfs_fs_size(lfs_t *lfs);
 
+// Get the usage of the shared file cache pool
+//
+// The counts start at zero on every mount and stay zero without a
+// file_cache_count in the configuration.
+//
+// Returns a negative error code on failure.
+int lfs_fs_cachestat(lfs_t *lfs, struct lfs_cachestat *stat);
+
 // Traverse through all blocks in use by the filesystem
 //
 // The provided callback will be called with each block address that is
@@ -670,6 +1186,99 @@ lfs_ssize_t lfs_fs_size(lfs_t *lfs);
 // Returns a negative error code on failure.
 int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data);
 
+// Export every block in use by the filesystem as a sequential archive
+//
+// The archive is streamed through the provided callback and consists of a
+// header of four le32 words (LFS_EXPORT_MAGIC, LFS_EXPORT_VERSION,
+// block_size, block_count), followed by one record per block in use, an
+// le32 block address followed by the block's contents. Metadata pairs come
+// first, then all other blocks, each group in ascending address order so
+// the block device is read in a single sequential pass with one
+// block-sized read per block. The archive ends with an le32 0xffffffff and
+// the le32 number of exported blocks.
+//
+// Requires a zeroable map of (block_count+31)/32 words and a buffer of
+// block_size bytes. Exporting a view mounted with lfs_snapshot_mount gives
+// a consistent archive while the live filesystem keeps changing.
+//
+// Returns a negative error code on failure, errors returned by the
+// callback are passed through.
+int lfs_fs_export(lfs_t *lfs, uint32_t *map, void *buffer,
+        int (*cb)(void *data, const void *buffer, lfs_size_t size),
+        void *data);
+
+#ifndef LFS_READONLY
+// Incrementally defragment files
+//
+// Walks the metadata pairs and rewrites any file whose blocks are scattered
+// into a single run of contiguous free blocks. The new copy is committed
+// atomically, so a power-loss leaves either the old or the new copy in
+// place. At most budget blocks are rewritten per call, a file larger than
+// the budget is rewritten on its own. Open files are skipped. The
+// statistics in the defrag state report the fragmentation before and
+// after.
+//
+// Returns 1 if there is more work to do, 0 once the pass is complete, or a
+// negative error code on failure.
+int lfs_fs_defrag(lfs_t *lfs, lfs_defrag_t *defrag, lfs_size_t budget);
+
+// Look for free blocks ahead of the allocator
+//
+// Scans the next lookahead window once the current one is used up,
+// otherwise scans the current window again so blocks freed since can be
+// allocated right away. Every free block in the window is reported through
+// the discard callback, if provided. Meant to be called while the
+// filesystem is idle, it does the work an allocation would otherwise do.
+//
+// Returns a negative error code on failure.
+int lfs_fs_gc(lfs_t *lfs);
+#endif
+
+
+/// Snapshot operations ///
+
+#ifndef LFS_READONLY
+// Take a read-only snapshot of the filesystem
+//
+// Every metadata pair reachable from the root is copied into a single
+// freshly allocated block, the provided pairs buffer must be able to hold
+// one entry per metadata pair. While the snapshot is held, all blocks
+// reachable from it are treated as in-use by the allocator, so writes to
+// the live filesystem continue into new blocks.
+//
+// Returns LFS_ERR_NOMEM if the pairs buffer is too small, or another
+// negative error code on failure.
+int lfs_snapshot_create(lfs_t *lfs, lfs_snapshot_t *snapshot,
+        struct lfs_snapshot_pair *pairs, lfs_size_t size);
+
+// Release a snapshot
+//
+// The blocks held by the snapshot are returned to the allocator the next
+// time it scans the filesystem. Any views mounted from the snapshot must
+// be unmounted first.
+//
+// Returns a negative error code on failure.
+int lfs_snapshot_release(lfs_t *lfs, lfs_snapshot_t *snapshot);
+#endif
+
+// Mount a read-only view of a snapshot
+//
+// The view is a regular littlefs object and can be read concurrently with
+// writes to the live filesystem, as long as block device access is
+// serialized. Any attempt to write through the view fails with
+// LFS_ERR_INVAL. Unmount with lfs_unmount.
+//
+// The config must describe the same block device as the live filesystem.
+// It can be the live filesystem's config only if that config has no
+// statically allocated buffers, otherwise the view needs a config with its
+// own buffers, the view and the live filesystem would overwrite each
+// other's caches.
+//
+// Returns LFS_ERR_INVAL if the config shares a buffer with the live
+// filesystem, or another negative error code on failure.
+int lfs_snapshot_mount(lfs_t *lfs, const struct lfs_config *config,
+        const lfs_snapshot_t *snapshot);
+
 #ifndef LFS_READONLY
 #ifdef LFS_MIGRATE
 // Attempts to migrate a previous version of littlefs
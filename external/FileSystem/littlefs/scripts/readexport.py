@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+
+import struct
+import sys
+import os
+from readmdir import Tag, MetadataPair
+
+EXPORT_MAGIC = 0x5853464c
+EXPORT_VERSION = 0x00000001
+
+def read_archive(f):
+    magic, version, block_size, block_count = struct.unpack('<IIII',
+        f.read(16))
+    if magic != EXPORT_MAGIC:
+        raise ValueError("bad magic %#010x" % magic)
+    if version != EXPORT_VERSION:
+        raise ValueError("unsupported version %#010x" % version)
+
+    blocks = {}
+    while True:
+        block, = struct.unpack('<I', f.read(4))
+        if block == 0xffffffff:
+            count, = struct.unpack('<I', f.read(4))
+            if count != len(blocks):
+                raise ValueError("truncated archive, expected %d blocks, "
+                    "found %d" % (count, len(blocks)))
+            break
+
+        if block >= block_count:
+            raise ValueError("block %#x out of range" % block)
+        data = f.read(block_size)
+        if len(data) != block_size:
+            raise ValueError("truncated archive in block %#x" % block)
+        blocks[block] = data
+
+    return block_size, block_count, blocks
+
+def ctz_index(block_size, off):
+    # find the block index and offset of a file offset, see lfs_ctz_index
+    b = block_size - 2*4
+    i = off // b
+    if i == 0:
+        return 0, off
+
+    i = (off - 4*(popc(i-1)+2)) // b
+    return i, off - b*i - 4*popc(i)
+
+def popc(x):
+    return bin(x).count('1')
+
+def ctz(x):
+    return (x & -x).bit_length() - 1
+
+def read_ctz(blocks, block_size, head, size):
+    if size == 0:
+        return b''
+
+    # follow the first pointer of each block back to the start of the file
+    index, _ = ctz_index(block_size, size-1)
+    chain = [head]
+    for _ in range(index):
+        block, = struct.unpack('<I', blocks[chain[-1]][0:4])
+        chain.append(block)
+
+    # each block holds its pointers followed by data up to the block's end
+    data = b''.join(
+        blocks[block][0 if i == 0 else 4*(ctz(i)+1):]
+        for i, block in enumerate(reversed(chain)))
+    return data[:size]
+
+def read_index(blocks, block_size, root, size):
+    if size == 0:
+        return b''
+
+    # the depth of the index is implied by the number of data blocks
+    fanout = block_size // 4
+    count = (size-1) // block_size + 1
+    depth = 0
+    while fanout**depth < count:
+        depth += 1
+
+    data = []
+    for i in range(count):
+        block = root
+        for k in reversed(range(depth)):
+            entry = (i // fanout**k) % fanout
+            block, = struct.unpack('<I', blocks[block][4*entry:4*entry+4])
+        data.append(blocks[block])
+    return b''.join(data)[:size]
+
+def load_mdir(blocks, block_size, pair):
+    data = [blocks.get(b, b'\xff'*block_size) for b in pair]
+    mdir = MetadataPair(data)
+    mdir.blocks = pair
+    try:
+        mdir.tail = mdir[Tag('tail', 0, 0)]
+        if mdir.tail.size != 8 or mdir.tail.data == 8*b'\xff':
+            mdir.tail = None
+    except KeyError:
+        mdir.tail = None
+    return mdir
+
+def extract(blocks, block_size, outdir):
+    # group metadata pairs into directories, following the tail list
+    dirs = []
+    mdirs = []
+    seen = set()
+    tail = (0, 1)
+    while True:
+        if frozenset(tail) in seen:
+            raise ValueError("cycle detected {%#x, %#x}" % tail)
+        seen.add(frozenset(tail))
+
+        mdir = load_mdir(blocks, block_size, tail)
+        if not mdir:
+            raise ValueError("corrupted mdir {%#x, %#x}" % tail)
+        mdirs.append(mdir)
+        if mdir.tail is None or not mdir.tail.is_('hardtail'):
+            dirs.append(mdirs)
+            mdirs = []
+        if mdir.tail is None:
+            break
+        tail = struct.unpack('<II', mdir.tail.data)
+
+    dirtable = {frozenset(dir[0].blocks): dir for dir in dirs}
+
+    count = 0
+    pending = [(outdir, dirs[0])]
+    while pending:
+        path, dir = pending.pop(0)
+        os.makedirs(path, exist_ok=True)
+        for mdir in dir:
+            for tag in mdir.tags:
+                if not (tag.is_('dir') or tag.is_('reg')):
+                    continue
+                name = tag.data.decode('utf8')
+                npath = os.path.join(path, name)
+                struct_ = mdir[Tag('struct', tag.id, 0)]
+                if tag.is_('dir'):
+                    pair = frozenset(struct.unpack('<II', struct_.data))
+                    pending.append((npath, dirtable[pair]))
+                    continue
+
+                if struct_.is_('inlinestruct'):
+                    data = struct_.data
+                elif struct_.is_('indexstruct'):
+                    root, size = struct.unpack('<II', struct_.data)
+                    data = read_index(blocks, block_size, root, size)
+                else:
+                    head, size = struct.unpack('<II', struct_.data)
+                    data = read_ctz(blocks, block_size, head, size)
+                with open(npath, 'wb') as f:
+                    f.write(data)
+                count += 1
+
+    return count
+
+def main(args):
+    with open(args.archive, 'rb') as f:
+        block_size, block_count, blocks = read_archive(f)
+
+    print("littlefs export, block_size %d, block_count %d, %d blocks" % (
+        block_size, block_count, len(blocks)))
+
+    if args.output:
+        with open(args.output, 'wb') as f:
+            for block in range(block_count):
+                f.write(blocks.get(block, b'\xff'*block_size))
+
+    if args.extract:
+        count = extract(blocks, block_size, args.extract)
+        print("extracted %d files to %s" % (count, args.extract))
+
+    return 0
+
+if __name__ == "__main__":
+    import argparse
+    import sys
+    parser = argparse.ArgumentParser(
+        description="Restore a littlefs image or its files from an archive "
+            "created with lfs_fs_export.")
+    parser.add_argument('archive',
+        help="Archive created by lfs_fs_export.")
+    parser.add_argument('-o', '--output',
+        help="Write a disk image, blocks not in the archive are erased.")
+    parser.add_argument('-x', '--extract',
+        help="Extract all files into this directory.")
+    sys.exit(main(parser.parse_args()))
@@ -17,12 +17,14 @@ TAG_TYPES = {
     'dirstruct':    (0x7ff, 0x200),
     'ctzstruct':    (0x7ff, 0x202),
     'inlinestruct': (0x7ff, 0x201),
+    'indexstruct':  (0x7ff, 0x203),
     'userattr':     (0x700, 0x300),
     'tail':         (0x700, 0x600),
     'softtail':     (0x7ff, 0x600),
     'hardtail':     (0x7ff, 0x601),
     'gstate':       (0x700, 0x700),
     'movestate':    (0x7ff, 0x7ff),
+    'dirindex':     (0x7ff, 0x7fe),
     'crc':          (0x700, 0x500),
 }
 